@@ -0,0 +1,144 @@
+#ifndef ALU_H
+#define ALU_H
+
+#include "cpu.h"
+
+// Arithmetic, logic, flags and conditions shared by every core, so they can only differ in how they
+// decode and dispatch
+
+#if CHECK_FLAGS
+#define EAGER_FLAGS(update) update
+#else
+#define EAGER_FLAGS(update)
+#endif
+
+// Reading flags
+static inline uint8_t get_flags(CPU* cpu) { // Settles any pending flags
+    if (cpu->lazy_flags.kind != FLAGS_SETTLED) {
+        cpu->registers.r8[REG_F] = compute_flags(&cpu->lazy_flags, cpu->registers.r8[REG_F]);
+        cpu->lazy_flags.kind = FLAGS_SETTLED;
+    }
+    return cpu->registers.r8[REG_F];
+}
+static inline uint8_t get_flag_C(CPU* cpu) { // Carry on its own is cheap to work out
+    return compute_carry(&cpu->lazy_flags, cpu->registers.r8[REG_F]);
+}
+static inline void record_flags(CPU* cpu, FlagsKind kind, uint8_t result, uint8_t a, uint8_t b, uint8_t carry) {
+    cpu->lazy_flags = (LazyFlags) {kind, result, a, b, carry};
+}
+
+static inline void alu_add(CPU* cpu, uint8_t value, uint8_t carry) { // ADD, ADI, ADC, ACI
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = a + value + carry;
+    record_flags(cpu, FLAGS_ADD, cpu->registers.r8[REG_A], a, value, carry);
+    EAGER_FLAGS(update_flags_add(&cpu->eager_flags, a, value, carry));
+}
+static inline void alu_sub(CPU* cpu, uint8_t value, uint8_t carry) { // SUB, SUI, SBB, SBI
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = a - value - carry;
+    record_flags(cpu, FLAGS_SUB, cpu->registers.r8[REG_A], a, value, carry);
+    EAGER_FLAGS(update_flags_sub(&cpu->eager_flags, a, value, carry));
+}
+static inline void alu_cmp(CPU* cpu, uint8_t value) { // CMP, CPI
+    uint8_t a = cpu->registers.r8[REG_A];
+    record_flags(cpu, FLAGS_SUB, a - value, a, value, 0);
+    EAGER_FLAGS(update_flags_sub(&cpu->eager_flags, a, value, 0));
+}
+static inline void alu_and(CPU* cpu, uint8_t value) { // ANA, ANI
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = a & value;
+    record_flags(cpu, FLAGS_AND, cpu->registers.r8[REG_A], a, value, 0);
+    EAGER_FLAGS(update_flags_logic(&cpu->eager_flags, cpu->registers.r8[REG_A], ((a | value) & 0x08) != 0)); // AC is bit 3 of either operand
+}
+static inline void alu_or(CPU* cpu, uint8_t value) { // ORA, ORI
+    cpu->registers.r8[REG_A] = cpu->registers.r8[REG_A] | value;
+    record_flags(cpu, FLAGS_LOGIC, cpu->registers.r8[REG_A], 0, 0, 0);
+    EAGER_FLAGS(update_flags_logic(&cpu->eager_flags, cpu->registers.r8[REG_A], 0));
+}
+static inline void alu_xor(CPU* cpu, uint8_t value) { // XRA, XRI
+    cpu->registers.r8[REG_A] = cpu->registers.r8[REG_A] ^ value;
+    record_flags(cpu, FLAGS_LOGIC, cpu->registers.r8[REG_A], 0, 0, 0);
+    EAGER_FLAGS(update_flags_logic(&cpu->eager_flags, cpu->registers.r8[REG_A], 0));
+}
+static inline uint8_t alu_inr(CPU* cpu, uint8_t value) { // INR, leaves CY alone
+    uint8_t result = value + 1;
+    record_flags(cpu, FLAGS_INR, result, 0, 0, get_flag_C(cpu));
+    EAGER_FLAGS(update_flags_inr(&cpu->eager_flags, result));
+    return result;
+}
+static inline uint8_t alu_dcr(CPU* cpu, uint8_t value) { // DCR, leaves CY alone
+    uint8_t result = value - 1;
+    record_flags(cpu, FLAGS_DCR, result, 0, 0, get_flag_C(cpu));
+    EAGER_FLAGS(update_flags_dcr(&cpu->eager_flags, result));
+    return result;
+}
+
+// Instructions that only touch CY settle the other flags first
+static inline void set_flag_C(CPU* cpu, uint8_t carry) { // STC, CMC, DAD and the rotates
+    cpu->registers.r8[REG_F] = (get_flags(cpu) & ~FLAG_C) | carry;
+    EAGER_FLAGS(cpu->eager_flags = (cpu->eager_flags & ~FLAG_C) | carry);
+}
+static inline void alu_dad(CPU* cpu, uint16_t value) { // DAD
+    uint32_t result = cpu->registers.r16[PAIR_HL] + value;
+    cpu->registers.r16[PAIR_HL] = result;
+    set_flag_C(cpu, result >> 16);
+}
+static inline void alu_rlc(CPU* cpu) { // RLC
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = (a << 1) | (a >> 7);
+    set_flag_C(cpu, a >> 7);
+}
+static inline void alu_rrc(CPU* cpu) { // RRC
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = (a >> 1) | (a << 7);
+    set_flag_C(cpu, a & 1);
+}
+static inline void alu_ral(CPU* cpu) { // RAL
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = (a << 1) | get_flag_C(cpu);
+    set_flag_C(cpu, a >> 7);
+}
+static inline void alu_rar(CPU* cpu) { // RAR
+    uint8_t a = cpu->registers.r8[REG_A];
+    cpu->registers.r8[REG_A] = (a >> 1) | (get_flag_C(cpu) << 7);
+    set_flag_C(cpu, a & 1);
+}
+static inline void alu_daa(CPU* cpu) { // DAA, an ADD of the correction except that CY never clears
+    uint8_t a = cpu->registers.r8[REG_A];
+    uint8_t flags = get_flags(cpu);
+    uint8_t correction = 0;
+    uint8_t carry = flags & FLAG_C;
+    if ((a & 0x0F) > 9 || (flags & FLAG_A)) correction |= 0x06;
+    if (a > 0x99 || carry) {
+        correction |= 0x60;
+        carry = 1;
+    }
+    cpu->registers.r8[REG_A] = a + correction;
+    LazyFlags add = {FLAGS_ADD, cpu->registers.r8[REG_A], a, correction, 0};
+    cpu->registers.r8[REG_F] = compute_flags(&add, 0) | carry;
+    EAGER_FLAGS(update_flags_add(&cpu->eager_flags, a, correction, 0));
+    EAGER_FLAGS(cpu->eager_flags |= carry);
+}
+
+// PSW is A:F, F has to be settled before it is pushed
+static inline uint16_t get_psw(CPU* cpu) {
+    get_flags(cpu);
+    return cpu->registers.r16[PAIR_PSW];
+}
+static inline void set_psw(CPU* cpu, uint16_t value) {
+    cpu->registers.r16[PAIR_PSW] = value;
+    cpu->registers.r8[REG_F] = (cpu->registers.r8[REG_F] & (FLAG_S | FLAG_Z | FLAG_A | FLAG_P | FLAG_C)) | FLAGS_FIXED;
+    cpu->lazy_flags.kind = FLAGS_SETTLED;
+    EAGER_FLAGS(cpu->eager_flags = cpu->registers.r8[REG_F]);
+}
+
+// Condition field (CCC) of Jccc, Cccc and Rccc
+static const char* const condition_names[8] = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
+static inline bool condition(CPU* cpu, uint8_t ccc) {
+    if ((ccc >> 1) == 1) return get_flag_C(cpu) == (ccc & 1); // Carry does not need the rest settled
+    uint8_t flags = get_flags(cpu);
+    uint8_t mask[4] = {FLAG_Z, FLAG_C, FLAG_P, FLAG_S};
+    return ((flags & mask[ccc >> 1]) != 0) == (ccc & 1);
+}
+
+#endif
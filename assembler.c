@@ -0,0 +1,1025 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "colors.h"
+
+// Two-pass 8080 assembler, built next to the emulator as asm.exe by pcc.py -c.
+//
+// Instructions come from opcodes.def, the same table the cores are built from: each name there is
+// a mnemonic and its register operands ("MOV A, M", "LXI SP", "JNZ") and the size says how many
+// immediate bytes follow, so the assembler knows every instruction the emulator runs and nothing
+// else. Pass 1 works out where every line goes and the value of every label; pass 2 evaluates the
+// operands and writes the bytes. Both passes expand macros the same way.
+//
+// Syntax, one statement per line, ; starts a comment:
+//   label:  MNEMONIC operands      labels end in a colon and are case-sensitive
+//   name    EQU expression         constant, SET instead of EQU can be redefined later
+//           ORG expression         carry on at this address
+//           DB 1, 'text', "text"   bytes, DW for little-endian words
+//           DS count[, fill]       reserve count bytes, zero unless fill is given
+//   name    MACRO a, b             body up to ENDM, invoked as "name x, y". LOCAL lab inside the
+//           LOCAL lab              body makes lab a new label on every expansion
+//           ENDM
+//           END                    ignore the rest of the file
+// Expressions take 12, 0x0C, 0Ch, 0b1100, 1100b, 14o, 14q, 'c' and 'cd' (two characters make a
+// 16-bit value, the first in the high byte), $ for the address of the current line, symbols,
+// LOW(x) and HIGH(x), unary - + ~, and * / % + - << >> & ^ | with C precedence. MOD, SHL, SHR,
+// AND, XOR, OR and NOT work as operator words as well.
+//
+// The image written is every byte from --start (0 by default) to the last one assembled, which is
+// what the emulator loads at 0x0000; use --start 0x100 for a CP/M .COM. The listing has the
+// address, bytes and source of every line, and the symbol map has one "ADDRESS NAME" line per
+// label, sorted by address, for the emulator to name addresses with.
+
+#define MAX_OPERANDS 64
+#define MAX_LINE 4096
+#define MAX_MACRO_DEPTH 32
+#define MAX_ERRORS 100
+#define LISTING_BYTES 4 // Per listing row
+
+// The instruction set, by mnemonic and register operands
+typedef struct Form {
+    const char* name; // As in opcodes.def
+    uint8_t opcode;
+    uint8_t size;
+} Form;
+
+#define OPCODE(opcode, name, size, cycles, body) {name, opcode, size},
+static const Form forms[256] = {
+#include "opcodes.def"
+};
+#undef OPCODE
+
+typedef struct Symbol {
+    char* name;
+    int32_t value;
+    bool defined;
+    bool label; // Goes in the symbol map
+    bool redefinable; // SET
+    int line; // Where it was defined
+} Symbol;
+
+typedef struct Macro {
+    char* name;
+    char* params[MAX_OPERANDS];
+    int param_count;
+    char** lines;
+    int line_count, line_capacity;
+} Macro;
+
+// Open addressing from names to indices, grows at half full
+typedef struct NameTable {
+    const char** names;
+    int* indices;
+    uint32_t capacity;
+    uint32_t count;
+} NameTable;
+
+typedef struct Assembler {
+    int pass; // 1 or 2
+    uint32_t address; // Past 0xFFFF only to report overflowing
+    bool ended; // Hit END
+    const char* filename;
+    int line_number;
+    const char* macro_name; // Being expanded, for errors
+    int macro_depth;
+    int errors;
+    bool line_failed; // An error was reported for this line already
+    int* failed_lines; // By pass 1, in order, so pass 2 doesn't report them again
+    int failed_count, failed_capacity;
+
+    uint8_t* image;
+    uint32_t low, high; // Range written, high is one past the end
+    bool wrote;
+
+    Symbol* symbols;
+    int symbol_count, symbol_capacity;
+    NameTable symbol_names;
+    Macro* macros;
+    int macro_count, macro_capacity;
+    NameTable macro_names;
+    Macro* defining; // Between MACRO and ENDM
+    int expansions; // Numbers the LOCAL labels of each expansion
+
+    NameTable form_names; // "MOV A,M" to the opcode
+    NameTable mnemonics; // "MOV" to how many register operands it takes
+
+    FILE* listing;
+    uint8_t line_bytes[MAX_LINE]; // Written by the current line, for the listing
+    int line_byte_count;
+    uint32_t line_address;
+    bool line_listed_value; // EQU and SET list their value instead of an address
+    int32_t line_value;
+} Assembler;
+
+// Names
+static uint32_t hash_name(const char* name) { // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*name) hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    return hash;
+}
+static int find_name(const NameTable* table, const char* name) {
+    if (table->capacity == 0) return -1;
+    for (uint32_t slot = hash_name(name) & (table->capacity - 1);; slot = (slot + 1) & (table->capacity - 1)) {
+        if (table->names[slot] == NULL) return -1;
+        if (strcmp(table->names[slot], name) == 0) return table->indices[slot];
+    }
+}
+static void add_name(NameTable* table, const char* name, int index) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        NameTable grown = {calloc(table->capacity > 0 ? table->capacity * 2 : 256, sizeof(char*)), malloc((table->capacity > 0 ? table->capacity * 2 : 256) * sizeof(int)), table->capacity > 0 ? table->capacity * 2 : 256, 0};
+        if (grown.names == NULL || grown.indices == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < table->capacity; i++) {
+            if (table->names[i] != NULL) add_name(&grown, table->names[i], table->indices[i]);
+        }
+        free(table->names);
+        free(table->indices);
+        *table = grown;
+    }
+    uint32_t slot = hash_name(name) & (table->capacity - 1);
+    while (table->names[slot] != NULL) slot = (slot + 1) & (table->capacity - 1);
+    table->names[slot] = name;
+    table->indices[slot] = index;
+    table->count++;
+}
+static void free_names(NameTable* table) {
+    free(table->names);
+    free(table->indices);
+}
+
+static char* copy_string(const char* text, size_t length) {
+    char* copy = malloc(length + 1);
+    if (copy == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+static bool is_name_start(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || c == '.' || c == '?' || c == '@';
+}
+static bool is_name_char(char c) {
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+static char* skip_space(char* text) {
+    while (*text == ' ' || *text == '\t' || *text == '\r') text++;
+    return text;
+}
+static bool same_word(const char* a, const char* b) { // Case-insensitive
+    while (*a && *b && (*a | 0x20) == (*b | 0x20)) {
+        a++;
+        b++;
+    }
+    return *a == '\0' && *b == '\0';
+}
+// Copies at most size - 1 characters in upper case, snprintf is too slow for every line
+static size_t copy_upper(char* to, size_t size, const char* from, size_t length) {
+    size_t i = 0;
+    for (; i < length && i < size - 1 && from[i]; i++) to[i] = from[i] >= 'a' && from[i] <= 'z' ? from[i] - ('a' - 'A') : from[i];
+    to[i] = '\0';
+    return i;
+}
+
+// Errors, one per line is enough. Pass 2 runs after a failed pass 1 as well, to find the errors
+// only it can see, such as undefined symbols
+static bool failed_in_pass_1(Assembler* as, int line) {
+    int low = 0, high = as->failed_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (as->failed_lines[middle] < line) low = middle + 1;
+        else high = middle;
+    }
+    return low < as->failed_count && as->failed_lines[low] == line;
+}
+static void report(Assembler* as, const char* format, const char* detail) {
+    if (as->line_failed) return;
+    as->line_failed = true;
+    if (as->pass == 2 && failed_in_pass_1(as, as->line_number)) return;
+    if (as->pass == 1) {
+        if (as->failed_count == as->failed_capacity) {
+            as->failed_capacity = as->failed_capacity > 0 ? as->failed_capacity * 2 : 64;
+            as->failed_lines = realloc(as->failed_lines, as->failed_capacity * sizeof(int));
+            if (as->failed_lines == NULL) {
+                printf("Out of memory\n");
+                exit(1);
+            }
+        }
+        as->failed_lines[as->failed_count++] = as->line_number;
+    }
+    as->errors++;
+    if (as->errors > MAX_ERRORS) return;
+    printf("%s%s:%d: error:%s ", RED, as->filename, as->line_number, RESET);
+    printf(format, detail);
+    if (as->macro_name != NULL) printf(" (in macro %s)", as->macro_name);
+    printf("\n");
+}
+
+// Symbols
+static Symbol* find_symbol(Assembler* as, const char* name) {
+    int index = find_name(&as->symbol_names, name);
+    return index < 0 ? NULL : &as->symbols[index];
+}
+static Symbol* add_symbol(Assembler* as, const char* name) {
+    Symbol* symbol = find_symbol(as, name);
+    if (symbol != NULL) return symbol;
+    if (as->symbol_count == as->symbol_capacity) {
+        as->symbol_capacity = as->symbol_capacity > 0 ? as->symbol_capacity * 2 : 256;
+        Symbol* symbols = realloc(as->symbols, as->symbol_capacity * sizeof(Symbol));
+        if (symbols == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        // The table points at the names, which stay where they are
+        as->symbols = symbols;
+    }
+    symbol = &as->symbols[as->symbol_count];
+    *symbol = (Symbol) {.name = copy_string(name, strlen(name))};
+    add_name(&as->symbol_names, symbol->name, as->symbol_count++);
+    return symbol;
+}
+// Labels and EQU are fixed once defined in pass 1, pass 2 only checks they came out the same
+static void define_symbol(Assembler* as, const char* name, int32_t value, bool defined, bool label, bool redefinable) {
+    Symbol* symbol = add_symbol(as, name);
+    if (as->pass == 1 && symbol->line != 0 && !(symbol->redefinable && redefinable)) {
+        report(as, "%s is already defined", name);
+        return;
+    }
+    if (as->pass == 2 && as->errors == 0 && !redefinable && symbol->line == as->line_number && symbol->defined && defined && symbol->value != value) {
+        report(as, "%s moved between passes, something before it depends on a later symbol", name);
+        return;
+    }
+    if (as->pass == 1 || redefinable || defined) {
+        symbol->value = value;
+        symbol->defined = defined;
+    }
+    symbol->label = label;
+    symbol->redefinable = redefinable;
+    symbol->line = as->line_number;
+}
+
+// Expressions, by C precedence. undefined is set when a symbol has no value yet, which only pass 1
+// lets through
+typedef struct Parser {
+    Assembler* as;
+    char* text;
+    bool undefined;
+    bool failed;
+} Parser;
+
+static int32_t parse_expression(Parser* p, int precedence);
+
+static void parse_error(Parser* p, const char* format, const char* detail) {
+    if (!p->failed) report(p->as, format, detail);
+    p->failed = true;
+}
+
+static int32_t parse_number(Parser* p) {
+    char* start = p->text;
+    while (is_name_char(*p->text)) p->text++;
+    char digits[64];
+    size_t length = p->text - start;
+    if (length >= sizeof(digits)) {
+        parse_error(p, "number %s is too long", "");
+        return 0;
+    }
+    copy_upper(digits, sizeof(digits), start, length);
+
+    int base = 10;
+    char* begin = digits;
+    char last = digits[length - 1];
+    if (last == 'H') { // Suffixes first, 0BH is hex
+        base = 16;
+        digits[--length] = '\0';
+    }
+    else if (length > 2 && digits[0] == '0' && (digits[1] == 'X' || digits[1] == 'B' || digits[1] == 'O')) {
+        base = digits[1] == 'X' ? 16 : digits[1] == 'B' ? 2 : 8;
+        begin += 2;
+    }
+    else if (last == 'B' || last == 'O' || last == 'Q' || last == 'D') {
+        base = last == 'B' ? 2 : last == 'D' ? 10 : 8;
+        digits[--length] = '\0';
+    }
+
+    int32_t value = 0;
+    if (*begin == '\0') parse_error(p, "%s is not a number", start);
+    for (char* c = begin; *c && !p->failed; c++) {
+        int digit = *c >= '0' && *c <= '9' ? *c - '0' : *c >= 'A' && *c <= 'F' ? *c - 'A' + 10 : 99;
+        if (digit >= base) {
+            digits[length] = '\0';
+            parse_error(p, "bad digit in number %s", digits);
+        }
+        value = value * base + digit;
+    }
+    return value & 0xFFFFFF;
+}
+
+// 'c' or 'cd', with '' for a quote
+static int32_t parse_character(Parser* p) {
+    char quote = *p->text++;
+    int32_t value = 0;
+    int count = 0;
+    while (*p->text && !(*p->text == quote && p->text[1] != quote)) {
+        if (*p->text == quote) p->text++;
+        value = value << 8 | (uint8_t) *p->text++;
+        count++;
+    }
+    if (*p->text != quote) parse_error(p, "missing closing quote%s", "");
+    else p->text++;
+    if (count == 0 || count > 2) parse_error(p, "a character constant holds one or two characters%s", "");
+    return value;
+}
+
+static int32_t parse_primary(Parser* p) {
+    p->text = skip_space(p->text);
+    char c = *p->text;
+    if (c == '(') {
+        p->text++;
+        int32_t value = parse_expression(p, 0);
+        p->text = skip_space(p->text);
+        if (*p->text != ')') parse_error(p, "missing )%s", "");
+        else p->text++;
+        return value;
+    }
+    if (c == '-' || c == '+' || c == '~') {
+        p->text++;
+        int32_t value = parse_primary(p);
+        return c == '-' ? -value : c == '~' ? ~value : value;
+    }
+    if (c == '$' && !is_name_char(p->text[1])) {
+        p->text++;
+        return (int32_t) p->as->line_address;
+    }
+    if (c == '\'' || c == '"') return parse_character(p);
+    if (c >= '0' && c <= '9') return parse_number(p);
+    if (is_name_start(c)) {
+        char* start = p->text;
+        while (is_name_char(*p->text)) p->text++;
+        char name[256];
+        size_t length = p->text - start;
+        if (length >= sizeof(name)) length = sizeof(name) - 1;
+        memcpy(name, start, length);
+        name[length] = '\0';
+        if (same_word(name, "NOT")) return ~parse_primary(p);
+        if (same_word(name, "LOW") || same_word(name, "HIGH")) {
+            p->text = skip_space(p->text);
+            if (*p->text == '(') {
+                int32_t value = parse_primary(p);
+                return same_word(name, "LOW") ? value & 0xFF : (value >> 8) & 0xFF;
+            }
+        }
+        Symbol* symbol = find_symbol(p->as, name);
+        if (symbol == NULL || !symbol->defined) {
+            if (p->as->pass == 2) parse_error(p, "%s is not defined", name);
+            p->undefined = true;
+            return 0;
+        }
+        return symbol->value;
+    }
+    if (c == '\0') parse_error(p, "missing operand%s", "");
+    else {
+        char bad[2] = {c, '\0'};
+        parse_error(p, "unexpected %s in expression", bad);
+    }
+    return 0;
+}
+
+// Binary operators, higher binds tighter
+typedef struct Operator {
+    const char* symbol;
+    int precedence;
+} Operator;
+static const Operator operators[] = {
+    {"<<", 5}, {">>", 5}, {"*", 6}, {"/", 6}, {"%", 6}, {"+", 4}, {"-", 4}, {"&", 3}, {"^", 2}, {"|", 1},
+    {"SHL", 5}, {"SHR", 5}, {"MOD", 6}, {"AND", 3}, {"XOR", 2}, {"OR", 1},
+};
+
+static const Operator* peek_operator(Parser* p) {
+    char* text = skip_space(p->text);
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        size_t length = strlen(operators[i].symbol);
+        bool word = is_name_start(operators[i].symbol[0]);
+        bool match = true;
+        for (size_t j = 0; j < length && match; j++) match = (text[j] | (word ? 0x20 : 0)) == (operators[i].symbol[j] | (word ? 0x20 : 0));
+        if (match && (!word || !is_name_char(text[length]))) return &operators[i];
+    }
+    return NULL;
+}
+
+static int32_t parse_expression(Parser* p, int precedence) {
+    int32_t left = parse_primary(p);
+    for (;;) {
+        const Operator* op = peek_operator(p);
+        if (op == NULL || op->precedence <= precedence || p->failed) return left;
+        p->text = skip_space(p->text) + strlen(op->symbol);
+        int32_t right = parse_expression(p, op->precedence);
+        switch (op->symbol[0] | 0x20) {
+            case '<': left = (int32_t) ((uint32_t) left << (right & 31)); break;
+            case '>': left >>= right & 31; break;
+            case '*': left *= right; break;
+            case '/': case '%':
+                if (right == 0 && !p->undefined) parse_error(p, "division by zero%s", "");
+                else if (right != 0) left = op->symbol[0] == '/' ? left / right : left % right;
+                break;
+            case '+': left += right; break;
+            case '-': left -= right; break;
+            case '&': case 'a': left &= right; break;
+            case '^': case 'x': left ^= right; break;
+            case '|': left |= right; break;
+            case 's': left = (op->symbol[2] | 0x20) == 'l' ? (int32_t) ((uint32_t) left << (right & 31)) : left >> (right & 31); break;
+            case 'm': if (right != 0) left %= right; else if (!p->undefined) parse_error(p, "division by zero%s", ""); break;
+            case 'o': left |= right; break;
+        }
+    }
+}
+
+// A whole operand, false if it is not a valid expression. defined is false while pass 1 is still
+// waiting for a symbol
+static bool evaluate(Assembler* as, char* text, int32_t* value, bool* defined) {
+    Parser p = {as, text, false, false};
+    *value = parse_expression(&p, 0);
+    p.text = skip_space(p.text);
+    if (!p.failed && *p.text != '\0') parse_error(&p, "unexpected %s after the expression", p.text);
+    if (defined != NULL) *defined = !p.undefined;
+    return !p.failed;
+}
+// For ORG, DS and the like, which need the value in pass 1
+static bool evaluate_now(Assembler* as, char* text, int32_t* value) {
+    bool defined;
+    if (!evaluate(as, text, value, &defined)) return false;
+    if (!defined) report(as, "%s uses a symbol that is only defined later", text);
+    return defined;
+}
+
+// Output
+static void emit_byte(Assembler* as, int32_t value) {
+    if (as->address > 0xFFFF) {
+        report(as, "past the end of memory%s", "");
+        as->address++;
+        return;
+    }
+    if (as->pass == 2) {
+        as->image[as->address] = (uint8_t) value;
+        if (!as->wrote || as->address < as->low) as->low = as->address;
+        if (!as->wrote || as->address + 1 > as->high) as->high = as->address + 1;
+        as->wrote = true;
+        if (as->line_byte_count < MAX_LINE) as->line_bytes[as->line_byte_count++] = (uint8_t) value;
+    }
+    as->address++;
+}
+static void emit_value(Assembler* as, char* operand, int size) {
+    int32_t value = 0;
+    bool defined = true;
+    if (as->pass == 2 && evaluate(as, operand, &value, &defined)) {
+        if (size == 1 && (value < -256 || value > 255)) report(as, "%s does not fit in a byte", operand);
+        if (size == 2 && (value < -65536 || value > 65535)) report(as, "%s does not fit in a word", operand);
+    }
+    emit_byte(as, value & 0xFF);
+    if (size == 2) emit_byte(as, (value >> 8) & 0xFF);
+}
+
+// Splits at commas outside quotes and parentheses, trimming each operand. -1 if there are too many
+static int split_operands(char* text, char** operands) {
+    int count = 0;
+    text = skip_space(text);
+    if (*text == '\0') return 0;
+    char* start = text;
+    int depth = 0;
+    char quote = 0;
+    for (;; text++) {
+        char c = *text;
+        if (quote) {
+            if (c == quote) quote = 0;
+            else if (c == '\0') quote = 0;
+        }
+        else if (c == '\'' || c == '"') quote = c;
+        else if (c == '(') depth++;
+        else if (c == ')') depth--;
+        if (c == '\0' || (c == ',' && depth == 0 && !quote)) {
+            if (count == MAX_OPERANDS) return -1;
+            char* end = text;
+            while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+            *end = '\0';
+            operands[count++] = skip_space(start);
+            if (c == '\0') return count;
+            start = text + 1;
+        }
+        if (c == '\0') return count;
+    }
+}
+
+// DB strings are every character between the quotes, anything else is one byte
+static void emit_data(Assembler* as, char** operands, int count, int size) {
+    for (int i = 0; i < count; i++) {
+        char* operand = operands[i];
+        size_t length = strlen(operand);
+        bool string = size == 1 && length >= 2 && (operand[0] == '\'' || operand[0] == '"') && operand[length - 1] == operand[0];
+        if (!string) {
+            emit_value(as, operand, size);
+            continue;
+        }
+        for (size_t j = 1; j < length - 1; j++) {
+            if (operand[j] == operand[0] && operand[j + 1] == operand[0]) j++; // Doubled quote
+            emit_byte(as, (uint8_t) operand[j]);
+        }
+    }
+}
+
+// Instructions
+static void build_forms(Assembler* as) {
+    for (int opcode = 0; opcode < 256; opcode++) {
+        const char* name = forms[opcode].name;
+        if (name == NULL || name[0] == '*') continue; // Undocumented aliases are only run, never assembled
+        char key[32];
+        size_t length = 0;
+        int registers = 0;
+        for (const char* c = name; *c && length < sizeof(key) - 1; c++) {
+            if (*c == ',') registers++;
+            if (*c != ' ' || (c > name && c[-1] != ',')) key[length++] = *c;
+        }
+        key[length] = '\0';
+        char* space = strchr(key, ' ');
+        if (space != NULL) registers++;
+        add_name(&as->form_names, copy_string(key, length), opcode);
+        char* mnemonic = copy_string(key, space != NULL ? (size_t) (space - key) : length);
+        if (find_name(&as->mnemonics, mnemonic) < 0) add_name(&as->mnemonics, mnemonic, strcmp(mnemonic, "RST") == 0 ? 0 : registers);
+        else free(mnemonic);
+    }
+}
+
+static void assemble_instruction(Assembler* as, const char* mnemonic, int registers, char** operands, int count) {
+    if (strcmp(mnemonic, "RST") == 0) { // The vector is an expression, not part of the name
+        int32_t vector = 0;
+        bool defined = true;
+        if (count != 1) report(as, "RST takes one operand, the vector 0-7%s", "");
+        else if (as->pass == 2 && evaluate(as, operands[0], &vector, &defined) && (vector < 0 || vector > 7)) report(as, "RST %s is not a vector 0-7", operands[0]);
+        emit_byte(as, 0xC7 | (vector & 7) << 3);
+        return;
+    }
+
+    char key[32];
+    size_t length = copy_upper(key, sizeof(key), mnemonic, sizeof(key));
+    for (int i = 0; i < registers && i < count; i++) {
+        key[length++] = i == 0 ? ' ' : ',';
+        length += copy_upper(key + length, 8, operands[i], 7); // No register is longer than PSW
+    }
+    int opcode = count >= registers ? find_name(&as->form_names, key) : -1;
+    if (opcode < 0) {
+        if (count < registers) report(as, "%s needs more operands", mnemonic);
+        else report(as, "%s is not an instruction", key);
+        return;
+    }
+    int immediates = forms[opcode].size > 1 ? 1 : 0;
+    if (count != registers + immediates) {
+        report(as, count > registers + immediates ? "too many operands for %s" : "%s needs a value operand", mnemonic);
+        return;
+    }
+    emit_byte(as, opcode);
+    if (immediates) emit_value(as, operands[registers], forms[opcode].size - 1);
+}
+
+// Listing
+static void list_line(Assembler* as, const char* source, bool expanded) {
+    if (as->listing == NULL || as->pass != 2) return;
+    const char* marker = expanded ? "+" : " ";
+    int row = 0;
+    do {
+        char bytes[LISTING_BYTES * 3 + 1] = "";
+        for (int i = 0; i < LISTING_BYTES && row * LISTING_BYTES + i < as->line_byte_count; i++) sprintf(bytes + i * 3, "%02X ", as->line_bytes[row * LISTING_BYTES + i]);
+        if (row > 0) fprintf(as->listing, "%04X  %-12s\n", (as->line_address + row * LISTING_BYTES) & 0xFFFF, bytes);
+        else if (as->line_listed_value) fprintf(as->listing, "=%04X %-12s %6d%s %s\n", as->line_value & 0xFFFF, bytes, as->line_number, marker, source);
+        else fprintf(as->listing, "%04X  %-12s %6d%s %s\n", as->line_address & 0xFFFF, bytes, as->line_number, marker, source);
+        row++;
+    } while (row * LISTING_BYTES < as->line_byte_count);
+}
+
+static void assemble_line(Assembler* as, const char* source, bool expanded);
+
+// Body lines with the parameters and LOCAL labels swapped in, outside of quotes
+static void expand_macro(Assembler* as, Macro* macro, char** args, int arg_count) {
+    if (as->macro_depth == MAX_MACRO_DEPTH) {
+        report(as, "macros nest more than %s deep, is one calling itself?", "32");
+        return;
+    }
+    if (arg_count > macro->param_count) {
+        report(as, "too many arguments for %s", macro->name);
+        return;
+    }
+    int expansion = ++as->expansions;
+    char* locals[MAX_OPERANDS];
+    int local_count = 0;
+    const char* outer = as->macro_name;
+    as->macro_name = macro->name;
+    as->macro_depth++;
+
+    for (int i = 0; i < macro->line_count && !as->ended; i++) {
+        const char* line = macro->lines[i];
+        char* keyword = skip_space((char*) line);
+        if (strncasecmp(keyword, "LOCAL", 5) == 0 && (keyword[5] == ' ' || keyword[5] == '\t')) {
+            char names[MAX_LINE];
+            snprintf(names, sizeof(names), "%s", keyword + 5);
+            char* operands[MAX_OPERANDS];
+            int count = split_operands(names, operands);
+            for (int j = 0; j < count && local_count < MAX_OPERANDS; j++) locals[local_count++] = copy_string(operands[j], strlen(operands[j]));
+            continue;
+        }
+
+        char expanded[MAX_LINE];
+        size_t length = 0;
+        char quote = 0;
+        for (const char* c = line; *c && length < sizeof(expanded) - 1;) {
+            if (quote || *c == '\'' || *c == '"' || *c == ';' || !is_name_start(*c)) {
+                if (*c == ';' && !quote) { // The comment goes as it is
+                    while (*c && length < sizeof(expanded) - 1) expanded[length++] = *c++;
+                    break;
+                }
+                if (quote && *c == quote) quote = 0;
+                else if (!quote && (*c == '\'' || *c == '"')) quote = *c;
+                expanded[length++] = *c++;
+                continue;
+            }
+            const char* start = c;
+            while (is_name_char(*c)) c++;
+            size_t name_length = c - start;
+            const char* replacement = NULL;
+            char local[300];
+            for (int j = 0; j < macro->param_count && replacement == NULL; j++) {
+                if (strlen(macro->params[j]) == name_length && strncmp(macro->params[j], start, name_length) == 0) replacement = j < arg_count ? args[j] : "";
+            }
+            for (int j = 0; j < local_count && replacement == NULL; j++) {
+                if (strlen(locals[j]) == name_length && strncmp(locals[j], start, name_length) == 0) {
+                    snprintf(local, sizeof(local), "%s??%04d", locals[j], expansion);
+                    replacement = local;
+                }
+            }
+            if (replacement == NULL) {
+                if (length + name_length >= sizeof(expanded)) break;
+                memcpy(expanded + length, start, name_length);
+                length += name_length;
+            }
+            else {
+                size_t replacement_length = strlen(replacement);
+                if (length + replacement_length >= sizeof(expanded)) break;
+                memcpy(expanded + length, replacement, replacement_length);
+                length += replacement_length;
+            }
+        }
+        expanded[length] = '\0';
+        assemble_line(as, expanded, true);
+    }
+    for (int j = 0; j < local_count; j++) free(locals[j]);
+    as->macro_depth--;
+    as->macro_name = outer;
+}
+
+static void define_macro(Assembler* as, const char* name, char** params, int count) {
+    // A second definition is an error, its body is still collected so it isn't assembled
+    if (find_name(&as->macro_names, name) >= 0) report(as, "macro %s is already defined", name);
+    if (as->macro_count == as->macro_capacity) {
+        as->macro_capacity = as->macro_capacity > 0 ? as->macro_capacity * 2 : 32;
+        as->macros = realloc(as->macros, as->macro_capacity * sizeof(Macro));
+        if (as->macros == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    Macro* macro = &as->macros[as->macro_count];
+    *macro = (Macro) {.name = copy_string(name, strlen(name)), .param_count = count};
+    for (int i = 0; i < count; i++) macro->params[i] = copy_string(params[i], strlen(params[i]));
+    if (find_name(&as->macro_names, name) < 0) add_name(&as->macro_names, macro->name, as->macro_count);
+    as->macro_count++;
+    as->defining = macro;
+}
+
+static void add_macro_line(Macro* macro, const char* line) {
+    if (macro->line_count == macro->line_capacity) {
+        macro->line_capacity = macro->line_capacity > 0 ? macro->line_capacity * 2 : 16;
+        macro->lines = realloc(macro->lines, macro->line_capacity * sizeof(char*));
+        if (macro->lines == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    macro->lines[macro->line_count++] = copy_string(line, strlen(line));
+}
+
+// One statement: [label:] [name] OPERATION [operands] [; comment]
+static void assemble_line(Assembler* as, const char* source, bool expanded) {
+    char line[MAX_LINE];
+    size_t line_length = strlen(source);
+    if (line_length >= MAX_LINE) line_length = MAX_LINE - 1;
+    memcpy(line, source, line_length);
+    line[line_length] = '\0';
+    as->line_address = as->address;
+    as->line_byte_count = 0;
+    as->line_listed_value = false;
+    if (!expanded) as->line_failed = false;
+
+    // Comments end the line, except inside quotes
+    char quote = 0;
+    for (char* c = line; *c; c++) {
+        if (quote && *c == quote) quote = 0;
+        else if (!quote && (*c == '\'' || *c == '"')) quote = *c;
+        else if (!quote && *c == ';') {
+            *c = '\0';
+            break;
+        }
+    }
+
+    char* text = skip_space(line);
+    char* label = NULL; // With a colon
+    char* name = NULL; // Without one, for EQU, SET and MACRO
+    char* operation = NULL;
+    if (is_name_start(*text)) {
+        char* start = text;
+        while (is_name_char(*text)) text++;
+        char* end = text;
+        text = skip_space(text);
+        if (*text == ':') {
+            *end = '\0';
+            label = start;
+            text = skip_space(text + 1);
+            if (is_name_start(*text)) {
+                operation = text;
+                while (is_name_char(*text)) text++;
+                if (*text != '\0') *text++ = '\0';
+            }
+        }
+        else {
+            operation = start;
+            char saved = *end;
+            *end = '\0';
+            // "name EQU 5" names the symbol before the operation
+            char* next = text;
+            while (is_name_char(*next)) next++;
+            char word[8] = "";
+            if (next - text < (long) sizeof(word)) {
+                memcpy(word, text, next - text);
+                word[next - text] = '\0';
+            }
+            if (same_word(word, "EQU") || same_word(word, "SET") || same_word(word, "MACRO")) {
+                name = start;
+                operation = text;
+                text = next;
+                if (*text != '\0') *text++ = '\0';
+            }
+            else if (saved != '\0') text = end + 1;
+            else text = end;
+        }
+    }
+    else if (*text != '\0') {
+        char bad[2] = {*text, '\0'};
+        report(as, "a line can't start with %s", bad);
+        list_line(as, source, expanded);
+        return;
+    }
+
+    // Inside a macro definition every line but ENDM is kept for later
+    if (as->defining != NULL) {
+        if (operation != NULL && label == NULL && name == NULL && same_word(operation, "ENDM")) as->defining = NULL;
+        else add_macro_line(as->defining, source);
+        list_line(as, source, expanded);
+        return;
+    }
+
+    char mnemonic[16] = "";
+    if (operation != NULL) copy_upper(mnemonic, sizeof(mnemonic), operation, sizeof(mnemonic));
+    char* operands[MAX_OPERANDS];
+    int count = operation != NULL ? split_operands(text, operands) : 0;
+    if (count < 0) {
+        report(as, "more than %s operands", "64");
+        list_line(as, source, expanded);
+        return;
+    }
+
+    if (label != NULL) define_symbol(as, label, (int32_t) as->address, true, true, false);
+
+    if (operation == NULL) {} // A label on its own
+    else if (strcmp(mnemonic, "EQU") == 0 || strcmp(mnemonic, "SET") == 0) {
+        int32_t value = 0;
+        bool defined = false;
+        if (name == NULL) report(as, "%s needs a name before it", mnemonic);
+        else if (count != 1) report(as, "%s takes one expression", mnemonic);
+        else if (evaluate(as, operands[0], &value, &defined)) define_symbol(as, name, value, defined, false, mnemonic[0] == 'S');
+        as->line_listed_value = true;
+        as->line_value = value;
+    }
+    else if (strcmp(mnemonic, "MACRO") == 0) {
+        if (name == NULL) report(as, "MACRO needs a name before it%s", "");
+        else define_macro(as, name, operands, count);
+    }
+    else if (strcmp(mnemonic, "ENDM") == 0) report(as, "ENDM without MACRO%s", "");
+    else if (strcmp(mnemonic, "ORG") == 0) {
+        int32_t value;
+        if (count != 1) report(as, "ORG takes one address%s", "");
+        else if (evaluate_now(as, operands[0], &value)) {
+            if (value < 0 || value > 0xFFFF) report(as, "ORG %s is outside the address space", operands[0]);
+            else as->address = as->line_address = (uint32_t) value;
+        }
+    }
+    else if (strcmp(mnemonic, "DB") == 0 || strcmp(mnemonic, "DW") == 0) {
+        if (count == 0) report(as, "%s needs at least one value", mnemonic);
+        emit_data(as, operands, count, mnemonic[1] == 'B' ? 1 : 2);
+    }
+    else if (strcmp(mnemonic, "DS") == 0) {
+        int32_t size, fill = 0;
+        bool filled = count == 2;
+        if (count < 1 || count > 2) report(as, "DS takes a count and an optional fill byte%s", "");
+        else if (evaluate_now(as, operands[0], &size) && (!filled || as->pass == 1 || evaluate(as, operands[1], &fill, NULL))) {
+            if (size < 0 || as->address + size > 0x10000) report(as, "DS %s does not fit in the address space", operands[0]);
+            else if (filled) for (int32_t i = 0; i < size; i++) emit_byte(as, fill);
+            else as->address += size;
+        }
+    }
+    else if (strcmp(mnemonic, "END") == 0) as->ended = true;
+    else {
+        int index = find_name(&as->macro_names, operation);
+        int registers = find_name(&as->mnemonics, mnemonic);
+        if (name != NULL) report(as, "%s is missing the colon after it", name);
+        else if (index >= 0) {
+            list_line(as, source, expanded);
+            expand_macro(as, &as->macros[index], operands, count);
+            return;
+        }
+        else if (registers >= 0) assemble_instruction(as, mnemonic, registers, operands, count);
+        else report(as, "unknown instruction %s", operation);
+    }
+    list_line(as, source, expanded);
+}
+
+static void run_pass(Assembler* as, char* source, size_t size) {
+    as->address = 0;
+    as->ended = false;
+    as->line_number = 0;
+    as->expansions = 0;
+    as->defining = NULL;
+    for (int i = 0; i < as->macro_count; i++) { // Defined again as the pass reaches them
+        free(as->macros[i].name);
+        for (int j = 0; j < as->macros[i].param_count; j++) free(as->macros[i].params[j]);
+        for (int j = 0; j < as->macros[i].line_count; j++) free(as->macros[i].lines[j]);
+        free(as->macros[i].lines);
+    }
+    as->macro_count = 0;
+    free_names(&as->macro_names);
+    as->macro_names = (NameTable) {0};
+
+    char* line = source;
+    char* end = source + size;
+    while (line < end && !as->ended) {
+        char* newline = memchr(line, '\n', end - line);
+        char* line_end = newline != NULL ? newline : end;
+        as->line_number++;
+        if (line_end - line >= MAX_LINE) {
+            as->line_failed = false;
+            report(as, "line is longer than %s characters", "4095");
+        }
+        else {
+            char saved = *line_end;
+            *line_end = '\0';
+            assemble_line(as, line, false);
+            *line_end = saved;
+        }
+        line = line_end + 1;
+    }
+    if (as->defining != NULL) {
+        as->line_failed = false;
+        report(as, "macro %s has no ENDM", as->defining->name);
+    }
+}
+
+static int compare_labels(const void* a, const void* b) {
+    const Symbol* x = *(const Symbol* const*) a;
+    const Symbol* y = *(const Symbol* const*) b;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static int write_symbol_map(Assembler* as, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        printf("Could not open %s to write the symbol map\n", filename);
+        return 1;
+    }
+    const Symbol** labels = malloc((as->symbol_count + 1) * sizeof(Symbol*));
+    int count = 0;
+    for (int i = 0; labels != NULL && i < as->symbol_count; i++) {
+        if (as->symbols[i].label && as->symbols[i].defined) labels[count++] = &as->symbols[i];
+    }
+    if (labels != NULL) qsort(labels, count, sizeof(Symbol*), compare_labels);
+    for (int i = 0; i < count; i++) fprintf(file, "%04X %s\n", labels[i]->value & 0xFFFF, labels[i]->name);
+    free(labels);
+    if (fclose(file) != 0) {
+        printf("Could not write the symbol map to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+static char* read_source(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+    size_t capacity = 1 << 16;
+    char* source = malloc(capacity + 1);
+    *size = 0;
+    size_t got;
+    while (source != NULL && (got = fread(source + *size, 1, capacity - *size, file)) > 0) {
+        *size += got;
+        if (*size == capacity) {
+            capacity *= 2;
+            char* grown = realloc(source, capacity + 1);
+            if (grown == NULL) free(source);
+            source = grown;
+        }
+    }
+    fclose(file);
+    return source;
+}
+
+int main(int argc, char* argv[]) {
+    const char* input = NULL;
+    const char* output = NULL;
+    const char* listing_filename = NULL;
+    const char* map_filename = NULL;
+    uint32_t start = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i]; // Image, the source with .bin by default
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) listing_filename = argv[++i]; // Listing
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) map_filename = argv[++i]; // Symbol map for the emulator
+        else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) start = strtoul(argv[++i], NULL, 0) & 0xFFFF; // First address in the image
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            printf("Usage: %s [-o IMAGE] [-l LISTING] [-m SYMBOLS] [--start ADDRESS] SOURCE\n", argv[0]);
+            return 1;
+        }
+        else input = argv[i];
+    }
+    if (input == NULL) {
+        printf("Usage: %s [-o IMAGE] [-l LISTING] [-m SYMBOLS] [--start ADDRESS] SOURCE\n", argv[0]);
+        return 1;
+    }
+    char default_output[4096];
+    if (output == NULL) { // program.asm becomes program.bin
+        snprintf(default_output, sizeof(default_output) - 4, "%s", input);
+        char* dot = strrchr(default_output, '.');
+        char* slash = strrchr(default_output, '/');
+        if (dot != NULL && (slash == NULL || dot > slash)) *dot = '\0';
+        strcat(default_output, ".bin");
+        output = default_output;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    size_t size;
+    char* source = read_source(input, &size);
+    if (source == NULL) {
+        printf("Could not read %s\n", input);
+        return 1;
+    }
+
+    Assembler as = {.filename = input, .image = calloc(0x10000, 1)};
+    if (as.image == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    build_forms(&as);
+    as.pass = 1;
+    run_pass(&as, source, size);
+    if (listing_filename != NULL && as.errors == 0) {
+        as.listing = fopen(listing_filename, "w");
+        if (as.listing == NULL) printf("Could not open %s to write the listing\n", listing_filename);
+    }
+    as.pass = 2;
+    run_pass(&as, source, size);
+    if (as.listing != NULL && fclose(as.listing) != 0) {
+        printf("Could not write the listing to %s\n", listing_filename);
+        as.errors++;
+    }
+    if (as.errors > MAX_ERRORS) printf("%d more errors\n", as.errors - MAX_ERRORS);
+    if (as.errors > 0) {
+        printf("%s: %d error%s, nothing written\n", input, as.errors, as.errors == 1 ? "" : "s");
+        return 1;
+    }
+
+    uint32_t end = as.wrote && as.high > start ? as.high : start;
+    FILE* file = fopen(output, "wb");
+    bool written = file != NULL && fwrite(as.image + start, 1, end - start, file) == end - start;
+    if (file != NULL && fclose(file) != 0) written = false;
+    if (!written) {
+        printf("Could not write the image to %s\n", output);
+        return 1;
+    }
+    if (map_filename != NULL && write_symbol_map(&as, map_filename)) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Assembled %s: %d lines, %u bytes (0x%04x-0x%04x) to %s in %.1f ms\n", input, as.line_number, end - start, start, end > start ? end - 1 : start, output, seconds * 1e3);
+    return 0;
+}
@@ -0,0 +1,500 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "alu.h"
+#include "lockstep.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "debugger.h"
+
+// Batch runner. Every line of a manifest is one run: a program image and the state to start it
+// in, so one binary can be listed many times with different registers and memory. Runs are
+// spread over a pool of threads, one CPU per run, and nothing mutable is shared between runs;
+// the opcode tables are const and every CPU maps its own copy-on-write view of its image.
+//
+// Manifest lines look like
+//     program.bin A=0x12 BC=0x1234 SP=0xF000 PC=0x0100 @0x2000=0x55
+// where @ADDRESS=VALUE writes one byte of memory, which has to be outside the --rom range. Blank
+// lines and lines starting with # are skipped.
+//
+// The image can also be a snapshot file (see snapshot.c). Consecutive lines naming the same
+// snapshot load it once and every run is restored from it copy-on-write, so many what-if runs can
+// branch from one warmed-up state without each replaying the prefix. Snapshots carry their own
+// ROM size and --rom does not apply to them. Cycles, and --max-cycles, count from reset as they
+// do everywhere else, so they include the prefix the snapshot was taken after.
+//
+// With the lockstep core, consecutive lines naming the same image run together as one lockstep
+// group of up to LOCKSTEP_MAX_LANES lanes, and lanes that leave their group finish on the
+// threaded core.
+//
+// When profiling, every worker fills its own profile and they are merged once all runs are done,
+// so runs of different images add up by guest address.
+//
+// Watchpoints are copied into every run, which stops at its first hit and is listed as paused with
+// what it hit. Runs with only write watchpoints keep their core's speed, see debugger.c.
+
+#define MAX_OVERRIDES 32
+
+typedef enum OverrideKind {
+    OVERRIDE_REGISTER, // 8-bit register by register field
+    OVERRIDE_PAIR, // Register pair by RP field, 3 is SP
+    OVERRIDE_PSW,
+    OVERRIDE_PC,
+    OVERRIDE_MEMORY,
+} OverrideKind;
+
+typedef struct Override {
+    uint8_t kind;
+    uint8_t target; // Register field or RP field
+    uint16_t address; // Only for OVERRIDE_MEMORY
+    uint16_t value;
+} Override;
+
+typedef struct BatchTask {
+    char* filename;
+    Snapshot* snapshot; // Shared by consecutive runs of the same snapshot file, NULL for program images
+    Override overrides[MAX_OVERRIDES];
+    int override_count;
+} BatchTask;
+
+typedef enum BatchStatus {
+    BATCH_HALTED,
+    BATCH_INVALID, // Stopped on an invalid opcode or a flag mismatch in CHECK_FLAGS builds
+    BATCH_OUT_OF_CYCLES,
+    BATCH_LOAD_FAILED,
+    BATCH_PAUSED, // Stopped on a watchpoint
+} BatchStatus;
+
+// Compact summary of one run, written only by the thread that ran it
+typedef struct BatchResult {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint16_t pairs[4]; // BC, DE, HL, PSW
+    uint16_t stack_pointer;
+    uint16_t program_counter;
+    uint8_t status;
+    uint8_t hit_kind; // WATCH_ bit of the watchpoint a paused run hit
+    uint16_t hit_address;
+} BatchResult;
+
+// Every worker owns a range of groups and works through it from the front, a worker that runs out
+// steals the back half of someone else's range. A group is a single run unless the lockstep core
+// is used
+typedef struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t head, tail; // Groups [head, tail) are still queued here
+    int id;
+    struct Batch* batch;
+    Profile* profile; // Only when profiling, merged into one report at the end
+} Worker;
+
+typedef struct Batch {
+    BatchTask* tasks;
+    BatchResult* results;
+    size_t task_count;
+    size_t* groups; // Index of the first run of every group, and task_count at the end
+    size_t group_count;
+    Worker* workers;
+    int worker_count;
+    Core core;
+    uint64_t max_cycles;
+    size_t rom_size;
+    const Debugger* watches; // Copied into every run, NULL for none
+} Batch;
+
+static const char* const status_names[] = {"halted", "invalid", "out_of_cycles", "load_failed", "paused"};
+
+// Parses one NAME=VALUE token, false if it is not one
+static bool parse_override(char* token, Override* override) {
+    char* equals = strchr(token, '=');
+    if (equals == NULL) return false;
+    *equals = '\0';
+    char* end;
+    unsigned long value = strtoul(equals + 1, &end, 0);
+    if (*end != '\0' || value > 0xFFFF) return false;
+    override->value = value;
+
+    if (token[0] == '@') {
+        unsigned long address = strtoul(token + 1, &end, 0);
+        if (*end != '\0' || address > 0xFFFF || value > 0xFF) return false;
+        override->kind = OVERRIDE_MEMORY;
+        override->address = address;
+        return true;
+    }
+    if (strcmp(token, "PC") == 0) {
+        override->kind = OVERRIDE_PC;
+        return true;
+    }
+    if (strcmp(token, "PSW") == 0) {
+        override->kind = OVERRIDE_PSW;
+        return true;
+    }
+    const char* pairs[] = {"BC", "DE", "HL", "SP"};
+    for (int rp = 0; rp < 4; rp++) {
+        if (strcmp(token, pairs[rp]) == 0) {
+            override->kind = OVERRIDE_PAIR;
+            override->target = rp;
+            return true;
+        }
+    }
+    for (int reg = 0; reg < 8; reg++) {
+        if (reg != REGISTER_M && token[0] == register_names[reg] && token[1] == '\0' && value <= 0xFF) {
+            override->kind = OVERRIDE_REGISTER;
+            override->target = reg;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void apply_overrides(CPU* cpu, const BatchTask* task) {
+    for (int i = 0; i < task->override_count; i++) {
+        const Override* override = &task->overrides[i];
+        switch (override->kind) {
+            case OVERRIDE_REGISTER: set_register(cpu, override->target, override->value); break;
+            case OVERRIDE_PAIR: set_pair(cpu, override->target, override->value); break;
+            case OVERRIDE_PSW: set_psw(cpu, override->value); break;
+            case OVERRIDE_PC: cpu->program_counter = override->value; break;
+            case OVERRIDE_MEMORY: write_memory(&cpu->memory, override->address, override->value); break; // run_batch rejects ROM addresses
+        }
+    }
+}
+
+static void free_tasks(BatchTask* tasks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || tasks[i].snapshot != tasks[i - 1].snapshot) free_snapshot(tasks[i].snapshot);
+        free(tasks[i].filename);
+    }
+    free(tasks);
+}
+
+// Returns the number of runs read, or -1 if the manifest could not be read. Nothing is left
+// allocated on failure
+static long read_manifest(const char* manifest, BatchTask** tasks) {
+    FILE* file = fopen(manifest, "r");
+    if (file == NULL) {
+        printf("Could not open manifest %s\n", manifest);
+        return -1;
+    }
+
+    size_t count = 0, capacity = 256;
+    *tasks = malloc(capacity * sizeof(BatchTask));
+    if (*tasks == NULL) {
+        printf("Out of memory reading manifest %s\n", manifest);
+        fclose(file);
+        return -1;
+    }
+
+    char line[4096];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* save;
+        char* token = strtok_r(line, " \t\r\n", &save);
+        if (token == NULL || token[0] == '#') continue;
+
+        if (count == capacity) {
+            BatchTask* grown = realloc(*tasks, capacity * 2 * sizeof(BatchTask));
+            if (grown == NULL) {
+                printf("Out of memory reading manifest %s\n", manifest);
+                goto failed;
+            }
+            *tasks = grown;
+            capacity *= 2;
+        }
+        BatchTask* task = &(*tasks)[count];
+        task->filename = strdup(token);
+        if (task->filename == NULL) {
+            printf("Out of memory reading manifest %s\n", manifest);
+            goto failed;
+        }
+        task->snapshot = NULL;
+        task->override_count = 0;
+        count++;
+
+        while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (task->override_count == MAX_OVERRIDES || !parse_override(token, &task->overrides[task->override_count])) {
+                printf("%s:%d: bad state override %s\n", manifest, line_number, token);
+                goto failed;
+            }
+            task->override_count++;
+        }
+    }
+    fclose(file);
+    return count;
+
+failed:
+    fclose(file);
+    free_tasks(*tasks, count);
+    *tasks = NULL;
+    return -1;
+}
+
+// Loads every snapshot named in the manifest, once per run of lines naming the same file
+static bool load_task_snapshots(Batch* batch) {
+    for (size_t i = 0; i < batch->task_count; i++) {
+        BatchTask* task = &batch->tasks[i];
+        if (i > 0 && strcmp(task->filename, batch->tasks[i - 1].filename) == 0) task->snapshot = batch->tasks[i - 1].snapshot;
+        else if (is_snapshot_file(task->filename)) {
+            task->snapshot = load_snapshot(task->filename);
+            if (task->snapshot == NULL) return false;
+        }
+    }
+    return true;
+}
+
+// Overrides are applied with write_memory, which drops writes to ROM, and ROM may also be read-only
+// on the host, so a manifest that pokes ROM is rejected up front instead
+static bool check_rom_overrides(const Batch* batch) {
+    for (size_t i = 0; i < batch->task_count; i++) {
+        const BatchTask* task = &batch->tasks[i];
+        size_t rom_size = task->snapshot != NULL ? task->snapshot->state.rom_size : batch->rom_size;
+        for (int j = 0; j < task->override_count; j++) {
+            const Override* override = &task->overrides[j];
+            if (override->kind == OVERRIDE_MEMORY && override->address < rom_size) {
+                printf("Run %zu (%s) writes 0x%04x, which is inside the %zu bytes of ROM\n", i, task->filename, override->address, rom_size);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Consecutive runs of the same image go in one group for the lockstep core, every other core
+// runs them one at a time
+static bool group_tasks(Batch* batch) {
+    batch->groups = malloc((batch->task_count + 1) * sizeof(size_t));
+    if (batch->groups == NULL) return false;
+    batch->group_count = 0;
+    for (size_t i = 0; i < batch->task_count; i++) {
+        size_t first = batch->group_count > 0 ? batch->groups[batch->group_count - 1] : 0;
+        bool joins = batch->core == CORE_LOCKSTEP && batch->group_count > 0 && i - first < LOCKSTEP_MAX_LANES && strcmp(batch->tasks[i].filename, batch->tasks[first].filename) == 0;
+        if (!joins) batch->groups[batch->group_count++] = i;
+    }
+    batch->groups[batch->group_count] = batch->task_count;
+    return true;
+}
+
+static bool start_task(Batch* batch, size_t index, CPU* cpu) {
+    const BatchTask* task = &batch->tasks[index];
+    if (task->snapshot != NULL ? restore_snapshot(cpu, task->snapshot) : initialize_cpu(cpu, task->filename, batch->rom_size)) {
+        batch->results[index].status = BATCH_LOAD_FAILED;
+        return false;
+    }
+    if (batch->max_cycles > 0) cpu->cycle_limit = batch->max_cycles;
+    apply_overrides(cpu, task);
+    return true;
+}
+
+static void finish_task(Batch* batch, size_t index, CPU* cpu, bool error_stop) {
+    BatchResult* result = &batch->results[index];
+    result->status = error_stop ? BATCH_INVALID : run_paused(cpu) ? BATCH_PAUSED : cpu->running ? BATCH_OUT_OF_CYCLES : BATCH_HALTED;
+    if (result->status == BATCH_PAUSED) {
+        result->hit_kind = cpu->debugger->hit.kind;
+        result->hit_address = cpu->debugger->hit.address;
+    }
+    result->cycles = cpu->cycles;
+    get_flags(cpu);
+    memcpy(result->pairs, cpu->registers.r16, sizeof(result->pairs));
+    result->stack_pointer = cpu->stack_pointer;
+    result->program_counter = cpu->program_counter;
+    free_cpu(cpu);
+}
+
+static void run_task(Batch* batch, size_t index, Core core, Profile* profile) {
+    CPU cpu;
+    if (!start_task(batch, index, &cpu)) return;
+    cpu.profile = profile;
+    Debugger debugger;
+    if (batch->watches != NULL) {
+        debugger = *batch->watches;
+        attach_debugger(&cpu, &debugger);
+    }
+    bool error_stop = run_cpu(&cpu, core, &batch->results[index].instructions);
+    if (profile != NULL) end_profile_run(profile, &cpu);
+    finish_task(batch, index, &cpu, error_stop);
+}
+
+// Runs the group in lockstep for as long as its lanes agree, then finishes every lane that left
+// on the threaded core
+static void run_lockstep_group(Batch* batch, size_t first, size_t count) {
+    Lockstep* lockstep = create_lockstep(count);
+    if (lockstep == NULL) {
+        for (size_t i = first; i < first + count; i++) run_task(batch, i, CORE_THREADED, NULL);
+        return;
+    }
+    bool loaded[LOCKSTEP_MAX_LANES];
+    for (size_t lane = 0; lane < count; lane++) {
+        CPU cpu;
+        loaded[lane] = start_task(batch, first + lane, &cpu);
+        if (!loaded[lane]) continue;
+        const BatchTask* task = &batch->tasks[first + lane];
+        for (int j = 0; j < task->override_count; j++) {
+            if (task->overrides[j].kind == OVERRIDE_MEMORY) mark_lockstep_write(lockstep, task->overrides[j].address);
+        }
+        load_lockstep_lane(lockstep, lane, &cpu);
+    }
+
+    run_lockstep(lockstep, batch->max_cycles > 0 ? batch->max_cycles : UINT64_MAX);
+
+    for (size_t lane = 0; lane < count; lane++) {
+        if (!loaded[lane]) continue;
+        CPU cpu = {.bus = NULL, .cycle_limit = batch->max_cycles > 0 ? batch->max_cycles : UINT64_MAX};
+        BatchResult* result = &batch->results[first + lane];
+        result->instructions = store_lockstep_lane(lockstep, lane, &cpu);
+        bool error_stop = false;
+        if (cpu.running && cpu.cycles < cpu.cycle_limit) {
+            uint64_t instructions = 0;
+            error_stop = run_cpu(&cpu, CORE_THREADED, &instructions);
+            result->instructions += instructions;
+        }
+        finish_task(batch, first + lane, &cpu, error_stop);
+    }
+    free_lockstep(lockstep);
+}
+
+static void run_group(Worker* worker, size_t group) {
+    Batch* batch = worker->batch;
+    size_t first = batch->groups[group], count = batch->groups[group + 1] - first;
+    if (batch->core != CORE_LOCKSTEP) run_task(batch, first, batch->core, worker->profile);
+    else if (count >= LOCKSTEP_MIN_LANES) run_lockstep_group(batch, first, count);
+    else for (size_t i = first; i < first + count; i++) run_task(batch, i, CORE_THREADED, NULL);
+}
+
+// Takes the next group off this worker, stealing from the others once it is out
+static bool take_group(Worker* self, size_t* index) {
+    pthread_mutex_lock(&self->lock);
+    bool found = self->head < self->tail;
+    if (found) *index = self->head++;
+    pthread_mutex_unlock(&self->lock);
+    if (found) return true;
+
+    Batch* batch = self->batch;
+    for (int i = 1; i < batch->worker_count; i++) {
+        Worker* victim = &batch->workers[(self->id + i) % batch->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->tail - victim->head;
+        size_t stolen = (left + 1) / 2;
+        victim->tail -= stolen;
+        size_t start = victim->tail;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen == 0) continue;
+
+        *index = start;
+        pthread_mutex_lock(&self->lock);
+        self->head = start + 1;
+        self->tail = start + stolen;
+        pthread_mutex_unlock(&self->lock);
+        return true;
+    }
+    return false;
+}
+
+static void* worker_main(void* argument) {
+    Worker* self = argument;
+    size_t index;
+    while (take_group(self, &index)) run_group(self, index);
+    return NULL;
+}
+
+int run_batch(const char* manifest, size_t rom_size, Core core, int threads, uint64_t max_cycles, const ProfileOutput* profile_output, const Debugger* watches) {
+    if (profile_output != NULL && core == CORE_LOCKSTEP) {
+        printf("Lockstep groups cannot be profiled, profiling every run on the table core instead\n");
+        core = CORE_TABLE;
+    }
+    if (watches != NULL && core == CORE_LOCKSTEP) {
+        printf("Lockstep groups cannot be watched, running every run on the threaded core instead\n");
+        core = CORE_THREADED;
+    }
+    Batch batch = {.core = core, .max_cycles = max_cycles, .rom_size = rom_size, .watches = watches};
+    long count = read_manifest(manifest, &batch.tasks);
+    if (count < 0) return 1;
+    batch.task_count = count;
+    if (!load_task_snapshots(&batch) || !check_rom_overrides(&batch)) {
+        free_tasks(batch.tasks, batch.task_count);
+        return 1;
+    }
+
+    if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#if DEBUG
+    threads = 1; // Traces from several threads would interleave into nonsense
+#endif
+    if (threads < 1) threads = 1;
+    batch.results = calloc(count > 0 ? count : 1, sizeof(BatchResult));
+    if (batch.results == NULL || !group_tasks(&batch)) {
+        printf("Out of memory starting a batch of %ld runs\n", count);
+        free(batch.results);
+        free(batch.groups);
+        free_tasks(batch.tasks, batch.task_count);
+        return 1;
+    }
+    if ((size_t) threads > batch.group_count && batch.group_count > 0) threads = batch.group_count;
+    batch.worker_count = threads;
+    batch.workers = calloc(threads, sizeof(Worker));
+    bool out_of_memory = batch.workers == NULL;
+    for (int i = 0; i < threads && !out_of_memory && profile_output != NULL; i++) {
+        batch.workers[i].profile = create_profile();
+        out_of_memory = batch.workers[i].profile == NULL;
+    }
+    if (out_of_memory) {
+        printf("Out of memory starting a batch of %ld runs\n", count);
+        for (int i = 0; batch.workers != NULL && i < threads; i++) free_profile(batch.workers[i].profile);
+        free(batch.workers);
+        free(batch.results);
+        free(batch.groups);
+        free_tasks(batch.tasks, batch.task_count);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        Worker* worker = &batch.workers[i];
+        worker->id = i;
+        worker->batch = &batch;
+        worker->head = batch.group_count * i / threads;
+        worker->tail = batch.group_count * (i + 1) / threads;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    for (int i = 1; i < threads; i++) pthread_create(&batch.workers[i].thread, NULL, worker_main, &batch.workers[i]);
+    worker_main(&batch.workers[0]); // The calling thread is worker 0
+    for (int i = 1; i < threads; i++) pthread_join(batch.workers[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Results in manifest order, then the totals
+    uint64_t total_instructions = 0, total_cycles = 0;
+    size_t status_counts[5] = {0};
+    for (size_t i = 0; i < batch.task_count; i++) {
+        const BatchResult* result = &batch.results[i];
+        status_counts[result->status]++;
+        total_instructions += result->instructions;
+        total_cycles += result->cycles;
+        printf("%zu %s %s instructions=%llu cycles=%llu PC=0x%04x SP=0x%04x BC=0x%04x DE=0x%04x HL=0x%04x PSW=0x%04x",
+               i, batch.tasks[i].filename, status_names[result->status], (unsigned long long) result->instructions, (unsigned long long) result->cycles,
+               result->program_counter, result->stack_pointer, result->pairs[PAIR_BC], result->pairs[PAIR_DE], result->pairs[PAIR_HL], result->pairs[PAIR_PSW]);
+        if (result->status == BATCH_PAUSED) printf(" hit=%c:0x%04x", result->hit_kind == WATCH_READ ? 'r' : result->hit_kind == WATCH_WRITE ? 'w' : 'x', result->hit_address);
+        printf("\n");
+    }
+    double seconds = elapsed_seconds(&start, &end);
+    printf("Ran %zu programs on %d threads in %.6f s: %zu halted, %zu invalid, %zu out of cycles, %zu failed to load\n",
+           batch.task_count, threads, seconds, status_counts[BATCH_HALTED], status_counts[BATCH_INVALID], status_counts[BATCH_OUT_OF_CYCLES], status_counts[BATCH_LOAD_FAILED]);
+    if (watches != NULL) printf("%zu paused on a watchpoint\n", status_counts[BATCH_PAUSED]);
+    printf("Executed %llu instructions and %llu cycles (%.2f MIPS)\n", (unsigned long long) total_instructions, (unsigned long long) total_cycles, seconds > 0 ? total_instructions / seconds / 1e6 : 0.0);
+
+    bool profile_failed = false;
+    if (profile_output != NULL) {
+        for (int i = 1; i < threads; i++) merge_profile(batch.workers[0].profile, batch.workers[i].profile);
+        profile_failed = report_profile(batch.workers[0].profile, profile_output) != 0;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+        free_profile(batch.workers[i].profile);
+    }
+    free(batch.workers);
+    free(batch.results);
+    free(batch.groups);
+    free_tasks(batch.tasks, batch.task_count);
+    return status_counts[BATCH_LOAD_FAILED] > 0 || profile_failed;
+}
@@ -0,0 +1,212 @@
+#include <math.h>
+#include "cpu.h"
+#include "profile.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define COUNTER_CACHE_MISSES PERF_COUNT_HW_CACHE_MISSES
+#define COUNTER_BRANCH_MISSES PERF_COUNT_HW_BRANCH_MISSES
+#else
+#define COUNTER_CACHE_MISSES 0
+#define COUNTER_BRANCH_MISSES 0
+#endif
+
+// Benchmark harness. Every image runs RUNS times on every core, and once more on the table core
+// with the profiler attached, each run on a fresh CPU with only the core itself timed. A row
+// reports the mean wall time of a run and its spread, instructions per second and the guest clock
+// rate that works out to, and the host cache and branch misses per run where perf counters can be
+// opened (Linux with perf_event_paranoid at 2 or lower, and not in most containers). Rows are
+// printed as a table and, with a report file, written as JSON or CSV with the same columns in the
+// same order every time, so reports from two builds can be compared line by line.
+//
+// The workloads/ directory holds a corpus of images made for this, see workloads/*.asm
+
+#define BENCH_ENGINES 4
+
+typedef struct BenchRow {
+    const char* image;
+    const char* engine;
+    uint64_t instructions; // Per run
+    uint64_t cycles; // Per run
+    double seconds_mean, seconds_stddev, seconds_min, seconds_max; // Per run
+    double mips; // At the mean time
+    double mhz; // Guest clock rate at the mean time
+    int64_t cache_misses, branch_misses; // Mean per run, -1 where the counters could not be opened
+} BenchRow;
+
+// Host hardware counters for this thread, user space only. -1 where they are not available
+static int open_counter(uint64_t config) {
+#ifdef __linux__
+    struct perf_event_attr attr = {.type = PERF_TYPE_HARDWARE, .size = sizeof(attr), .config = config, .disabled = 1, .exclude_kernel = 1, .exclude_hv = 1};
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+static void start_counter(int fd) {
+#ifdef __linux__
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+static int64_t stop_counter(int fd) {
+#ifdef __linux__
+    uint64_t value;
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    return read(fd, &value, sizeof(value)) == sizeof(value) ? (int64_t) value : -1;
+#else
+    return -1;
+#endif
+}
+static void close_counter(int fd) {
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+}
+
+// Runs one image on one engine runs times, false if it could not be loaded or stopped on an error.
+// The spread of the run times is kept with Welford's method, so no run is kept around
+static bool bench_engine(BenchRow* row, const char* filename, size_t rom_size, Core core, Profile* profile, int runs, int cache_fd, int branch_fd) {
+    double mean = 0, squares = 0;
+    int64_t cache_misses = 0, branch_misses = 0;
+    for (int run = 0; run < runs; run++) {
+        CPU cpu;
+        if (initialize_cpu(&cpu, (char*) filename, rom_size)) return false;
+        cpu.profile = profile;
+
+        uint64_t instruction_count = 0;
+        struct timespec start, end;
+        start_counter(cache_fd);
+        start_counter(branch_fd);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool error_stop = run_cpu(&cpu, core, &instruction_count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int64_t cache = stop_counter(cache_fd), branch = stop_counter(branch_fd);
+        if (profile != NULL) end_profile_run(profile, &cpu);
+        uint64_t cycles = cpu.cycles;
+        free_cpu(&cpu);
+        if (error_stop) return false;
+
+        double seconds = elapsed_seconds(&start, &end);
+        double delta = seconds - mean;
+        mean += delta / (run + 1);
+        squares += delta * (seconds - mean);
+        if (run == 0 || seconds < row->seconds_min) row->seconds_min = seconds;
+        if (run == 0 || seconds > row->seconds_max) row->seconds_max = seconds;
+        row->instructions = instruction_count;
+        row->cycles = cycles;
+        cache_misses = cache < 0 || cache_misses < 0 ? -1 : cache_misses + cache;
+        branch_misses = branch < 0 || branch_misses < 0 ? -1 : branch_misses + branch;
+    }
+
+    row->seconds_mean = mean;
+    row->seconds_stddev = runs > 1 ? sqrt(squares / (runs - 1)) : 0;
+    row->mips = row->seconds_mean > 0 ? row->instructions / row->seconds_mean / 1e6 : 0;
+    row->mhz = row->seconds_mean > 0 ? row->cycles / row->seconds_mean / 1e6 : 0;
+    row->cache_misses = cache_misses < 0 ? -1 : cache_misses / runs;
+    row->branch_misses = branch_misses < 0 ? -1 : branch_misses / runs;
+    return true;
+}
+
+static void print_bench_row(const BenchRow* row) {
+    printf("%-24s %-8s %10llu instructions in %.6f s ±%4.1f%% (%8.2f MIPS, %8.2f MHz)", row->image, row->engine, (unsigned long long) row->instructions,
+           row->seconds_mean, row->seconds_mean > 0 ? 100 * row->seconds_stddev / row->seconds_mean : 0.0, row->mips, row->mhz);
+    if (row->cache_misses >= 0) printf(", %lld cache misses", (long long) row->cache_misses);
+    if (row->branch_misses >= 0) printf(", %lld branch misses", (long long) row->branch_misses);
+    printf("\n");
+}
+
+// Reports, one row per image and engine. Missing counters are null in JSON and empty in CSV
+static void write_counter_json(FILE* file, const char* name, int64_t value) {
+    if (value < 0) fprintf(file, ", \"%s\": null", name);
+    else fprintf(file, ", \"%s\": %lld", name, (long long) value);
+}
+static void write_bench_json(const BenchRow* rows, int row_count, int runs, FILE* file) {
+    fprintf(file, "{\n  \"runs\": %d,\n  \"results\": [", runs);
+    const char* separator = "\n";
+    for (int i = 0; i < row_count; i++) {
+        const BenchRow* row = &rows[i];
+        fprintf(file, "%s    {\"image\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, \"cycles\": %llu, \"seconds_mean\": %.9f, \"seconds_stddev\": %.9f, \"seconds_min\": %.9f, \"seconds_max\": %.9f, \"mips\": %.3f, \"mhz\": %.3f",
+                separator, row->image, row->engine, (unsigned long long) row->instructions, (unsigned long long) row->cycles,
+                row->seconds_mean, row->seconds_stddev, row->seconds_min, row->seconds_max, row->mips, row->mhz);
+        write_counter_json(file, "cache_misses", row->cache_misses);
+        write_counter_json(file, "branch_misses", row->branch_misses);
+        fprintf(file, "}");
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+static void write_bench_csv(const BenchRow* rows, int row_count, int runs, FILE* file) {
+    fprintf(file, "image,engine,runs,instructions,cycles,seconds_mean,seconds_stddev,seconds_min,seconds_max,mips,mhz,cache_misses,branch_misses\n");
+    for (int i = 0; i < row_count; i++) {
+        const BenchRow* row = &rows[i];
+        fprintf(file, "\"%s\",%s,%d,%llu,%llu,%.9f,%.9f,%.9f,%.9f,%.3f,%.3f,", row->image, row->engine, runs, (unsigned long long) row->instructions, (unsigned long long) row->cycles,
+                row->seconds_mean, row->seconds_stddev, row->seconds_min, row->seconds_max, row->mips, row->mhz);
+        if (row->cache_misses >= 0) fprintf(file, "%lld", (long long) row->cache_misses);
+        fprintf(file, ",");
+        if (row->branch_misses >= 0) fprintf(file, "%lld", (long long) row->branch_misses);
+        fprintf(file, "\n");
+    }
+}
+static int write_bench_report(const BenchRow* rows, int row_count, int runs, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        printf("Could not open %s to write the benchmark report\n", filename);
+        return 1;
+    }
+    size_t length = strlen(filename);
+    if (length >= 5 && strcmp(filename + length - 5, ".json") == 0) write_bench_json(rows, row_count, runs, file);
+    else write_bench_csv(rows, row_count, runs, file);
+    if (fclose(file) != 0) {
+        printf("Could not write the benchmark report to %s\n", filename);
+        return 1;
+    }
+    printf("Wrote the benchmark report to %s\n", filename);
+    return 0;
+}
+
+// Runs every image through every core and reports how they compare, the last row of each image is
+// the table core with the profiler attached
+int run_benchmark(char** filenames, int file_count, size_t rom_size, int runs, const char* report_filename) {
+    const Core cores[BENCH_ENGINES] = {CORE_TABLE, CORE_THREADED, CORE_JIT, CORE_TABLE};
+    const char* engine_names[BENCH_ENGINES] = {"table", "threaded", "jit", "profiled"};
+    BenchRow* rows = calloc(file_count * BENCH_ENGINES, sizeof(BenchRow));
+    Profile* profile = create_profile();
+    int cache_fd = open_counter(COUNTER_CACHE_MISSES), branch_fd = open_counter(COUNTER_BRANCH_MISSES);
+    int code = rows == NULL || profile == NULL;
+    if (code) printf("Out of memory starting the benchmark\n");
+    if (cache_fd < 0 && !code) printf("Host perf counters are not available, cache and branch misses are left out\n");
+
+    int row_count = 0;
+    for (int file = 0; file < file_count && !code; file++) {
+        for (int i = 0; i < BENCH_ENGINES; i++) {
+            BenchRow* row = &rows[row_count];
+            row->image = filenames[file];
+            row->engine = engine_names[i];
+            if (!bench_engine(row, filenames[file], rom_size, cores[i], i == 3 ? profile : NULL, runs, cache_fd, branch_fd)) {
+                printf("Stopped benchmarking %s on the %s core, it could not be loaded or stopped on an invalid opcode\n", filenames[file], engine_names[i]);
+                code = 1;
+                break;
+            }
+            print_bench_row(row);
+            row_count++;
+        }
+        if (code) break;
+        const BenchRow* image_rows = &rows[row_count - BENCH_ENGINES];
+        if (image_rows[0].mips > 0 && image_rows[3].mips > 0) {
+            printf("threaded speedup: %.2fx, jit speedup: %.2fx, profiler overhead: %.1f%%\n", image_rows[1].mips / image_rows[0].mips, image_rows[2].mips / image_rows[0].mips, 100 * (image_rows[0].mips / image_rows[3].mips - 1));
+        }
+    }
+
+    if (!code && report_filename != NULL) code = write_bench_report(rows, row_count, runs, report_filename);
+    close_counter(cache_fd);
+    close_counter(branch_fd);
+    free_profile(profile);
+    free(rows);
+    return code;
+}
@@ -0,0 +1,362 @@
+#include "cpu.h"
+#include "alu.h"
+#include "devices.h"
+#include "snapshot.h"
+
+// Conformance runs of CP/M exerciser programs such as 8080PRE, TST8080, CPUTEST and 8080EXM.
+//
+// Each .COM is loaded at 0x0100 on a 64 KiB machine with just enough of CP/M around it: a HLT at
+// 0x0000 for the warm boot that ends every one of them, and a JMP at 0x0005 to a BDOS shim at
+// BDOS_ENTRY, which 0x0006 also gives as the top of memory the way CP/M does. The shim passes
+// function 2 (print E) and 9 (print the $-terminated string at DE) to a device on BDOS_PORT and
+// warm boots on function 0; every other function returns without doing anything.
+//
+// --conformance runs each program on one core and reports every line of its output as it comes,
+// marked pass or fail by the words in it (PASS, OK, OPERATIONAL, COMPLETE against ERROR and
+// FAIL), then a verdict for the program: it passes if it reached the warm boot with at least one
+// passing line and no failing one.
+//
+// --conformance-diff runs each program on the table core next to the threaded core, then next to
+// the JIT. The other core runs to its next branch or block end, the table core steps through the
+// same instructions one at a time, and the two are compared there: registers, flags, PC, SP,
+// cycles, INTE and output on every step, and memory every DIFF_CHECK_INTERVAL steps, which is
+// where a snapshot is taken to go back to. When memory differs both rewind to that snapshot and
+// run again comparing memory on every step, so the report always names the first block that
+// went wrong and the instructions the table core ran in it.
+
+#define COM_START 0x0100
+#define BDOS_ENTRY 0xFE00
+#define BDOS_PORT 0xFF
+#define DIFF_CHECK_INTERVAL 1024 // Steps between memory compares and snapshots
+#define DIFF_HISTORY 64 // Instructions of the diverging block that are printed
+
+// At BDOS_ENTRY. The BDOS may clobber every register, so the shim can use A
+static const uint8_t bdos_shim[] = {
+    0x79, // MOV A, C
+    0xB7, // ORA A
+    0xCA, 0x00, 0x00, // JZ 0x0000, function 0 warm boots
+    0xD3, BDOS_PORT, // OUT BDOS_PORT
+    0xC9, // RET
+};
+
+typedef struct Bdos {
+    Device device;
+    char* output; // Everything the program printed, kept for --conformance-diff to compare
+    size_t used, capacity;
+    size_t line_start; // Start of the line --conformance has not reported yet
+    bool report; // Report each line as it ends, --conformance only
+    int passed, failed; // Lines reported
+} Bdos;
+
+// Whole word, or the start of one, in any case
+static bool has_word(const char* line, size_t length, const char* word) {
+    size_t word_length = strlen(word);
+    for (size_t i = 0; i + word_length <= length; i++) {
+        if (i > 0 && ((line[i - 1] | 0x20) >= 'a' && (line[i - 1] | 0x20) <= 'z')) continue;
+        size_t j = 0;
+        while (j < word_length && (line[i + j] | 0x20) == (word[j] | 0x20)) j++;
+        if (j == word_length) return true;
+    }
+    return false;
+}
+
+// 1 for a passing test group, -1 for a failing one and 0 for anything else
+static int classify_line(const char* line, size_t length) {
+    if (has_word(line, length, "ERROR") || has_word(line, length, "FAIL")) return -1;
+    if (has_word(line, length, "PASS") || has_word(line, length, "OK") || has_word(line, length, "OPERATIONAL") || has_word(line, length, "COMPLETE")) return 1;
+    return 0;
+}
+
+static void report_line(Bdos* bdos, size_t end) {
+    const char* line = bdos->output + bdos->line_start;
+    size_t length = end - bdos->line_start;
+    bdos->line_start = end;
+    while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == '\n')) length--;
+    while (length > 0 && (line[0] == '\r' || line[0] == '\n')) {
+        line++;
+        length--;
+    }
+    if (length == 0) return;
+
+    int verdict = classify_line(line, length);
+    if (verdict > 0) bdos->passed++;
+    if (verdict < 0) bdos->failed++;
+    if (verdict > 0) printf("  %sPASS%s  %.*s\n", GREEN, RESET, (int) length, line);
+    else if (verdict < 0) printf("  %sFAIL%s  %.*s\n", RED, RESET, (int) length, line);
+    else printf("        %s%.*s%s\n", DIM, (int) length, line, RESET);
+    fflush(stdout);
+}
+
+static void print_char(Bdos* bdos, char value) {
+    if (bdos->used == bdos->capacity) {
+        size_t capacity = bdos->capacity > 0 ? bdos->capacity * 2 : 4096;
+        char* output = realloc(bdos->output, capacity);
+        if (output == NULL) return; // Drops what does not fit, the run still finishes
+        bdos->output = output;
+        bdos->capacity = capacity;
+    }
+    bdos->output[bdos->used++] = value;
+    if (bdos->report && value == '\n') report_line(bdos, bdos->used);
+}
+
+static void write_bdos(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    Bdos* bdos = (Bdos*) device;
+    uint8_t function = cpu->registers.r8[REG_C];
+    if (function == 2) print_char(bdos, (char) cpu->registers.r8[REG_E]);
+    else if (function == 9) {
+        uint16_t address = cpu->registers.r16[PAIR_DE];
+        for (int i = 0; i < ADDRESS_SPACE_SIZE && read_memory(&cpu->memory, address) != '$'; i++, address++) print_char(bdos, (char) read_memory(&cpu->memory, address));
+    }
+}
+
+static void close_bdos(Device* device) {
+    Bdos* bdos = (Bdos*) device;
+    free(bdos->output);
+    free(bdos);
+}
+
+// The address space a .COM starts in, 1 if the file can't be read and 2 if it does not fit
+static int load_com(const char* filename, uint8_t* image) {
+    memset(image, 0, ADDRESS_SPACE_SIZE);
+    image[0x0000] = 0x76; // HLT
+    image[0x0005] = 0xC3; // JMP BDOS_ENTRY
+    image[0x0006] = BDOS_ENTRY & 0xFF;
+    image[0x0007] = BDOS_ENTRY >> 8;
+    memcpy(image + BDOS_ENTRY, bdos_shim, sizeof(bdos_shim));
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Could not open %s\n", filename);
+        return 1;
+    }
+    bool fits = fread(image + COM_START, 1, BDOS_ENTRY - COM_START, file) <= BDOS_ENTRY - COM_START && fgetc(file) == EOF;
+    fclose(file);
+    if (!fits) {
+        printf("%s does not fit below the BDOS at 0x%04x\n", filename, BDOS_ENTRY);
+        return 2;
+    }
+    return 0;
+}
+
+// Like initialize_cpu, with the program at COM_START and the shim's device on the bus
+static int boot_com(CPU* cpu, const uint8_t* image, bool report) {
+    cpu->bus = NULL;
+    cpu->scheduler = NULL;
+    cpu->jit = NULL;
+    cpu->fusion = NULL;
+    cpu->profile = NULL;
+    cpu->trace = NULL;
+    cpu->debugger = NULL;
+    Bdos* bdos = calloc(1, sizeof(Bdos));
+    if (bdos == NULL || load_memory_bytes(&cpu->memory, image, ADDRESS_SPACE_SIZE, 0) != 0) {
+        printf("Out of memory starting a conformance run\n");
+        free(bdos);
+        return 2;
+    }
+    bdos->device = (Device) {.name = "BDOS", .port_count = 1, .write = write_bdos, .close = close_bdos};
+    bdos->report = report;
+    cpu->bus = create_bus();
+    if (cpu->bus == NULL || !attach_device(cpu->bus, &bdos->device, BDOS_PORT)) {
+        if (cpu->bus == NULL) close_bdos(&bdos->device);
+        printf("Out of memory starting a conformance run\n");
+        free(cpu->bus);
+        cpu->bus = NULL;
+        free_cpu(cpu);
+        return 2;
+    }
+    reset_cpu(cpu);
+    cpu->program_counter = COM_START;
+    return 0;
+}
+
+static void shut_down(CPU* cpu) {
+    free_bus(cpu->bus);
+    free_cpu(cpu);
+}
+
+static Bdos* bdos_of(CPU* cpu) {
+    return (Bdos*) cpu->bus->ports[BDOS_PORT];
+}
+
+// A warm boot runs the HLT at 0x0000
+static bool warm_booted(CPU* cpu) {
+    return !cpu->running && cpu->program_counter == 0x0001;
+}
+
+static bool run_conformance_rom(const char* filename, const uint8_t* image, Core core, uint64_t max_cycles) {
+    CPU cpu;
+    if (boot_com(&cpu, image, true) != 0) return false;
+    printf("%s%s%s\n", BOLD, filename, RESET);
+    if (max_cycles > 0) cpu.cycle_limit = max_cycles;
+
+    uint64_t instruction_count = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool error_stop = run_cpu(&cpu, core, &instruction_count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Bdos* bdos = bdos_of(&cpu);
+    if (bdos->line_start < bdos->used) report_line(bdos, bdos->used);
+    bool finished = !error_stop && warm_booted(&cpu);
+    bool passed = finished && bdos->passed > 0 && bdos->failed == 0;
+    const char* verdict = passed ? GREEN "PASS" RESET : RED "FAIL" RESET;
+    double seconds = elapsed_seconds(&start, &end);
+    printf("%s: %s, %d passed and %d failed, %llu instructions and %llu cycles in %.2f s (%.2f MIPS)\n", filename, verdict, bdos->passed, bdos->failed,
+           (unsigned long long) instruction_count, (unsigned long long) cpu.cycles, seconds, seconds > 0 ? instruction_count / seconds / 1e6 : 0.0);
+    if (error_stop && opcode_lookup[fetch(&cpu)].size == 0) printf("%sStopped on invalid opcode 0x%02x at 0x%04x\n%s", RED, fetch(&cpu), cpu.program_counter, RESET);
+    else if (!finished && cpu.running) printf("%sStopped after --max-cycles %llu without reaching the warm boot\n%s", RED, (unsigned long long) max_cycles, RESET);
+    else if (!finished) printf("%sHalted at 0x%04x instead of warm booting\n%s", RED, cpu.program_counter - 1, RESET);
+    shut_down(&cpu);
+    return passed;
+}
+
+// Runs every program on one core and reports each test group, 0 if every program passed
+int run_conformance(char** filenames, int file_count, Core core, uint64_t max_cycles) {
+    uint8_t* image = malloc(ADDRESS_SPACE_SIZE);
+    if (image == NULL) return 1;
+    int passed = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (load_com(filenames[i], image) == 0 && run_conformance_rom(filenames[i], image, core, max_cycles)) passed++;
+    }
+    free(image);
+    printf("%d of %d programs passed\n", passed, file_count);
+    return passed != file_count;
+}
+
+// Everything but memory, which is compared separately
+static bool same_state(CPU* a, CPU* b) {
+    for (int reg = 0; reg < 8; reg++) {
+        if (reg != REGISTER_M && a->registers.r8[register_slots[reg]] != b->registers.r8[register_slots[reg]]) return false;
+    }
+    Bdos* a_bdos = bdos_of(a);
+    Bdos* b_bdos = bdos_of(b);
+    return get_flags(a) == get_flags(b) && a->stack_pointer == b->stack_pointer && a->program_counter == b->program_counter
+        && a->cycles == b->cycles && a->running == b->running && a->interrupts_enabled == b->interrupts_enabled
+        && a_bdos->used == b_bdos->used && (a_bdos->used == 0 || memcmp(a_bdos->output, b_bdos->output, a_bdos->used) == 0);
+}
+
+static void print_diff_state(const char* name, CPU* cpu) {
+    printf("  %-9s A=0x%02x F=0x%02x BC=0x%04x DE=0x%04x HL=0x%04x SP=0x%04x PC=0x%04x INTE=%d running=%d cycles=%llu output=%zu bytes\n", name,
+           cpu->registers.r8[REG_A], get_flags(cpu), cpu->registers.r16[PAIR_BC], cpu->registers.r16[PAIR_DE], cpu->registers.r16[PAIR_HL],
+           cpu->stack_pointer, cpu->program_counter, cpu->interrupts_enabled, cpu->running, (unsigned long long) cpu->cycles, bdos_of(cpu)->used);
+}
+
+// Back to a snapshot both CPUs matched at, with the output they had then
+static bool rewind_to(CPU* cpu, const Snapshot* snapshot, size_t output_used) {
+    DeviceBus* bus = cpu->bus;
+    free_cpu(cpu);
+    if (restore_snapshot(cpu, snapshot) != 0) {
+        cpu->bus = bus;
+        return false;
+    }
+    cpu->bus = bus;
+    bdos_of(cpu)->used = output_used;
+    return true;
+}
+
+// The table core next to another one, true if they agree all the way to the warm boot
+static bool diff_conformance_rom(const char* filename, const uint8_t* image, Core core, const char* core_name, uint64_t max_cycles) {
+    CPU table, other;
+    if (boot_com(&table, image, false) != 0) return false;
+    if (boot_com(&other, image, false) != 0) {
+        shut_down(&table);
+        return false;
+    }
+
+    uint16_t history[DIFF_HISTORY]; // Addresses of the last instructions the table core stepped
+    uint64_t instruction_count = 0, block_start = 0, steps = 0;
+    uint64_t checkpoint_count = 0;
+    size_t checkpoint_output = 0;
+    Snapshot* checkpoint = take_snapshot(&table);
+    bool every_step = false; // Memory compared on every step after a rewind
+    bool agreed = checkpoint != NULL, table_error = false, other_error = false;
+    int memory_address = -1;
+    if (checkpoint == NULL) printf("Out of memory taking a snapshot\n");
+
+    while (agreed && other.running && (max_cycles == 0 || other.cycles < max_cycles)) {
+        uint64_t count = 0;
+        other.cycle_limit = other.cycles + 1; // To the next branch or the end of the block
+        other_error = run_core(&other, core, &count);
+        uint64_t table_steps = other_error ? count + 1 : count; // One more to run into the same invalid opcode
+
+        block_start = instruction_count;
+        for (uint64_t i = 0; i < table_steps && table.running && !table_error; i++) {
+            uint64_t stepped = 0;
+            history[i % DIFF_HISTORY] = table.program_counter;
+            table.cycle_limit = table.cycles + 1;
+            table_error = run_table(&table, &stepped);
+            instruction_count += stepped;
+        }
+        steps++;
+
+        bool check_memory = every_step || steps % DIFF_CHECK_INTERVAL == 0 || other_error || table_error || !other.running;
+        memory_address = -1;
+        for (int address = 0; check_memory && address < ADDRESS_SPACE_SIZE && memory_address < 0; address++) {
+            if (table.memory.bytes[address] != other.memory.bytes[address]) memory_address = address;
+        }
+        if (memory_address >= 0 && !every_step) { // Somewhere since the last snapshot, go back and find it
+            if (!rewind_to(&table, checkpoint, checkpoint_output) || !rewind_to(&other, checkpoint, checkpoint_output)) {
+                printf("Could not rewind to the last snapshot\n");
+                agreed = false;
+                break;
+            }
+            instruction_count = checkpoint_count;
+            every_step = true;
+            continue;
+        }
+        agreed = memory_address < 0 && other_error == table_error && same_state(&table, &other);
+        if (!agreed || other_error) break;
+
+        if (check_memory && !every_step) {
+            Snapshot* next = take_snapshot(&table);
+            if (next != NULL) {
+                free_snapshot(checkpoint);
+                checkpoint = next;
+                checkpoint_count = instruction_count;
+                checkpoint_output = bdos_of(&table)->used;
+            }
+        }
+    }
+
+    if (agreed) {
+        printf("%s: table and %s agree over %llu instructions%s\n", filename, core_name, (unsigned long long) instruction_count,
+               other.running ? ", stopped by --max-cycles" : other_error ? ", both stopped on an invalid opcode" : "");
+    }
+    else if (checkpoint != NULL) {
+        uint64_t block_length = instruction_count - block_start;
+        printf("%s%s: table and %s diverge in the %llu instructions after instruction %llu:\n%s", RED, filename, core_name,
+               (unsigned long long) block_length, (unsigned long long) block_start, RESET);
+        uint64_t first = block_length > DIFF_HISTORY ? block_length - DIFF_HISTORY : 0;
+        if (first > 0) printf("  ... %llu instructions\n", (unsigned long long) first);
+        for (uint64_t i = first; i < block_length; i++) {
+            uint16_t address = history[i % DIFF_HISTORY];
+            printf("  0x%04x  %s\n", address, get_opcode_name(read_memory(&table.memory, address)));
+        }
+        print_diff_state("table", &table);
+        print_diff_state(core_name, &other);
+        if (memory_address >= 0) printf("  memory at 0x%04x: table 0x%02x, %s 0x%02x\n", memory_address, table.memory.bytes[memory_address], core_name, other.memory.bytes[memory_address]);
+        if (table_error != other_error) printf("  %s stopped on an invalid opcode\n", table_error ? "table" : core_name);
+    }
+    free_snapshot(checkpoint);
+    shut_down(&table);
+    shut_down(&other);
+    return agreed;
+}
+
+// Runs every program on the table core in lockstep with the threaded core and the JIT, 0 if they
+// agree on all of them
+int diff_conformance(char** filenames, int file_count, uint64_t max_cycles) {
+    const Core cores[] = {CORE_THREADED, CORE_JIT};
+    const char* core_names[] = {"threaded", "jit"};
+    uint8_t* image = malloc(ADDRESS_SPACE_SIZE);
+    if (image == NULL) return 1;
+    int agreed = 0;
+    for (int i = 0; i < file_count; i++) {
+        bool same = load_com(filenames[i], image) == 0;
+        for (int j = 0; j < 2 && same; j++) same = diff_conformance_rom(filenames[i], image, cores[j], core_names[j], max_cycles);
+        if (same) agreed++;
+    }
+    free(image);
+    printf("The cores agree on %d of %d programs\n", agreed, file_count);
+    return agreed != file_count;
+}
@@ -0,0 +1,576 @@
+#include "cpu.h"
+#include "alu.h"
+
+// Dynamic recompiler. Guest code is translated a basic block at a time into x86-64 code in an
+// executable arena, and blocks are cached by the guest address they start at. Register moves,
+// MVI, INR, DCR, ADD/SUB/ANA/XRA/ORA/CMP, LXI, INX, DCX, XCHG, JMP and Jcc become native code
+// working on the CPU struct directly; everything else calls its run_table handler from the
+// translated code, so every opcode is supported and behaves exactly as in the table core.
+//
+// Translated bytes are recorded in memory.code_map and their pages get PAGE_CODE, so writes to
+// them take write_memory_slow, which flags the write. A block that writes memory leaves right
+// after the write if it hit translated code, and the dispatcher drops every block overlapping the
+// written range before running anything else.
+//
+// Blocks end at the first branch, HLT, CALL, RET, RST or PCHL, or after JIT_MAX_INSTRUCTIONS. IN,
+// OUT and EI also end them, with the cycle count brought up to date before their handler runs so
+// devices and the scheduler see the same count as on the other cores. A
+// block whose branch leads back to its own start loops natively and only checks the cycle budget
+// on the way round. Other hosts, and hosts that refuse an executable mapping, run the threaded core.
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE (4 << 20) // Executable bytes per CPU, the cache is flushed when it fills up
+#define JIT_MAX_INSTRUCTIONS 64 // Per block
+#define JIT_MAX_BLOCK_BYTES 8192 // Largest block translate can emit, with room to spare
+
+// Translated code is called as code(cpu, &count) and returns true on a flag mismatch in
+// CHECK_FLAGS builds. It keeps cpu in rbx and count in r12
+typedef bool (*JitCode)(CPU* cpu, uint64_t* count);
+
+typedef struct JitBlock {
+    uint16_t start;
+    uint16_t length; // Guest bytes, may wrap past 0xFFFF
+} JitBlock;
+
+typedef struct Jit {
+    uint8_t* arena;
+    size_t used;
+    bool full; // The block being emitted ran out of arena
+    JitCode entry[ADDRESS_SPACE_SIZE]; // By guest address, NULL if not translated
+    JitBlock blocks[ADDRESS_SPACE_SIZE]; // Every live block, at most one per start address
+    size_t block_count;
+    uint8_t code_map[ADDRESS_SPACE_SIZE]; // memory.code_map points here
+} Jit;
+
+// What translate does with each opcode
+typedef enum JitOp {
+    JIT_NOP, JIT_MOV, JIT_MVI, JIT_INR, JIT_DCR, JIT_ALU, JIT_ALU_IMMEDIATE, JIT_LXI, JIT_INX, JIT_DCX,
+    JIT_XCHG, JIT_JMP, JIT_JCC,
+    JIT_CALL, // Calls the handler
+    JIT_WRITES, // Calls the handler, which may write memory
+    JIT_ENDS, // Calls the handler, which may branch or halt, and ends the block
+    JIT_SYNC, // Accounts for the block so far, calls the handler and ends the block
+} JitOp;
+
+#define NOP_() JIT_NOP
+#define HLT_() JIT_ENDS
+#define MOV_RR(d, s) JIT_MOV
+#define MVI_R(d) JIT_MVI
+#define INR_R(d) JIT_INR
+#define DCR_R(d) JIT_DCR
+#define ADD_R(s) JIT_ALU
+#define ADC_R(s) JIT_CALL
+#define SUB_R(s) JIT_ALU
+#define SBB_R(s) JIT_CALL
+#define ANA_R(s) JIT_ALU
+#define XRA_R(s) JIT_ALU
+#define ORA_R(s) JIT_ALU
+#define CMP_R(s) JIT_ALU
+#define ADI_I() JIT_ALU_IMMEDIATE
+#define ACI_I() JIT_CALL
+#define SUI_I() JIT_ALU_IMMEDIATE
+#define SBI_I() JIT_CALL
+#define ANI_I() JIT_ALU_IMMEDIATE
+#define XRI_I() JIT_ALU_IMMEDIATE
+#define ORI_I() JIT_ALU_IMMEDIATE
+#define CPI_I() JIT_ALU_IMMEDIATE
+#define LXI_P(p) JIT_LXI
+#define INX_P(p) JIT_INX
+#define DCX_P(p) JIT_DCX
+#define DAD_P(p) JIT_CALL
+#define LDAX_P(p) JIT_CALL
+#define STAX_P(p) JIT_WRITES
+#define LDA_A() JIT_CALL
+#define STA_A() JIT_WRITES
+#define LHLD_A() JIT_CALL
+#define SHLD_A() JIT_WRITES
+#define XCHG_() JIT_XCHG
+#define XTHL_() JIT_WRITES
+#define SPHL_() JIT_CALL
+#define PUSH_P(p) JIT_WRITES
+#define POP_P(p) JIT_CALL
+#define RLC_() JIT_CALL
+#define RRC_() JIT_CALL
+#define RAL_() JIT_CALL
+#define RAR_() JIT_CALL
+#define DAA_() JIT_CALL
+#define CMA_() JIT_CALL
+#define STC_() JIT_CALL
+#define CMC_() JIT_CALL
+#define JMP_A() JIT_JMP
+#define JCC_A(c) JIT_JCC
+#define CALL_A() JIT_ENDS
+#define CCC_A(c) JIT_ENDS
+#define RET_() JIT_ENDS
+#define RCC_(c) JIT_ENDS
+#define RST_N(n) JIT_ENDS
+#define PCHL_() JIT_ENDS
+#define IN_P() JIT_SYNC
+#define OUT_P() JIT_SYNC
+#define EI_() JIT_SYNC
+#define DI_() JIT_CALL
+
+static const uint8_t jit_ops[256] = {
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = body,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+#define FLAGS_UNKNOWN 0xFF // Lazy flag kind is only known at run time
+
+// Offsets into the CPU struct for the generated code
+#define CPU_REGISTER(slot) (offsetof(CPU, registers) + (slot))
+#define CPU_PAIR(rp) ((rp) == 3 ? offsetof(CPU, stack_pointer) : offsetof(CPU, registers) + 2 * (rp)) // RP field, 3 is SP
+#define CPU_LAZY(field) (offsetof(CPU, lazy_flags) + offsetof(LazyFlags, field))
+
+enum { X86_EAX, X86_ECX }; // The only host registers the generated code uses besides rbx and r12
+
+// Emitting
+static void emit(Jit* jit, const uint8_t* bytes, size_t size) {
+    if (jit->used + size > JIT_ARENA_SIZE) {
+        jit->full = true;
+        return;
+    }
+    memcpy(jit->arena + jit->used, bytes, size);
+    jit->used += size;
+}
+#define EMIT(jit, ...) emit((jit), (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}))
+
+static void emit32(Jit* jit, uint32_t value) {
+    emit(jit, (const uint8_t*) &value, 4);
+}
+static void emit64(Jit* jit, uint64_t value) {
+    emit(jit, (const uint8_t*) &value, 8);
+}
+
+// ModRM for [rbx + offset] with the given reg field
+static void emit_rbx(Jit* jit, uint8_t reg, size_t offset) {
+    if (offset < 0x80) EMIT(jit, 0x43 | (reg << 3), offset);
+    else {
+        EMIT(jit, 0x83 | (reg << 3));
+        emit32(jit, offset);
+    }
+}
+static void emit_load8(Jit* jit, uint8_t reg, size_t offset) { // movzx reg, byte [rbx + offset]
+    EMIT(jit, 0x0F, 0xB6);
+    emit_rbx(jit, reg, offset);
+}
+static void emit_load16(Jit* jit, uint8_t reg, size_t offset) { // movzx reg, word [rbx + offset]
+    EMIT(jit, 0x0F, 0xB7);
+    emit_rbx(jit, reg, offset);
+}
+static void emit_store8(Jit* jit, uint8_t reg, size_t offset) { // mov [rbx + offset], reg8
+    EMIT(jit, 0x88);
+    emit_rbx(jit, reg, offset);
+}
+static void emit_store16(Jit* jit, uint8_t reg, size_t offset) { // mov [rbx + offset], reg16
+    EMIT(jit, 0x66, 0x89);
+    emit_rbx(jit, reg, offset);
+}
+static void emit_store8_immediate(Jit* jit, size_t offset, uint8_t value) { // mov byte [rbx + offset], value
+    EMIT(jit, 0xC6);
+    emit_rbx(jit, 0, offset);
+    EMIT(jit, value);
+}
+static void emit_store16_immediate(Jit* jit, size_t offset, uint16_t value) { // mov word [rbx + offset], value
+    EMIT(jit, 0x66, 0xC7);
+    emit_rbx(jit, 0, offset);
+    EMIT(jit, value & 0xFF, value >> 8);
+}
+
+// call function(cpu, second), second only if it is not negative
+static void emit_call(Jit* jit, const void* function, int second) {
+    EMIT(jit, 0x48, 0x89, 0xDF); // mov rdi, rbx
+    if (second >= 0) {
+        EMIT(jit, 0xBE); // mov esi, second
+        emit32(jit, second);
+    }
+    EMIT(jit, 0x48, 0xB8); // mov rax, function
+    emit64(jit, (uint64_t) (uintptr_t) function);
+    EMIT(jit, 0xFF, 0xD0); // call rax
+}
+
+// Jumps, forward ones are patched once their target is known
+static size_t emit_jcc(Jit* jit, uint8_t condition) { // 0x80-0x8F, the second opcode byte
+    EMIT(jit, 0x0F, condition);
+    size_t at = jit->used;
+    emit32(jit, 0);
+    return at;
+}
+static void patch_jump(Jit* jit, size_t at) { // To here
+    if (jit->full) return;
+    int32_t displacement = jit->used - (at + 4);
+    memcpy(jit->arena + at, &displacement, 4);
+}
+static void emit_jcc_back(Jit* jit, uint8_t condition, size_t target) {
+    EMIT(jit, 0x0F, condition);
+    emit32(jit, (uint32_t) (int32_t) (target - (jit->used + 4)));
+}
+
+// Adds what the block ran so far to the cycle and instruction counts
+static void emit_account(Jit* jit, uint32_t cycles, uint32_t instructions) {
+    EMIT(jit, 0x48, 0x81); // add qword [rbx + cycles], cycles
+    emit_rbx(jit, 0, offsetof(CPU, cycles));
+    emit32(jit, cycles);
+    EMIT(jit, 0x49, 0x81, 0x04, 0x24); // add qword [r12], instructions
+    emit32(jit, instructions);
+}
+
+// Leaves the block after accounting for it. target < 0 leaves the PC as the handlers set it
+static void emit_exit(Jit* jit, int target, uint32_t cycles, uint32_t instructions, bool mismatch) {
+    emit_account(jit, cycles, instructions);
+    if (target >= 0) emit_store16_immediate(jit, offsetof(CPU, program_counter), target);
+    if (mismatch) EMIT(jit, 0xB8, 1, 0, 0, 0); // mov eax, 1
+    else EMIT(jit, 0x31, 0xC0); // xor eax, eax
+    EMIT(jit, 0x48, 0x83, 0xC4, 0x08, 0x41, 0x5C, 0x5B, 0xC3); // add rsp, 8; pop r12; pop rbx; ret
+}
+
+// Branches to target, looping back to the body without leaving while a block that branches to
+// its own start has cycle budget left
+static void emit_branch(Jit* jit, uint16_t target, uint16_t start, size_t body, uint32_t cycles, uint32_t instructions) {
+    if (target != start) {
+        emit_exit(jit, target, cycles, instructions, false);
+        return;
+    }
+    emit_account(jit, cycles, instructions);
+    EMIT(jit, 0x48, 0x8B); // mov rax, [rbx + cycles]
+    emit_rbx(jit, X86_EAX, offsetof(CPU, cycles));
+    EMIT(jit, 0x48, 0x3B); // cmp rax, [rbx + cycle_limit]
+    emit_rbx(jit, X86_EAX, offsetof(CPU, cycle_limit));
+    emit_jcc_back(jit, 0x82, body); // jb body
+    emit_exit(jit, target, 0, 0, false);
+}
+
+// Carry of the last ALU instruction into eax, as 0 or 1
+static void emit_carry(Jit* jit, uint8_t kind) {
+    switch (kind) {
+        case FLAGS_ADD: case FLAGS_SUB:
+            emit_load8(jit, X86_EAX, CPU_LAZY(a));
+            emit_load8(jit, X86_ECX, CPU_LAZY(b));
+            if (kind == FLAGS_ADD) EMIT(jit, 0x01, 0xC8); // add eax, ecx
+            else EMIT(jit, 0x29, 0xC8); // sub eax, ecx
+            emit_load8(jit, X86_ECX, CPU_LAZY(carry));
+            if (kind == FLAGS_ADD) EMIT(jit, 0x01, 0xC8);
+            else EMIT(jit, 0x29, 0xC8);
+            EMIT(jit, 0xC1, 0xE8, 0x08, 0x83, 0xE0, 0x01); // shr eax, 8; and eax, 1
+            break;
+        case FLAGS_AND: case FLAGS_LOGIC: EMIT(jit, 0x31, 0xC0); break; // xor eax, eax
+        case FLAGS_INR: case FLAGS_DCR: emit_load8(jit, X86_EAX, CPU_LAZY(carry)); break;
+        default: // Not known until run time
+            emit_call(jit, (const void*) get_flag_C, -1);
+            EMIT(jit, 0x0F, 0xB6, 0xC0); // movzx eax, al
+            break;
+    }
+}
+
+static bool jit_condition(CPU* cpu, uint8_t ccc) {
+    return condition(cpu, ccc);
+}
+
+// Tests condition ccc and returns the x86 jcc that jumps when it holds. Flags the block set
+// itself are tested from the recorded result, the rest are left to jit_condition
+static uint8_t emit_condition(Jit* jit, uint8_t ccc, uint8_t kind) {
+    bool want_set = ccc & 1;
+    if (kind == FLAGS_UNKNOWN) {
+        emit_call(jit, (const void*) jit_condition, ccc);
+        EMIT(jit, 0x84, 0xC0); // test al, al
+        return 0x85; // jnz
+    }
+    switch (ccc >> 1) {
+        case 0: // Z
+            EMIT(jit, 0x80); // cmp byte [rbx + result], 0
+            emit_rbx(jit, 7, CPU_LAZY(result));
+            EMIT(jit, 0x00);
+            return want_set ? 0x84 : 0x85; // je, jne
+        case 1: // CY
+            emit_carry(jit, kind);
+            EMIT(jit, 0x85, 0xC0); // test eax, eax
+            return want_set ? 0x85 : 0x84;
+        case 2: // P, which is the host's PF as well
+            emit_load8(jit, X86_EAX, CPU_LAZY(result));
+            EMIT(jit, 0x84, 0xC0);
+            return want_set ? 0x8A : 0x8B; // jp, jnp
+        default: // S
+            EMIT(jit, 0xF6); // test byte [rbx + result], 0x80
+            emit_rbx(jit, 0, CPU_LAZY(result));
+            EMIT(jit, 0x80);
+            return want_set ? 0x85 : 0x84;
+    }
+}
+
+// ADD, SUB, ANA, XRA, ORA and CMP with the operand already in cl, recorded like alu.h does
+static uint8_t emit_alu(Jit* jit, uint8_t op) {
+    static const uint8_t host_ops[8] = {0x00, 0, 0x28, 0, 0x20, 0x30, 0x08, 0x28}; // add, sub, and, xor, or, sub (CMP)
+    static const uint8_t kinds[8] = {FLAGS_ADD, 0, FLAGS_SUB, 0, FLAGS_AND, FLAGS_LOGIC, FLAGS_LOGIC, FLAGS_SUB};
+    emit_load8(jit, X86_EAX, CPU_REGISTER(REG_A));
+    if (kinds[op] != FLAGS_LOGIC) {
+        emit_store8(jit, X86_EAX, CPU_LAZY(a));
+        emit_store8(jit, X86_ECX, CPU_LAZY(b));
+    }
+    EMIT(jit, host_ops[op], 0xC8); // op al, cl
+    if (op != 7) emit_store8(jit, X86_EAX, CPU_REGISTER(REG_A));
+    emit_store8(jit, X86_EAX, CPU_LAZY(result));
+    emit_store8_immediate(jit, CPU_LAZY(kind), kinds[op]);
+    emit_store8_immediate(jit, CPU_LAZY(carry), 0);
+    return kinds[op];
+}
+
+// INR and DCR, which keep CY in the carry field
+static uint8_t emit_step(Jit* jit, uint8_t reg, bool decrement, uint8_t kind) {
+    if (kind != FLAGS_INR && kind != FLAGS_DCR) {
+        emit_carry(jit, kind);
+        emit_store8(jit, X86_EAX, CPU_LAZY(carry));
+    }
+    emit_load8(jit, X86_EAX, CPU_REGISTER(register_slots[reg]));
+    EMIT(jit, 0xFE, decrement ? 0xC8 : 0xC0); // dec al, inc al
+    emit_store8(jit, X86_EAX, CPU_REGISTER(register_slots[reg]));
+    emit_store8(jit, X86_EAX, CPU_LAZY(result));
+    emit_store8_immediate(jit, CPU_LAZY(kind), decrement ? FLAGS_DCR : FLAGS_INR);
+    return decrement ? FLAGS_DCR : FLAGS_INR;
+}
+
+// Sets PC past the instruction and calls its table handler, like run_table
+static void emit_handler(Jit* jit, uint8_t opcode, uint16_t next, uint32_t cycles, uint32_t instructions) {
+    emit_store16_immediate(jit, offsetof(CPU, program_counter), next);
+    emit_call(jit, (const void*) opcode_lookup[opcode].execute, opcode);
+#if CHECK_FLAGS
+    emit_call(jit, (const void*) check_flags, -1);
+    EMIT(jit, 0x84, 0xC0); // test al, al
+    size_t matched = emit_jcc(jit, 0x85);
+    emit_exit(jit, -1, cycles, instructions, true);
+    patch_jump(jit, matched);
+#else
+    (void) cycles;
+    (void) instructions;
+#endif
+}
+
+// Translation cache
+static void mark_code(Jit* jit, Memory* memory, const JitBlock* block) {
+    for (int i = 0; i < block->length; i++) {
+        uint16_t address = block->start + i;
+        jit->code_map[address] = 1;
+        memory->page_flags[address / MEMORY_PAGE_SIZE] |= PAGE_CODE;
+    }
+}
+
+static void flush_jit(Jit* jit, Memory* memory) {
+    jit->used = 0;
+    jit->full = false;
+    memset(jit->entry, 0, sizeof(jit->entry));
+    jit->block_count = 0;
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    for (int page = 0; page < MEMORY_PAGES; page++) memory->page_flags[page] &= ~PAGE_CODE;
+    memory->code_written = false;
+}
+
+// Drops every block with a byte in the written range, the space they took is only reclaimed by
+// the next flush
+static void invalidate_written(Jit* jit, Memory* memory) {
+    uint16_t low = memory->code_written_low, high = memory->code_written_high;
+    size_t kept = 0;
+    for (size_t i = 0; i < jit->block_count; i++) {
+        JitBlock block = jit->blocks[i];
+        bool hit = false;
+        for (int j = 0; j < block.length && !hit; j++) {
+            uint16_t address = block.start + j;
+            hit = address >= low && address <= high;
+        }
+        if (hit) jit->entry[block.start] = NULL;
+        else jit->blocks[kept++] = block;
+    }
+    jit->block_count = kept;
+
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    for (int page = 0; page < MEMORY_PAGES; page++) memory->page_flags[page] &= ~PAGE_CODE;
+    for (size_t i = 0; i < jit->block_count; i++) mark_code(jit, memory, &jit->blocks[i]);
+    memory->code_written = false;
+    TRACE("%sDropped translations over 0x%04x-0x%04x, %zu blocks left%s\n", COMMENT_COLOR, low, high, jit->block_count, RESET);
+}
+
+static JitCode translate(Jit* jit, CPU* cpu, uint16_t start) {
+    if (jit->used + JIT_MAX_BLOCK_BYTES > JIT_ARENA_SIZE) flush_jit(jit, &cpu->memory);
+    size_t entry = jit->used;
+    EMIT(jit, 0x53, 0x41, 0x54, 0x48, 0x83, 0xEC, 0x08); // push rbx; push r12; sub rsp, 8
+    EMIT(jit, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4); // mov rbx, rdi; mov r12, rsi
+    size_t body = jit->used;
+
+    Memory* memory = &cpu->memory;
+    uint16_t pc = start;
+    uint32_t cycles = 0, instructions = 0;
+    uint8_t kind = FLAGS_UNKNOWN;
+    for (;;) {
+        uint8_t opcode = read_memory(memory, pc);
+        const Instruction* instruction = &opcode_lookup[opcode];
+        uint8_t immediate = read_memory(memory, pc + 1);
+        uint16_t address = read_memory16(memory, pc + 1);
+        uint16_t next = pc + instruction->size;
+        uint8_t dst = (opcode >> 3) & 7, src = opcode & 7, rp = (opcode >> 4) & 3;
+        cycles += instruction->cycles;
+        instructions++;
+
+        // Anything touching M goes through its handler, and everything does when checking flags
+        uint8_t op = jit_ops[opcode];
+        if (op == JIT_MOV || op == JIT_MVI || op == JIT_INR || op == JIT_DCR) {
+            if (dst == REGISTER_M) op = JIT_WRITES;
+            else if (op == JIT_MOV && src == REGISTER_M) op = JIT_CALL;
+        }
+        if (op == JIT_ALU && src == REGISTER_M) op = JIT_CALL;
+        if (CHECK_FLAGS && op < JIT_CALL) op = op == JIT_JMP || op == JIT_JCC ? JIT_ENDS : JIT_CALL;
+
+        bool ends = false;
+        switch (op) {
+            case JIT_NOP: break;
+            case JIT_MOV:
+                emit_load8(jit, X86_EAX, CPU_REGISTER(register_slots[src]));
+                emit_store8(jit, X86_EAX, CPU_REGISTER(register_slots[dst]));
+                break;
+            case JIT_MVI: emit_store8_immediate(jit, CPU_REGISTER(register_slots[dst]), immediate); break;
+            case JIT_INR: case JIT_DCR: kind = emit_step(jit, dst, op == JIT_DCR, kind); break;
+            case JIT_ALU:
+                emit_load8(jit, X86_ECX, CPU_REGISTER(register_slots[src]));
+                kind = emit_alu(jit, dst);
+                break;
+            case JIT_ALU_IMMEDIATE:
+                EMIT(jit, 0xB1, immediate); // mov cl, immediate
+                kind = emit_alu(jit, dst);
+                break;
+            case JIT_LXI: emit_store16_immediate(jit, CPU_PAIR(rp), address); break;
+            case JIT_INX: case JIT_DCX: // add/sub word [rbx + pair], 1
+                EMIT(jit, 0x66, 0x83);
+                emit_rbx(jit, op == JIT_INX ? 0 : 5, CPU_PAIR(rp));
+                EMIT(jit, 0x01);
+                break;
+            case JIT_XCHG:
+                emit_load16(jit, X86_EAX, CPU_PAIR(PAIR_DE));
+                emit_load16(jit, X86_ECX, CPU_PAIR(PAIR_HL));
+                emit_store16(jit, X86_ECX, CPU_PAIR(PAIR_DE));
+                emit_store16(jit, X86_EAX, CPU_PAIR(PAIR_HL));
+                break;
+            case JIT_JMP:
+                emit_branch(jit, address, start, body, cycles, instructions);
+                ends = true;
+                break;
+            case JIT_JCC: {
+                size_t taken = emit_jcc(jit, emit_condition(jit, dst, kind));
+                emit_branch(jit, next, start, body, cycles, instructions);
+                patch_jump(jit, taken);
+                emit_branch(jit, address, start, body, cycles, instructions);
+                ends = true;
+                break;
+            }
+            case JIT_CALL:
+                emit_handler(jit, opcode, next, cycles, instructions);
+                kind = FLAGS_UNKNOWN;
+                break;
+            case JIT_WRITES: { // Leaves right away if the write hit translated code
+                emit_handler(jit, opcode, next, cycles, instructions);
+                kind = FLAGS_UNKNOWN;
+                EMIT(jit, 0x80); // cmp byte [rbx + code_written], 0
+                emit_rbx(jit, 7, offsetof(CPU, memory) + offsetof(Memory, code_written));
+                EMIT(jit, 0x00);
+                size_t clean = emit_jcc(jit, 0x84);
+                emit_exit(jit, -1, cycles, instructions, false);
+                patch_jump(jit, clean);
+                break;
+            }
+            case JIT_ENDS:
+                emit_handler(jit, opcode, next, cycles, instructions);
+                emit_exit(jit, -1, cycles, instructions, false);
+                ends = true;
+                break;
+            case JIT_SYNC:
+                emit_account(jit, cycles, instructions);
+                emit_handler(jit, opcode, next, 0, 0);
+                emit_exit(jit, -1, 0, 0, false);
+                ends = true;
+                break;
+        }
+        pc = next;
+        if (!ends && instructions == JIT_MAX_INSTRUCTIONS) {
+            emit_exit(jit, pc, cycles, instructions, false);
+            ends = true;
+        }
+        if (ends) break;
+    }
+
+    if (jit->full) { // Only if JIT_MAX_BLOCK_BYTES is too small, run_jit steps past it instead
+        jit->used = entry;
+        jit->full = false;
+        return NULL;
+    }
+    JitBlock* block = &jit->blocks[jit->block_count++];
+    block->start = start;
+    block->length = pc - start;
+    mark_code(jit, memory, block);
+    jit->entry[start] = (JitCode) (jit->arena + entry);
+    TRACE("%sTranslated 0x%04x-0x%04x, %u instructions in %zu bytes%s\n", COMMENT_COLOR, start, (uint16_t) (pc - 1), instructions, jit->used - entry, RESET);
+    return jit->entry[start];
+}
+
+static Jit* create_jit(CPU* cpu) {
+    Jit* jit = calloc(1, sizeof(Jit));
+    if (jit == NULL) return NULL;
+    jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->arena == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    cpu->memory.code_map = jit->code_map;
+    return jit;
+}
+
+void free_jit(CPU* cpu) {
+    Jit* jit = cpu->jit;
+    if (jit == NULL) return;
+    for (int page = 0; page < MEMORY_PAGES; page++) cpu->memory.page_flags[page] &= ~PAGE_CODE;
+    cpu->memory.code_map = NULL;
+    cpu->memory.code_written = false;
+    munmap(jit->arena, JIT_ARENA_SIZE);
+    free(jit);
+    cpu->jit = NULL;
+}
+
+// Same contract as run_table
+bool run_jit(CPU* cpu, uint64_t* instruction_count) {
+    if (cpu->jit == NULL) cpu->jit = create_jit(cpu);
+    if (cpu->jit == NULL) return run_threaded(cpu, instruction_count); // No executable memory here
+    Jit* jit = cpu->jit;
+
+    uint64_t count = 0;
+    while (cpu->running && cpu->cycles < cpu->cycle_limit) {
+        if (cpu->memory.code_written) invalidate_written(jit, &cpu->memory);
+        JitCode code = jit->entry[cpu->program_counter];
+        if (code == NULL) code = translate(jit, cpu, cpu->program_counter);
+        if (code == NULL) { // Could not translate, step through it in the table core
+            uint64_t limit = cpu->cycle_limit, stepped = 0;
+            cpu->cycle_limit = cpu->cycles + 1;
+            bool error_stop = run_table(cpu, &stepped);
+            cpu->cycle_limit = limit;
+            count += stepped;
+            if (error_stop) {
+                *instruction_count = count;
+                return true;
+            }
+            continue;
+        }
+        if (code(cpu, &count)) {
+            *instruction_count = count;
+            return true;
+        }
+    }
+    *instruction_count = count;
+    return false;
+}
+
+#else
+void free_jit(CPU* cpu) {
+    (void) cpu;
+}
+
+bool run_jit(CPU* cpu, uint64_t* instruction_count) { // No backend for this host
+    return run_threaded(cpu, instruction_count);
+}
+#endif
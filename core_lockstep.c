@@ -0,0 +1,560 @@
+#include "lockstep.h"
+#include "alu.h"
+
+// Lockstep engine. Every lane of a group runs the same instruction at the same time, so the
+// instruction is fetched and decoded once for the whole group and the 8-bit ALU work (MOV, MVI,
+// INR, DCR, ADD through CMP and the branch conditions) runs as vector kernels over the register
+// planes. Memory, 16-bit and stack instructions still loop over the lanes, each lane has its own
+// copy-on-write memory, but they skip the per-lane fetch and decode. Flags are kept eagerly here,
+// lazy flags do not vectorize.
+//
+// A lane leaves the group before an instruction it would run differently: a conditional branch
+// going the other way, a RET or PCHL to another address, or different code bytes in a page some
+// lane wrote to. It keeps its own PC and cycle count from then on and store_lockstep_lane hands
+// it back so a scalar core can finish it.
+
+// Kernels are written with GCC vector extensions over LOCKSTEP_VECTOR lanes at a time. On x86-64
+// Linux each one is built for AVX2 and for the SSE2 every x86-64 has, and the loader picks one for
+// the host; elsewhere the compiler lowers them to whatever the target has
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+typedef uint8_t Lanes __attribute__((vector_size(LOCKSTEP_VECTOR)));
+
+// Everything the engine does differently, decoded once per opcode from opcodes.def
+typedef enum LaneOp {
+    LANE_NOP, LANE_HLT, LANE_MOV, LANE_MVI, LANE_INR, LANE_DCR, LANE_ALU, LANE_ALU_IMMEDIATE,
+    LANE_LXI, LANE_INX, LANE_DCX, LANE_DAD, LANE_LDAX, LANE_STAX, LANE_LDA, LANE_STA, LANE_LHLD, LANE_SHLD,
+    LANE_XCHG, LANE_XTHL, LANE_SPHL, LANE_PUSH, LANE_POP,
+    LANE_RLC, LANE_RRC, LANE_RAL, LANE_RAR, LANE_DAA, LANE_CMA, LANE_STC, LANE_CMC,
+    LANE_JMP, LANE_JCC, LANE_CALL, LANE_CCC, LANE_RET, LANE_RCC, LANE_RST, LANE_PCHL,
+    LANE_IN, LANE_OUT, LANE_EI, LANE_DI,
+} LaneOp;
+
+#define NOP_() LANE_NOP
+#define HLT_() LANE_HLT
+#define MOV_RR(d, s) LANE_MOV
+#define MVI_R(d) LANE_MVI
+#define INR_R(d) LANE_INR
+#define DCR_R(d) LANE_DCR
+#define ADD_R(s) LANE_ALU
+#define ADC_R(s) LANE_ALU
+#define SUB_R(s) LANE_ALU
+#define SBB_R(s) LANE_ALU
+#define ANA_R(s) LANE_ALU
+#define XRA_R(s) LANE_ALU
+#define ORA_R(s) LANE_ALU
+#define CMP_R(s) LANE_ALU
+#define ADI_I() LANE_ALU_IMMEDIATE
+#define ACI_I() LANE_ALU_IMMEDIATE
+#define SUI_I() LANE_ALU_IMMEDIATE
+#define SBI_I() LANE_ALU_IMMEDIATE
+#define ANI_I() LANE_ALU_IMMEDIATE
+#define XRI_I() LANE_ALU_IMMEDIATE
+#define ORI_I() LANE_ALU_IMMEDIATE
+#define CPI_I() LANE_ALU_IMMEDIATE
+#define LXI_P(p) LANE_LXI
+#define INX_P(p) LANE_INX
+#define DCX_P(p) LANE_DCX
+#define DAD_P(p) LANE_DAD
+#define LDAX_P(p) LANE_LDAX
+#define STAX_P(p) LANE_STAX
+#define LDA_A() LANE_LDA
+#define STA_A() LANE_STA
+#define LHLD_A() LANE_LHLD
+#define SHLD_A() LANE_SHLD
+#define XCHG_() LANE_XCHG
+#define XTHL_() LANE_XTHL
+#define SPHL_() LANE_SPHL
+#define PUSH_P(p) LANE_PUSH
+#define POP_P(p) LANE_POP
+#define RLC_() LANE_RLC
+#define RRC_() LANE_RRC
+#define RAL_() LANE_RAL
+#define RAR_() LANE_RAR
+#define DAA_() LANE_DAA
+#define CMA_() LANE_CMA
+#define STC_() LANE_STC
+#define CMC_() LANE_CMC
+#define JMP_A() LANE_JMP
+#define JCC_A(c) LANE_JCC
+#define CALL_A() LANE_CALL
+#define CCC_A(c) LANE_CCC
+#define RET_() LANE_RET
+#define RCC_(c) LANE_RCC
+#define RST_N(n) LANE_RST
+#define PCHL_() LANE_PCHL
+#define IN_P() LANE_IN
+#define OUT_P() LANE_OUT
+#define EI_() LANE_EI
+#define DI_() LANE_DI
+
+static const uint8_t lane_ops[256] = {
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = body,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+// ALU field of ADD through CMP and ADI through CPI
+enum { ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_AND, ALU_XOR, ALU_OR, ALU_CMP };
+
+// kernel_condition results
+#define LANES_TAKEN 1
+#define LANES_SKIPPED 2
+
+#define FOR_EACH_LANE(lockstep, i) for (int i = 0; i < (lockstep)->lanes; i++) if ((lockstep)->active[i])
+
+// Kernels. Every one of them works on whole planes, inactive lanes keep what they had. Vectors are
+// only ever locals of a kernel and are never passed to a function, so no call depends on the
+// vector ABI of whichever clone is running
+typedef uint8_t PlaneLanes __attribute__((vector_size(LOCKSTEP_VECTOR), aligned(1), may_alias));
+#define LANES(plane, i) (*(PlaneLanes*) ((plane) + (i)))
+#define blend_lanes(updated, old, mask) (((updated) & (mask)) | ((old) & ~(mask)))
+#define szp_lanes(result) ({ /* S, Z, P and the fixed bit */ \
+    Lanes parity = (result) ^ ((result) >> 4); \
+    parity ^= parity >> 2; \
+    parity ^= parity >> 1; \
+    ((result) & FLAG_S) | ((Lanes) ((result) == 0) & FLAG_Z) | ((~parity & 1) << 2) | FLAGS_FIXED; \
+})
+
+KERNEL static void kernel_move(uint8_t* destination, const uint8_t* source, const uint8_t* active, int capacity) {
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        LANES(destination, i) = blend_lanes(LANES(source, i), LANES(destination, i), LANES(active, i));
+    }
+}
+KERNEL static void kernel_exchange(uint8_t* x, uint8_t* y, const uint8_t* active, int capacity) { // XCHG, one pair of planes at a time
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        Lanes a = LANES(x, i), b = LANES(y, i), mask = LANES(active, i);
+        LANES(x, i) = blend_lanes(b, a, mask);
+        LANES(y, i) = blend_lanes(a, b, mask);
+    }
+}
+
+// ADD, ADC, SUB, SBB and CMP, which keeps the flags and drops the result
+KERNEL static void kernel_arith(uint8_t* a_plane, uint8_t* f_plane, const uint8_t* operand, const uint8_t* active, int capacity, bool subtract, bool with_carry, bool keep) {
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        Lanes a = LANES(a_plane, i), b = LANES(operand, i), f = LANES(f_plane, i), mask = LANES(active, i);
+        Lanes carry_in = with_carry ? (f & FLAG_C) : (Lanes) {0};
+        Lanes result, carry, aux;
+        if (subtract) {
+            result = a - b - carry_in;
+            carry = (Lanes) (a < b) | ((Lanes) (a == b) & (Lanes) (carry_in != 0)); // Borrow
+            aux = ~(a ^ b ^ result) & FLAG_A;
+        }
+        else {
+            result = a + b + carry_in;
+            carry = (Lanes) (result < a) | ((Lanes) (result == a) & (Lanes) (carry_in != 0));
+            aux = (a ^ b ^ result) & FLAG_A;
+        }
+        if (keep) LANES(a_plane, i) = blend_lanes(result, a, mask);
+        LANES(f_plane, i) = blend_lanes(szp_lanes(result) | aux | (carry & FLAG_C), f, mask);
+    }
+}
+
+// ANA, XRA and ORA, all of which clear CY
+KERNEL static void kernel_logic(uint8_t* a_plane, uint8_t* f_plane, const uint8_t* operand, const uint8_t* active, int capacity, uint8_t op) {
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        Lanes a = LANES(a_plane, i), b = LANES(operand, i), f = LANES(f_plane, i), mask = LANES(active, i);
+        Lanes result, aux = {0};
+        if (op == ALU_AND) {
+            result = a & b;
+            aux = ((a | b) & 0x08) << 1; // AC is bit 3 of either operand
+        }
+        else if (op == ALU_XOR) result = a ^ b;
+        else result = a | b;
+        LANES(a_plane, i) = blend_lanes(result, a, mask);
+        LANES(f_plane, i) = blend_lanes(szp_lanes(result) | aux, f, mask);
+    }
+}
+
+// INR and DCR, CY is left alone
+KERNEL static void kernel_step(uint8_t* plane, uint8_t* f_plane, const uint8_t* active, int capacity, bool decrement) {
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        Lanes value = LANES(plane, i), f = LANES(f_plane, i), mask = LANES(active, i);
+        Lanes result = decrement ? value - 1 : value + 1;
+        Lanes aux = decrement ? (Lanes) ((result & 0x0F) != 0x0F) : (Lanes) ((result & 0x0F) == 0);
+        LANES(plane, i) = blend_lanes(result, value, mask);
+        LANES(f_plane, i) = blend_lanes(szp_lanes(result) | (aux & FLAG_A) | (f & FLAG_C), f, mask);
+    }
+}
+
+// Whether any active lane takes the branch and whether any skips it, as LANES_* bits
+KERNEL static int kernel_condition(const uint8_t* f_plane, const uint8_t* active, int capacity, uint8_t flag, bool want_set) {
+    Lanes taken = {0}, skipped = {0};
+    for (int i = 0; i < capacity; i += LOCKSTEP_VECTOR) {
+        Lanes set = (Lanes) ((LANES(f_plane, i) & flag) != 0), mask = LANES(active, i);
+        Lanes takes = want_set ? set : ~set;
+        taken |= takes & mask;
+        skipped |= ~takes & mask;
+    }
+    int outcome = 0;
+    for (int i = 0; i < LOCKSTEP_VECTOR; i++) outcome |= (taken[i] ? LANES_TAKEN : 0) | (skipped[i] ? LANES_SKIPPED : 0);
+    return outcome;
+}
+
+// Per-lane access
+static inline uint16_t lane_pair(Lockstep* lockstep, uint8_t rp, int lane) { // RP field, 3 is SP
+    if (rp == 3) return lockstep->stack_pointer[lane];
+    return (lockstep->registers[register_slots[rp * 2]][lane] << 8) | lockstep->registers[register_slots[rp * 2 + 1]][lane];
+}
+static inline void set_lane_pair(Lockstep* lockstep, uint8_t rp, int lane, uint16_t value) {
+    if (rp == 3) lockstep->stack_pointer[lane] = value;
+    else {
+        lockstep->registers[register_slots[rp * 2]][lane] = value >> 8;
+        lockstep->registers[register_slots[rp * 2 + 1]][lane] = value & 0xFF;
+    }
+}
+static uint16_t lane_hl(Lockstep* lockstep, int lane) {
+    return lane_pair(lockstep, PAIR_HL, lane);
+}
+static uint16_t lane_return_address(Lockstep* lockstep, int lane) {
+    return read_memory16(&lockstep->memory[lane], lockstep->stack_pointer[lane]);
+}
+static inline void write_lane(Lockstep* lockstep, int lane, uint16_t address, uint8_t value) {
+    write_memory(&lockstep->memory[lane], address, value);
+    lockstep->written_pages[address / MEMORY_PAGE_SIZE] = 1;
+}
+static inline void write_lane16(Lockstep* lockstep, int lane, uint16_t address, uint16_t value) {
+    write_lane(lockstep, lane, address, value & 0xFF);
+    write_lane(lockstep, lane, address + 1, value >> 8);
+}
+static inline void push_lane(Lockstep* lockstep, int lane, uint16_t value) {
+    lockstep->stack_pointer[lane] -= 2;
+    write_lane16(lockstep, lane, lockstep->stack_pointer[lane], value);
+}
+
+// The plane an instruction reads its 8-bit operand from, M is gathered into the scratch plane
+static const uint8_t* operand_plane(Lockstep* lockstep, uint8_t reg) {
+    if (reg != REGISTER_M) return lockstep->registers[register_slots[reg]];
+    FOR_EACH_LANE(lockstep, i) lockstep->scratch[i] = read_memory(&lockstep->memory[i], lane_hl(lockstep, i));
+    return lockstep->scratch;
+}
+static const uint8_t* immediate_plane(Lockstep* lockstep, uint8_t value) {
+    memset(lockstep->scratch, value, lockstep->capacity);
+    return lockstep->scratch;
+}
+
+static void group_alu(Lockstep* lockstep, uint8_t op, const uint8_t* operand) {
+    uint8_t* a = lockstep->registers[REG_A];
+    uint8_t* f = lockstep->registers[REG_F];
+    if (op >= ALU_AND && op <= ALU_OR) kernel_logic(a, f, operand, lockstep->active, lockstep->capacity, op);
+    else kernel_arith(a, f, operand, lockstep->active, lockstep->capacity, op != ALU_ADD && op != ALU_ADC, op == ALU_ADC || op == ALU_SBB, op != ALU_CMP);
+}
+
+// Group membership
+static void leave_group(Lockstep* lockstep, int lane) { // Before the instruction at the group's PC
+    lockstep->active[lane] = 0;
+    lockstep->program_counter[lane] = lockstep->group_program_counter;
+    lockstep->cycles[lane] = lockstep->group_cycles;
+    lockstep->instructions[lane] = lockstep->group_instructions;
+    lockstep->group_lanes--;
+}
+static int group_leader(Lockstep* lockstep) { // The group goes wherever this lane goes
+    for (int i = 0; i < lockstep->lanes; i++) {
+        if (lockstep->active[i]) return i;
+    }
+    return -1;
+}
+
+// Lanes that disagree with the leader on a condition leave, returns the group's outcome
+static bool group_condition(Lockstep* lockstep, int leader, uint8_t ccc) {
+    static const uint8_t flag_masks[4] = {FLAG_Z, FLAG_C, FLAG_P, FLAG_S};
+    uint8_t flag = flag_masks[ccc >> 1];
+    bool want_set = ccc & 1;
+    uint8_t* f = lockstep->registers[REG_F];
+    int outcome = kernel_condition(f, lockstep->active, lockstep->capacity, flag, want_set);
+    if (outcome != (LANES_TAKEN | LANES_SKIPPED)) return outcome == LANES_TAKEN;
+
+    bool taken = ((f[leader] & flag) != 0) == want_set;
+    FOR_EACH_LANE(lockstep, i) {
+        if ((((f[i] & flag) != 0) == want_set) != taken) leave_group(lockstep, i);
+    }
+    return taken;
+}
+
+// Lanes heading somewhere other than the leader leave, for RET and PCHL
+static uint16_t group_target(Lockstep* lockstep, int leader, uint16_t (*target)(Lockstep* lockstep, int lane)) {
+    uint16_t address = target(lockstep, leader);
+    FOR_EACH_LANE(lockstep, i) {
+        if (target(lockstep, i) != address) leave_group(lockstep, i);
+    }
+    return address;
+}
+
+// Fetches from the leader. Pages nobody wrote to hold the same bytes in every lane, code in the
+// others is compared first and lanes with different bytes leave
+static uint8_t fetch_group(Lockstep* lockstep, int leader) {
+    uint16_t pc = lockstep->group_program_counter;
+    Memory* code = &lockstep->memory[leader];
+    uint8_t opcode = read_memory(code, pc);
+    uint8_t size = opcode_lookup[opcode].size;
+
+    bool written = false;
+    for (int k = 0; k < size; k++) written |= lockstep->written_pages[(uint16_t) (pc + k) / MEMORY_PAGE_SIZE];
+    if (!written) return opcode;
+    FOR_EACH_LANE(lockstep, i) {
+        for (int k = 0; k < size; k++) {
+            if (read_memory(&lockstep->memory[i], pc + k) != read_memory(code, pc + k)) {
+                leave_group(lockstep, i);
+                break;
+            }
+        }
+    }
+    return opcode;
+}
+
+static void step_group(Lockstep* lockstep) {
+    int leader = group_leader(lockstep);
+    uint16_t pc = lockstep->group_program_counter;
+    uint8_t opcode = fetch_group(lockstep, leader);
+    const Instruction* instruction = &opcode_lookup[opcode];
+    Memory* code = &lockstep->memory[leader];
+    uint8_t immediate = read_memory(code, pc + 1);
+    uint16_t address = read_memory16(code, pc + 1);
+    uint16_t next = pc + instruction->size;
+    uint64_t cycles = instruction->cycles;
+    TRACE("%s0x%04x%s %s%s%s %s(%d lanes)%s\n", DIM, pc, RESET, OPCODE_COLOR, opcode_names[opcode], RESET, COMMENT_COLOR, lockstep->group_lanes, RESET);
+
+    uint8_t** planes = lockstep->registers;
+    uint8_t* a = planes[REG_A];
+    uint8_t* f = planes[REG_F];
+    uint8_t dst = (opcode >> 3) & 7, src = opcode & 7, rp = (opcode >> 4) & 3;
+    switch (lane_ops[opcode]) {
+        case LANE_NOP: break;
+        case LANE_HLT: lockstep->halted = true; break;
+
+        // 8-bit data and ALU, vectorized
+        case LANE_MOV:
+            if (dst == REGISTER_M) {
+                FOR_EACH_LANE(lockstep, i) write_lane(lockstep, i, lane_hl(lockstep, i), planes[register_slots[src]][i]);
+            }
+            else kernel_move(planes[register_slots[dst]], operand_plane(lockstep, src), lockstep->active, lockstep->capacity);
+            break;
+        case LANE_MVI:
+            if (dst == REGISTER_M) {
+                FOR_EACH_LANE(lockstep, i) write_lane(lockstep, i, lane_hl(lockstep, i), immediate);
+            }
+            else kernel_move(planes[register_slots[dst]], immediate_plane(lockstep, immediate), lockstep->active, lockstep->capacity);
+            break;
+        case LANE_INR: case LANE_DCR: {
+            bool decrement = lane_ops[opcode] == LANE_DCR;
+            if (dst != REGISTER_M) {
+                kernel_step(planes[register_slots[dst]], f, lockstep->active, lockstep->capacity, decrement);
+                break;
+            }
+            operand_plane(lockstep, REGISTER_M);
+            kernel_step(lockstep->scratch, f, lockstep->active, lockstep->capacity, decrement);
+            FOR_EACH_LANE(lockstep, i) write_lane(lockstep, i, lane_hl(lockstep, i), lockstep->scratch[i]);
+            break;
+        }
+        case LANE_ALU: group_alu(lockstep, dst, operand_plane(lockstep, src)); break;
+        case LANE_ALU_IMMEDIATE: group_alu(lockstep, dst, immediate_plane(lockstep, immediate)); break;
+        case LANE_XCHG:
+            kernel_exchange(planes[REG_D], planes[REG_H], lockstep->active, lockstep->capacity);
+            kernel_exchange(planes[REG_E], planes[REG_L], lockstep->active, lockstep->capacity);
+            break;
+
+        // Memory and 16-bit, lane by lane
+        case LANE_LXI: FOR_EACH_LANE(lockstep, i) set_lane_pair(lockstep, rp, i, address); break;
+        case LANE_INX: FOR_EACH_LANE(lockstep, i) set_lane_pair(lockstep, rp, i, lane_pair(lockstep, rp, i) + 1); break;
+        case LANE_DCX: FOR_EACH_LANE(lockstep, i) set_lane_pair(lockstep, rp, i, lane_pair(lockstep, rp, i) - 1); break;
+        case LANE_DAD:
+            FOR_EACH_LANE(lockstep, i) {
+                uint32_t result = lane_hl(lockstep, i) + lane_pair(lockstep, rp, i);
+                set_lane_pair(lockstep, PAIR_HL, i, result);
+                f[i] = (f[i] & ~FLAG_C) | (result >> 16);
+            }
+            break;
+        case LANE_LDAX: FOR_EACH_LANE(lockstep, i) a[i] = read_memory(&lockstep->memory[i], lane_pair(lockstep, rp, i)); break;
+        case LANE_STAX: FOR_EACH_LANE(lockstep, i) write_lane(lockstep, i, lane_pair(lockstep, rp, i), a[i]); break;
+        case LANE_LDA: FOR_EACH_LANE(lockstep, i) a[i] = read_memory(&lockstep->memory[i], address); break;
+        case LANE_STA: FOR_EACH_LANE(lockstep, i) write_lane(lockstep, i, address, a[i]); break;
+        case LANE_LHLD: FOR_EACH_LANE(lockstep, i) set_lane_pair(lockstep, PAIR_HL, i, read_memory16(&lockstep->memory[i], address)); break;
+        case LANE_SHLD: FOR_EACH_LANE(lockstep, i) write_lane16(lockstep, i, address, lane_hl(lockstep, i)); break;
+        case LANE_XTHL:
+            FOR_EACH_LANE(lockstep, i) {
+                uint16_t top = lane_return_address(lockstep, i);
+                write_lane16(lockstep, i, lockstep->stack_pointer[i], lane_hl(lockstep, i));
+                set_lane_pair(lockstep, PAIR_HL, i, top);
+            }
+            break;
+        case LANE_SPHL: FOR_EACH_LANE(lockstep, i) lockstep->stack_pointer[i] = lane_hl(lockstep, i); break;
+        case LANE_PUSH:
+            FOR_EACH_LANE(lockstep, i) push_lane(lockstep, i, rp == 3 ? (a[i] << 8) | f[i] : lane_pair(lockstep, rp, i));
+            break;
+        case LANE_POP:
+            FOR_EACH_LANE(lockstep, i) {
+                uint16_t value = lane_return_address(lockstep, i);
+                lockstep->stack_pointer[i] += 2;
+                if (rp != 3) set_lane_pair(lockstep, rp, i, value);
+                else {
+                    a[i] = value >> 8;
+                    f[i] = (value & (FLAG_S | FLAG_Z | FLAG_A | FLAG_P | FLAG_C)) | FLAGS_FIXED;
+                }
+            }
+            break;
+
+        // Rotates and the other flag instructions
+        case LANE_RLC: FOR_EACH_LANE(lockstep, i) { uint8_t v = a[i]; a[i] = (v << 1) | (v >> 7); f[i] = (f[i] & ~FLAG_C) | (v >> 7); } break;
+        case LANE_RRC: FOR_EACH_LANE(lockstep, i) { uint8_t v = a[i]; a[i] = (v >> 1) | (v << 7); f[i] = (f[i] & ~FLAG_C) | (v & 1); } break;
+        case LANE_RAL: FOR_EACH_LANE(lockstep, i) { uint8_t v = a[i]; a[i] = (v << 1) | (f[i] & FLAG_C); f[i] = (f[i] & ~FLAG_C) | (v >> 7); } break;
+        case LANE_RAR: FOR_EACH_LANE(lockstep, i) { uint8_t v = a[i]; a[i] = (v >> 1) | ((f[i] & FLAG_C) << 7); f[i] = (f[i] & ~FLAG_C) | (v & 1); } break;
+        case LANE_DAA:
+            FOR_EACH_LANE(lockstep, i) { // Same as alu_daa
+                uint8_t v = a[i], correction = 0, carry = f[i] & FLAG_C;
+                if ((v & 0x0F) > 9 || (f[i] & FLAG_A)) correction |= 0x06;
+                if (v > 0x99 || carry) {
+                    correction |= 0x60;
+                    carry = 1;
+                }
+                a[i] = v + correction;
+                LazyFlags add = {FLAGS_ADD, a[i], v, correction, 0};
+                f[i] = compute_flags(&add, 0) | carry;
+            }
+            break;
+        case LANE_CMA: FOR_EACH_LANE(lockstep, i) a[i] = ~a[i]; break;
+        case LANE_STC: FOR_EACH_LANE(lockstep, i) f[i] |= FLAG_C; break;
+        case LANE_CMC: FOR_EACH_LANE(lockstep, i) f[i] ^= FLAG_C; break;
+
+        // Branches, where lanes can leave the group
+        case LANE_JMP: next = address; break;
+        case LANE_JCC: if (group_condition(lockstep, leader, dst)) next = address; break;
+        case LANE_CCC:
+            if (!group_condition(lockstep, leader, dst)) break;
+            cycles += 6; // A taken conditional call is a CALL
+            // Fall through
+        case LANE_CALL:
+            FOR_EACH_LANE(lockstep, i) push_lane(lockstep, i, next);
+            next = address;
+            break;
+        case LANE_RCC:
+            if (!group_condition(lockstep, leader, dst)) break;
+            cycles += 6; // A taken conditional return is a RET
+            // Fall through
+        case LANE_RET:
+            next = group_target(lockstep, leader, lane_return_address);
+            FOR_EACH_LANE(lockstep, i) lockstep->stack_pointer[i] += 2;
+            break;
+        case LANE_RST:
+            FOR_EACH_LANE(lockstep, i) push_lane(lockstep, i, next);
+            next = dst * 8;
+            break;
+        case LANE_PCHL: next = group_target(lockstep, leader, lane_hl); break;
+
+        // Lanes never echo to the console, they only keep what was written
+        case LANE_IN: FOR_EACH_LANE(lockstep, i) a[i] = lockstep->ports[i][immediate]; break;
+        case LANE_OUT: FOR_EACH_LANE(lockstep, i) lockstep->ports[i][immediate] = a[i]; break;
+        case LANE_EI: FOR_EACH_LANE(lockstep, i) lockstep->interrupts_enabled[i] = true; break;
+        case LANE_DI: FOR_EACH_LANE(lockstep, i) lockstep->interrupts_enabled[i] = false; break;
+    }
+
+    lockstep->group_program_counter = next;
+    lockstep->group_cycles += cycles;
+    lockstep->group_instructions++;
+}
+
+// Runs the group until it halts, its cycle count reaches cycle_limit or too few lanes are left in
+// it to be worth running together
+void run_lockstep(Lockstep* lockstep, uint64_t cycle_limit) {
+    while (!lockstep->halted && lockstep->group_lanes >= LOCKSTEP_MIN_LANES && lockstep->group_cycles < cycle_limit) step_group(lockstep);
+}
+
+Lockstep* create_lockstep(int lanes) {
+    if (lanes < 1 || lanes > LOCKSTEP_MAX_LANES) return NULL;
+    Lockstep* lockstep = calloc(1, sizeof(Lockstep));
+    if (lockstep == NULL) return NULL;
+    lockstep->lanes = lanes;
+    lockstep->capacity = (lanes + LOCKSTEP_VECTOR - 1) / LOCKSTEP_VECTOR * LOCKSTEP_VECTOR;
+
+    int capacity = lockstep->capacity;
+    bool allocated = true;
+    for (int slot = 0; slot < 8; slot++) {
+        lockstep->registers[slot] = calloc(capacity, 1);
+        allocated &= lockstep->registers[slot] != NULL;
+    }
+    lockstep->active = calloc(capacity, 1);
+    lockstep->scratch = calloc(capacity, 1);
+    lockstep->interrupts_enabled = calloc(capacity, 1);
+    lockstep->stack_pointer = calloc(capacity, sizeof(uint16_t));
+    lockstep->program_counter = calloc(capacity, sizeof(uint16_t));
+    lockstep->cycles = calloc(capacity, sizeof(uint64_t));
+    lockstep->instructions = calloc(capacity, sizeof(uint64_t));
+    lockstep->ports = calloc(capacity, MAX_PORTS);
+    lockstep->memory = calloc(capacity, sizeof(Memory));
+    allocated &= lockstep->active != NULL && lockstep->scratch != NULL && lockstep->interrupts_enabled != NULL && lockstep->stack_pointer != NULL && lockstep->program_counter != NULL
+                 && lockstep->cycles != NULL && lockstep->instructions != NULL && lockstep->ports != NULL && lockstep->memory != NULL;
+    if (!allocated) {
+        free_lockstep(lockstep);
+        return NULL;
+    }
+    return lockstep;
+}
+
+void free_lockstep(Lockstep* lockstep) {
+    if (lockstep == NULL) return;
+    if (lockstep->memory != NULL) {
+        for (int i = 0; i < lockstep->lanes; i++) {
+            if (lockstep->memory[i].bytes != NULL) unmap_memory_image(&lockstep->memory[i]);
+        }
+    }
+    for (int slot = 0; slot < 8; slot++) free(lockstep->registers[slot]);
+    free(lockstep->active);
+    free(lockstep->scratch);
+    free(lockstep->interrupts_enabled);
+    free(lockstep->stack_pointer);
+    free(lockstep->program_counter);
+    free(lockstep->cycles);
+    free(lockstep->instructions);
+    free(lockstep->ports);
+    free(lockstep->memory);
+    free(lockstep);
+}
+
+// The first lane loaded sets where the group starts, a lane that starts anywhere else is loaded as
+// if it had already left
+void load_lockstep_lane(Lockstep* lockstep, int lane, CPU* cpu) {
+    get_flags(cpu);
+    for (int slot = 0; slot < 8; slot++) lockstep->registers[slot][lane] = cpu->registers.r8[slot];
+    lockstep->stack_pointer[lane] = cpu->stack_pointer;
+    lockstep->interrupts_enabled[lane] = cpu->interrupts_enabled;
+    memcpy(lockstep->ports[lane], cpu->ports, MAX_PORTS);
+    lockstep->memory[lane] = cpu->memory;
+    cpu->memory.bytes = NULL;
+
+    if (lockstep->group_lanes == 0) {
+        lockstep->group_program_counter = cpu->program_counter;
+        lockstep->group_cycles = cpu->cycles;
+    }
+    if (cpu->running && cpu->program_counter == lockstep->group_program_counter && cpu->cycles == lockstep->group_cycles) {
+        lockstep->active[lane] = 0xFF;
+        lockstep->group_lanes++;
+        return;
+    }
+    lockstep->program_counter[lane] = cpu->program_counter;
+    lockstep->cycles[lane] = cpu->cycles;
+}
+
+// Fills in everything the engine keeps for a lane and hands its memory back, once per lane after
+// run_lockstep. Returns the number of instructions the lane ran in the group
+uint64_t store_lockstep_lane(Lockstep* lockstep, int lane, CPU* cpu) {
+    bool grouped = lockstep->active[lane];
+    for (int slot = 0; slot < 8; slot++) cpu->registers.r8[slot] = lockstep->registers[slot][lane];
+    cpu->lazy_flags.kind = FLAGS_SETTLED;
+    cpu->eager_flags = cpu->registers.r8[REG_F];
+    cpu->stack_pointer = lockstep->stack_pointer[lane];
+    cpu->program_counter = grouped ? lockstep->group_program_counter : lockstep->program_counter[lane];
+    cpu->cycles = grouped ? lockstep->group_cycles : lockstep->cycles[lane];
+    cpu->running = !(grouped && lockstep->halted);
+    cpu->interrupts_enabled = lockstep->interrupts_enabled[lane];
+    memcpy(cpu->ports, lockstep->ports[lane], MAX_PORTS);
+    cpu->memory = lockstep->memory[lane];
+    lockstep->memory[lane].bytes = NULL;
+    return grouped ? lockstep->group_instructions : lockstep->instructions[lane];
+}
+
+void mark_lockstep_write(Lockstep* lockstep, uint16_t address) {
+    lockstep->written_pages[address / MEMORY_PAGE_SIZE] = 1;
+}
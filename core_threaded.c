@@ -0,0 +1,428 @@
+#include "cpu.h"
+#include "alu.h"
+
+// Threaded interpreter core. Every opcode in opcodes.def gets its own body with the register
+// fields already decoded, so MOV B, C is a single byte copy instead of two lookups by register
+// field. With GCC/Clang each body jumps straight to the next one through a table of
+// label addresses (computed goto), otherwise it falls back to a switch in a loop.
+//
+// With computed goto it also runs superinstructions: short sequences that show up all over guest
+// code, run by one handler with a single dispatch. The handler of an opcode that can start one
+// checks a tag kept for its address, decoding what starts there the first time it runs, so data
+// in the image that happens to look like a sequence is never tagged. The sequences, picked from
+// opcode pair counts over workloads/:
+//   ALU op on a register or immediate, then Jcc      ORA A / JZ, CPI / JC
+//   MOV A,r, ALU op, then Jcc                        MOV A,B / ORA C / JNZ
+//   INR r or DCR r, then JNZ                         loop counters
+//   MVI r, then an ALU op on a register              MVI r,# / ADD r
+//   MOV A,M, then INX H                              byte loads through HL
+// M is only an operand in the last one. The ALU op records its flags through alu.h as usual, so
+// the flags a sequence leaves are the same, but its Jcc is decided from the result directly
+// rather than from the flags. A superinstruction reads its opcodes anyway for their register
+// fields, so it checks they are still the ones it was tagged for and sends the address back to
+// be decoded if the guest rewrote them. Nothing has to watch writes for that, which would send
+// every write to a page holding code down write_memory_slow. None of the sequences writes memory,
+// so none can rewrite itself halfway through.
+// Build with -DFUSION=0 to leave superinstructions out.
+
+#ifndef FUSION
+#define FUSION 1
+#endif
+
+#define IMMEDIATE read_memory(&cpu->memory, cpu->program_counter + 1)
+#define IMMEDIATE16 read_memory16(&cpu->memory, cpu->program_counter + 1)
+
+// Register operands by name, M is memory at H:L
+#define GET_A() cpu->registers.r8[REG_A]
+#define GET_B() cpu->registers.r8[REG_B]
+#define GET_C() cpu->registers.r8[REG_C]
+#define GET_D() cpu->registers.r8[REG_D]
+#define GET_E() cpu->registers.r8[REG_E]
+#define GET_H() cpu->registers.r8[REG_H]
+#define GET_L() cpu->registers.r8[REG_L]
+#define GET_M() read_memory(&cpu->memory, cpu->registers.r16[PAIR_HL])
+#define SET_A(v) cpu->registers.r8[REG_A] = (v)
+#define SET_B(v) cpu->registers.r8[REG_B] = (v)
+#define SET_C(v) cpu->registers.r8[REG_C] = (v)
+#define SET_D(v) cpu->registers.r8[REG_D] = (v)
+#define SET_E(v) cpu->registers.r8[REG_E] = (v)
+#define SET_H(v) cpu->registers.r8[REG_H] = (v)
+#define SET_L(v) cpu->registers.r8[REG_L] = (v)
+#define SET_M(v) write_memory(&cpu->memory, cpu->registers.r16[PAIR_HL], (v))
+
+// Register pairs by name, PSW only shows up in PUSH and POP
+#define GET_BC() cpu->registers.r16[PAIR_BC]
+#define GET_DE() cpu->registers.r16[PAIR_DE]
+#define GET_HL() cpu->registers.r16[PAIR_HL]
+#define GET_SP() cpu->stack_pointer
+#define GET_PSW() get_psw(cpu)
+#define SET_BC(v) cpu->registers.r16[PAIR_BC] = (v)
+#define SET_DE(v) cpu->registers.r16[PAIR_DE] = (v)
+#define SET_HL(v) cpu->registers.r16[PAIR_HL] = (v)
+#define SET_SP(v) cpu->stack_pointer = (v)
+#define SET_PSW(v) set_psw(cpu, (v))
+
+// Branches leave through JUMP instead of the shared tail, they end a block so the cycle budget is
+// checked there
+#define JUMP(address) \
+    cpu->program_counter = (address); \
+    count++; \
+    CHECK_STEP(); \
+    CHECK_BUDGET(); \
+    NEXT()
+
+// Opcode bodies used by opcodes.def
+#define NOP_()
+#define HLT_() cpu->running = false; cpu->program_counter++; count++; goto halted
+#define MOV_RR(d, s) SET_##d(GET_##s())
+#define MVI_R(d) SET_##d(IMMEDIATE)
+#define INR_R(d) SET_##d(alu_inr(cpu, GET_##d()))
+#define DCR_R(d) SET_##d(alu_dcr(cpu, GET_##d()))
+#define ADD_R(s) alu_add(cpu, GET_##s(), 0)
+#define ADC_R(s) alu_add(cpu, GET_##s(), get_flag_C(cpu))
+#define SUB_R(s) alu_sub(cpu, GET_##s(), 0)
+#define SBB_R(s) alu_sub(cpu, GET_##s(), get_flag_C(cpu))
+#define ANA_R(s) alu_and(cpu, GET_##s())
+#define XRA_R(s) alu_xor(cpu, GET_##s())
+#define ORA_R(s) alu_or(cpu, GET_##s())
+#define CMP_R(s) alu_cmp(cpu, GET_##s())
+#define ADI_I() alu_add(cpu, IMMEDIATE, 0)
+#define ACI_I() alu_add(cpu, IMMEDIATE, get_flag_C(cpu))
+#define SUI_I() alu_sub(cpu, IMMEDIATE, 0)
+#define SBI_I() alu_sub(cpu, IMMEDIATE, get_flag_C(cpu))
+#define ANI_I() alu_and(cpu, IMMEDIATE)
+#define XRI_I() alu_xor(cpu, IMMEDIATE)
+#define ORI_I() alu_or(cpu, IMMEDIATE)
+#define CPI_I() alu_cmp(cpu, IMMEDIATE)
+#define LXI_P(p) SET_##p(IMMEDIATE16)
+#define INX_P(p) SET_##p(GET_##p() + 1)
+#define DCX_P(p) SET_##p(GET_##p() - 1)
+#define DAD_P(p) alu_dad(cpu, GET_##p())
+#define LDAX_P(p) SET_A(read_memory(&cpu->memory, GET_##p()))
+#define STAX_P(p) write_memory(&cpu->memory, GET_##p(), GET_A())
+#define LDA_A() SET_A(read_memory(&cpu->memory, IMMEDIATE16))
+#define STA_A() write_memory(&cpu->memory, IMMEDIATE16, GET_A())
+#define LHLD_A() SET_HL(read_memory16(&cpu->memory, IMMEDIATE16))
+#define SHLD_A() write_memory16(&cpu->memory, IMMEDIATE16, GET_HL())
+#define XCHG_() { uint16_t hl = GET_HL(); SET_HL(GET_DE()); SET_DE(hl); }
+#define XTHL_() { uint16_t hl = GET_HL(); SET_HL(read_memory16(&cpu->memory, GET_SP())); write_memory16(&cpu->memory, GET_SP(), hl); }
+#define SPHL_() SET_SP(GET_HL())
+#define PUSH_P(p) push_word(cpu, GET_##p())
+#define POP_P(p) SET_##p(pop_word(cpu))
+#define RLC_() alu_rlc(cpu)
+#define RRC_() alu_rrc(cpu)
+#define RAL_() alu_ral(cpu)
+#define RAR_() alu_rar(cpu)
+#define DAA_() alu_daa(cpu)
+#define CMA_() SET_A(~GET_A())
+#define STC_() set_flag_C(cpu, 1)
+#define CMC_() set_flag_C(cpu, !get_flag_C(cpu))
+#define JMP_A() JUMP(IMMEDIATE16)
+#define JCC_A(c) if (condition(cpu, c)) { JUMP(IMMEDIATE16); }
+#define CALL_A() { uint16_t target = IMMEDIATE16; push_word(cpu, cpu->program_counter + 3); JUMP(target); }
+#define CCC_A(c) if (condition(cpu, c)) { cpu->cycles += 6; CALL_A() }
+#define RET_() JUMP(pop_word(cpu))
+#define RCC_(c) if (condition(cpu, c)) { cpu->cycles += 6; RET_(); }
+#define RST_N(n) push_word(cpu, cpu->program_counter + 1); JUMP((n) * 8)
+#define PCHL_() JUMP(GET_HL())
+#define IN_P() SET_A(read_port(cpu, IMMEDIATE))
+#define OUT_P() write_port(cpu, IMMEDIATE)
+#define EI_() cpu->interrupts_enabled = true; if (cpu->scheduler != NULL) cpu->cycle_limit = cpu->cycles /* See EI */
+#define DI_() cpu->interrupts_enabled = false
+
+#if defined(__GNUC__) && FUSION
+typedef struct Fusion {
+    uint8_t kinds[ADDRESS_SPACE_SIZE]; // Sequence starting at each address, FUSED_UNKNOWN until it first runs
+} Fusion;
+
+// The families with an ALU op take eight kinds each, one per ALU op field
+enum {
+    FUSED_NONE,
+    FUSED_ALU_JCC,
+    FUSED_ALU_I_JCC = FUSED_ALU_JCC + 8,
+    FUSED_MOV_ALU_JCC = FUSED_ALU_I_JCC + 8,
+    FUSED_MOV_ALU_I_JCC = FUSED_MOV_ALU_JCC + 8,
+    FUSED_MVI_ALU = FUSED_MOV_ALU_I_JCC + 8,
+    FUSED_INR_JNZ = FUSED_MVI_ALU + 8,
+    FUSED_DCR_JNZ,
+    FUSED_LOAD_INX,
+    FUSED_KINDS,
+    FUSED_UNKNOWN = 0xFF,
+};
+
+#define IS_ALU(opcode) (((opcode) & 0xC0) == 0x80 && ((opcode) & 7) != REGISTER_M)
+#define IS_ALU_IMMEDIATE(opcode) (((opcode) & 0xC7) == 0xC6)
+#define IS_JCC(opcode) (((opcode) & 0xC7) == 0xC2)
+#define IS_MOV_A(opcode) ((opcode) >= 0x78 && (opcode) <= 0x7F && (opcode) != 0x7E) // MOV A, r
+#define IS_MVI(opcode) (((opcode) & 0xC7) == 0x06 && (opcode) != 0x36)
+#define IS_INR(opcode) (((opcode) & 0xC7) == 0x04 && (opcode) != 0x34)
+#define IS_DCR(opcode) (((opcode) & 0xC7) == 0x05 && (opcode) != 0x35)
+#define ALU_FIELD(opcode) (((opcode) >> 3) & 7)
+
+// Opcodes a sequence can start with, constant for each handler so the others compile it away
+#define IS_FUSION_HEAD(opcode) (IS_ALU(opcode) || IS_ALU_IMMEDIATE(opcode) || ((opcode) >= 0x78 && (opcode) <= 0x7F) || IS_MVI(opcode) || IS_INR(opcode) || IS_DCR(opcode))
+
+// The sequence starting at address. Sequences that would reach 0xFFFF are left out, so running
+// one never wraps the PC, which is where the cycle budget would have been checked
+static uint8_t classify_sequence(Memory* memory, uint16_t address) {
+    uint8_t bytes[6];
+    for (int i = 0; i < 6; i++) bytes[i] = read_memory(memory, address + i);
+    uint8_t first = bytes[0], kind = FUSED_NONE;
+    int length = 0;
+    if (IS_ALU(first) && IS_JCC(bytes[1])) kind = FUSED_ALU_JCC + ALU_FIELD(first), length = 4;
+    else if (IS_ALU_IMMEDIATE(first) && IS_JCC(bytes[2])) kind = FUSED_ALU_I_JCC + ALU_FIELD(first), length = 5;
+    else if (IS_MOV_A(first) && IS_ALU(bytes[1]) && IS_JCC(bytes[2])) kind = FUSED_MOV_ALU_JCC + ALU_FIELD(bytes[1]), length = 5;
+    else if (IS_MOV_A(first) && IS_ALU_IMMEDIATE(bytes[1]) && IS_JCC(bytes[3])) kind = FUSED_MOV_ALU_I_JCC + ALU_FIELD(bytes[1]), length = 6;
+    else if (IS_MVI(first) && IS_ALU(bytes[2])) kind = FUSED_MVI_ALU + ALU_FIELD(bytes[2]), length = 3;
+    else if (IS_INR(first) && bytes[1] == 0xC2) kind = FUSED_INR_JNZ, length = 4;
+    else if (IS_DCR(first) && bytes[1] == 0xC2) kind = FUSED_DCR_JNZ, length = 4;
+    else if (first == 0x7E && bytes[1] == 0x23) kind = FUSED_LOAD_INX, length = 2;
+    return address + length < ADDRESS_SPACE_SIZE ? kind : FUSED_NONE;
+}
+
+// The tags, made by the first run. Without them every head finds FUSED_NONE and runs on its own
+static uint8_t* prepare_fusion(CPU* cpu) {
+    static uint8_t untagged[ADDRESS_SPACE_SIZE];
+    if (cpu->fusion == NULL) {
+        cpu->fusion = malloc(sizeof(Fusion));
+        if (cpu->fusion == NULL) return untagged;
+        memset(cpu->fusion->kinds, FUSED_UNKNOWN, sizeof(cpu->fusion->kinds));
+    }
+    return cpu->fusion->kinds;
+}
+
+void free_fusion(CPU* cpu) {
+    free(cpu->fusion);
+    cpu->fusion = NULL;
+}
+
+// Jcc ccc from the result the ALU op before it just recorded, without settling the flags
+static inline bool result_condition(CPU* cpu, uint8_t ccc) {
+    uint8_t result = cpu->lazy_flags.result;
+    bool set;
+    switch (ccc >> 1) {
+        case 0: set = result == 0; break;
+        case 1: set = get_flag_C(cpu); break;
+        case 2: set = szp_flags[result] & FLAG_P; break;
+        default: set = result & 0x80; break;
+    }
+    return set == (ccc & 1);
+}
+
+#define FUSED_BYTE(offset) read_memory(&cpu->memory, cpu->program_counter + (offset))
+#define FIELD_REGISTER(field) cpu->registers.r8[register_slots[(field) & 7]] // Never M here
+#define TRACE_FUSED(opcode) TRACE("%s%s%s\n", OPCODE_COLOR, opcode_names[opcode], RESET)
+#define FUSED_CHECK(still_there) if (!(still_there)) goto fused_stale
+
+#define ALU_0(v) alu_add(cpu, v, 0)
+#define ALU_1(v) alu_add(cpu, v, get_flag_C(cpu))
+#define ALU_2(v) alu_sub(cpu, v, 0)
+#define ALU_3(v) alu_sub(cpu, v, get_flag_C(cpu))
+#define ALU_4(v) alu_and(cpu, v)
+#define ALU_5(v) alu_xor(cpu, v)
+#define ALU_6(v) alu_or(cpu, v)
+#define ALU_7(v) alu_cmp(cpu, v)
+#define FOR_EACH_ALU(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+// Ends a sequence on the Jcc at offset, the instructions before it already counted
+#define FUSED_JCC(offset, jcc, holds) \
+    TRACE_FUSED(jcc); \
+    if (holds) { JUMP(read_memory16(&cpu->memory, cpu->program_counter + (offset) + 1)); } \
+    cpu->program_counter += (offset) + 3; \
+    count++; \
+    CHECK_STEP(); \
+    NEXT();
+
+#define FUSED_ENTRIES(op) \
+    [FUSED_ALU_JCC + op] = &&fused_alu_jcc_##op, \
+    [FUSED_ALU_I_JCC + op] = &&fused_alu_i_jcc_##op, \
+    [FUSED_MOV_ALU_JCC + op] = &&fused_mov_alu_jcc_##op, \
+    [FUSED_MOV_ALU_I_JCC + op] = &&fused_mov_alu_i_jcc_##op, \
+    [FUSED_MVI_ALU + op] = &&fused_mvi_alu_##op,
+
+#define FUSED_ALU_HANDLERS(op) \
+    fused_alu_jcc_##op: { \
+        uint8_t alu = FUSED_BYTE(0), jcc = FUSED_BYTE(1); \
+        FUSED_CHECK(IS_ALU(alu) && ALU_FIELD(alu) == op && IS_JCC(jcc)); \
+        TRACE_FUSED(alu); \
+        cpu->cycles += 4 + 10; \
+        ALU_##op(FIELD_REGISTER(alu)); \
+        count++; \
+        FUSED_JCC(1, jcc, result_condition(cpu, ALU_FIELD(jcc))) \
+    } \
+    fused_alu_i_jcc_##op: { \
+        uint8_t alu = FUSED_BYTE(0), jcc = FUSED_BYTE(2); \
+        FUSED_CHECK(alu == (0xC6 | op << 3) && IS_JCC(jcc)); \
+        TRACE_FUSED(alu); \
+        cpu->cycles += 7 + 10; \
+        ALU_##op(FUSED_BYTE(1)); \
+        count++; \
+        FUSED_JCC(2, jcc, result_condition(cpu, ALU_FIELD(jcc))) \
+    } \
+    fused_mov_alu_jcc_##op: { \
+        uint8_t mov = FUSED_BYTE(0), alu = FUSED_BYTE(1), jcc = FUSED_BYTE(2); \
+        FUSED_CHECK(IS_MOV_A(mov) && IS_ALU(alu) && ALU_FIELD(alu) == op && IS_JCC(jcc)); \
+        TRACE_FUSED(mov); \
+        TRACE_FUSED(alu); \
+        cpu->cycles += 5 + 4 + 10; \
+        SET_A(FIELD_REGISTER(mov)); \
+        ALU_##op(FIELD_REGISTER(alu)); \
+        count += 2; \
+        FUSED_JCC(2, jcc, result_condition(cpu, ALU_FIELD(jcc))) \
+    } \
+    fused_mov_alu_i_jcc_##op: { \
+        uint8_t mov = FUSED_BYTE(0), alu = FUSED_BYTE(1), jcc = FUSED_BYTE(3); \
+        FUSED_CHECK(IS_MOV_A(mov) && alu == (0xC6 | op << 3) && IS_JCC(jcc)); \
+        TRACE_FUSED(mov); \
+        TRACE_FUSED(alu); \
+        cpu->cycles += 5 + 7 + 10; \
+        SET_A(FIELD_REGISTER(mov)); \
+        ALU_##op(FUSED_BYTE(2)); \
+        count += 2; \
+        FUSED_JCC(3, jcc, result_condition(cpu, ALU_FIELD(jcc))) \
+    } \
+    fused_mvi_alu_##op: { \
+        uint8_t mvi = FUSED_BYTE(0), alu = FUSED_BYTE(2); \
+        FUSED_CHECK(IS_MVI(mvi) && IS_ALU(alu) && ALU_FIELD(alu) == op); \
+        TRACE_FUSED(mvi); \
+        TRACE_FUSED(alu); \
+        cpu->cycles += 7 + 4; \
+        FIELD_REGISTER(mvi >> 3) = FUSED_BYTE(1); \
+        ALU_##op(FIELD_REGISTER(alu)); \
+        cpu->program_counter += 3; \
+        count += 2; \
+        CHECK_STEP(); \
+        NEXT(); \
+    }
+
+#define FUSED_HEAD(opcode) if (IS_FUSION_HEAD(opcode) && fused[cpu->program_counter] != FUSED_NONE) goto fused_head;
+#else
+#define FUSED_HEAD(opcode)
+
+void free_fusion(CPU* cpu) { // Nothing is ever tagged
+    (void) cpu;
+}
+#endif
+
+#if defined(__GNUC__)
+#define HANDLER(opcode) op_##opcode:
+#define NEXT() goto *dispatch_table[read_memory(&cpu->memory, cpu->program_counter)]
+#else
+#define HANDLER(opcode) case opcode:
+#define NEXT() continue
+#endif
+
+// The PC only goes backwards through a branch or by wrapping past the top of memory, so checking
+// the cycle budget at those two places is enough to always catch a guest that runs on forever
+#define CHECK_BUDGET() if (cpu->cycles >= cpu->cycle_limit) goto paused
+
+#if CHECK_FLAGS
+#define CHECK_STEP() if (!check_flags(cpu)) goto stopped
+#else
+#define CHECK_STEP()
+#endif
+
+#define TABLE_ENTRY(opcode, name, size, states, body) [opcode] = &&op_##opcode,
+#define EXECUTE(opcode, name, size, states, body) \
+    HANDLER(opcode) \
+        FUSED_HEAD(opcode) \
+        TRACE("%s%s%s\n", OPCODE_COLOR, name, RESET); \
+        cpu->cycles += states; \
+        body; \
+        cpu->program_counter += size; \
+        count++; \
+        CHECK_STEP(); \
+        if (cpu->program_counter < size) CHECK_BUDGET(); /* Wrapped past the top of memory */ \
+        NEXT();
+
+// Every opcode is in opcodes.def, so this only returns true on a flag mismatch in CHECK_FLAGS
+// builds, and false on HLT or once the cycle budget runs out
+bool run_threaded(CPU* cpu, uint64_t* instruction_count) {
+    uint64_t count = 0;
+    if (!cpu->running) goto halted;
+
+#if defined(__GNUC__)
+    static const void* const dispatch_table[256] = {
+#define OPCODE TABLE_ENTRY
+#include "opcodes.def"
+#undef OPCODE
+    };
+
+#if FUSION
+    static const void* const fused_table[FUSED_KINDS] = {
+        FOR_EACH_ALU(FUSED_ENTRIES)
+        [FUSED_INR_JNZ] = &&fused_inr_jnz,
+        [FUSED_DCR_JNZ] = &&fused_dcr_jnz,
+        [FUSED_LOAD_INX] = &&fused_load_inx,
+    };
+    uint8_t* fused = prepare_fusion(cpu);
+#endif
+
+    NEXT();
+#define OPCODE EXECUTE
+#include "opcodes.def"
+#undef OPCODE
+
+#if FUSION
+fused_stale: // The guest rewrote a tagged sequence
+    TRACE("%sSuperinstruction at 0x%04x was rewritten%s\n", COMMENT_COLOR, cpu->program_counter, RESET);
+    fused[cpu->program_counter] = FUSED_UNKNOWN;
+fused_head:
+    if (fused[cpu->program_counter] == FUSED_UNKNOWN) {
+        fused[cpu->program_counter] = classify_sequence(&cpu->memory, cpu->program_counter);
+        if (fused[cpu->program_counter] == FUSED_NONE) goto *dispatch_table[read_memory(&cpu->memory, cpu->program_counter)]; // Its own handler, now that the tag says none
+    }
+    goto *fused_table[fused[cpu->program_counter]];
+
+    FOR_EACH_ALU(FUSED_ALU_HANDLERS)
+fused_inr_jnz: {
+    uint8_t inr = FUSED_BYTE(0), jnz = FUSED_BYTE(1);
+    FUSED_CHECK(IS_INR(inr) && jnz == 0xC2);
+    TRACE_FUSED(inr);
+    cpu->cycles += 5 + 10;
+    FIELD_REGISTER(inr >> 3) = alu_inr(cpu, FIELD_REGISTER(inr >> 3));
+    count++;
+    FUSED_JCC(1, jnz, cpu->lazy_flags.result != 0)
+}
+fused_dcr_jnz: {
+    uint8_t dcr = FUSED_BYTE(0), jnz = FUSED_BYTE(1);
+    FUSED_CHECK(IS_DCR(dcr) && jnz == 0xC2);
+    TRACE_FUSED(dcr);
+    cpu->cycles += 5 + 10;
+    FIELD_REGISTER(dcr >> 3) = alu_dcr(cpu, FIELD_REGISTER(dcr >> 3));
+    count++;
+    FUSED_JCC(1, jnz, cpu->lazy_flags.result != 0)
+}
+fused_load_inx:
+    FUSED_CHECK(FUSED_BYTE(0) == 0x7E && FUSED_BYTE(1) == 0x23);
+    TRACE_FUSED(0x7E);
+    TRACE_FUSED(0x23);
+    cpu->cycles += 7 + 5;
+    SET_A(GET_M());
+    SET_HL(GET_HL() + 1);
+    cpu->program_counter += 2;
+    count += 2;
+    CHECK_STEP();
+    NEXT();
+#endif
+#else
+    for (;;) {
+        switch (read_memory(&cpu->memory, cpu->program_counter)) {
+#define OPCODE EXECUTE
+#include "opcodes.def"
+#undef OPCODE
+        }
+    }
+#endif
+
+#if CHECK_FLAGS
+stopped:
+    *instruction_count = count;
+    return true;
+#endif
+
+halted:
+paused:
+    *instruction_count = count;
+    return false;
+}
@@ -0,0 +1,219 @@
+#ifndef INTEL_8080
+#define INTEL_8080
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "registers.h"
+#include "colors.h"
+#include "memory.h"
+#include "flags.h"
+
+// Build with -DDEBUG=0 for the headless build: every TRACE compiles away, so the handlers hold no
+// formatting code and no stdio calls, and the dispatch loop runs at full speed
+#ifndef DEBUG
+#define DEBUG 1
+#endif
+
+#if DEBUG
+#define TRACE(...) printf(__VA_ARGS__)
+#else
+#define TRACE(...) ((void) 0)
+#endif
+
+#define MEMORY_WIDTH 8
+#define MAX_PORTS 256
+
+#define OPCODE_COLOR BLUE
+#define COMMENT_COLOR DIM
+#define IMMEDIATE_COLOR YELLOW
+#define REGISTER_COLOR YELLOW_BRIGHT
+
+// Structs
+typedef struct CPU {
+    // Everything the cores touch on every instruction, kept within one cache line
+    _Alignas(64) RegisterFile registers; // F only holds settled flags, use get_flags
+    uint16_t stack_pointer;
+    uint16_t program_counter;
+    LazyFlags lazy_flags;
+    bool running;
+    uint8_t eager_flags; // Only kept up to date when built with CHECK_FLAGS
+    uint64_t cycles; // T-states since reset
+    uint64_t cycle_limit; // The cores return once cycles reaches this, see run_paced
+    Memory memory; // Its bytes pointer comes first
+
+    bool interrupts_enabled; // INTE, set by EI and cleared by DI
+    uint8_t ports[MAX_PORTS]; // Last byte written to each port, IN reads it back where no device answers
+    struct DeviceBus* bus; // Devices on the ports, NULL for none (batch runs), see devices.c
+    struct Scheduler* scheduler; // Pending events and interrupt requests, NULL for none (batch runs), see scheduler.c
+    struct Jit* jit; // Translation cache, created by the first run_jit and released by free_cpu
+    struct Fusion* fusion; // Superinstructions, tagged by the first run_threaded and released by free_cpu
+    struct Profile* profile; // Set to run every core on the profiled table loop, see profile.c
+    struct TraceWriter* trace; // Set to run every core on the recording table loop, see tracefile.c
+    struct Debugger* debugger; // Breakpoints and watchpoints, NULL for none, see debugger.c
+} CPU;
+
+_Static_assert(offsetof(CPU, memory) + sizeof(uint8_t*) <= 64, "hot CPU state must fit in one cache line");
+
+// Register access by register field, M reads and writes memory at H:L
+static inline uint8_t get_register(CPU* cpu, uint8_t reg) {
+    if (reg == REGISTER_M) return read_memory(&cpu->memory, cpu->registers.r16[PAIR_HL]);
+    return cpu->registers.r8[register_slots[reg]];
+}
+static inline void set_register(CPU* cpu, uint8_t reg, uint8_t value) {
+    if (reg == REGISTER_M) write_memory(&cpu->memory, cpu->registers.r16[PAIR_HL], value);
+    else cpu->registers.r8[register_slots[reg]] = value;
+}
+
+// Register pair access by RP field, 3 is SP here and only means PSW for PUSH and POP
+static inline uint16_t get_pair(CPU* cpu, uint8_t rp) {
+    if (rp == 3) return cpu->stack_pointer;
+    return cpu->registers.r16[rp];
+}
+static inline void set_pair(CPU* cpu, uint8_t rp, uint16_t value) {
+    if (rp == 3) cpu->stack_pointer = value;
+    else cpu->registers.r16[rp] = value;
+}
+
+// Stack, grows down from SP
+static inline void push_word(CPU* cpu, uint16_t value) {
+    cpu->stack_pointer -= 2;
+    write_memory16(&cpu->memory, cpu->stack_pointer, value);
+}
+static inline uint16_t pop_word(CPU* cpu) {
+    uint16_t value = read_memory16(&cpu->memory, cpu->stack_pointer);
+    cpu->stack_pointer += 2;
+    return value;
+}
+
+// Only what the dispatch loop touches, names live in the cold opcode_names table
+typedef struct Instruction {
+    void (*execute)(CPU* cpu, uint8_t opcode);
+    uint8_t size; // Size of the instruction
+    uint8_t cycles; // T-states, conditional calls and returns add the rest themselves when taken
+} Instruction;
+
+typedef enum Core {
+    CORE_TABLE, // opcode_lookup function pointer dispatch
+    CORE_THREADED, // Pre-specialized handlers with direct threading, see core_threaded.c
+    CORE_LOCKSTEP, // Many runs of one image side by side, batches only, see core_lockstep.c
+    CORE_JIT, // Basic blocks translated to x86-64, see core_jit.c
+} Core;
+
+// Global variables
+extern const Instruction opcode_lookup[256];
+extern const char* const opcode_names[256];
+
+// Function prototypes
+void print_cpu_registers(CPU* cpu);
+void print_cpu_memory(CPU* cpu);
+void print_binary(uint8_t byte);
+double elapsed_seconds(struct timespec* start, struct timespec* end);
+void update_flags_add(uint8_t* flags, uint8_t reg_a_value, uint8_t added_value, uint8_t carry);
+void update_flags_sub(uint8_t* flags, uint8_t reg_a_value, uint8_t added_value, uint8_t carry);
+void update_flags_logic(uint8_t* flags, uint8_t result, uint8_t aux_carry);
+void update_flags_inr(uint8_t* flags, uint8_t result);
+void update_flags_dcr(uint8_t* flags, uint8_t result);
+bool check_flags(CPU* cpu);
+void update_flag_S(uint8_t* flags, uint8_t result); // Sign
+void update_flag_Z(uint8_t* flags, uint8_t result); // Zero
+void update_flag_P(uint8_t* flags, uint8_t result); // Parity
+void print_8bit_registers(CPU* cpu);
+void print_16bit_registers(CPU* cpu);
+void print_states_and_flags(CPU* cpu);
+const char* get_opcode_name(uint8_t opcode);
+int initialize_cpu(CPU* cpu, char* filename, size_t rom_size); // Loads filename and resets, see main.c
+void reset_cpu(CPU* cpu);
+void free_cpu(CPU* cpu);
+uint8_t fetch(CPU* cpu);
+void write_port(CPU* cpu, uint8_t port_number);
+uint8_t read_port(CPU* cpu, uint8_t port_number);
+bool run_table(CPU* cpu, uint64_t* instruction_count);
+bool run_threaded(CPU* cpu, uint64_t* instruction_count);
+bool run_jit(CPU* cpu, uint64_t* instruction_count);
+void free_jit(CPU* cpu);
+void free_fusion(CPU* cpu);
+bool run_cpu(CPU* cpu, Core core, uint64_t* instruction_count);
+bool run_core(CPU* cpu, Core core, uint64_t* instruction_count);
+bool run_paced(CPU* cpu, Core core, uint64_t clock_hz, uint64_t* instruction_count);
+#define MAX_IMAGES 64 // Program images on one command line
+int run_benchmark(char** filenames, int file_count, size_t rom_size, int runs, const char* report_filename); // See bench.c
+int run_conformance(char** filenames, int file_count, Core core, uint64_t max_cycles); // See conformance.c
+int diff_conformance(char** filenames, int file_count, uint64_t max_cycles);
+struct ProfileOutput;
+struct Debugger;
+int run_batch(const char* manifest, size_t rom_size, Core core, int threads, uint64_t max_cycles, const struct ProfileOutput* profile_output, const struct Debugger* watches); // See batch.c, NULL to not profile or watch
+
+
+// Opcode functions
+void NOP(CPU* cpu, uint8_t opcode);
+void HLT(CPU* cpu, uint8_t opcode);
+
+// Data management
+void MVI(CPU* cpu, uint8_t opcode);
+void MOV(CPU* cpu, uint8_t opcode);
+void LXI(CPU* cpu, uint8_t opcode); // Load register pair immediate
+void LDA(CPU* cpu, uint8_t opcode); // Load A from memory
+void STA(CPU* cpu, uint8_t opcode); // Store A to memory
+void LHLD(CPU* cpu, uint8_t opcode); // Load H:L from memory
+void SHLD(CPU* cpu, uint8_t opcode); // Store H:L to memory
+void LDAX(CPU* cpu, uint8_t opcode); // Load A indirect through BC or DE
+void STAX(CPU* cpu, uint8_t opcode); // Store A indirect through BC or DE
+void XCHG(CPU* cpu, uint8_t opcode); // Exchange DE and HL
+
+// Arithmetic and logic opcodes (8-bit only)
+void ADD(CPU* cpu, uint8_t opcode); // Add register to A
+void ADI(CPU* cpu, uint8_t opcode); // Add immediate to A
+void ADC(CPU* cpu, uint8_t opcode); // Add register to A with carry
+void ACI(CPU* cpu, uint8_t opcode); // Add immediate to A with carry
+void SUB(CPU* cpu, uint8_t opcode); // Subtract register from A
+void SUI(CPU* cpu, uint8_t opcode); // Subtract immediate from A
+void SBB(CPU* cpu, uint8_t opcode); // Subtract register from A with borrow
+void SBI(CPU* cpu, uint8_t opcode); // Subtract immediate from A with borrow
+void INR(CPU* cpu, uint8_t opcode); // Increment register
+void DCR(CPU* cpu, uint8_t opcode); // Decrement register
+void ANA(CPU* cpu, uint8_t opcode); // AND register with A
+void ANI(CPU* cpu, uint8_t opcode); // AND immediate with A
+void ORA(CPU* cpu, uint8_t opcode); // OR register with A
+void ORI(CPU* cpu, uint8_t opcode); // OR immediate with A
+void XRA(CPU* cpu, uint8_t opcode); // ExclusiveOR register with A
+void XRI(CPU* cpu, uint8_t opcode); // ExclusiveOR immediate with A
+void CMP(CPU* cpu, uint8_t opcode); // Compare register with A
+void CPI(CPU* cpu, uint8_t opcode); // Compare immediate with A
+void INX(CPU* cpu, uint8_t opcode); // Increment register pair
+void DCX(CPU* cpu, uint8_t opcode); // Decrement register pair
+void DAD(CPU* cpu, uint8_t opcode); // Add register pair to HL
+void DAA(CPU* cpu, uint8_t opcode); // Decimal adjust A
+void RLC(CPU* cpu, uint8_t opcode); // Rotate A left
+void RRC(CPU* cpu, uint8_t opcode); // Rotate A right
+void RAL(CPU* cpu, uint8_t opcode); // Rotate A left through carry
+void RAR(CPU* cpu, uint8_t opcode); // Rotate A right through carry
+void CMA(CPU* cpu, uint8_t opcode); // Complement A
+void CMC(CPU* cpu, uint8_t opcode); // Complement carry
+void STC(CPU* cpu, uint8_t opcode); // Set carry
+
+// Branches and stack
+void JMP(CPU* cpu, uint8_t opcode); // Unconditional jump
+void JCC(CPU* cpu, uint8_t opcode); // Conditional jump
+void CALL(CPU* cpu, uint8_t opcode); // Unconditional subroutine call
+void CCC(CPU* cpu, uint8_t opcode); // Conditional subroutine call
+void RET(CPU* cpu, uint8_t opcode); // Unconditional return
+void RCC(CPU* cpu, uint8_t opcode); // Conditional return
+void RST(CPU* cpu, uint8_t opcode); // Restart, call n*8
+void PCHL(CPU* cpu, uint8_t opcode); // Jump to H:L
+void PUSH(CPU* cpu, uint8_t opcode); // Push register pair
+void POP(CPU* cpu, uint8_t opcode); // Pop register pair
+void XTHL(CPU* cpu, uint8_t opcode); // Swap H:L with the top of the stack
+void SPHL(CPU* cpu, uint8_t opcode); // Set SP to H:L
+
+// Input and output
+void IN(CPU* cpu, uint8_t opcode); // Read input port into A
+void OUT(CPU* cpu, uint8_t opcode); // Write A to output port
+void EI(CPU* cpu, uint8_t opcode); // Enable interrupts
+void DI(CPU* cpu, uint8_t opcode); // Disable interrupts
+
+#endif
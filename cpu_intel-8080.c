@@ -1,751 +1,606 @@
-#ifndef INTEL_8080
-#define INTEL_8080
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include "registers.h"
-#include "colors.h"
-
-#define DEBUG true
-#define MAX_PROGRAM_SIZE 64
-#define MEMORY_WIDTH 8
-#define MAX_PORTS 256
-
-#define OPCODE_COLOR BLUE
-#define COMMENT_COLOR DIM
-#define IMMEDIATE_COLOR YELLOW
-#define REGISTER_COLOR YELLOW_BRIGHT
-
-// Structs
-typedef struct CPU {
-    uint8_register A, B, C, D, E, H, L, M, flag;
-    uint16_register BC, DE, HL;
-    uint16_t stack_pointer;
-    uint16_t program_counter; 
-    uint8_t memory[MAX_PROGRAM_SIZE];
-    uint8_t ports[MAX_PORTS];
-    bool running;
-} CPU;
-
-typedef struct Instruction {
-    char name[16]; // For debugging
-    void (*execute)(CPU* cpu, uint8_t opcode);
-    uint8_t size; // Size of the instruction
-} Instruction;
-
-// Global variables
-Instruction opcode_lookup[256];
-
-// Function prototypes
-void initialize_uint8_register(uint8_register* reg, char c, uint8_t v);
-void initialize_uint16_register(uint16_register* reg, char* s, uint16_t v);
-void print_cpu_registers(CPU* cpu);
-void print_cpu_memory(CPU* cpu);
-void print_binary(uint8_t byte);
-void initialize_opcode_lookup();
-void update_uint16_registers(CPU* cpu);
-void update_uint8_registers(CPU* cpu);
-void update_flags_add(CPU* cpu, uint8_t opcode, uint8_t reg_a_value, uint8_t added_value);
-void update_flags_sub(CPU* cpu, uint8_t opcode, uint8_t reg_a_value, uint8_t added_value);
-void update_16_reg(CPU* cpu); // TODO: Implement. Updates BC, DE, and HL based off of their components
-void update_8_reg(CPU* cpu); // TODO: Implement. Updates the components of BC, DE, and HL
-void update_flag_S(CPU* cpu); // Sign
-void update_flag_Z(CPU* cpu); // Zero
-void update_flag_A(CPU* cpu, uint8_t a, uint8_t b, uint8_t c); // Nibble carry/borrow
-void update_flag_P(CPU* cpu); // Parity
-void update_flag_C(CPU* cpu, uint8_t a, uint8_t b, uint8_t c); // Byte carry/borrow
-void print_8bit_registers(CPU* cpu);
-void print_16bit_registers(CPU* cpu);
-void print_states_and_flags(CPU* cpu);
-char* get_register_name(uint8_t reg);
-int initialize_cpu(CPU* cpu, char* filename);
-uint8_t fetch(CPU* cpu);
-uint8_t get_flag_S(CPU* cpu); // Sign
-uint8_t get_flag_Z(CPU* cpu); // Zero
-uint8_t get_flag_P(CPU* cpu); // Parity
-uint8_register* get_register_ptr(CPU* cpu, uint8_t reg);
-
-
-// Opcode functions
-void NOP(CPU* cpu, uint8_t opcode);
-void HLT(CPU* cpu, uint8_t opcode);
-
-// // Data management (8-bit only)
-void MVI(CPU* cpu, uint8_t opcode);
-void MOV(CPU* cpu, uint8_t opcode);
-
-// Arithmetic and logic opcodes (8-bit only)
-void ADD(CPU* cpu, uint8_t opcode); // Add register to A
-void ADI(CPU* cpu, uint8_t opcode); // Add immediate to A
-void ADC(CPU* cpu, uint8_t opcode); // Add register to A with carry
-void ACI(CPU* cpu, uint8_t opcode); // Add immediate to A with carry
-void SUB(CPU* cpu, uint8_t opcode); // Subtract register from A
-void SUI(CPU* cpu, uint8_t opcode); // Subtract immediate from A
-void SBB(CPU* cpu, uint8_t opcode); // Subtract register from A with borrow
-void SBI(CPU* cpu, uint8_t opcode); // Subtract immediate from A with borrow
-void INR(CPU* cpu, uint8_t opcode); // Increment register
-void DCR(CPU* cpu, uint8_t opcode); // Decrement register
-void ANA(CPU* cpu, uint8_t opcode); // AND register with A
-void ANI(CPU* cpu, uint8_t opcode); // AND immediate with A
-void ORA(CPU* cpu, uint8_t opcode); // OR register with A
-void ORI(CPU* cpu, uint8_t opcode); // OR immediate with A
-void XRA(CPU* cpu, uint8_t opcode); // ExclusiveOR register with A
-void XRI(CPU* cpu, uint8_t opcode); // ExclusiveOR immediate with A
-void CMP(CPU* cpu, uint8_t opcode); // Compare register with A
-void CPI(CPU* cpu, uint8_t opcode); // Compare immediate with A
-
-// Input and output
-void OUT(CPU* cpu, uint8_t opcode); // Write A to output port
-
-// Start!
-int main(int argc, char* argv[]) {
-    char* filename;
-    bool running = true;
-    if (argc == 1) filename = "program.bin";
-    else filename = argv[1];
-
-    CPU cpu;
-    int code = initialize_cpu(&cpu, filename);
-    if (code){ // Failed to initialize the CPU
-        printf("Failed to initalize CPU, exit code %d\n", code);
-        return 1;
-    } 
-    
-    if (DEBUG) printf("Initializing opcode lookup table");
-    initialize_opcode_lookup();
-
-    if (DEBUG) {
-        printf("\nStarting conditions:\n");
-        print_cpu_registers(&cpu);
-        printf("\n");
-        print_cpu_memory(&cpu);
-        printf("\n");
-    }
-
-    // Fetch-decode-execute loop
-    bool error_stop = false;
-    while (cpu.running) {
-        if (cpu.program_counter >= MAX_PROGRAM_SIZE) cpu.program_counter = 0;
-        uint8_t opcode = cpu.memory[cpu.program_counter];
-        Instruction inst = opcode_lookup[opcode];
-
-        if (inst.size == 0) {
-            printf("%sInvalid opcode (0x%02x) detected, exitting\n%s", RED, opcode, RESET);
-            error_stop = true;
-            break;
-        }
-
-        inst.execute(&cpu, opcode);
-        cpu.program_counter += inst.size;
-    }
-
-    if (DEBUG) {
-        printf("\nEnding conditions:\n");
-        print_cpu_registers(&cpu);
-        printf("\n");
-        print_cpu_memory(&cpu);
-        printf("\n");
-    }
-
-    return 0;
+#include "cpu.h"
+#include "alu.h"
+#include "profile.h"
+#include "tracefile.h"
+#include "devices.h"
+#include "scheduler.h"
+#include "debugger.h"
+
+// The CPU: reset, the opcode tables, the table core and the opcode handlers. Nothing in here
+// prints outside of TRACE and CHECK_FLAGS builds, the command line front end is main.c
+
+bool run_cpu(CPU* cpu, Core core, uint64_t* instruction_count) {
+    if (cpu->scheduler != NULL) return run_scheduled(cpu, core, instruction_count);
+    return run_core(cpu, core, instruction_count);
+}
+// Runs up to cycle_limit on one core, without stopping for events
+bool run_core(CPU* cpu, Core core, uint64_t* instruction_count) {
+    if (cpu->profile != NULL) return run_profiled(cpu, instruction_count);
+    if (cpu->trace != NULL) return run_recorded(cpu, instruction_count);
+    if (cpu->debugger != NULL) return run_watched(cpu, core, instruction_count);
+    if (core == CORE_THREADED) return run_threaded(cpu, instruction_count);
+    if (core == CORE_JIT) return run_jit(cpu, instruction_count);
+    return run_table(cpu, instruction_count);
 }
 
 // Function defenitions
 // Initialize
-void initialize_uint8_register(uint8_register* reg, char c, uint8_t v) {
-    reg->name = c;
-    reg->value = v;
-}
-void initialize_uint16_register(uint16_register* reg, char* s, uint16_t v) {
-    strcpy(reg->name, s);
-    reg->value = v;
-}
-int initialize_cpu(CPU* cpu, char* filename) {
-    // Main registers
-    initialize_uint8_register(&cpu->A, 'A', 0);
-    initialize_uint8_register(&cpu->B, 'B', 0);
-    initialize_uint8_register(&cpu->C, 'C', 0);
-    initialize_uint8_register(&cpu->D, 'D', 0);
-    initialize_uint8_register(&cpu->E, 'E', 0);
-    initialize_uint8_register(&cpu->H, 'H', 0);
-    initialize_uint8_register(&cpu->L, 'L', 0);
-    initialize_uint8_register(&cpu->M, 'M', 0);
-
-    // Register pairs
-    initialize_uint16_register(&cpu->BC, "BC", 0);
-    initialize_uint16_register(&cpu->DE, "DE", 0);
-    initialize_uint16_register(&cpu->HL, "HL", 0);
+// Power-on state. Memory and whatever is attached to the CPU are left as they are
+void reset_cpu(CPU* cpu) {
+    // Main registers and register pairs, they share storage
+    memset(&cpu->registers, 0, sizeof(cpu->registers));
 
     cpu->stack_pointer = 0;
     cpu->program_counter = 0;
-
-    for (int i = 0; i < MAX_PROGRAM_SIZE; i++) cpu->memory[i] = 0;
-
-    // Get program data, put into memory
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Could not open file %s\n", filename);
-        return 1;
-    }
-
-    if (DEBUG) printf("Opened %s\n", filename);
-    fread(cpu->memory, 1, sizeof(cpu->memory), file);
-    fclose(file);
+    cpu->cycles = 0;
+    cpu->cycle_limit = UINT64_MAX;
+    cpu->interrupts_enabled = false;
+    for (int i = 0; i < MAX_PORTS; i++) cpu->ports[i] = 0;
     cpu->running = true;
     
     // Set flag register
-    initialize_uint8_register(&cpu->flag, 'F', 0b00000010);
-
-    return 0;
-}
-
-// Printing
-void print_cpu_registers(CPU* cpu) {
-    print_8bit_registers(cpu);
-    print_16bit_registers(cpu);
-    print_states_and_flags(cpu);
-}  
-void print_cpu_memory(CPU* cpu) {
-    int last_index = -1;
-
-    for (int i = MAX_PROGRAM_SIZE - 1; i >= 0; i--) {
-        if (cpu->memory[i] != 0) {
-            last_index = i + 1;
-            break;
-        }
-    }
-
-    int last_row = (last_index - 1) / MEMORY_WIDTH;
-
-    for (int i = 0; i < MAX_PROGRAM_SIZE; i++) {
-        // Address block
-        int current_row = i / MEMORY_WIDTH;
-        if (current_row <= last_row) printf("%s", GREEN);
-        else printf("%s", DIM);
-
-        if (i % MEMORY_WIDTH == 0) printf("0x%0*x\t", MEMORY_WIDTH, i);
-        printf("%s", RESET);
-
-        // Actual data
-        if (i < last_index) printf("%s", GREEN);
-        else printf("%s", DIM);
-        printf("%02x %s", cpu->memory[i], RESET);
-        if (i % MEMORY_WIDTH == MEMORY_WIDTH - 1) printf("\n");
-    }
+    cpu->registers.r8[REG_F] = 0b00000010;
+    cpu->lazy_flags.kind = FLAGS_SETTLED;
+    cpu->eager_flags = cpu->registers.r8[REG_F];
 }
-void print_binary(uint8_t byte) {
-    printf("0b");
-    for (int i = 7; i >= 0; i--) {
-        int num = (byte >> i) & 1;
-        printf("%d", num);
-    }
-}
-void print_8bit_registers(CPU* cpu) {
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->A.name, IMMEDIATE_COLOR, cpu->A.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->B.name, IMMEDIATE_COLOR, cpu->B.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->C.name, IMMEDIATE_COLOR, cpu->C.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->D.name, IMMEDIATE_COLOR, cpu->D.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->E.name, IMMEDIATE_COLOR, cpu->E.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->H.name, IMMEDIATE_COLOR, cpu->H.value);
-    printf("%s%c = %s%d, ", REGISTER_COLOR, cpu->L.name, IMMEDIATE_COLOR, cpu->L.value);
-    printf("%s%c = %s%d\n%s", REGISTER_COLOR, cpu->M.name, IMMEDIATE_COLOR, cpu->M.value, RESET);
-}
-void print_16bit_registers(CPU* cpu) {
-    printf("%s%s = %s0x%04x, ", REGISTER_COLOR, cpu->BC.name, IMMEDIATE_COLOR, cpu->BC.value);
-    printf("%s%s = %s0x%04x, ", REGISTER_COLOR, cpu->DE.name, IMMEDIATE_COLOR, cpu->DE.value);
-    printf("%s%s = %s0x%04x\n%s", REGISTER_COLOR, cpu->HL.name, IMMEDIATE_COLOR, cpu->HL.value, RESET);
-}
-void print_states_and_flags(CPU* cpu) {
-    printf("%sSP = %d, PC = %d, ", MAGENTA, cpu->stack_pointer, cpu->program_counter);
-    // TODO: Split the Flag print into its multiple flags
-    printf("Flag = ");
-    print_binary(cpu->flag.value);
-    printf(" (0x%02x), Running = %d%s",cpu->flag.value, cpu->running, RESET); 
+void free_cpu(CPU* cpu) {
+    free_jit(cpu);
+    free_fusion(cpu);
+    unmap_memory_image(&cpu->memory);
 }
 
 // Getting
 uint8_t fetch(CPU* cpu) {
-    return cpu->memory[cpu->program_counter];
-}
-uint8_register* get_register_ptr(CPU* cpu, uint8_t reg) {
-    switch (reg) {
-        case 0:
-            return &cpu->B;
-        case 1:
-            return &cpu->C;
-        case 2:
-            return &cpu->D;
-        case 3:
-            return &cpu->E;
-        case 4:
-            return &cpu->H;
-        case 5:
-            return &cpu->L;
-        case 6:
-            return &cpu->M;
-        case 7:
-            return &cpu->A;
-    }
-}
-char* get_register_name(uint8_t reg) {
-    char* names[] = {"B", "C", "D", "E", "H", "L", "M", "A"};
-    return names[reg & 7];
-}
-uint8_t get_flag_S(CPU* cpu) { // Sign
-    // Set Sign to 1 if negative, otherwise 0
-    if ((cpu->A.value & 0x80) == 0x80)  return 0x80;
-    return 0;
-}
-uint8_t get_flag_Z(CPU* cpu) { // Zero
-    // Set Zero to 1 if equal to 0, otherwise 0
-    if (cpu->A.value == 0) return 0x40;
-    return 0;
-}
-uint8_t get_flag_P(CPU* cpu) { // Parity
-    int parity = 0;
-    int temp = cpu->A.value;
-    for (int i = 0; i <= 7; i++) {
-        parity += temp & 1;
-        temp >>= 1;
-    }
-
-    // Set Pairty to 1 if even number of bits, otherwise 0
-    if (parity % 2 == 0)  return 0x04;
-    return 0;
-}
-
-// Updating registers
-void update_uint16_registers(CPU* cpu) {
-    uint16_register reg16_bc = uint8_to_uint16_register(&cpu->B, &cpu->C);
-    uint16_register reg16_de = uint8_to_uint16_register(&cpu->D, &cpu->E);
-    uint16_register reg16_hl = uint8_to_uint16_register(&cpu->H, &cpu->L);
-
-    cpu->BC.value = reg16_bc.value;
-    cpu->DE.value = reg16_de.value;
-    cpu->HL.value = reg16_hl.value;
+    return read_memory(&cpu->memory, cpu->program_counter);
 }
-void update_uint8_registers(CPU* cpu) {
-    cpu->B.value = (uint8_t) (cpu->BC.value >> 8);
-    cpu->C.value = (uint8_t) (cpu->BC.value & 0x0F);
-
-    cpu->D.value = (uint8_t) (cpu->DE.value >> 8);
-    cpu->E.value = (uint8_t) (cpu->DE.value & 0x0F);
-
-    cpu->H.value = (uint8_t) (cpu->HL.value >> 8);
-    cpu->L.value = (uint8_t) (cpu->HL.value & 0x0F);
+const char* get_opcode_name(uint8_t opcode) {
+    if (opcode_names[opcode] == NULL) return "INVALID";
+    return opcode_names[opcode];
 }
-
 // Updating flags SZ0A0P1C
-void update_flag_S(CPU* cpu) {
+// These work the flags out eagerly, the cores use the lazy flags in flags.h and only check
+// against these when built with CHECK_FLAGS
+void update_flag_S(uint8_t* flags, uint8_t result) {
     // Set Sign to 1 if negative, otherwise 0
-    if ((cpu->A.value & 0x80) == 0x80)  cpu->flag.value |= 0x80;
-    cpu->flag.value &= ~0x80;
+    if ((result & 0x80) == 0x80) *flags |= 0x80;
+    else *flags &= ~0x80;
 }
-void update_flag_Z(CPU* cpu) {
+void update_flag_Z(uint8_t* flags, uint8_t result) {
     // Set Zero to 1 if equal to 0, otherwise 0
-    if (cpu->A.value == 0) cpu->flag.value |= 0x40;
-    cpu->flag.value &= ~0x40;
+    if (result == 0) *flags |= 0x40;
+    else *flags &= ~0x40;
 }
-void update_flag_P(CPU* cpu) {
+void update_flag_P(uint8_t* flags, uint8_t result) {
     int parity = 0;
-    int temp = cpu->A.value;
+    int temp = result;
     for (int i = 0; i <= 7; i++) {
         parity += temp & 1;
         temp >>= 1;
     }
 
     // Set Pairty to 1 if even number of bits, otherwise 0
-    if (parity % 2 == 0)  cpu->flag.value |= 0x04;
-    cpu->flag.value &= ~0x04;
+    if (parity % 2 == 0) *flags |= 0x04;
+    else *flags &= ~0x04;
 }
-void update_flags_add(CPU* cpu, uint8_t opcode, uint8_t reg_a_value, uint8_t added_value) {
-    uint8_t curr_flags = cpu->flag.value;
+void update_flags_add(uint8_t* flags, uint8_t reg_a_value, uint8_t added_value, uint8_t carry) {
     uint8_t a = reg_a_value;
     uint8_t b = added_value;
-    uint8_t c = 0;
-    if ((0x88 <= opcode && opcode <= 0x8F) || opcode == 0xCE) c = 1; // If the opcode is for ADC (0x88-0x8F) or ACI (0xCE) 
-    c *= cpu->flag.value & 1;
+    uint8_t c = carry; // Carry in, only non-zero for ADC and ACI
+    uint8_t result = a + b + c;
 
     // S.Z.P.A.C.
-    get_flag_S(cpu);
-    get_flag_Z(cpu);
-    get_flag_P(cpu);
+    update_flag_S(flags, result);
+    update_flag_Z(flags, result);
+    update_flag_P(flags, result);
 
     // Set CY to 1 if overflow, otherwise 0
-    if ((uint16_t)a + (uint16_t)b + c > 0xFF) curr_flags |= 0x01;
-    else curr_flags &= ~0x01;
+    if ((uint16_t)a + (uint16_t)b + c > 0xFF) *flags |= 0x01;
+    else *flags &= ~0x01;
 
     // Set AC to 1 if nibble overflow, otherwise 0
-    if ((a & 0x0F) + (b & 0x0F) + c > 0x0F) curr_flags |= 0x10;
-    else curr_flags &= ~ 0x10;
-
-    cpu->flag.value = curr_flags;
+    if ((a & 0x0F) + (b & 0x0F) + c > 0x0F) *flags |= 0x10;
+    else *flags &= ~0x10;
 }
-void update_flags_sub(CPU* cpu, uint8_t opcode, uint8_t reg_a_value, uint8_t added_value) {
-    uint8_t curr_flags = cpu->flag.value;
+void update_flags_sub(uint8_t* flags, uint8_t reg_a_value, uint8_t added_value, uint8_t carry) {
     uint8_t a = reg_a_value;
     uint8_t b = added_value;
-    uint8_t c = 0;
-    if ((0x98 <= opcode && opcode <= 0x9F) || opcode == 0xDE) c = 1;
-    c *= cpu->flag.value & 1;
+    uint8_t c = carry; // Borrow in, only non-zero for SBB and SBI
+    uint8_t result = a - b - c;
 
     // S.Z.P.A.C.
-    uint8_t s_flag = get_flag_S(cpu);
-    uint8_t z_flag = get_flag_Z(cpu);
-    uint8_t p_flag = get_flag_P(cpu);
-
-    curr_flags = curr_flags | s_flag | z_flag | p_flag;
+    update_flag_S(flags, result);
+    update_flag_Z(flags, result);
+    update_flag_P(flags, result);
 
     // Set CY to 1 if borrow, otherwise 0
-    if (a < b + c) curr_flags |= 0x01;
-    else curr_flags &= ~0x01;
-
-    // Set AC to 1 if nibble borrow, otherwise 0
-    if ((a & 0x0F) < ((b + c) & 0x0F)) curr_flags |= 0x10;
-    else curr_flags &= ~0x10;
-
-    cpu->flag.value = curr_flags;
-}
-
-// Opcode table
-void initialize_opcode_lookup() {
-    // Set all opcodes to be invalid
-    for (int i = 0; i < 256; i++) opcode_lookup[i] = (Instruction) {"INVALID", HLT, 0}; // Size = 0 for invalid opcodes
-
-    // Create all MOV opcodes
-    for (int i = 0x40; i <= 0x7F; i++) {
-        char* dest_name = get_register_name((i >> 3) & 7);
-        char* src_name = get_register_name(i & 7);
-        opcode_lookup[i] = (Instruction) {"", MOV, 1};
-        snprintf(opcode_lookup[i].name, sizeof(opcode_lookup[i].name), "MOV %s, %s", dest_name, src_name);
-    }
-
-    // Create all MVI opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = (i << 3) | 6;
-        opcode_lookup[opcode] = (Instruction) {"", MVI, 2};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "MVI %s", get_register_name(i));
-    }
-
-    // Create all ADD opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = 128 + i;
-        opcode_lookup[opcode] = (Instruction) {"", ADD, 1};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "ADD %s", get_register_name(i));
-    }
-
-    // Create all ADC opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = 136 + i;
-        opcode_lookup[opcode] = (Instruction) {"", ADC, 1};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "ADC %s", get_register_name(i));
-    }
-
-    // Create all SUB opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = 144 + i;
-        opcode_lookup[opcode] = (Instruction) {"", SUB, 1};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "SUB %s", get_register_name(i));
-    }
-
-    // Create all SBB opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = 152 + i;
-        opcode_lookup[opcode] = (Instruction) {"", SBB, 1};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "SBB %s", get_register_name(i));
-    }
-
-    // Create all INR and DCR opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t inr_opcode = 4 + (i << 3);
-        uint8_t dcr_opcode = 5 + (i << 3);
-        opcode_lookup[inr_opcode] = (Instruction) {"", INR, 1};
-        opcode_lookup[dcr_opcode] = (Instruction) {"", DCR, 1};
-        snprintf(opcode_lookup[inr_opcode].name, sizeof(opcode_lookup[inr_opcode].name), "INR %s", get_register_name(i));
-        snprintf(opcode_lookup[dcr_opcode].name, sizeof(opcode_lookup[dcr_opcode].name), "DCR %s", get_register_name(i));
-    }
-
-    // Create all ANA, ORA, XRA opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t ana_opcode = 160 + i;
-        uint8_t ora_opcode = 176 + i;
-        uint8_t xra_opcode = 1668 + i;
-        opcode_lookup[ana_opcode] = (Instruction) {"", ANA, 1};
-        opcode_lookup[ora_opcode] = (Instruction) {"", ORA, 1};
-        opcode_lookup[xra_opcode] = (Instruction) {"", XRA, 1};
-        snprintf(opcode_lookup[ana_opcode].name, sizeof(opcode_lookup[ana_opcode].name), "ANA %s", get_register_name(i));
-        snprintf(opcode_lookup[ora_opcode].name, sizeof(opcode_lookup[ora_opcode].name), "ORA %s", get_register_name(i));
-        snprintf(opcode_lookup[xra_opcode].name, sizeof(opcode_lookup[xra_opcode].name), "XRA %s", get_register_name(i));
-    }
-
-    // Create all CMP opcodes
-    for (int i = 0; i <= 7; i++) {
-        uint8_t opcode = 184 + i;
-        opcode_lookup[opcode] = (Instruction) {"", CMP, 1};
-        snprintf(opcode_lookup[opcode].name, sizeof(opcode_lookup[opcode].name), "CMP %s", get_register_name(i));
-    }
-
-    opcode_lookup[0x00] = (Instruction) {"NOP", NOP, 1};
-    opcode_lookup[0x76] = (Instruction) {"HLT", HLT, 1};
-    opcode_lookup[0xC6] = (Instruction) {"ADI", ADI, 2};
-    opcode_lookup[0xCE] = (Instruction) {"ACI", ACI, 2};
-    opcode_lookup[0xD3] = (Instruction) {"OUT", OUT, 2};
-    opcode_lookup[0xD6] = (Instruction) {"SUI", SUI, 2};
-    opcode_lookup[0xDE] = (Instruction) {"SBI", SBI, 2};
-    opcode_lookup[0xE6] = (Instruction) {"ANI", ANI, 2};
-    opcode_lookup[0xF6] = (Instruction) {"ORI", ORI, 2};
-    opcode_lookup[0xEE] = (Instruction) {"XRI", XRI, 2};
-    opcode_lookup[0xFE] = (Instruction) {"CPI", CPI, 2};
+    if (a < b + c) *flags |= 0x01;
+    else *flags &= ~0x01;
+
+    // The 8080 subtracts by adding the complement, so AC is set when the low nibble does NOT borrow
+    if ((a & 0x0F) >= (b & 0x0F) + c) *flags |= 0x10;
+    else *flags &= ~0x10;
+}
+void update_flags_logic(uint8_t* flags, uint8_t result, uint8_t aux_carry) {
+    update_flag_S(flags, result);
+    update_flag_Z(flags, result);
+    update_flag_P(flags, result);
+    *flags &= ~0x01; // CY = 0, always
+    if (aux_carry) *flags |= 0x10;
+    else *flags &= ~0x10;
+}
+void update_flags_inr(uint8_t* flags, uint8_t result) {
+    update_flag_S(flags, result);
+    update_flag_Z(flags, result);
+    update_flag_P(flags, result);
+    if ((result & 0x0F) == 0x00) *flags |= 0x10; // Carry out of the low nibble
+    else *flags &= ~0x10;
+}
+void update_flags_dcr(uint8_t* flags, uint8_t result) {
+    update_flag_S(flags, result);
+    update_flag_Z(flags, result);
+    update_flag_P(flags, result);
+    if ((result & 0x0F) != 0x0F) *flags |= 0x10; // No borrow out of the low nibble
+    else *flags &= ~0x10;
+}
+
+#if CHECK_FLAGS
+// Compares the lazy flags with the eager ones without settling them, false on a mismatch
+bool check_flags(CPU* cpu) {
+    uint8_t lazy = compute_flags(&cpu->lazy_flags, cpu->registers.r8[REG_F]);
+    if (lazy == cpu->eager_flags) return true;
+
+    printf("%sFlag mismatch after PC = 0x%04x: lazy 0x%02x, eager 0x%02x\n%s", RED, cpu->program_counter, lazy, cpu->eager_flags, RESET);
+    return false;
+}
+#endif
+
+// S, Z and P of every 8-bit result with the fixed bit set, built at compile time like the opcode
+// tables below so every CPU on every thread shares it
+#define PARITY(v) ((~((v) ^ (v) >> 1 ^ (v) >> 2 ^ (v) >> 3 ^ (v) >> 4 ^ (v) >> 5 ^ (v) >> 6 ^ (v) >> 7) & 1) << 2)
+#define SZP(v) (((v) & FLAG_S) | ((v) == 0 ? FLAG_Z : 0) | PARITY(v) | FLAGS_FIXED)
+#define SZP4(v) SZP(v), SZP((v) + 1), SZP((v) + 2), SZP((v) + 3)
+#define SZP16(v) SZP4(v), SZP4((v) + 4), SZP4((v) + 8), SZP4((v) + 12)
+#define SZP64(v) SZP16(v), SZP16((v) + 16), SZP16((v) + 32), SZP16((v) + 48)
+const uint8_t szp_flags[256] = {SZP64(0), SZP64(64), SZP64(128), SZP64(192)};
+#undef SZP64
+#undef SZP16
+#undef SZP4
+#undef SZP
+#undef PARITY
+
+// Cold, only read when tracing or reporting
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = name,
+const char* const opcode_names[256] = {
+#include "opcodes.def"
+};
+#undef OPCODE
+
+// Opcode table, built at compile time so every CPU on every thread can share it. Each opcodes.def
+// body names the handler that decodes its register fields at run time
+#define NOP_() NOP
+#define HLT_() HLT
+#define MOV_RR(d, s) MOV
+#define MVI_R(d) MVI
+#define INR_R(d) INR
+#define DCR_R(d) DCR
+#define ADD_R(s) ADD
+#define ADC_R(s) ADC
+#define SUB_R(s) SUB
+#define SBB_R(s) SBB
+#define ANA_R(s) ANA
+#define XRA_R(s) XRA
+#define ORA_R(s) ORA
+#define CMP_R(s) CMP
+#define ADI_I() ADI
+#define ACI_I() ACI
+#define SUI_I() SUI
+#define SBI_I() SBI
+#define ANI_I() ANI
+#define XRI_I() XRI
+#define ORI_I() ORI
+#define CPI_I() CPI
+#define LXI_P(p) LXI
+#define INX_P(p) INX
+#define DCX_P(p) DCX
+#define DAD_P(p) DAD
+#define LDAX_P(p) LDAX
+#define STAX_P(p) STAX
+#define LDA_A() LDA
+#define STA_A() STA
+#define LHLD_A() LHLD
+#define SHLD_A() SHLD
+#define XCHG_() XCHG
+#define XTHL_() XTHL
+#define SPHL_() SPHL
+#define PUSH_P(p) PUSH
+#define POP_P(p) POP
+#define RLC_() RLC
+#define RRC_() RRC
+#define RAL_() RAL
+#define RAR_() RAR
+#define DAA_() DAA
+#define CMA_() CMA
+#define STC_() STC
+#define CMC_() CMC
+#define JMP_A() JMP
+#define JCC_A(c) JCC
+#define CALL_A() CALL
+#define CCC_A(c) CCC
+#define RET_() RET
+#define RCC_(c) RCC
+#define RST_N(n) RST
+#define PCHL_() PCHL
+#define IN_P() IN
+#define OUT_P() OUT
+#define EI_() EI
+#define DI_() DI
+
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = {body, size, cycles},
+const Instruction opcode_lookup[256] = {
+#include "opcodes.def"
+};
+#undef OPCODE
+
+// Function pointer dispatch through opcode_lookup, returns true if it stopped on an invalid opcode
+// (with the PC still on it) and false on HLT or once the cycle budget runs out
+bool run_table(CPU* cpu, uint64_t* instruction_count) {
+    uint64_t count = 0;
+    while (cpu->running && cpu->cycles < cpu->cycle_limit) {
+        uint8_t opcode = fetch(cpu);
+        const Instruction* inst = &opcode_lookup[opcode];
+
+        if (inst->size == 0) { // Left at the PC for the caller to report
+            *instruction_count = count;
+            return true;
+        }
 
-    int count = 0;
-    for (int i = 0; i < 256; i++) { 
-        if (opcode_lookup[i].size != 0) {
-            count += 1;
-            // printf("\nOpcode %d: %s", i, opcode_lookup[i].name);
+        cpu->cycles += inst->cycles;
+        cpu->program_counter += inst->size;
+        inst->execute(cpu, opcode);
+        count++;
+#if CHECK_FLAGS
+        if (!check_flags(cpu)) {
+            *instruction_count = count;
+            return true;
         }
+#endif
     }
-    if (DEBUG) printf("\n%d/256 (%0.2f%%) opcodes implemented", count, count / 2.56);
-
-    // TODO: All size 0 instructions become NOP after we do all the counting, will need to also fix the error checking in main
+    *instruction_count = count;
+    return false;
+}
 
+// run_table moves the PC past every instruction before its handler runs, so operands are the
+// bytes just behind it and branches can simply set the PC
+static uint8_t immediate8(CPU* cpu) {
+    return read_memory(&cpu->memory, cpu->program_counter - 1);
+}
+static uint16_t immediate16(CPU* cpu) {
+    return read_memory16(&cpu->memory, cpu->program_counter - 2);
 }
 
 // Opcode function defenitions
 void NOP(CPU* cpu, uint8_t opcode) {
-    if (DEBUG) printf("%sNOP\t\t// No operation\n%s", DIM, RESET);
+    TRACE("%sNOP\t\t// No operation\n%s", DIM, RESET);
 }
 void HLT(CPU* cpu, uint8_t opcode) { 
     cpu->running = false;
-    if (DEBUG) printf("%s%sHLT%s%s\t\t// Stop the CPU\n%s", DIM, RED, RESET, DIM, RESET);
+    TRACE("%s%sHLT%s%s\t\t// Stop the CPU\n%s", DIM, RED, RESET, DIM, RESET);
 }
 
-// Data management (8-bit only)
+// Data management
 void MOV(CPU* cpu, uint8_t opcode) {
-    uint8_register* dest_ptr = get_register_ptr(cpu, (opcode >> 3) & 7);
-    uint8_register* src_ptr = get_register_ptr(cpu, opcode & 7);
-    dest_ptr->value = src_ptr->value;
-    if (DEBUG) printf("%sMOV %s%c, %c\t%s%s// Copy value %d from register %c to register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, dest_ptr->name, src_ptr->name, RESET, DIM, src_ptr->value,src_ptr->name, dest_ptr->name, RESET);
-    update_uint16_registers(cpu);
+    uint8_t dest = (opcode >> 3) & 7;
+    uint8_t src = opcode & 7;
+    uint8_t value = get_register(cpu, src);
+    set_register(cpu, dest, value);
+    TRACE("%sMOV %s%c, %c\t%s%s// Copy value %d from register %c to register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[dest], register_names[src], RESET, DIM, value, register_names[src], register_names[dest], RESET);
 }
 void MVI(CPU* cpu, uint8_t opcode) {
-    int reg_number = (opcode >> 3) & 7;
-
-    uint8_register* dest_ptr = get_register_ptr(cpu, reg_number);
-    int ival = cpu->memory[cpu->program_counter + 1];
-    dest_ptr->value = ival;
-    if (DEBUG) printf("%sMVI %s%c, %s%d\t%s%s// Copy immediate value %d to register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, dest_ptr->name, IMMEDIATE_COLOR, ival, RESET, DIM, ival, dest_ptr->name, RESET);
-
-    // TODO: Potentially update the register pair possibily affected by this move
-    // Now to update any potential register pairs that could of changed from this
-    // Only need to change if the register is B, C, D, E, H, or L. Which is most of them.
-    update_uint16_registers(cpu);
+    uint8_t dest = (opcode >> 3) & 7;
+    uint8_t ival = immediate8(cpu);
+    set_register(cpu, dest, ival);
+    TRACE("%sMVI %s%c, %s%d\t%s%s// Copy immediate value %d to register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[dest], IMMEDIATE_COLOR, ival, RESET, DIM, ival, register_names[dest], RESET);
+}
+void LXI(CPU* cpu, uint8_t opcode) { // Load register pair immediate
+    uint8_t rp = (opcode >> 4) & 3;
+    uint16_t ival = immediate16(cpu);
+    set_pair(cpu, rp, ival);
+    TRACE("%sLXI %s%s, %s0x%04x\t%s%s// Copy immediate value 0x%04x to register pair %s\n%s", OPCODE_COLOR, REGISTER_COLOR, rp == 3 ? "SP" : pair_names[rp], IMMEDIATE_COLOR, ival, RESET, DIM, ival, rp == 3 ? "SP" : pair_names[rp], RESET);
+}
+void LDA(CPU* cpu, uint8_t opcode) { // Load A from memory
+    uint16_t address = immediate16(cpu);
+    cpu->registers.r8[REG_A] = read_memory(&cpu->memory, address);
+    TRACE("%sLDA %s0x%04x\t%s%s// Load A from address 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+}
+void STA(CPU* cpu, uint8_t opcode) { // Store A to memory
+    uint16_t address = immediate16(cpu);
+    write_memory(&cpu->memory, address, cpu->registers.r8[REG_A]);
+    TRACE("%sSTA %s0x%04x\t%s%s// Store A to address 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+}
+void LHLD(CPU* cpu, uint8_t opcode) { // Load H:L from memory
+    uint16_t address = immediate16(cpu);
+    cpu->registers.r16[PAIR_HL] = read_memory16(&cpu->memory, address);
+    TRACE("%sLHLD %s0x%04x\t%s%s// Load HL from address 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+}
+void SHLD(CPU* cpu, uint8_t opcode) { // Store H:L to memory
+    uint16_t address = immediate16(cpu);
+    write_memory16(&cpu->memory, address, cpu->registers.r16[PAIR_HL]);
+    TRACE("%sSHLD %s0x%04x\t%s%s// Store HL to address 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+}
+void LDAX(CPU* cpu, uint8_t opcode) { // Load A indirect through BC or DE
+    uint8_t rp = (opcode >> 4) & 1;
+    cpu->registers.r8[REG_A] = read_memory(&cpu->memory, cpu->registers.r16[rp]);
+    TRACE("%sLDAX %s%s\t%s%s// Load A from the address in %s\n%s", OPCODE_COLOR, REGISTER_COLOR, pair_names[rp], RESET, DIM, pair_names[rp], RESET);
+}
+void STAX(CPU* cpu, uint8_t opcode) { // Store A indirect through BC or DE
+    uint8_t rp = (opcode >> 4) & 1;
+    write_memory(&cpu->memory, cpu->registers.r16[rp], cpu->registers.r8[REG_A]);
+    TRACE("%sSTAX %s%s\t%s%s// Store A to the address in %s\n%s", OPCODE_COLOR, REGISTER_COLOR, pair_names[rp], RESET, DIM, pair_names[rp], RESET);
+}
+void XCHG(CPU* cpu, uint8_t opcode) { // Exchange DE and HL
+    uint16_t hl = cpu->registers.r16[PAIR_HL];
+    cpu->registers.r16[PAIR_HL] = cpu->registers.r16[PAIR_DE];
+    cpu->registers.r16[PAIR_DE] = hl;
+    TRACE("%sXCHG\t\t%s%s// Exchange DE and HL\n%s", OPCODE_COLOR, RESET, DIM, RESET);
 }
 
 // Arithmetic and logic opcodes (8-bit only)
 void ADD(CPU* cpu, uint8_t opcode) { // Add register to A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    uint8_t a = cpu->A.value;
-    uint8_t b = reg->value;
-    cpu->A.value += reg->value;
-    if (DEBUG) printf("%sADD %s%c\t%s\t%s// Add value %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, DIM, reg->value, reg->name, RESET);
-    update_flags_add(cpu, opcode, a, reg->value);
-    update_uint16_registers(cpu);
+    uint8_t reg = opcode & 7;
+    uint8_t b = get_register(cpu, reg);
+    TRACE("%sADD %s%c\t%s\t%s// Add value %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, DIM, b, register_names[reg], RESET);
+    alu_add(cpu, b, 0);
 }
 void ADI(CPU* cpu, uint8_t opcode) { // Add immediate to A
-    uint8_t a = cpu->A.value;
-    uint8_t b = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value += b;
-    if (DEBUG) printf("%sADI %s%u\t%s\t%s// Add immediate value %u to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, DIM, b, RESET);
-    update_flags_add(cpu, opcode, a, b);
-    update_uint16_registers(cpu);
+    uint8_t b = immediate8(cpu);
+    TRACE("%sADI %s%u\t%s\t%s// Add immediate value %u to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, DIM, b, RESET);
+    alu_add(cpu, b, 0);
 } 
 void ADC(CPU* cpu, uint8_t opcode) { // Add register to A with carry
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    uint8_t a = cpu->A.value;
-    uint8_t b = reg->value;
-    uint8_t c = cpu->flag.value & 1;
-    cpu->A.value = a + b + c;
-    if (DEBUG) printf("%sADC %s%c\t%s\t%s// Add value %d and carry %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, DIM, reg->value, c, reg->name, RESET);
-    update_flags_add(cpu, opcode, a, reg->value);
-    update_uint16_registers(cpu);
+    uint8_t reg = opcode & 7;
+    uint8_t b = get_register(cpu, reg);
+    uint8_t c = get_flag_C(cpu);
+    TRACE("%sADC %s%c\t%s\t%s// Add value %d and carry %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, DIM, b, c, register_names[reg], RESET);
+    alu_add(cpu, b, c);
 } 
 void ACI(CPU* cpu, uint8_t opcode) { // Add immediate to A with carry
-    uint8_t a = cpu->A.value;
-    uint8_t b = cpu->memory[cpu->program_counter + 1];
-    uint8_t c = cpu->flag.value & 1;
-    cpu->A.value += b + c;
-    if (DEBUG) printf("%sACI %s%u\t%s\t%s// Add immediate value %u and carry %d to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, DIM, b, c, RESET);
-    update_flags_add(cpu, opcode, a, b);
-    update_uint16_registers(cpu);
+    uint8_t b = immediate8(cpu);
+    uint8_t c = get_flag_C(cpu);
+    TRACE("%sACI %s%u\t%s\t%s// Add immediate value %u and carry %d to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, DIM, b, c, RESET);
+    alu_add(cpu, b, c);
 }
 void SUB(CPU* cpu, uint8_t opcode) { // Subtract register from A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    uint8_t a = cpu->A.value;
-    uint8_t b = reg->value;
-    cpu->A.value -= reg->value;
-    if (DEBUG) printf("%sSUB %s%c\t\t%s%s// Subtract value %d from register %c from A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->value, reg->name, RESET);
-    update_flags_sub(cpu, opcode, a, reg->value);
-    update_uint16_registers(cpu);
+    uint8_t reg = opcode & 7;
+    uint8_t b = get_register(cpu, reg);
+    TRACE("%sSUB %s%c\t\t%s%s// Subtract value %d from register %c from A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, b, register_names[reg], RESET);
+    alu_sub(cpu, b, 0);
 } 
 void SUI(CPU* cpu, uint8_t opcode) { // Subtract immediate from A
-    uint8_t a = cpu->A.value;
-    uint8_t b = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value -= b;
-    if (DEBUG) printf("%sSUI %s%u\t\t%s%s// Subtract immediate value %u from A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, RESET);
-    update_flags_sub(cpu, opcode, a, b);
-    update_uint16_registers(cpu);
+    uint8_t b = immediate8(cpu);
+    TRACE("%sSUI %s%u\t\t%s%s// Subtract immediate value %u from A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, RESET);
+    alu_sub(cpu, b, 0);
 } 
 void SBB(CPU* cpu, uint8_t opcode) { // Subtract register from A with borrow
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    uint8_t a = cpu->A.value;
-    uint8_t b = reg->value;
-    uint8_t c = cpu->flag.value & 1;
-    cpu->A.value = a - b - c;
-    if (DEBUG) printf("%sSBB %s%c\t\t%s%s// Subtract value %d and borrow %d from register %c from A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->value, c, reg->name, RESET);
-    update_flags_sub(cpu, opcode, a, reg->value);
-    update_uint16_registers(cpu);
+    uint8_t reg = opcode & 7;
+    uint8_t b = get_register(cpu, reg);
+    uint8_t c = get_flag_C(cpu);
+    TRACE("%sSBB %s%c\t\t%s%s// Subtract value %d and borrow %d from register %c from A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, b, c, register_names[reg], RESET);
+    alu_sub(cpu, b, c);
 } 
 void SBI(CPU* cpu, uint8_t opcode) { // Subtract immediate from A with borrow
-    uint8_t a = cpu->A.value;
-    uint8_t b = cpu->memory[cpu->program_counter + 1];
-    uint8_t c = cpu->flag.value & 1;
-    cpu->A.value -= b - c;
-    if (DEBUG) printf("%sSBB %s%u\t\t%s%s// Subtract immediate value %u and borrow %u from A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, c, RESET);
-    update_flags_sub(cpu, opcode, a, b);
-    update_uint16_registers(cpu);
+    uint8_t b = immediate8(cpu);
+    uint8_t c = get_flag_C(cpu);
+    TRACE("%sSBI %s%u\t\t%s%s// Subtract immediate value %u and borrow %u from A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, c, RESET);
+    alu_sub(cpu, b, c);
 } 
 void INR(CPU* cpu, uint8_t opcode) { // Increment register
-    uint8_register* reg = get_register_ptr(cpu, (opcode >> 3) & 7);
-    reg->value++;
-    if (DEBUG) printf("%sINR %s%c\t%s\t%s// Increment register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, DIM, reg->name, RESET);
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    if (reg->value - 1 == 0x0F) { cpu->flag.value |= 0x10; } // carry = true
-    else { cpu->flag.value &= ~ 0x10; } // carry = false
-    update_uint16_registers(cpu);
+    uint8_t reg = (opcode >> 3) & 7;
+    TRACE("%sINR %s%c\t%s\t%s// Increment register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, DIM, register_names[reg], RESET);
+    set_register(cpu, reg, alu_inr(cpu, get_register(cpu, reg)));
 }
 void DCR(CPU* cpu, uint8_t opcode) { // Decrement register
-    uint8_register* reg = get_register_ptr(cpu, (opcode >> 3) & 7);
-    reg->value--;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    if (reg->value + 1 == 0x10) {cpu->flag.value |= 0x10; } // borrow = true
-    else {cpu->flag.value &= ~0x10; } // borrow = false
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sDCR %s%c\t%s\t%s// Decrement register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, DIM, reg->name, RESET);
+    uint8_t reg = (opcode >> 3) & 7;
+    set_register(cpu, reg, alu_dcr(cpu, get_register(cpu, reg)));
+    TRACE("%sDCR %s%c\t%s\t%s// Decrement register %c\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, DIM, register_names[reg], RESET);
 }
 void ANA(CPU* cpu, uint8_t opcode) { // AND register with A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    cpu->A.value = cpu->A.value & reg->value;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x01; // CY = 0, always
-    cpu->flag.value |= 0x10; // AC = 1 for ANA/ANI only
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sANA %s%c\t\t%s%s// Logical AND register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->name, RESET);
+    uint8_t reg = opcode & 7;
+    alu_and(cpu, get_register(cpu, reg));
+    TRACE("%sANA %s%c\t\t%s%s// Logical AND register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, register_names[reg], RESET);
 }
 void ANI(CPU* cpu, uint8_t opcode) { // AND immediate with A
-    uint8_t val = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value = cpu->A.value & val;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x01; // CY = 0, always
-    cpu->flag.value |= 0x10; // AC = 1 for ANA/ANI only
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sANI %s%u\t\t%s%s// Logical AND immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
+    uint8_t val = immediate8(cpu);
+    alu_and(cpu, val);
+    TRACE("%sANI %s%u\t\t%s%s// Logical AND immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
 }
 void ORA(CPU* cpu, uint8_t opcode) { // OR register with A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    cpu->A.value = cpu->A.value | reg->value;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x11; // CY = AC = 0
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sORA %s%c\t\t%s%s// Logical OR register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->name, RESET);
+    uint8_t reg = opcode & 7;
+    alu_or(cpu, get_register(cpu, reg));
+    TRACE("%sORA %s%c\t\t%s%s// Logical OR register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, register_names[reg], RESET);
 }
 void ORI(CPU* cpu, uint8_t opcode) { // OR immediate with A
-    uint8_t val = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value = cpu->A.value | val;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x11; // CY = AC = 0
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sORI %s%u\t\t%s%s// Logical OR immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
+    uint8_t val = immediate8(cpu);
+    alu_or(cpu, val);
+    TRACE("%sORI %s%u\t\t%s%s// Logical OR immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
 }
 void XRA(CPU* cpu, uint8_t opcode) { // Exclusive OR register with A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    cpu->A.value = cpu->A.value ^ reg->value;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x11; // CY = AC = 0
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sXRA %s%c\t\t%s%s// Logical OR register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->name, RESET);
+    uint8_t reg = opcode & 7;
+    alu_xor(cpu, get_register(cpu, reg));
+    TRACE("%sXRA %s%c\t\t%s%s// Logical XOR register %c with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, register_names[reg], RESET);
 }
 void XRI(CPU* cpu, uint8_t opcode) { // Exclusive OR immediate with A
-    uint8_t val = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value = cpu->A.value ^ val;
-    update_flag_S(cpu);
-    update_flag_Z(cpu);
-    update_flag_P(cpu);
-    cpu->flag.value &= ~0x11; // CY = AC = 0
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sXRI %s%u\t\t%s%s// Logical OR immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
+    uint8_t val = immediate8(cpu);
+    alu_xor(cpu, val);
+    TRACE("%sXRI %s%u\t\t%s%s// Logical XOR immediate %u with register A\n%s", OPCODE_COLOR, REGISTER_COLOR, val, RESET, COMMENT_COLOR, val, RESET);
 }
 void CMP(CPU* cpu, uint8_t opcode) { // Compare register with A
-    uint8_register* reg = get_register_ptr(cpu, opcode & 7);
-    uint8_t a = cpu->A.value;
-    uint8_t b = reg->value;
-    cpu->A.value -= reg->value;
-    update_flags_sub(cpu, opcode, a, reg->value);
-    cpu->A.value = a;
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sCMP %s%c\t\t%s%s// Compare value %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, reg->name, RESET, COMMENT_COLOR, reg->value, reg->name, RESET);
+    uint8_t reg = opcode & 7;
+    uint8_t b = get_register(cpu, reg);
+    alu_cmp(cpu, b);
+    TRACE("%sCMP %s%c\t\t%s%s// Compare value %d from register %c to A\n%s", OPCODE_COLOR, REGISTER_COLOR, register_names[reg], RESET, COMMENT_COLOR, b, register_names[reg], RESET);
 }
 void CPI(CPU* cpu, uint8_t opcode) { // Compare immediate with A
-    uint8_t a = cpu->A.value;
-    uint8_t b = cpu->memory[cpu->program_counter + 1];
-    cpu->A.value -= b;
-    update_flags_sub(cpu, opcode, a, b);
-    cpu->A.value = a;
-    update_uint16_registers(cpu);
-    if (DEBUG) printf("%sCPI %s%u\t\t%s%s// Compare immediate value %u to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, RESET);
+    uint8_t b = immediate8(cpu);
+    alu_cmp(cpu, b);
+    TRACE("%sCPI %s%u\t\t%s%s// Compare immediate value %u to A\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, b, RESET, COMMENT_COLOR, b, RESET);
+}
+void INX(CPU* cpu, uint8_t opcode) { // Increment register pair
+    uint8_t rp = (opcode >> 4) & 3;
+    set_pair(cpu, rp, get_pair(cpu, rp) + 1);
+    TRACE("%sINX %s%s\t%s\t%s// Increment register pair %s\n%s", OPCODE_COLOR, REGISTER_COLOR, rp == 3 ? "SP" : pair_names[rp], RESET, DIM, rp == 3 ? "SP" : pair_names[rp], RESET);
+}
+void DCX(CPU* cpu, uint8_t opcode) { // Decrement register pair
+    uint8_t rp = (opcode >> 4) & 3;
+    set_pair(cpu, rp, get_pair(cpu, rp) - 1);
+    TRACE("%sDCX %s%s\t%s\t%s// Decrement register pair %s\n%s", OPCODE_COLOR, REGISTER_COLOR, rp == 3 ? "SP" : pair_names[rp], RESET, DIM, rp == 3 ? "SP" : pair_names[rp], RESET);
+}
+void DAD(CPU* cpu, uint8_t opcode) { // Add register pair to HL
+    uint8_t rp = (opcode >> 4) & 3;
+    alu_dad(cpu, get_pair(cpu, rp));
+    TRACE("%sDAD %s%s\t%s\t%s// Add register pair %s to HL\n%s", OPCODE_COLOR, REGISTER_COLOR, rp == 3 ? "SP" : pair_names[rp], RESET, DIM, rp == 3 ? "SP" : pair_names[rp], RESET);
+}
+void DAA(CPU* cpu, uint8_t opcode) { // Decimal adjust A
+    alu_daa(cpu);
+    TRACE("%sDAA\t\t%s%s// Decimal adjust A\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void RLC(CPU* cpu, uint8_t opcode) { // Rotate A left
+    alu_rlc(cpu);
+    TRACE("%sRLC\t\t%s%s// Rotate A left\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void RRC(CPU* cpu, uint8_t opcode) { // Rotate A right
+    alu_rrc(cpu);
+    TRACE("%sRRC\t\t%s%s// Rotate A right\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void RAL(CPU* cpu, uint8_t opcode) { // Rotate A left through carry
+    alu_ral(cpu);
+    TRACE("%sRAL\t\t%s%s// Rotate A left through carry\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void RAR(CPU* cpu, uint8_t opcode) { // Rotate A right through carry
+    alu_rar(cpu);
+    TRACE("%sRAR\t\t%s%s// Rotate A right through carry\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void CMA(CPU* cpu, uint8_t opcode) { // Complement A
+    cpu->registers.r8[REG_A] = ~cpu->registers.r8[REG_A];
+    TRACE("%sCMA\t\t%s%s// Complement A\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void CMC(CPU* cpu, uint8_t opcode) { // Complement carry
+    set_flag_C(cpu, !get_flag_C(cpu));
+    TRACE("%sCMC\t\t%s%s// Complement carry\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void STC(CPU* cpu, uint8_t opcode) { // Set carry
+    set_flag_C(cpu, 1);
+    TRACE("%sSTC\t\t%s%s// Set carry\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+
+// Branches and stack
+void JMP(CPU* cpu, uint8_t opcode) { // Unconditional jump
+    uint16_t address = immediate16(cpu);
+    TRACE("%sJMP %s0x%04x\t%s%s// Jump to 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+    cpu->program_counter = address;
+}
+void JCC(CPU* cpu, uint8_t opcode) { // Conditional jump
+    uint8_t ccc = (opcode >> 3) & 7;
+    uint16_t address = immediate16(cpu);
+    bool taken = condition(cpu, ccc);
+    TRACE("%sJ%s %s0x%04x\t%s%s// Jump to 0x%04x if %s, %s\n%s", OPCODE_COLOR, condition_names[ccc], IMMEDIATE_COLOR, address, RESET, DIM, address, condition_names[ccc], taken ? "taken" : "not taken", RESET);
+    if (taken) cpu->program_counter = address;
+}
+void CALL(CPU* cpu, uint8_t opcode) { // Unconditional subroutine call
+    uint16_t address = immediate16(cpu);
+    TRACE("%sCALL %s0x%04x\t%s%s// Call 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, address, RESET, DIM, address, RESET);
+    push_word(cpu, cpu->program_counter);
+    cpu->program_counter = address;
+}
+void CCC(CPU* cpu, uint8_t opcode) { // Conditional subroutine call
+    uint8_t ccc = (opcode >> 3) & 7;
+    uint16_t address = immediate16(cpu);
+    bool taken = condition(cpu, ccc);
+    TRACE("%sC%s %s0x%04x\t%s%s// Call 0x%04x if %s, %s\n%s", OPCODE_COLOR, condition_names[ccc], IMMEDIATE_COLOR, address, RESET, DIM, address, condition_names[ccc], taken ? "taken" : "not taken", RESET);
+    if (taken) {
+        cpu->cycles += 6;
+        push_word(cpu, cpu->program_counter);
+        cpu->program_counter = address;
+    }
+}
+void RET(CPU* cpu, uint8_t opcode) { // Unconditional return
+    uint16_t address = pop_word(cpu);
+    TRACE("%sRET\t\t%s%s// Return to 0x%04x\n%s", OPCODE_COLOR, RESET, DIM, address, RESET);
+    cpu->program_counter = address;
+}
+void RCC(CPU* cpu, uint8_t opcode) { // Conditional return
+    uint8_t ccc = (opcode >> 3) & 7;
+    bool taken = condition(cpu, ccc);
+    TRACE("%sR%s\t\t%s%s// Return if %s, %s\n%s", OPCODE_COLOR, condition_names[ccc], RESET, DIM, condition_names[ccc], taken ? "taken" : "not taken", RESET);
+    if (taken) {
+        cpu->cycles += 6;
+        cpu->program_counter = pop_word(cpu);
+    }
+}
+void RST(CPU* cpu, uint8_t opcode) { // Restart, call n*8
+    uint8_t n = (opcode >> 3) & 7;
+    TRACE("%sRST %s%d\t%s\t%s// Call 0x%04x\n%s", OPCODE_COLOR, IMMEDIATE_COLOR, n, RESET, DIM, n * 8, RESET);
+    push_word(cpu, cpu->program_counter);
+    cpu->program_counter = n * 8;
+}
+void PCHL(CPU* cpu, uint8_t opcode) { // Jump to H:L
+    TRACE("%sPCHL\t\t%s%s// Jump to 0x%04x\n%s", OPCODE_COLOR, RESET, DIM, cpu->registers.r16[PAIR_HL], RESET);
+    cpu->program_counter = cpu->registers.r16[PAIR_HL];
+}
+void PUSH(CPU* cpu, uint8_t opcode) { // Push register pair, RP 3 is PSW
+    uint8_t rp = (opcode >> 4) & 3;
+    push_word(cpu, rp == 3 ? get_psw(cpu) : cpu->registers.r16[rp]);
+    TRACE("%sPUSH %s%s\t%s\t%s// Push register pair %s\n%s", OPCODE_COLOR, REGISTER_COLOR, pair_names[rp], RESET, DIM, pair_names[rp], RESET);
+}
+void POP(CPU* cpu, uint8_t opcode) { // Pop register pair, RP 3 is PSW
+    uint8_t rp = (opcode >> 4) & 3;
+    uint16_t value = pop_word(cpu);
+    if (rp == 3) set_psw(cpu, value);
+    else cpu->registers.r16[rp] = value;
+    TRACE("%sPOP %s%s\t%s\t%s// Pop register pair %s\n%s", OPCODE_COLOR, REGISTER_COLOR, pair_names[rp], RESET, DIM, pair_names[rp], RESET);
+}
+void XTHL(CPU* cpu, uint8_t opcode) { // Swap H:L with the top of the stack
+    uint16_t hl = cpu->registers.r16[PAIR_HL];
+    cpu->registers.r16[PAIR_HL] = read_memory16(&cpu->memory, cpu->stack_pointer);
+    write_memory16(&cpu->memory, cpu->stack_pointer, hl);
+    TRACE("%sXTHL\t\t%s%s// Swap HL with the top of the stack\n%s", OPCODE_COLOR, RESET, DIM, RESET);
+}
+void SPHL(CPU* cpu, uint8_t opcode) { // Set SP to H:L
+    cpu->stack_pointer = cpu->registers.r16[PAIR_HL];
+    TRACE("%sSPHL\t\t%s%s// Copy HL to SP\n%s", OPCODE_COLOR, RESET, DIM, RESET);
 }
 
 // Input and output
+void IN(CPU* cpu, uint8_t opcode) { // Read input port into A
+    uint8_t port_number = immediate8(cpu);
+    cpu->registers.r8[REG_A] = read_port(cpu, port_number);
+    TRACE("%sIN %d\t\t// Read port %d (0x%02x) into A\n%s", DIM, port_number, port_number, cpu->registers.r8[REG_A], RESET);
+}
 void OUT(CPU* cpu, uint8_t opcode) { // Write A to output port
-    uint8_t port_number = cpu->memory[cpu->program_counter + 1];
-    cpu->ports[port_number] = cpu->A.value;
-    if (DEBUG) printf("%sOUT %d\t\t// ", DIM, port_number);
-    if (port_number == 0) {
-        if (DEBUG) printf("Write register A (0x%02x) to output\n%s", cpu->A.value, RESET);
-        printf("OUTPUT: %u\n", cpu->A.value);
-    }
-    else if (port_number == 1) { // Print all main 8-bit registers
-        if (DEBUG) printf("Write all 8-bit registers to output\n%s", RESET);
-        print_8bit_registers(cpu);
-    }
-    else if (port_number == 2) { // Print all main 16-bit registers
-        if (DEBUG) printf("Write all 16-bit registers to output\n%s", RESET);
-        print_16bit_registers(cpu);
-    }
-
-    else if (port_number == 3) { // Print all other CPU information
-        if (DEBUG) printf("Write all SP, PC, flag, and state to output to output\n%s", RESET);
-        print_states_and_flags(cpu);
-        printf("\n");
-    }
-
-    if (DEBUG) printf("%s", RESET);
-} 
-
-
-#endif
\ No newline at end of file
+    uint8_t port_number = immediate8(cpu);
+    TRACE("%sOUT %d\t\t// ", DIM, port_number);
+    if (port_number == 0) TRACE("Write register A (0x%02x) to output\n%s", cpu->registers.r8[REG_A], RESET);
+    else if (port_number == 1) TRACE("Write all 8-bit registers to output\n%s", RESET);
+    else if (port_number == 2) TRACE("Write all 16-bit registers to output\n%s", RESET);
+    else if (port_number == 3) TRACE("Write all SP, PC, flag, and state to output to output\n%s", RESET);
+    write_port(cpu, port_number);
+    TRACE("%s", RESET);
+}
+uint8_t read_port(CPU* cpu, uint8_t port_number) { // Reads back whatever was last written there unless a device answers
+    Device* device = cpu->bus != NULL ? cpu->bus->ports[port_number] : NULL;
+    if (device != NULL && device->read != NULL) return device->read(device, cpu, port_number - device->first_port);
+    return cpu->ports[port_number];
+}
+void write_port(CPU* cpu, uint8_t port_number) {
+    cpu->ports[port_number] = cpu->registers.r8[REG_A];
+    Device* device = cpu->bus != NULL ? cpu->bus->ports[port_number] : NULL;
+    if (device != NULL && device->write != NULL) device->write(device, cpu, port_number - device->first_port, cpu->registers.r8[REG_A]);
+}
+void EI(CPU* cpu, uint8_t opcode) { // Enable interrupts
+    cpu->interrupts_enabled = true;
+    if (cpu->scheduler != NULL) cpu->cycle_limit = cpu->cycles; // Back to the scheduler, a waiting interrupt is taken after the next instruction
+    TRACE("%sEI\t\t// Enable interrupts\n%s", DIM, RESET);
+}
+void DI(CPU* cpu, uint8_t opcode) { // Disable interrupts
+    cpu->interrupts_enabled = false;
+    TRACE("%sDI\t\t// Disable interrupts\n%s", DIM, RESET);
+}
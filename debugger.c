@@ -0,0 +1,319 @@
+#include "debugger.h"
+#include "alu.h"
+
+// Breakpoints and watchpoints.
+//
+// Writes are caught on the memory path: pages holding a write watchpoint get PAGE_WATCH, which
+// sends writes to them through write_memory_slow and on to watched_write, the same way PAGE_HOOK
+// reaches the embedding API's write_hook. Writes to every other page cost the cores nothing more
+// than the page flag test they already make.
+//
+// Reads and execution are worked out from the opcode before the instruction runs, as tracefile.c
+// does for writes, so read_memory stays a plain load on every core. That needs every instruction
+// looked at, so while a read or execute watchpoint is set the CPU runs on run_debugged, a copy of
+// the table loop that only looks further at an instruction whose page, or the page of the data it
+// reads, holds one.
+//
+// A hit pauses the run by pulling cycle_limit down to the current count, so every core stops where
+// it already checks its budget: straight away on the table core and the stepping loop, at the next
+// branch on the threaded core and at the end of the block on the JIT. Reads and execution pause
+// before the instruction runs, writes once it has.
+
+// Data read by each opcode, from opcodes.def
+enum {
+    READ_NONE,
+    READ_HL,
+    READ_BC,
+    READ_DE,
+    READ_DIRECT, // LDA
+    READ_DIRECT16, // LHLD
+    READ_STACK, // Two bytes at SP
+    READ_STACK_TAKEN, // Two bytes at SP if the condition holds
+};
+
+#define WATCH_READS_A READ_NONE
+#define WATCH_READS_B READ_NONE
+#define WATCH_READS_C READ_NONE
+#define WATCH_READS_D READ_NONE
+#define WATCH_READS_E READ_NONE
+#define WATCH_READS_H READ_NONE
+#define WATCH_READS_L READ_NONE
+#define WATCH_READS_M READ_HL
+#define WATCH_LDAX_BC READ_BC
+#define WATCH_LDAX_DE READ_DE
+
+#define NOP_() READ_NONE
+#define HLT_() READ_NONE
+#define MOV_RR(d, s) WATCH_READS_##s
+#define MVI_R(d) READ_NONE
+#define INR_R(d) WATCH_READS_##d
+#define DCR_R(d) WATCH_READS_##d
+#define ADD_R(s) WATCH_READS_##s
+#define ADC_R(s) WATCH_READS_##s
+#define SUB_R(s) WATCH_READS_##s
+#define SBB_R(s) WATCH_READS_##s
+#define ANA_R(s) WATCH_READS_##s
+#define XRA_R(s) WATCH_READS_##s
+#define ORA_R(s) WATCH_READS_##s
+#define CMP_R(s) WATCH_READS_##s
+#define ADI_I() READ_NONE
+#define ACI_I() READ_NONE
+#define SUI_I() READ_NONE
+#define SBI_I() READ_NONE
+#define ANI_I() READ_NONE
+#define XRI_I() READ_NONE
+#define ORI_I() READ_NONE
+#define CPI_I() READ_NONE
+#define LXI_P(p) READ_NONE
+#define INX_P(p) READ_NONE
+#define DCX_P(p) READ_NONE
+#define DAD_P(p) READ_NONE
+#define LDAX_P(p) WATCH_LDAX_##p
+#define STAX_P(p) READ_NONE
+#define LDA_A() READ_DIRECT
+#define STA_A() READ_NONE
+#define LHLD_A() READ_DIRECT16
+#define SHLD_A() READ_NONE
+#define XCHG_() READ_NONE
+#define XTHL_() READ_STACK
+#define SPHL_() READ_NONE
+#define PUSH_P(p) READ_NONE
+#define POP_P(p) READ_STACK
+#define RLC_() READ_NONE
+#define RRC_() READ_NONE
+#define RAL_() READ_NONE
+#define RAR_() READ_NONE
+#define DAA_() READ_NONE
+#define CMA_() READ_NONE
+#define STC_() READ_NONE
+#define CMC_() READ_NONE
+#define JMP_A() READ_NONE
+#define JCC_A(c) READ_NONE
+#define CALL_A() READ_NONE
+#define CCC_A(c) READ_NONE
+#define RET_() READ_STACK
+#define RCC_(c) READ_STACK_TAKEN
+#define RST_N(n) READ_NONE
+#define PCHL_() READ_NONE
+#define IN_P() READ_NONE
+#define OUT_P() READ_NONE
+#define EI_() READ_NONE
+#define DI_() READ_NONE
+
+static const uint8_t watch_reads[256] = {
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = body,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+Debugger* create_debugger(void) {
+    return calloc(1, sizeof(Debugger));
+}
+
+void free_debugger(Debugger* debugger) {
+    free(debugger);
+}
+
+static bool in_watchpoint(const Watchpoint* watchpoint, uint16_t address) {
+    if (watchpoint->first <= watchpoint->last) return address >= watchpoint->first && address <= watchpoint->last;
+    return address >= watchpoint->first || address <= watchpoint->last;
+}
+
+bool add_watchpoint(Debugger* debugger, uint16_t first, uint16_t last, uint8_t kinds) {
+    if (debugger->watchpoint_count == MAX_WATCHPOINTS) return false;
+    debugger->watchpoints[debugger->watchpoint_count++] = (Watchpoint) {.first = first, .last = last, .kinds = kinds};
+    for (uint16_t page = first / MEMORY_PAGE_SIZE;; page = (page + 1) % MEMORY_PAGES) {
+        debugger->pages[page] |= kinds;
+        if (page == last / MEMORY_PAGE_SIZE) break;
+    }
+    if (kinds & (WATCH_READ | WATCH_EXECUTE)) debugger->stepping = true;
+    return true;
+}
+
+bool remove_watchpoint(Debugger* debugger, uint16_t first, uint16_t last, uint8_t kinds) {
+    int found = -1;
+    for (int i = 0; i < debugger->watchpoint_count && found < 0; i++) {
+        const Watchpoint* watchpoint = &debugger->watchpoints[i];
+        if (watchpoint->first == first && watchpoint->last == last && watchpoint->kinds == kinds) found = i;
+    }
+    if (found < 0) return false;
+
+    // Pages are worked out again from the ones left
+    Watchpoint left[MAX_WATCHPOINTS];
+    int count = debugger->watchpoint_count - 1;
+    memcpy(left, debugger->watchpoints, found * sizeof(Watchpoint));
+    memcpy(left + found, debugger->watchpoints + found + 1, (count - found) * sizeof(Watchpoint));
+    debugger->watchpoint_count = 0;
+    debugger->stepping = false;
+    memset(debugger->pages, 0, sizeof(debugger->pages));
+    for (int i = 0; i < count; i++) add_watchpoint(debugger, left[i].first, left[i].last, left[i].kinds);
+    return true;
+}
+
+bool parse_watchpoint(Debugger* debugger, const char* spec) {
+    uint8_t kinds = 0;
+    const char* text = spec;
+    for (; *text != ':' && *text != '\0'; text++) {
+        if (*text == 'r') kinds |= WATCH_READ;
+        else if (*text == 'w') kinds |= WATCH_WRITE;
+        else if (*text == 'x') kinds |= WATCH_EXECUTE;
+        else break;
+    }
+    char* end = NULL;
+    unsigned long first = 0, last = 0;
+    bool valid = kinds != 0 && *text == ':';
+    if (valid) {
+        first = last = strtoul(text + 1, &end, 0);
+        valid = end != text + 1;
+    }
+    if (valid && *end == '-') {
+        const char* from = end + 1;
+        last = strtoul(from, &end, 0);
+        valid = end != from;
+    }
+    if (!valid || *end != '\0' || first > 0xFFFF || last > 0xFFFF) {
+        printf("Bad watchpoint %s, expected r, w and x and an address or range, for example rw:0x2000-0x20ff\n", spec);
+        return false;
+    }
+    if (!add_watchpoint(debugger, (uint16_t) first, (uint16_t) last, kinds)) {
+        printf("At most %d watchpoints and breakpoints can be set\n", MAX_WATCHPOINTS);
+        return false;
+    }
+    return true;
+}
+
+// Records the hit and pauses unless the callback says not to. Only the first hit of a pause is
+// kept, a write can hit several watchpoints or a word access two bytes
+static void watch_hit(CPU* cpu, uint8_t kind, uint16_t address, uint8_t value, uint16_t program_counter) {
+    Debugger* debugger = cpu->debugger;
+    WatchHit hit = {.kind = kind, .value = value, .address = address, .program_counter = program_counter, .cycles = cpu->cycles};
+    debugger->hit_count++;
+    if (debugger->callback != NULL && !debugger->callback(cpu, &hit, debugger->context)) return;
+    if (debugger->paused) return;
+    debugger->hit = hit;
+    debugger->paused = true;
+    cpu->cycle_limit = cpu->cycles;
+}
+
+static void check_watchpoints(CPU* cpu, uint8_t kind, uint16_t address, uint8_t value, uint16_t program_counter) {
+    Debugger* debugger = cpu->debugger;
+    if (!(debugger->pages[address / MEMORY_PAGE_SIZE] & kind)) return;
+    for (int i = 0; i < debugger->watchpoint_count; i++) {
+        const Watchpoint* watchpoint = &debugger->watchpoints[i];
+        if ((watchpoint->kinds & kind) && in_watchpoint(watchpoint, address)) {
+            watch_hit(cpu, kind, address, value, program_counter);
+            return;
+        }
+    }
+}
+
+static void watched_write(void* context, uint16_t address, uint8_t value) {
+    CPU* cpu = context;
+    if (cpu->debugger == NULL) return;
+    check_watchpoints(cpu, WATCH_WRITE, address, value, cpu->debugger->in_step ? cpu->debugger->instruction : cpu->program_counter);
+}
+
+void attach_debugger(CPU* cpu, Debugger* debugger) {
+    Memory* memory = &cpu->memory;
+    cpu->debugger = debugger;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (debugger != NULL && (debugger->pages[page] & WATCH_WRITE)) memory->page_flags[page] |= PAGE_WATCH;
+        else memory->page_flags[page] &= ~PAGE_WATCH;
+    }
+    memory->watch_hook = watched_write;
+    memory->watch_context = cpu;
+}
+
+void pause_debugger(CPU* cpu) {
+    Debugger* debugger = cpu->debugger;
+    if (debugger == NULL || debugger->paused) return;
+    debugger->hit = (WatchHit) {.program_counter = cpu->program_counter, .cycles = cpu->cycles};
+    debugger->paused = true;
+    cpu->cycle_limit = cpu->cycles;
+}
+
+void resume_debugger(CPU* cpu) {
+    Debugger* debugger = cpu->debugger;
+    if (debugger == NULL || !debugger->paused) return;
+    debugger->paused = false;
+    debugger->resuming = debugger->hit.kind != WATCH_WRITE;
+}
+
+// Reads of the instruction at address, before it runs
+static void check_reads(CPU* cpu, uint8_t opcode, uint16_t address) {
+    uint16_t target;
+    int size = 1;
+    switch (watch_reads[opcode]) {
+        case READ_HL: target = cpu->registers.r16[PAIR_HL]; break;
+        case READ_BC: target = cpu->registers.r16[PAIR_BC]; break;
+        case READ_DE: target = cpu->registers.r16[PAIR_DE]; break;
+        case READ_DIRECT: target = read_memory16(&cpu->memory, address + 1); break;
+        case READ_DIRECT16: target = read_memory16(&cpu->memory, address + 1); size = 2; break;
+        case READ_STACK: case READ_STACK_TAKEN: target = cpu->stack_pointer; size = 2; break;
+        default: return;
+    }
+    uint16_t end = target + size - 1;
+    if (!((cpu->debugger->pages[target / MEMORY_PAGE_SIZE] | cpu->debugger->pages[end / MEMORY_PAGE_SIZE]) & WATCH_READ)) return;
+    if (watch_reads[opcode] == READ_STACK_TAKEN && !condition(cpu, (opcode >> 3) & 7)) return; // Settles the flags, so only on a watched page
+    for (int i = 0; i < size; i++) {
+        uint16_t byte = target + i;
+        check_watchpoints(cpu, WATCH_READ, byte, read_memory(&cpu->memory, byte), address);
+    }
+}
+
+// run_table, looking for read and execute watchpoints before every instruction
+static bool run_debugged(CPU* cpu, uint64_t* instruction_count) {
+    Debugger* debugger = cpu->debugger;
+    uint64_t count = 0;
+    bool error_stop = false;
+    debugger->in_step = true;
+    while (cpu->running && cpu->cycles < cpu->cycle_limit) {
+        uint16_t address = cpu->program_counter;
+        uint8_t opcode = read_memory(&cpu->memory, address);
+        const Instruction* inst = &opcode_lookup[opcode];
+
+        if (inst->size == 0) { // Left at the PC for the caller to report, as in run_table
+            error_stop = true;
+            break;
+        }
+
+        if (debugger->resuming && address == debugger->hit.program_counter) debugger->resuming = false; // Paused right here, let it run
+        else {
+            debugger->resuming = false;
+            check_watchpoints(cpu, WATCH_EXECUTE, address, opcode, address);
+            if (watch_reads[opcode] != READ_NONE) check_reads(cpu, opcode, address);
+            if (debugger->paused) break;
+        }
+
+        debugger->instruction = address;
+        cpu->cycles += inst->cycles;
+        cpu->program_counter += inst->size;
+        inst->execute(cpu, opcode);
+        count++;
+#if CHECK_FLAGS
+        if (!check_flags(cpu)) {
+            error_stop = true;
+            break;
+        }
+#endif
+    }
+    debugger->in_step = false;
+    *instruction_count = count;
+    return error_stop;
+}
+
+bool run_watched(CPU* cpu, Core core, uint64_t* instruction_count) {
+    Debugger* debugger = cpu->debugger;
+    if (debugger->paused) {
+        *instruction_count = 0;
+        return false;
+    }
+    uint64_t limit = cpu->cycle_limit;
+    bool error_stop;
+    if (debugger->stepping) error_stop = run_debugged(cpu, instruction_count);
+    else if (core == CORE_THREADED) error_stop = run_threaded(cpu, instruction_count);
+    else if (core == CORE_JIT) error_stop = run_jit(cpu, instruction_count);
+    else error_stop = run_table(cpu, instruction_count);
+    if (debugger->paused) cpu->cycle_limit = limit; // Pulled down to stop the core where it paused
+    return error_stop;
+}
@@ -0,0 +1,65 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include "cpu.h"
+
+// Breakpoints and watchpoints on guest address ranges. Pages holding a write watchpoint get
+// PAGE_WATCH, so writes to every other page stay on the fast path and a CPU with only write
+// watchpoints runs on whichever core it was given. Read and execute watchpoints (a breakpoint is an
+// execute watchpoint on one address) are only looked for on a stepping copy of the table loop,
+// which run_core switches to while any is set, and only in instructions that touch a page holding
+// one. A hit calls the callback and pauses the run, see debugger.c
+
+#define MAX_WATCHPOINTS 32
+
+#define WATCH_READ 0x01 // Data the instruction reads, not its own bytes
+#define WATCH_WRITE 0x02
+#define WATCH_EXECUTE 0x04 // An instruction starting in the range
+
+typedef struct Watchpoint {
+    uint16_t first, last; // Inclusive, last below first wraps past 0xFFFF
+    uint8_t kinds; // WATCH_ bits
+} Watchpoint;
+
+typedef struct WatchHit {
+    uint8_t kind; // One WATCH_ bit, 0 when paused by pause_debugger
+    uint8_t value; // Byte read or written, the opcode for WATCH_EXECUTE
+    uint16_t address; // Byte accessed, where the instruction starts for WATCH_EXECUTE
+    uint16_t program_counter; // The instruction that hit it, for writes outside the stepping loop wherever the core had got to
+    uint64_t cycles; // Before the instruction for reads and execution, the core's count at the write for writes
+} WatchHit;
+
+// Called on every hit, true pauses the run there
+typedef bool (*WatchCallback)(CPU* cpu, const WatchHit* hit, void* context);
+
+typedef struct Debugger {
+    Watchpoint watchpoints[MAX_WATCHPOINTS];
+    int watchpoint_count;
+    uint8_t pages[MEMORY_PAGES]; // WATCH_ bits of every watchpoint on the page
+    bool stepping; // A read or execute watchpoint is set, so run_core steps
+    WatchCallback callback; // NULL pauses on every hit
+    void* context;
+
+    bool paused; // The run stopped on hit and goes no further until resume_debugger
+    WatchHit hit;
+    uint64_t hit_count;
+    bool resuming; // Reads and execution pause before the instruction, it runs unchecked once resumed
+    bool in_step; // Inside the stepping loop, where instruction is exact
+    uint16_t instruction; // Address of the instruction the stepping loop is running
+} Debugger;
+
+Debugger* create_debugger(void); // No watchpoints, pauses on every hit
+void free_debugger(Debugger* debugger);
+bool add_watchpoint(Debugger* debugger, uint16_t first, uint16_t last, uint8_t kinds); // False if MAX_WATCHPOINTS are set
+bool remove_watchpoint(Debugger* debugger, uint16_t first, uint16_t last, uint8_t kinds); // The one set with exactly these, false if there is none
+bool parse_watchpoint(Debugger* debugger, const char* spec); // "rwx:FIRST[-LAST]", false after saying why if it is not one
+void attach_debugger(CPU* cpu, Debugger* debugger); // Again after adding watchpoints or loading new memory, NULL detaches
+void pause_debugger(CPU* cpu); // From outside the run, an event handler for example; the cores stop at their next budget check
+void resume_debugger(CPU* cpu);
+bool run_watched(CPU* cpu, Core core, uint64_t* instruction_count); // Same contract as run_table, run_core calls it when cpu->debugger is set
+
+static inline bool run_paused(const CPU* cpu) {
+    return cpu->debugger != NULL && cpu->debugger->paused;
+}
+
+#endif
@@ -0,0 +1,433 @@
+#include "devices.h"
+#include "scheduler.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// Devices, by the port offset each one answers on:
+//
+// console  OUT 0 prints "OUTPUT: n", OUT 1, 2 and 3 print the 8-bit registers, the 16-bit
+//          registers and the rest of the CPU state. Output is gathered in a CONSOLE_BUFFER_SIZE
+//          buffer and written to stdout in one go when it fills or the bus is flushed, trace
+//          builds flush it after every OUT to keep it in order with the traces.
+// timer    IN 0 reads the low byte of the cycles since the timer was last reset divided by the
+//          divisor and latches the high byte for IN 1. OUT 0 resets it. OUT 1 sets how many
+//          counts apart it interrupts, 0 (the default) for never, and OUT 2 the RST vector it
+//          interrupts with, 7 by default. It counts guest cycles, so it reads and interrupts the
+//          same on every run and every core.
+// disk     A file of DISK_SECTOR_SIZE byte sectors. OUT 0 and OUT 1 set the low and high byte of
+//          the sector number, IN 2 and OUT 2 read and write the next byte of it and move on to
+//          the next sector at the end, IN 3 reads 1 if a read or write failed since the last
+//          IN 3 and 0 otherwise. The current sector is held in memory and only written back
+//          when another one is picked or the bus is flushed.
+// input    A thread reads a file, or stdin, ahead into a queue. IN 0 takes the next byte, 0 if
+//          none is waiting, IN 1 reads bit 0 set if a byte is waiting and bit 1 once the input
+//          has ended and every byte was taken.
+// ring     Two queues in a file mapped shared (put it on /dev/shm for plain shared memory), for
+//          talking to another process that maps the same file, see SharedRing. OUT 0 queues a
+//          byte for the other side and drops it if the queue is full, IN 0 takes the next byte
+//          the other side queued, 0 if none, IN 1 reads bit 0 set if a byte is waiting and
+//          bit 1 if the outgoing queue is full.
+
+static void close_device(Device* device) {
+    if (device->flush != NULL) device->flush(device);
+    free(device);
+}
+
+// Queue halves, the producer side never blocks the consumer or the other way around
+static bool queue_push(ByteQueue* queue, uint8_t* bytes, uint32_t size, uint8_t value) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == size) return false;
+    bytes[tail & (size - 1)] = value;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+static bool queue_pop(ByteQueue* queue, const uint8_t* bytes, uint32_t size, uint8_t* value) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) return false;
+    *value = bytes[head & (size - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+static bool queue_empty(ByteQueue* queue) {
+    return atomic_load_explicit(&queue->head, memory_order_relaxed) == atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
+
+// Console
+typedef struct Console {
+    Device device;
+    size_t used;
+    char buffer[CONSOLE_BUFFER_SIZE];
+} Console;
+
+static void flush_console(Device* device) {
+    Console* console = (Console*) device;
+    if (console->used > 0) fwrite(console->buffer, 1, console->used, stdout);
+    console->used = 0;
+}
+static void write_console(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    Console* console = (Console*) device;
+    if (offset == 0) {
+        if (console->used + sizeof("OUTPUT: 255\n") > CONSOLE_BUFFER_SIZE) flush_console(device);
+        char* out = console->buffer + console->used;
+        memcpy(out, "OUTPUT: ", 8);
+        out += 8;
+        if (value >= 100) *out++ = '0' + value / 100;
+        if (value >= 10) *out++ = '0' + value / 10 % 10;
+        *out++ = '0' + value % 10;
+        *out++ = '\n';
+        console->used = out - console->buffer;
+    }
+    else { // The register dumps are rare, they print straight after whatever is buffered
+        flush_console(device);
+        if (offset == 1) print_8bit_registers(cpu); // Print all main 8-bit registers
+        else if (offset == 2) print_16bit_registers(cpu); // Print all main 16-bit registers
+        else { // Print all other CPU information
+            print_states_and_flags(cpu);
+            printf("\n");
+        }
+    }
+#if DEBUG
+    flush_console(device);
+#endif
+}
+
+Device* create_console(void) {
+    Console* console = calloc(1, sizeof(Console));
+    if (console == NULL) return NULL;
+    console->device = (Device) {.name = "console", .port_count = 4, .write = write_console, .flush = flush_console, .close = close_device};
+    return &console->device;
+}
+
+// Timer
+typedef struct Timer {
+    Device device;
+    uint32_t divisor;
+    uint64_t start; // Cycle count it was last reset at
+    uint8_t high; // Latched by the last read of the low byte
+    uint8_t period; // Counts between interrupts, 0 for none
+    uint8_t vector;
+    uint64_t deadline; // Cycle count of the next interrupt
+} Timer;
+
+// Ticks are scheduled off the last deadline rather than the cycle count they fired at, so they
+// stay exactly period counts apart however late the core stopped for them
+static void tick_timer(CPU* cpu, void* context) {
+    Timer* timer = context;
+    request_interrupt(cpu, timer->vector);
+    timer->deadline += (uint64_t) timer->period * timer->divisor;
+    schedule_event(cpu, timer->deadline, tick_timer, timer);
+}
+
+static uint8_t read_timer(Device* device, CPU* cpu, uint8_t offset) {
+    Timer* timer = (Timer*) device;
+    if (offset == 1) return timer->high;
+    if (offset == 2) return cpu->ports[device->first_port + offset];
+    uint64_t count = (cpu->cycles - timer->start) / timer->divisor;
+    timer->high = count >> 8;
+    return count & 0xFF;
+}
+static void write_timer(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    Timer* timer = (Timer*) device;
+    if (offset == 0) timer->start = cpu->cycles;
+    else if (offset == 1) {
+        timer->period = value;
+        cancel_events(cpu, timer);
+        timer->deadline = cpu->cycles + (uint64_t) value * timer->divisor;
+        if (value > 0) schedule_event(cpu, timer->deadline, tick_timer, timer);
+    }
+    else timer->vector = value & 7;
+}
+
+Device* create_timer(uint32_t divisor) {
+    Timer* timer = calloc(1, sizeof(Timer));
+    if (timer == NULL) return NULL;
+    timer->device = (Device) {.name = "timer", .port_count = 3, .read = read_timer, .write = write_timer, .close = close_device};
+    timer->divisor = divisor > 0 ? divisor : 1;
+    timer->vector = 7;
+    return &timer->device;
+}
+
+// Disk
+typedef struct Disk {
+    Device device;
+    FILE* file;
+    uint16_t sector;
+    uint8_t position; // Next byte of the sector IN 2 or OUT 2 uses
+    bool dirty; // data holds writes the file does not have yet
+    bool failed;
+    uint8_t data[DISK_SECTOR_SIZE];
+} Disk;
+
+static void store_sector(Disk* disk) {
+    if (!disk->dirty) return;
+    disk->dirty = false;
+    if (fseek(disk->file, (long) disk->sector * DISK_SECTOR_SIZE, SEEK_SET) != 0 || fwrite(disk->data, DISK_SECTOR_SIZE, 1, disk->file) != 1) disk->failed = true;
+}
+static void load_sector(Disk* disk, uint16_t sector) {
+    store_sector(disk);
+    disk->sector = sector;
+    disk->position = 0;
+    size_t read = 0;
+    if (fseek(disk->file, (long) sector * DISK_SECTOR_SIZE, SEEK_SET) == 0) read = fread(disk->data, 1, DISK_SECTOR_SIZE, disk->file);
+    memset(disk->data + read, 0, DISK_SECTOR_SIZE - read); // Past the end of the file reads as zeros
+    clearerr(disk->file);
+}
+static void next_disk_byte(Disk* disk) {
+    if (++disk->position == DISK_SECTOR_SIZE) load_sector(disk, disk->sector + 1);
+}
+
+static uint8_t read_disk(Device* device, CPU* cpu, uint8_t offset) {
+    Disk* disk = (Disk*) device;
+    if (offset == 2) {
+        uint8_t value = disk->data[disk->position];
+        next_disk_byte(disk);
+        return value;
+    }
+    if (offset == 3) {
+        bool failed = disk->failed;
+        disk->failed = false;
+        return failed;
+    }
+    return cpu->ports[device->first_port + offset];
+}
+static void write_disk(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    Disk* disk = (Disk*) device;
+    if (offset == 0) load_sector(disk, (disk->sector & 0xFF00) | value);
+    else if (offset == 1) load_sector(disk, (disk->sector & 0x00FF) | (value << 8));
+    else if (offset == 2) {
+        disk->data[disk->position] = value;
+        disk->dirty = true;
+        next_disk_byte(disk);
+    }
+}
+static void flush_disk(Device* device) {
+    Disk* disk = (Disk*) device;
+    store_sector(disk);
+    fflush(disk->file);
+}
+static void close_disk(Device* device) {
+    flush_disk(device);
+    fclose(((Disk*) device)->file);
+    free(device);
+}
+
+Device* create_disk(const char* filename) {
+    Disk* disk = calloc(1, sizeof(Disk));
+    if (disk == NULL) return NULL;
+    disk->file = fopen(filename, "r+b");
+    if (disk->file == NULL) disk->file = fopen(filename, "w+b");
+    if (disk->file == NULL) {
+        printf("Could not open disk image %s\n", filename);
+        free(disk);
+        return NULL;
+    }
+    disk->device = (Device) {.name = "disk", .port_count = 4, .read = read_disk, .write = write_disk, .flush = flush_disk, .close = close_disk};
+    load_sector(disk, 0);
+    return &disk->device;
+}
+
+// Input
+typedef struct Input {
+    Device device;
+    FILE* file;
+    pthread_t thread;
+    ByteQueue queue;
+    _Atomic bool ended; // The reader hit the end of the file, set after its last byte was queued
+    uint8_t bytes[INPUT_QUEUE_SIZE];
+} Input;
+
+static void* input_main(void* argument) {
+    Input* input = argument;
+    int c;
+    while ((c = fgetc(input->file)) != EOF) {
+        while (!queue_push(&input->queue, input->bytes, INPUT_QUEUE_SIZE, c)) {
+            struct timespec wait = {0, 1000000}; // The guest is behind, give it a millisecond
+            nanosleep(&wait, NULL);
+        }
+    }
+    atomic_store_explicit(&input->ended, true, memory_order_release);
+    return NULL;
+}
+
+static uint8_t read_input(Device* device, CPU* cpu, uint8_t offset) {
+    Input* input = (Input*) device;
+    if (offset == 1) {
+        bool ended = atomic_load_explicit(&input->ended, memory_order_acquire);
+        bool empty = queue_empty(&input->queue);
+        return (empty ? 0 : 0x01) | (ended && empty ? 0x02 : 0);
+    }
+    uint8_t value = 0;
+    queue_pop(&input->queue, input->bytes, INPUT_QUEUE_SIZE, &value);
+    return value;
+}
+static void close_input(Device* device) {
+    Input* input = (Input*) device;
+    if (!atomic_load_explicit(&input->ended, memory_order_acquire)) pthread_cancel(input->thread); // Most likely waiting on a read
+    pthread_join(input->thread, NULL);
+    if (input->file != stdin) fclose(input->file);
+    free(input);
+}
+
+Device* create_input(const char* filename) {
+    Input* input = calloc(1, sizeof(Input));
+    if (input == NULL) return NULL;
+    input->file = filename != NULL ? fopen(filename, "rb") : stdin;
+    if (input->file == NULL) {
+        printf("Could not open input %s\n", filename);
+        free(input);
+        return NULL;
+    }
+    input->device = (Device) {.name = "input", .port_count = 2, .read = read_input, .close = close_input};
+    if (pthread_create(&input->thread, NULL, input_main, input) != 0) {
+        printf("Could not start the input reader\n");
+        if (input->file != stdin) fclose(input->file);
+        free(input);
+        return NULL;
+    }
+    return &input->device;
+}
+
+// Ring
+#define RING_MAGIC "I80RING"
+enum { RING_OUT, RING_IN }; // Guest to host and host to guest
+
+// Layout of the shared file. Whichever side opens it first sets it up, the other side only has to
+// check the magic and size, then push to queues[RING_IN] and take from queues[RING_OUT]
+typedef struct SharedRing {
+    char magic[8];
+    uint32_t size; // RING_QUEUE_SIZE
+    ByteQueue queues[2];
+    uint8_t bytes[2][RING_QUEUE_SIZE];
+} SharedRing;
+
+typedef struct Ring {
+    Device device;
+    SharedRing* shared;
+} Ring;
+
+static uint8_t read_ring(Device* device, CPU* cpu, uint8_t offset) {
+    SharedRing* shared = ((Ring*) device)->shared;
+    if (offset == 1) {
+        ByteQueue* out = &shared->queues[RING_OUT];
+        bool full = atomic_load_explicit(&out->tail, memory_order_relaxed) - atomic_load_explicit(&out->head, memory_order_acquire) == RING_QUEUE_SIZE;
+        return (queue_empty(&shared->queues[RING_IN]) ? 0 : 0x01) | (full ? 0x02 : 0);
+    }
+    uint8_t value = 0;
+    queue_pop(&shared->queues[RING_IN], shared->bytes[RING_IN], RING_QUEUE_SIZE, &value);
+    return value;
+}
+static void write_ring(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    SharedRing* shared = ((Ring*) device)->shared;
+    queue_push(&shared->queues[RING_OUT], shared->bytes[RING_OUT], RING_QUEUE_SIZE, value);
+}
+
+#ifdef _WIN32
+Device* create_ring(const char* filename) {
+    printf("Shared memory rings need mmap, which this build does not have\n");
+    return NULL;
+}
+#else
+static void close_ring(Device* device) {
+    munmap(((Ring*) device)->shared, sizeof(SharedRing));
+    free(device);
+}
+
+Device* create_ring(const char* filename) {
+    Ring* ring = calloc(1, sizeof(Ring));
+    if (ring == NULL) return NULL;
+    int fd = open(filename, O_RDWR | O_CREAT, 0600);
+    bool mapped = fd >= 0 && ftruncate(fd, sizeof(SharedRing)) == 0;
+    if (mapped) {
+        ring->shared = mmap(NULL, sizeof(SharedRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        mapped = ring->shared != MAP_FAILED;
+    }
+    if (fd >= 0) close(fd);
+    if (!mapped) {
+        printf("Could not map ring %s\n", filename);
+        free(ring);
+        return NULL;
+    }
+    if (memcmp(ring->shared->magic, RING_MAGIC, sizeof(ring->shared->magic)) != 0) {
+        ring->shared->size = RING_QUEUE_SIZE;
+        memcpy(ring->shared->magic, RING_MAGIC, sizeof(ring->shared->magic));
+    }
+    else if (ring->shared->size != RING_QUEUE_SIZE) {
+        printf("Ring %s was set up with %u byte queues, this build uses %d\n", filename, ring->shared->size, RING_QUEUE_SIZE);
+        munmap(ring->shared, sizeof(SharedRing));
+        free(ring);
+        return NULL;
+    }
+    ring->device = (Device) {.name = "ring", .port_count = 2, .read = read_ring, .write = write_ring, .close = close_ring};
+    return &ring->device;
+}
+#endif
+
+// Bus
+DeviceBus* create_bus(void) {
+    return calloc(1, sizeof(DeviceBus));
+}
+
+bool attach_device(DeviceBus* bus, Device* device, uint8_t first_port) {
+    bool fits = bus->device_count < MAX_DEVICES && first_port + device->port_count <= MAX_PORTS;
+    for (int port = first_port; fits && port < first_port + device->port_count; port++) {
+        if (bus->ports[port] != NULL) {
+            printf("The %s on port %d would overlap the %s on port %d\n", device->name, first_port, bus->ports[port]->name, bus->ports[port]->first_port);
+            fits = false;
+        }
+    }
+    if (!fits) {
+        if (bus->device_count == MAX_DEVICES) printf("No room for the %s, a bus holds at most %d devices\n", device->name, MAX_DEVICES);
+        else if (first_port + device->port_count > MAX_PORTS) printf("The %s needs %d ports and does not fit at port %d\n", device->name, device->port_count, first_port);
+        device->close(device);
+        return false;
+    }
+    device->first_port = first_port;
+    for (int port = first_port; port < first_port + device->port_count; port++) bus->ports[port] = device;
+    bus->devices[bus->device_count++] = device;
+    return true;
+}
+
+bool attach_device_spec(DeviceBus* bus, const char* spec) {
+    const char* at = strchr(spec, '@');
+    char name[16];
+    if (at == NULL || at - spec >= (long) sizeof(name)) goto bad;
+    memcpy(name, spec, at - spec);
+    name[at - spec] = '\0';
+
+    char* end;
+    unsigned long port = strtoul(at + 1, &end, 0);
+    if (end == at + 1 || port >= MAX_PORTS) goto bad;
+    bool has_argument = *end == ',';
+    unsigned long argument = has_argument ? strtoul(end + 1, &end, 0) : 0;
+    const char* filename = *end == '=' ? end + 1 : NULL;
+    if (filename == NULL && *end != '\0') goto bad;
+
+    Device* device;
+    if (strcmp(name, "console") == 0 && !has_argument && filename == NULL) device = create_console();
+    else if (strcmp(name, "timer") == 0 && filename == NULL && (!has_argument || (argument > 0 && argument <= UINT32_MAX))) device = create_timer(has_argument ? argument : 1);
+    else if (strcmp(name, "disk") == 0 && !has_argument && filename != NULL) device = create_disk(filename);
+    else if (strcmp(name, "input") == 0 && !has_argument) device = create_input(filename);
+    else if (strcmp(name, "ring") == 0 && !has_argument && filename != NULL) device = create_ring(filename);
+    else goto bad;
+    return device != NULL && attach_device(bus, device, port);
+
+bad:
+    printf("Bad device %s, expected console@PORT, timer@PORT[,DIVISOR], disk@PORT=FILE, input@PORT[=FILE] or ring@PORT=FILE\n", spec);
+    return false;
+}
+
+void flush_bus(DeviceBus* bus) {
+    for (int i = 0; i < bus->device_count; i++) {
+        if (bus->devices[i]->flush != NULL) bus->devices[i]->flush(bus->devices[i]);
+    }
+}
+
+void free_bus(DeviceBus* bus) {
+    if (bus == NULL) return;
+    for (int i = 0; i < bus->device_count; i++) bus->devices[i]->close(bus->devices[i]);
+    free(bus);
+}
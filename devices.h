@@ -0,0 +1,55 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "cpu.h"
+
+// Device bus. Devices are registered on a range of I/O ports and IN and OUT on those ports call
+// them; every other port is a plain latch in cpu->ports that IN reads back. Devices never block
+// the instruction that calls them: output is buffered and written out in batches, and input is
+// read ahead by a thread or another process into a lock-free queue that IN only polls. See
+// devices.c for the devices and their ports
+
+#define MAX_DEVICES 16
+#define CONSOLE_BUFFER_SIZE 65536 // Console output is written out once this fills, or when the bus is flushed
+#define INPUT_QUEUE_SIZE 4096 // Power of two
+#define RING_QUEUE_SIZE 65536 // Power of two, per direction
+#define DISK_SECTOR_SIZE 128
+
+typedef struct Device {
+    const char* name;
+    uint8_t first_port; // Set by attach_device, read and write get the port relative to it
+    uint16_t port_count;
+    uint8_t (*read)(struct Device* device, CPU* cpu, uint8_t offset); // NULL if IN reads the latch
+    void (*write)(struct Device* device, CPU* cpu, uint8_t offset, uint8_t value); // NULL if OUT only sets the latch
+    void (*flush)(struct Device* device); // Writes out anything buffered, NULL if nothing ever is
+    void (*close)(struct Device* device); // Flushes, then frees the device
+} Device;
+
+typedef struct DeviceBus {
+    Device* ports[MAX_PORTS]; // Device on each port, NULL where IN and OUT only use the latch
+    Device* devices[MAX_DEVICES];
+    int device_count;
+} DeviceBus;
+
+// Single producer, single consumer byte queue. head and tail only ever grow and are masked on use,
+// and each sits on its own cache line so the two sides never share one
+typedef struct ByteQueue {
+    _Alignas(64) _Atomic uint32_t head; // Next byte to take, only the consumer moves it
+    _Alignas(64) _Atomic uint32_t tail; // Next free slot, only the producer moves it
+} ByteQueue;
+
+DeviceBus* create_bus(void);
+bool attach_device(DeviceBus* bus, Device* device, uint8_t first_port); // Closes the device and returns false if its ports are taken
+bool attach_device_spec(DeviceBus* bus, const char* spec); // --device, for example timer@0x10,1000 or disk@0x20=disk.img
+void flush_bus(DeviceBus* bus);
+void free_bus(DeviceBus* bus);
+
+Device* create_console(void);
+Device* create_timer(uint32_t divisor);
+Device* create_disk(const char* filename);
+Device* create_input(const char* filename); // NULL filename reads stdin
+Device* create_ring(const char* filename);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef FLAGS_H
+#define FLAGS_H
+
+#include <stdint.h>
+
+// Lazy flags. ALU instructions only record what they did, the flag byte is worked out from that
+// record when something actually reads it. Most results are overwritten by the next ALU
+// instruction before anything looks at them, so most are never worked out at all.
+
+// Build with -DCHECK_FLAGS=1 to also run the eager flag functions after every ALU instruction
+// and stop on the first instruction where the two disagree
+#ifndef CHECK_FLAGS
+#define CHECK_FLAGS 0
+#endif
+
+// Flag bits, SZ0A0P1C
+#define FLAG_S 0x80 // Sign
+#define FLAG_Z 0x40 // Zero
+#define FLAG_A 0x10 // Auxiliary carry
+#define FLAG_P 0x04 // Parity
+#define FLAG_C 0x01 // Carry
+#define FLAGS_FIXED 0x02 // Bit 1 always reads as 1, bits 3 and 5 as 0
+
+typedef enum FlagsKind {
+    FLAGS_SETTLED, // The flag byte is up to date, nothing is pending
+    FLAGS_ADD, // ADD, ADC, ADI, ACI
+    FLAGS_SUB, // SUB, SBB, SUI, SBI, CMP, CPI
+    FLAGS_AND, // ANA, ANI
+    FLAGS_LOGIC, // ORA, ORI, XRA, XRI
+    FLAGS_INR,
+    FLAGS_DCR,
+} FlagsKind;
+
+typedef struct LazyFlags {
+    uint8_t kind;
+    uint8_t result;
+    uint8_t a, b; // Operands
+    uint8_t carry; // Carry in for ADD/SUB, the untouched CY for INR/DCR
+} LazyFlags;
+
+// S, Z and P of every 8-bit result with the fixed bit set, see cpu_intel-8080.c
+extern const uint8_t szp_flags[256];
+
+static inline uint8_t compute_carry(const LazyFlags* lazy, uint8_t settled) {
+    switch (lazy->kind) {
+        case FLAGS_ADD: return (lazy->a + lazy->b + lazy->carry) >> 8;
+        case FLAGS_SUB: return ((unsigned) (lazy->a - lazy->b - lazy->carry) >> 8) & 1; // Borrow
+        case FLAGS_AND: case FLAGS_LOGIC: return 0;
+        case FLAGS_INR: case FLAGS_DCR: return lazy->carry;
+        default: return settled & FLAG_C;
+    }
+}
+
+// Works out the flag byte without settling it. S, Z and P come from szp_flags and AC and CY from
+// the operands, so the only branch is on the kind of instruction and never on the values
+static inline uint8_t compute_flags(const LazyFlags* lazy, uint8_t settled) {
+    uint8_t result = lazy->result, a = lazy->a, b = lazy->b, carry = lazy->carry;
+    switch (lazy->kind) {
+        case FLAGS_ADD: return szp_flags[result] | ((a ^ b ^ result) & FLAG_A) | ((a + b + carry) >> 8); // AC is the carry into bit 4
+        case FLAGS_SUB: return szp_flags[result] | (~(a ^ b ^ result) & FLAG_A) | (((unsigned) (a - b - carry) >> 8) & 1); // The 8080 subtracts by adding the complement
+        case FLAGS_AND: return szp_flags[result] | (((a | b) & 0x08) << 1);
+        case FLAGS_LOGIC: return szp_flags[result];
+        case FLAGS_INR: return szp_flags[result] | ((result & 0x0F) == 0x00) << 4 | carry;
+        case FLAGS_DCR: return szp_flags[result] | ((result & 0x0F) != 0x0F) << 4 | carry;
+        default: return settled;
+    }
+}
+
+#endif
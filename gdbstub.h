@@ -0,0 +1,31 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "cpu.h"
+#include "debugger.h"
+
+// GDB remote serial protocol server on a local TCP port or Unix socket, for attaching a debugger
+// to a run while it goes. Until one attaches, the run only looks for it from a scheduler event every
+// GDB_POLL_CYCLES, so the cores run exactly as without it. See gdbstub.c
+
+#define GDB_POLL_CYCLES (1 << 18) // About 130 ms at 2 MHz
+#define GDB_PACKET_SIZE 4096
+
+typedef struct GdbStub {
+    int listener;
+    int client; // -1 while no debugger is attached
+    char path[108]; // Unix socket to remove on close, empty for TCP
+    const char* address; // As given, for messages
+    Debugger* debugger; // Ours when the run came without one
+    int signal; // Reported in the next stop reply when no watchpoint was hit
+    char input[GDB_PACKET_SIZE];
+    int input_used, input_read;
+    char packet[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+} GdbStub;
+
+GdbStub* open_gdb_stub(const char* address); // A port number for TCP on 127.0.0.1, otherwise a Unix socket path. NULL after saying why
+void close_gdb_stub(GdbStub* stub);
+bool run_gdb(CPU* cpu, Core core, uint64_t clock_hz, GdbStub* stub, bool wait, uint64_t* instruction_count); // run_cpu serving a debugger, wait holds the run until one attaches
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef I8080_H
+#define I8080_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Embedding API. Each I8080 is a complete emulator with its own 64 KiB address space, and nothing
+// is shared between them but constant tables, so a host can run as many as it likes on as many
+// threads as it likes, one thread per I8080 at a time. The core never prints, reads files or
+// sleeps: ports and memory-mapped I/O go through the callbacks below. Build libi8080.a with
+// pcc.py -c --library, see libi8080.c
+
+typedef struct I8080 I8080;
+
+typedef enum I8080Core {
+    I8080_CORE_TABLE, // Function pointer dispatch, checks its budget after every instruction
+    I8080_CORE_THREADED, // Direct threading, checks its budget at branches
+    I8080_CORE_JIT, // x86-64 translation, the threaded core on other hosts
+} I8080Core;
+
+typedef enum I8080Status {
+    I8080_RUNNING, // Ran for the cycles it was given and can carry on
+    I8080_HALTED, // Stopped on HLT, an interrupt wakes it up if interrupts are enabled
+    I8080_ERROR, // Stopped on an opcode it could not run
+} I8080Status;
+
+// Every callback may be NULL. They are called from inside i8080_step and i8080_run, and must not
+// call back into the same I8080 except for i8080_interrupt and i8080_read_memory
+typedef struct I8080Config {
+    I8080Core core; // Used by i8080_run, i8080_step always runs one instruction on the table core
+    void* context; // Passed to every callback
+    uint8_t (*read_port)(void* context, uint8_t port); // IN, NULL reads back the last byte written to the port
+    void (*write_port)(void* context, uint8_t port, uint8_t value); // OUT
+    void (*write_memory)(void* context, uint16_t address, uint8_t value); // Writes to pages passed to i8080_watch_writes, after they land
+} I8080Config;
+
+typedef struct I8080State {
+    uint8_t a, flags, b, c, d, e, h, l;
+    uint16_t stack_pointer, program_counter;
+    bool interrupts_enabled;
+    bool halted;
+    uint64_t cycles; // T-states since reset
+} I8080State;
+
+I8080* i8080_create(const I8080Config* config); // NULL config for the table core and no callbacks, NULL if out of memory
+int i8080_load(I8080* i8080, const uint8_t* image, size_t size, size_t rom_size); // Copies image to 0x0000 and resets, non-zero if out of memory
+void i8080_reset(I8080* i8080); // Registers, ports and pending interrupts, memory is left alone
+I8080Status i8080_step(I8080* i8080); // One instruction or taking one interrupt, EI goes together with the instruction after it
+I8080Status i8080_run(I8080* i8080, uint64_t cycles); // At least this many T-states, a few more to finish the last instruction or block
+void i8080_destroy(I8080* i8080);
+
+void i8080_interrupt(I8080* i8080, uint8_t vector); // Interrupts with RST vector (0-7) once interrupts are enabled
+void i8080_watch_writes(I8080* i8080, uint16_t address, size_t size); // Sends writes to the 256 byte pages covering this range to write_memory
+void i8080_read_memory(I8080* i8080, uint16_t address, uint8_t* bytes, size_t size); // Wraps past 0xFFFF
+void i8080_write_memory(I8080* i8080, uint16_t address, const uint8_t* bytes, size_t size); // Writes ROM too and calls no callback
+void i8080_get_state(I8080* i8080, I8080State* state);
+void i8080_set_state(I8080* i8080, const I8080State* state);
+uint64_t i8080_instructions(const I8080* i8080); // Since the last reset
+
+#endif
@@ -0,0 +1,179 @@
+#include "i8080.h"
+#include "cpu.h"
+#include "alu.h"
+#include "devices.h"
+#include "scheduler.h"
+
+// Embedding API, see i8080.h. An I8080 is one allocation holding the CPU, a device bus with one
+// device on every port that calls the host's port callbacks, and a scheduler for the interrupts
+// the host raises, so it runs through run_cpu exactly like a single run of the command line tool.
+// Memory writes the host watches take write_memory_slow through PAGE_HOOK, which calls the host's
+// write_memory directly. Nothing here touches any state outside its own I8080.
+
+struct I8080 {
+    CPU cpu; // First, so the port device gets back to its I8080 from the CPU it is handed
+    Device ports;
+    DeviceBus bus;
+    Scheduler scheduler;
+    I8080Config config;
+    Core core;
+    uint8_t watched[MEMORY_PAGES]; // PAGE_HOOK on pages passed to i8080_watch_writes, kept across loads
+    uint64_t instructions; // Since the last reset
+};
+
+static uint8_t read_host_port(Device* device, CPU* cpu, uint8_t offset) {
+    I8080* i8080 = (I8080*) cpu;
+    return i8080->config.read_port(i8080->config.context, offset);
+}
+static void write_host_port(Device* device, CPU* cpu, uint8_t offset, uint8_t value) {
+    I8080* i8080 = (I8080*) cpu;
+    i8080->config.write_port(i8080->config.context, offset, value);
+}
+
+// Hooks freshly loaded memory up to the host
+static void watch_memory(I8080* i8080) {
+    Memory* memory = &i8080->cpu.memory;
+    memory->write_hook = i8080->config.write_memory;
+    memory->hook_context = i8080->config.context;
+    for (int page = 0; page < MEMORY_PAGES; page++) memory->page_flags[page] |= i8080->watched[page];
+}
+
+static void release(I8080* i8080) {
+#ifdef _WIN32
+    _aligned_free(i8080);
+#else
+    free(i8080);
+#endif
+}
+
+I8080* i8080_create(const I8080Config* config) {
+    // The CPU's hot fields are laid out for a 64 byte aligned CPU
+#ifdef _WIN32
+    I8080* i8080 = _aligned_malloc(sizeof(I8080), _Alignof(I8080));
+#else
+    I8080* i8080 = aligned_alloc(_Alignof(I8080), sizeof(I8080));
+#endif
+    if (i8080 == NULL) return NULL;
+    memset(i8080, 0, sizeof(I8080));
+    if (config != NULL) i8080->config = *config;
+    i8080->core = i8080->config.core == I8080_CORE_JIT ? CORE_JIT : i8080->config.core == I8080_CORE_THREADED ? CORE_THREADED : CORE_TABLE;
+
+    // Starts out with an empty address space, so it runs NOPs until something is loaded
+    if (load_memory_bytes(&i8080->cpu.memory, NULL, 0, 0) != 0) {
+        release(i8080);
+        return NULL;
+    }
+    watch_memory(i8080);
+
+    i8080->ports = (Device) {
+        .name = "host",
+        .port_count = MAX_PORTS,
+        .read = i8080->config.read_port != NULL ? read_host_port : NULL,
+        .write = i8080->config.write_port != NULL ? write_host_port : NULL,
+    };
+    for (int port = 0; port < MAX_PORTS; port++) i8080->bus.ports[port] = &i8080->ports;
+    i8080->cpu.bus = &i8080->bus;
+    i8080->cpu.scheduler = &i8080->scheduler;
+    i8080_reset(i8080);
+    return i8080;
+}
+
+int i8080_load(I8080* i8080, const uint8_t* image, size_t size, size_t rom_size) {
+    Memory memory;
+    if (load_memory_bytes(&memory, image, size, rom_size) != 0) return 2; // Keeps what it had
+    free_cpu(&i8080->cpu); // Drops the translations of the old image with it
+    i8080->cpu.memory = memory;
+    watch_memory(i8080);
+    i8080_reset(i8080);
+    return 0;
+}
+
+void i8080_reset(I8080* i8080) {
+    reset_cpu(&i8080->cpu);
+    memset(&i8080->scheduler, 0, sizeof(Scheduler));
+    i8080->instructions = 0;
+}
+
+static I8080Status run_for(I8080* i8080, Core core, uint64_t cycles) {
+    CPU* cpu = &i8080->cpu;
+    cpu->cycle_limit = cycles < UINT64_MAX - cpu->cycles ? cpu->cycles + cycles : UINT64_MAX;
+    uint64_t count = 0;
+    bool error_stop = run_cpu(cpu, core, &count);
+    cpu->cycle_limit = UINT64_MAX;
+    i8080->instructions += count;
+    if (error_stop) return I8080_ERROR;
+    return cpu->running ? I8080_RUNNING : I8080_HALTED;
+}
+
+I8080Status i8080_step(I8080* i8080) {
+    return run_for(i8080, CORE_TABLE, 1); // The only core that checks its budget after every instruction
+}
+
+I8080Status i8080_run(I8080* i8080, uint64_t cycles) {
+    return run_for(i8080, i8080->core, cycles);
+}
+
+void i8080_destroy(I8080* i8080) {
+    if (i8080 == NULL) return;
+    free_cpu(&i8080->cpu);
+    release(i8080);
+}
+
+void i8080_interrupt(I8080* i8080, uint8_t vector) {
+    request_interrupt(&i8080->cpu, vector);
+}
+
+void i8080_watch_writes(I8080* i8080, uint16_t address, size_t size) {
+    if (i8080->config.write_memory == NULL || size == 0) return;
+    size_t pages = (address % MEMORY_PAGE_SIZE + size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+    if (pages > MEMORY_PAGES) pages = MEMORY_PAGES;
+    for (size_t i = 0; i < pages; i++) {
+        size_t page = (address / MEMORY_PAGE_SIZE + i) % MEMORY_PAGES;
+        i8080->watched[page] = PAGE_HOOK;
+        i8080->cpu.memory.page_flags[page] |= PAGE_HOOK;
+    }
+}
+
+void i8080_read_memory(I8080* i8080, uint16_t address, uint8_t* bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) bytes[i] = read_memory(&i8080->cpu.memory, (uint16_t) (address + i));
+}
+
+void i8080_write_memory(I8080* i8080, uint16_t address, const uint8_t* bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) poke_memory(&i8080->cpu.memory, (uint16_t) (address + i), bytes[i]);
+}
+
+void i8080_get_state(I8080* i8080, I8080State* state) {
+    CPU* cpu = &i8080->cpu;
+    const uint8_t* r8 = cpu->registers.r8;
+    *state = (I8080State) {
+        .a = r8[REG_A], .flags = get_flags(cpu),
+        .b = r8[REG_B], .c = r8[REG_C], .d = r8[REG_D], .e = r8[REG_E], .h = r8[REG_H], .l = r8[REG_L],
+        .stack_pointer = cpu->stack_pointer,
+        .program_counter = cpu->program_counter,
+        .interrupts_enabled = cpu->interrupts_enabled,
+        .halted = !cpu->running || i8080->scheduler.waiting,
+        .cycles = cpu->cycles,
+    };
+}
+
+void i8080_set_state(I8080* i8080, const I8080State* state) {
+    CPU* cpu = &i8080->cpu;
+    uint8_t* r8 = cpu->registers.r8;
+    r8[REG_B] = state->b;
+    r8[REG_C] = state->c;
+    r8[REG_D] = state->d;
+    r8[REG_E] = state->e;
+    r8[REG_H] = state->h;
+    r8[REG_L] = state->l;
+    set_psw(cpu, state->a << 8 | state->flags); // Like POP PSW, the fixed flag bits stay fixed
+    cpu->stack_pointer = state->stack_pointer;
+    cpu->program_counter = state->program_counter;
+    cpu->interrupts_enabled = state->interrupts_enabled;
+    cpu->running = !state->halted;
+    cpu->cycles = state->cycles;
+    i8080->scheduler.waiting = false;
+}
+
+uint64_t i8080_instructions(const I8080* i8080) {
+    return i8080->instructions;
+}
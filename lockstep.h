@@ -0,0 +1,50 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "cpu.h"
+
+// Lockstep engine. Runs many CPUs on the same program at once, with their state stored as
+// structure-of-arrays planes (every lane's A next to each other, every lane's flags next to each
+// other, ...) so ALU instructions run on a whole vector of lanes per step. Lanes stay in one group
+// as long as they agree on where the program goes; a lane whose branch, return address or code
+// differs from the group's leaves it and is handed back to the scalar cores, see core_lockstep.c
+
+#define LOCKSTEP_VECTOR 32 // Lanes per kernel step, one AVX2 register of 8-bit lanes
+#define LOCKSTEP_MAX_LANES 256
+#define LOCKSTEP_MIN_LANES 4 // Smaller groups run faster on the scalar cores
+
+typedef struct Lockstep {
+    int lanes; // Lanes in use
+    int capacity; // lanes rounded up to LOCKSTEP_VECTOR, planes are this long
+
+    // One plane per REG_* slot, F holds eagerly computed flags
+    uint8_t* registers[8];
+    uint8_t* active; // 0xFF while a lane follows the group, 0x00 once it left or was never loaded
+    uint8_t* scratch; // Operand plane for M and immediates
+    uint8_t* interrupts_enabled;
+    uint16_t* stack_pointer;
+    uint16_t* program_counter; // Only kept for lanes that left the group
+    uint64_t* cycles; // Only kept for lanes that left the group
+    uint64_t* instructions; // Only kept for lanes that left the group
+    uint8_t (*ports)[MAX_PORTS];
+    Memory* memory;
+
+    // Shared by every lane still in the group
+    uint16_t group_program_counter;
+    uint64_t group_cycles;
+    uint64_t group_instructions;
+    int group_lanes; // Lanes still in the group
+    bool halted;
+
+    // Guest pages any lane wrote to, code fetched from them is compared across lanes first
+    uint8_t written_pages[MEMORY_PAGES];
+} Lockstep;
+
+Lockstep* create_lockstep(int lanes);
+void free_lockstep(Lockstep* lockstep);
+void load_lockstep_lane(Lockstep* lockstep, int lane, CPU* cpu); // Takes over the CPU's memory
+uint64_t store_lockstep_lane(Lockstep* lockstep, int lane, CPU* cpu); // Hands the memory back, returns the lane's instruction count
+void mark_lockstep_write(Lockstep* lockstep, uint16_t address); // For memory set up outside the engine
+void run_lockstep(Lockstep* lockstep, uint64_t cycle_limit);
+
+#endif
@@ -0,0 +1,420 @@
+#include "cpu.h"
+#include "alu.h"
+#include "profile.h"
+#include "tracefile.h"
+#include "snapshot.h"
+#include "devices.h"
+#include "scheduler.h"
+#include "debugger.h"
+
+// Command line front end. Everything here loads images from files, prints or sleeps; the CPU itself
+// is in cpu_intel-8080.c and the cores, which do neither (see libi8080.c for the embedding API)
+
+static void print_watch_hit(const WatchHit* hit, const SymbolMap* symbols) {
+    char address[SYMBOL_NAME_SIZE], instruction[SYMBOL_NAME_SIZE];
+    format_address(symbols, hit->address, address);
+    format_address(symbols, hit->program_counter, instruction);
+    if (hit->kind == WATCH_EXECUTE) printf("Breakpoint at %s, cycle %llu\n", address, (unsigned long long) hit->cycles);
+    else if (hit->kind == WATCH_READ) printf("Read 0x%02x from %s at %s, cycle %llu\n", hit->value, address, instruction, (unsigned long long) hit->cycles);
+    else printf("Wrote 0x%02x to %s at %s, cycle %llu\n", hit->value, address, instruction, (unsigned long long) hit->cycles);
+}
+
+// --watch-log: every hit is printed and the run carries on
+static bool log_watch_hit(CPU* cpu, const WatchHit* hit, void* context) {
+    print_watch_hit(hit, context);
+    return false;
+}
+
+// Start!
+int main(int argc, char* argv[]) {
+    char* filename = "program.bin";
+    size_t rom_size = 0;
+    Core core = CORE_TABLE;
+    int bench_runs = 0;
+    char* bench_report = NULL;
+    char* images[MAX_IMAGES];
+    int image_count = 0;
+    int conformance = 0; // 1 to run exercisers, 2 to run them on every core in lockstep
+    char* manifest = NULL;
+    int threads = 0; // One per online host CPU
+    uint64_t max_cycles = 0; // No limit
+    uint64_t clock_hz = 0; // Unpaced unless set
+    char* profile_filename = NULL;
+    char* stacks_filename = NULL;
+    char* symbols_filename = NULL;
+    int profile_top = 10;
+    char* trace_filename = NULL;
+    char* dump_filename = NULL;
+    char* diff_filenames[2] = {NULL, NULL};
+    uint64_t trace_from = 0, trace_count = UINT64_MAX;
+    char* load_filename = NULL;
+    char* save_filename = NULL;
+    uint64_t snapshot_at = 0; // Run to the end
+    char* device_specs[MAX_DEVICES];
+    int device_count = 0;
+    bool console = true; // On ports 0-3 unless --device puts it somewhere else
+    Debugger* debugger = NULL; // Only once a watchpoint is given
+    bool watch_log = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rom") == 0 && i + 1 < argc) rom_size = strtoul(argv[++i], NULL, 0); // Bytes at 0x0000 that are read-only
+        else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "table") == 0) core = CORE_TABLE;
+            else if (strcmp(argv[i], "threaded") == 0) core = CORE_THREADED;
+            else if (strcmp(argv[i], "lockstep") == 0) core = CORE_LOCKSTEP;
+            else if (strcmp(argv[i], "jit") == 0) core = CORE_JIT;
+            else {
+                printf("Unknown core %s, expected table, threaded, lockstep or jit\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) bench_runs = atoi(argv[++i]); // Run every core this many times
+        else if (strcmp(argv[i], "--bench-report") == 0 && i + 1 < argc) bench_report = argv[++i]; // Write the --bench results to a file
+        else if (strcmp(argv[i], "--conformance") == 0) conformance = 1; // Run CP/M exerciser programs and report each test
+        else if (strcmp(argv[i], "--conformance-diff") == 0) conformance = 2; // Run them on the table core in lockstep with the others
+        else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) clock_hz = strtoull(argv[++i], NULL, 0); // Target clock rate in Hz, 2000000 for a stock 8080
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) manifest = argv[++i]; // Run every program listed in a manifest
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) max_cycles = strtoull(argv[++i], NULL, 0); // Per batch or conformance run
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profile_filename = argv[++i]; // Profile report, JSON if it ends in .json, CSV otherwise
+        else if (strcmp(argv[i], "--profile-top") == 0 && i + 1 < argc) profile_top = atoi(argv[++i]); // Rows in the printed profile tables
+        else if (strcmp(argv[i], "--profile-stacks") == 0 && i + 1 < argc) stacks_filename = argv[++i]; // Profile call stacks, collapsed for flame graph tools
+        else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) symbols_filename = argv[++i]; // Label map from asm.exe -m, names routines in profiles and traces
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_filename = argv[++i]; // Record a binary trace of the run
+        else if (strcmp(argv[i], "--trace-dump") == 0 && i + 1 < argc) dump_filename = argv[++i]; // Print a recorded trace instead of running
+        else if (strcmp(argv[i], "--trace-diff") == 0 && i + 2 < argc) { // Find where two recorded traces part ways
+            diff_filenames[0] = argv[++i];
+            diff_filenames[1] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace-from") == 0 && i + 1 < argc) trace_from = strtoull(argv[++i], NULL, 0); // First record --trace-dump prints
+        else if (strcmp(argv[i], "--trace-count") == 0 && i + 1 < argc) trace_count = strtoull(argv[++i], NULL, 0); // Records --trace-dump prints
+        else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) load_filename = argv[++i]; // Start from a snapshot instead of a program image
+        else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) save_filename = argv[++i]; // Snapshot the CPU once the run stops
+        else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) snapshot_at = strtoull(argv[++i], NULL, 0); // Stop the run at this many cycles since reset
+        else if ((strcmp(argv[i], "--break") == 0 || strcmp(argv[i], "--watch") == 0) && i + 1 < argc) { // Pause where execution reaches an address, or on accesses to a range
+            if (debugger == NULL && (debugger = create_debugger()) == NULL) {
+                printf("Out of memory setting a watchpoint\n");
+                return 1;
+            }
+            char* spec = argv[++i];
+            char breakpoint[32];
+            if (strcmp(argv[i - 1], "--break") == 0) {
+                snprintf(breakpoint, sizeof(breakpoint), "x:%s", argv[i]);
+                spec = breakpoint;
+            }
+            if (!parse_watchpoint(debugger, spec)) {
+                free_debugger(debugger);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--watch-log") == 0) watch_log = true; // Print every watchpoint hit and carry on instead of pausing
+        else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) { // Attach a device to the I/O ports
+            if (device_count == MAX_DEVICES) {
+                printf("At most %d devices can be attached\n", MAX_DEVICES);
+                return 1;
+            }
+            device_specs[device_count++] = argv[++i];
+            if (strncmp(argv[i], "console@", 8) == 0) console = false;
+        }
+        else { // Program image, --bench and --conformance take every one given
+            if (image_count == MAX_IMAGES) {
+                printf("At most %d images can be given\n", MAX_IMAGES);
+                return 1;
+            }
+            filename = images[image_count++] = argv[i];
+        }
+    }
+
+    // Only traces, profiles and watchpoint hits name addresses, each loads the symbols where it starts
+    SymbolMap* symbols = NULL;
+    bool profiling = profile_filename != NULL || stacks_filename != NULL;
+    ProfileOutput profile_output = {.filename = profile_filename, .stacks_filename = stacks_filename, .top = profile_top};
+
+    if (debugger != NULL && (dump_filename != NULL || diff_filenames[0] != NULL || trace_filename != NULL || profiling || bench_runs > 0 || conformance > 0)) {
+        printf("--break and --watch are for single runs and batches, and cannot be combined with --trace or --profile\n");
+        free_debugger(debugger);
+        return 1;
+    }
+    if (debugger != NULL && watch_log) debugger->callback = log_watch_hit; // Its context, the symbols, is set once they are loaded
+
+    if (dump_filename != NULL) {
+        if (symbols_filename != NULL && (symbols = load_symbols(symbols_filename)) == NULL) return 1;
+        int status = dump_trace(dump_filename, symbols, trace_from, trace_count);
+        free_symbols(symbols);
+        return status;
+    }
+    if (diff_filenames[0] != NULL) return diff_traces(diff_filenames[0], diff_filenames[1]);
+    if (trace_filename != NULL && (profiling || manifest != NULL)) {
+        printf("--trace records a single run and cannot be combined with --profile or --batch\n");
+        return 1;
+    }
+
+    if ((load_filename != NULL || save_filename != NULL) && (manifest != NULL || bench_runs > 0)) {
+        printf("--load-snapshot and --save-snapshot are for single runs, list snapshots in the manifest to branch a batch from them\n");
+        return 1;
+    }
+
+    if (conformance > 0 && image_count == 0) {
+        printf("Give the CP/M programs to run with --conformance, for example 8080PRE.COM TST8080.COM\n");
+        return 1;
+    }
+    if (conformance == 2) return diff_conformance(images, image_count, max_cycles);
+    if (manifest != NULL) {
+        if ((profiling || debugger != NULL) && symbols_filename != NULL && (symbols = load_symbols(symbols_filename)) == NULL) {
+            free_debugger(debugger);
+            return 1;
+        }
+        profile_output.symbols = symbols;
+        if (debugger != NULL) debugger->context = symbols;
+        int status = run_batch(manifest, rom_size, core, threads, max_cycles, profiling ? &profile_output : NULL, debugger);
+        free_symbols(symbols);
+        free_debugger(debugger);
+        return status;
+    }
+    if (core == CORE_LOCKSTEP) {
+        printf("The lockstep core only runs batches, use it with --batch\n");
+        free_debugger(debugger);
+        return 1;
+    }
+    if (conformance == 1) return run_conformance(images, image_count, core, max_cycles);
+    if (bench_runs > 0) {
+        if (image_count == 0) images[image_count++] = filename;
+        return run_benchmark(images, image_count, rom_size, bench_runs, bench_report);
+    }
+
+    CPU cpu;
+    int code;
+    if (load_filename != NULL) {
+        Snapshot* snapshot = load_snapshot(load_filename);
+        code = snapshot == NULL ? 1 : restore_snapshot(&cpu, snapshot);
+        free_snapshot(snapshot); // The restored memory keeps its own mapping of the file
+    }
+    else code = initialize_cpu(&cpu, filename, rom_size);
+    if (code){ // Failed to initialize the CPU
+        printf("Failed to initalize CPU, exit code %d\n", code);
+        free_debugger(debugger);
+        return 1;
+    } 
+    cpu.scheduler = create_scheduler();
+    cpu.bus = create_bus();
+    bool attached = cpu.scheduler != NULL && cpu.bus != NULL && (!console || attach_device_spec(cpu.bus, "console@0"));
+    for (int i = 0; i < device_count && attached; i++) attached = attach_device_spec(cpu.bus, device_specs[i]);
+    if (!attached) {
+        free_bus(cpu.bus);
+        free_scheduler(cpu.scheduler);
+        free_cpu(&cpu);
+        free_debugger(debugger);
+        return 1;
+    }
+    if (trace_filename != NULL) {
+        cpu.trace = open_trace_writer(trace_filename, &cpu);
+        if (cpu.trace == NULL) {
+            free_bus(cpu.bus);
+            free_scheduler(cpu.scheduler);
+            free_cpu(&cpu);
+            return 1;
+        }
+    }
+    if (profiling) {
+        cpu.profile = create_profile();
+        if (cpu.profile == NULL) printf("Out of memory starting the profiler\n");
+        if (cpu.profile != NULL && symbols_filename != NULL) profile_output.symbols = symbols = load_symbols(symbols_filename);
+        if (cpu.profile == NULL || (symbols_filename != NULL && symbols == NULL)) {
+            free_profile(cpu.profile);
+            free_bus(cpu.bus);
+            free_scheduler(cpu.scheduler);
+            free_cpu(&cpu);
+            return 1;
+        }
+    }
+    if (debugger != NULL) {
+        if (symbols_filename != NULL && (symbols = load_symbols(symbols_filename)) == NULL) {
+            free_bus(cpu.bus);
+            free_scheduler(cpu.scheduler);
+            free_cpu(&cpu);
+            free_debugger(debugger);
+            return 1;
+        }
+        debugger->context = symbols;
+        attach_debugger(&cpu, debugger);
+    }
+    
+#if DEBUG
+    printf("\nStarting conditions:\n");
+    print_cpu_registers(&cpu);
+    printf("\n");
+    print_cpu_memory(&cpu);
+    printf("\n");
+#endif
+
+    // Fetch-decode-execute loop, the program counter wraps around the 64 KiB address space on its own
+    uint64_t instruction_count = 0;
+    uint64_t start_cycles = cpu.cycles; // Not 0 when started from a snapshot
+    if (snapshot_at > 0) cpu.cycle_limit = snapshot_at;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool error_stop = clock_hz > 0 ? run_paced(&cpu, core, clock_hz, &instruction_count) : run_cpu(&cpu, core, &instruction_count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    flush_bus(cpu.bus);
+    if (error_stop && opcode_lookup[fetch(&cpu)].size == 0) printf("%sInvalid opcode (0x%02x) detected, exitting\n%s", RED, fetch(&cpu), RESET);
+    if (run_paused(&cpu)) {
+        printf("Paused: ");
+        print_watch_hit(&debugger->hit, symbols);
+    }
+    if (debugger != NULL && watch_log) printf("%llu watchpoint hits\n", (unsigned long long) debugger->hit_count);
+
+#if DEBUG
+    printf("\nEnding conditions:\n");
+    print_cpu_registers(&cpu);
+    printf("\n");
+    print_cpu_memory(&cpu);
+    printf("\n");
+#endif
+
+    double seconds = elapsed_seconds(&start, &end);
+    printf("Executed %llu instructions in %.6f s (%.2f MIPS)\n", (unsigned long long) instruction_count, seconds, seconds > 0 ? instruction_count / seconds / 1e6 : 0.0);
+    uint64_t cycles = cpu.cycles - start_cycles;
+    printf("Executed %llu cycles (%.2f MHz effective)\n", (unsigned long long) cycles, seconds > 0 ? cycles / seconds / 1e6 : 0.0);
+
+    if (cpu.trace != NULL && !close_trace_writer(cpu.trace)) {
+        printf("Could not write all of the trace to %s\n", trace_filename);
+        error_stop = true;
+    }
+    if (save_filename != NULL) {
+        Snapshot* snapshot = take_snapshot(&cpu);
+        if (snapshot == NULL) printf("Out of memory taking a snapshot\n");
+        if (snapshot == NULL || save_snapshot(snapshot, save_filename)) error_stop = true;
+        else printf("Saved a snapshot at cycle %llu (PC=0x%04x) to %s\n", (unsigned long long) cpu.cycles, cpu.program_counter, save_filename);
+        free_snapshot(snapshot);
+    }
+    if (cpu.profile != NULL) {
+        end_profile_run(cpu.profile, &cpu);
+        if (report_profile(cpu.profile, &profile_output)) error_stop = true;
+        free_profile(cpu.profile);
+    }
+    free_symbols(symbols);
+    free_bus(cpu.bus);
+    free_scheduler(cpu.scheduler);
+    free_cpu(&cpu);
+    free_debugger(debugger);
+    return error_stop;
+}
+
+// Runs at clock_hz by giving the core a millisecond worth of cycles at a time and sleeping off
+// however far ahead of the wall clock that put the guest. Stops at cpu->cycle_limit like the cores
+bool run_paced(CPU* cpu, Core core, uint64_t clock_hz, uint64_t* instruction_count) {
+    uint64_t slice = clock_hz / 1000 > 0 ? clock_hz / 1000 : 1;
+    uint64_t limit = cpu->cycle_limit;
+    uint64_t start_cycles = cpu->cycles;
+    bool error_stop = false;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    *instruction_count = 0;
+    while (cpu->running && !error_stop && !run_paused(cpu) && cpu->cycles < limit) {
+        uint64_t count = 0;
+        cpu->cycle_limit = limit - cpu->cycles > slice ? cpu->cycles + slice : limit;
+        error_stop = run_cpu(cpu, core, &count);
+        *instruction_count += count;
+        if (cpu->bus != NULL) flush_bus(cpu->bus); // Paced runs are watched as they go
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double ahead = (double) (cpu->cycles - start_cycles) / clock_hz - elapsed_seconds(&start, &now);
+        if (ahead > 0) {
+            struct timespec rest = {(time_t) ahead, (long) ((ahead - (time_t) ahead) * 1e9)};
+            nanosleep(&rest, NULL);
+        }
+    }
+    cpu->cycle_limit = limit;
+    return error_stop;
+}
+double elapsed_seconds(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Initialize
+int initialize_cpu(CPU* cpu, char* filename, size_t rom_size) {
+    cpu->bus = NULL;
+    cpu->scheduler = NULL;
+    cpu->jit = NULL;
+    cpu->fusion = NULL;
+    cpu->profile = NULL;
+    cpu->trace = NULL;
+    cpu->debugger = NULL;
+
+    // Map program data into memory
+    int code = map_memory_image(&cpu->memory, filename, rom_size);
+    if (code == 1) {
+        printf("Could not open file %s\n", filename);
+        return 1;
+    }
+    else if (code != 0) {
+        printf("Could not map file %s into memory\n", filename);
+        return 2;
+    }
+
+    TRACE("Opened %s (%zu bytes, %zu bytes ROM)\n", filename, cpu->memory.image_size, cpu->memory.rom_size);
+    reset_cpu(cpu);
+    return 0;
+}
+
+// Printing
+void print_cpu_registers(CPU* cpu) {
+    print_8bit_registers(cpu);
+    print_16bit_registers(cpu);
+    print_states_and_flags(cpu);
+}  
+void print_cpu_memory(CPU* cpu) {
+    // Only dump rows that hold something, runs of empty rows are collapsed into one line
+    bool skipped = false;
+    for (int row = 0; row < ADDRESS_SPACE_SIZE; row += MEMORY_WIDTH) {
+        bool empty = true;
+        for (int i = row; i < row + MEMORY_WIDTH; i++) if (cpu->memory.bytes[i] != 0) empty = false;
+
+        if (empty && row >= (int) cpu->memory.image_size) {
+            skipped = true;
+            continue;
+        }
+        if (skipped) printf("%s...\n%s", DIM, RESET);
+        skipped = false;
+
+        // Address block
+        printf("%s0x%04x\t%s", GREEN, row, RESET);
+
+        // Actual data
+        for (int i = row; i < row + MEMORY_WIDTH; i++) {
+            if (cpu->memory.bytes[i] != 0) printf("%s", GREEN);
+            else printf("%s", DIM);
+            printf("%02x %s", cpu->memory.bytes[i], RESET);
+        }
+        printf("\n");
+    }
+    if (skipped) printf("%s...\n%s", DIM, RESET);
+}
+void print_binary(uint8_t byte) {
+    printf("0b");
+    for (int i = 7; i >= 0; i--) {
+        int num = (byte >> i) & 1;
+        printf("%d", num);
+    }
+}
+void print_8bit_registers(CPU* cpu) {
+    uint8_t order[] = {7, 0, 1, 2, 3, 4, 5, 6}; // A first, then B-L and M
+    for (int i = 0; i < 8; i++) {
+        uint8_t reg = order[i];
+        printf("%s%c = %s%d%s", REGISTER_COLOR, register_names[reg], IMMEDIATE_COLOR, get_register(cpu, reg), i < 7 ? ", " : "\n" RESET);
+    }
+}
+void print_16bit_registers(CPU* cpu) {
+    for (int pair = PAIR_BC; pair <= PAIR_HL; pair++) {
+        printf("%s%s = %s0x%04x%s", REGISTER_COLOR, pair_names[pair], IMMEDIATE_COLOR, cpu->registers.r16[pair], pair < PAIR_HL ? ", " : "\n" RESET);
+    }
+}
+void print_states_and_flags(CPU* cpu) {
+    printf("%sSP = %d, PC = %d, ", MAGENTA, cpu->stack_pointer, cpu->program_counter);
+    // TODO: Split the Flag print into its multiple flags
+    printf("Flag = ");
+    uint8_t flags = get_flags(cpu);
+    print_binary(flags);
+    printf(" (0x%02x), Running = %d, INTE = %d, Cycles = %llu%s", flags, cpu->running, cpu->interrupts_enabled, (unsigned long long) cpu->cycles, RESET); 
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Marks every guest page overlapping [0, rom_size) as ROM
+static void mark_rom_pages(Memory* memory) {
+    memset(memory->page_flags, 0, sizeof(memory->page_flags));
+    for (size_t page = 0; page * MEMORY_PAGE_SIZE < memory->rom_size; page++) memory->page_flags[page] |= PAGE_ROM;
+}
+
+#ifdef _WIN32
+// No mmap, fall back to a private copy of the image
+int map_memory_image(Memory* memory, const char* filename, size_t rom_size) {
+    memory->bytes = calloc(ADDRESS_SPACE_SIZE, 1);
+    if (memory->bytes == NULL) return 2;
+    memory->mapped = false;
+    memory->code_map = NULL;
+    memory->code_written = false;
+    memory->write_hook = NULL;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        unmap_memory_image(memory);
+        return 1;
+    }
+    memory->image_size = fread(memory->bytes, 1, ADDRESS_SPACE_SIZE, file);
+    fclose(file);
+
+    memory->rom_size = rom_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : rom_size;
+    mark_rom_pages(memory);
+    return 0;
+}
+
+// Fills a fresh address space from bytes, snapshots restore through this
+int copy_memory_image(Memory* memory, const uint8_t* bytes, size_t image_size, size_t rom_size) {
+    memory->bytes = malloc(ADDRESS_SPACE_SIZE);
+    if (memory->bytes == NULL) return 2;
+    memcpy(memory->bytes, bytes, ADDRESS_SPACE_SIZE);
+    memory->mapped = false;
+    memory->code_map = NULL;
+    memory->code_written = false;
+    memory->write_hook = NULL;
+    memory->image_size = image_size;
+    memory->rom_size = rom_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : rom_size;
+    mark_rom_pages(memory);
+    return 0;
+}
+#else
+// The address space is one anonymous mapping, so untouched RAM costs nothing until written.
+// The image is mapped over the start of it with MAP_PRIVATE: its pages come straight from the
+// page cache and are shared by every instance loading the same file until one of them writes
+// to a page, at which point only that page is copied. ROM pages are never written (writes to
+// them are dropped in write_memory_slow) so they stay shared for the lifetime of the run.
+int map_memory_image(Memory* memory, const char* filename, size_t rom_size) {
+    memory->bytes = mmap(NULL, ADDRESS_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory->bytes == MAP_FAILED) {
+        memory->bytes = NULL;
+        return 2;
+    }
+    memory->mapped = true;
+    memory->code_map = NULL;
+    memory->code_written = false;
+    memory->write_hook = NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        unmap_memory_image(memory);
+        return 1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        unmap_memory_image(memory);
+        return 1;
+    }
+
+    size_t image_size = info.st_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : (size_t) info.st_size;
+    size_t host_page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_size = (image_size + host_page - 1) / host_page * host_page; // Never map past the last page of the file
+    if (map_size > ADDRESS_SPACE_SIZE) map_size = ADDRESS_SPACE_SIZE;
+
+    if (map_size > 0 && mmap(memory->bytes, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        close(fd);
+        unmap_memory_image(memory);
+        return 2;
+    }
+    close(fd);
+
+    memory->image_size = image_size;
+    memory->rom_size = rom_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : rom_size;
+    mark_rom_pages(memory);
+
+    // Let the host enforce ROM too when it lines up with host pages
+    size_t protect_size = memory->rom_size / host_page * host_page;
+    if (protect_size > 0) mprotect(memory->bytes, protect_size, PROT_READ);
+
+    return 0;
+}
+
+// Maps ADDRESS_SPACE_SIZE bytes of fd at offset as the whole address space. The mapping is
+// MAP_PRIVATE like the image one, so every CPU mapping the same snapshot shares its pages until it
+// writes to one. offset has to be a multiple of the host page size
+int map_memory_file(Memory* memory, int fd, size_t offset, size_t image_size, size_t rom_size) {
+    memory->bytes = mmap(NULL, ADDRESS_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) offset);
+    if (memory->bytes == MAP_FAILED) {
+        memory->bytes = NULL;
+        return 2;
+    }
+    memory->mapped = true;
+    memory->code_map = NULL;
+    memory->code_written = false;
+    memory->write_hook = NULL;
+    memory->image_size = image_size;
+    memory->rom_size = rom_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : rom_size;
+    mark_rom_pages(memory);
+
+    size_t host_page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t protect_size = memory->rom_size / host_page * host_page;
+    if (protect_size > 0) mprotect(memory->bytes, protect_size, PROT_READ);
+    return 0;
+}
+#endif
+
+// Fills a fresh address space with size bytes from image, for hosts that already hold the image
+// in memory (see libi8080.c). ROM is only enforced by write_memory_slow here, so the host can
+// still patch it through the bytes pointer
+int load_memory_bytes(Memory* memory, const uint8_t* image, size_t size, size_t rom_size) {
+#ifdef _WIN32
+    memory->bytes = calloc(ADDRESS_SPACE_SIZE, 1);
+    if (memory->bytes == NULL) return 2;
+    memory->mapped = false;
+#else
+    memory->bytes = mmap(NULL, ADDRESS_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory->bytes == MAP_FAILED) {
+        memory->bytes = NULL;
+        return 2;
+    }
+    memory->mapped = true;
+#endif
+    memory->code_map = NULL;
+    memory->code_written = false;
+    memory->write_hook = NULL;
+    memory->image_size = size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : size;
+    if (memory->image_size > 0) memcpy(memory->bytes, image, memory->image_size);
+    memory->rom_size = rom_size > ADDRESS_SPACE_SIZE ? ADDRESS_SPACE_SIZE : rom_size;
+    mark_rom_pages(memory);
+    return 0;
+}
+
+void unmap_memory_image(Memory* memory) {
+    if (memory->bytes == NULL) return;
+#ifdef _WIN32
+    free(memory->bytes);
+#else
+    if (memory->mapped) munmap(memory->bytes, ADDRESS_SPACE_SIZE);
+    else free(memory->bytes);
+#endif
+    memory->bytes = NULL;
+}
+
+static void record_code_write(Memory* memory, uint16_t address) {
+    if (!memory->code_written || address < memory->code_written_low) memory->code_written_low = address;
+    if (!memory->code_written || address > memory->code_written_high) memory->code_written_high = address;
+    memory->code_written = true;
+}
+
+void write_memory_slow(Memory* memory, uint16_t address, uint8_t value) {
+    uint8_t flags = memory->page_flags[address / MEMORY_PAGE_SIZE];
+    if (flags & PAGE_WATCH) memory->watch_hook(memory->watch_context, address, value); // Before the ROM check, a stray write to ROM is worth seeing
+    if (flags & PAGE_ROM) return; // Writes to ROM are ignored, like on real hardware
+    memory->bytes[address] = value;
+
+    if ((flags & PAGE_CODE) && memory->code_map[address]) record_code_write(memory, address);
+    if (flags & PAGE_HOOK) memory->write_hook(memory->hook_context, address, value);
+}
+
+// A write from outside the guest: ROM is written too and write_hook is not called, but the JIT
+// still sees it. Only for memory from load_memory_bytes, which never write-protects ROM
+void poke_memory(Memory* memory, uint16_t address, uint8_t value) {
+    memory->bytes[address] = value;
+    if ((memory->page_flags[address / MEMORY_PAGE_SIZE] & PAGE_CODE) && memory->code_map[address]) record_code_write(memory, address);
+}
@@ -0,0 +1,67 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ADDRESS_SPACE_SIZE 0x10000
+#define MEMORY_PAGE_SIZE 256 // Guest page size, used for per-page flags
+#define MEMORY_PAGES (ADDRESS_SPACE_SIZE / MEMORY_PAGE_SIZE)
+
+// Page flags, any set bit sends writes to that page down the slow path
+#define PAGE_ROM 0x01 // Writes are ignored
+#define PAGE_CODE 0x02 // Holds code the JIT translated, writes to it are recorded in code_written
+#define PAGE_HOOK 0x04 // Writes to it are passed on to write_hook once they land
+#define PAGE_WATCH 0x08 // Holds a write watchpoint, writes to it are passed on to watch_hook, see debugger.c
+
+typedef struct Memory {
+    uint8_t* bytes; // Full 64 KiB guest address space
+    uint8_t page_flags[MEMORY_PAGES];
+    size_t image_size; // Bytes taken from the program image
+    size_t rom_size; // Bytes at the start of the address space that are read-only
+    bool mapped; // True if bytes came from mmap, false if from calloc
+
+    // Set up by the JIT core, code_map is NULL otherwise
+    uint8_t* code_map; // Non-zero for every guest byte inside a translated block
+    bool code_written; // A write hit a translated byte since the JIT last looked
+    uint16_t code_written_low, code_written_high; // Range those writes covered
+
+    // Set up by the embedding API, see libi8080.c
+    void (*write_hook)(void* context, uint16_t address, uint8_t value);
+    void* hook_context;
+
+    // Set up by attach_debugger
+    void (*watch_hook)(void* context, uint16_t address, uint8_t value);
+    void* watch_context;
+} Memory;
+
+int map_memory_image(Memory* memory, const char* filename, size_t rom_size);
+int load_memory_bytes(Memory* memory, const uint8_t* image, size_t size, size_t rom_size);
+#ifdef _WIN32
+int copy_memory_image(Memory* memory, const uint8_t* bytes, size_t image_size, size_t rom_size); // See snapshot.c
+#else
+int map_memory_file(Memory* memory, int fd, size_t offset, size_t image_size, size_t rom_size); // See snapshot.c
+#endif
+void unmap_memory_image(Memory* memory);
+void write_memory_slow(Memory* memory, uint16_t address, uint8_t value);
+void poke_memory(Memory* memory, uint16_t address, uint8_t value);
+
+static inline uint8_t read_memory(Memory* memory, uint16_t address) {
+    return memory->bytes[address];
+}
+static inline void write_memory(Memory* memory, uint16_t address, uint8_t value) {
+    if (memory->page_flags[address / MEMORY_PAGE_SIZE]) write_memory_slow(memory, address, value);
+    else memory->bytes[address] = value;
+}
+
+// 16-bit words are little-endian and wrap around the top of the address space
+static inline uint16_t read_memory16(Memory* memory, uint16_t address) {
+    return read_memory(memory, address) | (read_memory(memory, address + 1) << 8);
+}
+static inline void write_memory16(Memory* memory, uint16_t address, uint16_t value) {
+    write_memory(memory, address, value & 0xFF);
+    write_memory(memory, address + 1, value >> 8);
+}
+
+#endif
@@ -12,11 +12,18 @@ parser.add_argument("-o", "--output_filename", default = None, help = "The outpu
 parser.add_argument("-v", "--verbose", action = "store_true", default = False, help = "Print verbose information")
 parser.add_argument("-N", "--no_output", action = "store_false", default = True, help = "Do not compile assembly code")
 parser.add_argument("--version", action = "store_true", default = False, help = "Show the version of pcc")
+parser.add_argument("--native", action = "store_true", default = False, help = "Assemble with asm.exe, the two-pass assembler built by -c, instead of simple_assembler")
+parser.add_argument("--listing", default = None, help = "With --native, also write a listing of every line with its address and bytes")
+parser.add_argument("--symbols", default = None, help = "With --native, also write a symbol map of every label for the emulator")
+parser.add_argument("--start", default = None, help = "With --native, the first address in the output file, 0x100 for a CP/M .COM")
 
 # C related arguments
 parser.add_argument("-r", "--run", action = "store_true", default = False, help = "Run the assembled file")
-parser.add_argument("-c", "--compile_c", action = "store_true", default = False, help = "Recompile the C file with 'gcc cpu_intel-8080.c -o out.exe' by default")
+parser.add_argument("-c", "--compile_c", action = "store_true", default = False, help = "Recompile the C files with 'gcc main.c cpu_intel-8080.c memory.c core_threaded.c core_lockstep.c core_jit.c profile.c symbols.c tracefile.c debugger.c snapshot.c devices.c scheduler.c batch.c bench.c conformance.c -pthread -lm -o out.exe' by default, and the assembler with 'gcc assembler.c -O2 -o asm.exe'")
 parser.add_argument("--compile_args", default = "-o out.exe", help = "Change the compile options for the C code")
+parser.add_argument("--headless", action = "store_true", default = False, help = "Compile the C code without any tracing, for raw speed")
+parser.add_argument("--check_flags", action = "store_true", default = False, help = "Compile the C code to check the lazy flags against the eager ones after every instruction")
+parser.add_argument("--library", action = "store_true", default = False, help = "With -c, also build libi8080.a to embed the emulator in another program, see i8080.h")
 
 args = parser.parse_args()
 
@@ -32,6 +39,11 @@ op_os_dict = {
 
 version = "0.1.0"
 
+c_sources = ["main.c", "cpu_intel-8080.c", "memory.c", "core_threaded.c", "core_lockstep.c", "core_jit.c", "profile.c", "symbols.c", "tracefile.c", "debugger.c", "snapshot.c", "devices.c", "scheduler.c", "batch.c", "bench.c", "conformance.c"]
+c_libraries = ["-pthread", "-lm"]
+assembler_sources = ["assembler.c"]
+library_sources = ["libi8080.c", "cpu_intel-8080.c", "memory.c", "core_threaded.c", "core_jit.c", "scheduler.c", "profile.c", "symbols.c", "tracefile.c", "debugger.c"]
+
 if (args.version):
     print(f"pcc {os_dict[os.name]} {version}")
 
@@ -46,7 +58,18 @@ else: out_filename = args.output_filename
 if __name__ == "__main__":
     write_code = 0
     
-    if (args.no_output):
+    if (args.no_output and args.native):
+        native_args = ["-o", out_filename]
+        if (args.listing != None): native_args += ["-l", args.listing]
+        if (args.symbols != None): native_args += ["-m", args.symbols]
+        if (args.start != None): native_args += ["--start", args.start]
+        try:
+            write_code = subprocess.run(["./asm.exe"] + native_args + [in_filename]).returncode
+        except FileNotFoundError:
+            print(f"{BOLD}pcc:{RESET}{RED} fatal error:{RESET} could not find asm.exe, build it with -c\nassembly terminated.")
+            write_code = 1
+    
+    elif (args.no_output):
         commands = sa.read_file(in_filename, args.verbose)
         write_code = sa.write_file(out_filename, commands, args.verbose)
     
@@ -56,8 +79,18 @@ if __name__ == "__main__":
     
     if (args.compile_c):
         if (args.verbose): print(f"{GREEN}LOG:{RESET} Recompiling C code with options '{args.compile_args}'")
-        result = subprocess.run(["gcc", "cpu_intel-8080.c"] + args.compile_args.split(" "))
+        mode_args = ["-DDEBUG=0", "-O2"] if args.headless else []
+        if (args.check_flags): mode_args.append("-DCHECK_FLAGS=1")
+        result = subprocess.run(["gcc"] + c_sources + c_libraries + mode_args + args.compile_args.split(" "))
         if (args.verbose): print(f"{GREEN}Log:{RESET} Got exit code {result.returncode} from recompiling C code")
+        result = subprocess.run(["gcc"] + assembler_sources + ["-O2", "-o", "asm.exe"])
+        if (args.verbose): print(f"{GREEN}Log:{RESET} Got exit code {result.returncode} from building asm.exe")
+
+        if (args.library):
+            # Always headless, the library never prints
+            result = subprocess.run(["gcc", "-c", "-fPIC", "-DDEBUG=0", "-O2"] + library_sources)
+            if (result.returncode == 0): result = subprocess.run(["ar", "rcs", "libi8080.a"] + [source[:-2] + ".o" for source in library_sources])
+            if (args.verbose): print(f"{GREEN}Log:{RESET} Got exit code {result.returncode} from building libi8080.a")
     
     if (args.run and write_code == 0):
         try:
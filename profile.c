@@ -0,0 +1,564 @@
+#include "profile.h"
+#include "alu.h"
+
+// Profiler. run_profiled is run_table plus two checks per instruction: whether it worked out
+// pending lazy flags (only for the opcodes that can) and whether it ended a basic block. Everything else is counted per block, so
+// the hot loop never touches per-address or per-opcode counters. The first time a block ends its
+// opcodes are copied out of guest memory, and write_profile spreads each block's entries and
+// cycles over its instructions from that copy. Counts by opcode therefore assume the code at an
+// address does not change once it has run.
+//
+// A basic block starts where control lands after a branch, call, return, RST, PCHL or HLT (taken
+// or not) and runs up to and including the next one. Block cycles are measured, so conditional
+// calls and returns are charged what they actually took. Flag cost is counted as records (ALU
+// instructions that left a lazy result) against settles (instructions that found a result pending
+// and had to work the flag byte out); a low settle share is the lazy flags paying off.
+//
+// Every block's cycles are also charged to a frame of the call tree. A shadow call stack follows
+// taken CALLs, RSTs and conditional calls (SP went down by two) and remembers where each left its
+// return address. A return pops every frame whose return address is now above SP rather than just
+// the top one, so code that drops a return address with POP and jumps, or returns from an interrupt
+// the profiler never saw being taken, puts the stack back in step at the next return. Interrupt
+// handlers are charged to whatever routine they interrupted.
+
+// What the profiler needs to know about each opcode
+#define PROFILE_RECORDS 1 // Leaves a lazy flag result
+#define PROFILE_ENDS 2 // Ends a basic block
+#define PROFILE_SETTLES 4 // May work out pending flags
+#define PROFILE_CALLS 8 // Pushes a return address if taken
+#define PROFILE_RETURNS 16 // Pops one if taken
+
+#define NOP_() 0
+#define HLT_() PROFILE_ENDS
+#define MOV_RR(d, s) 0
+#define MVI_R(d) 0
+#define INR_R(d) PROFILE_RECORDS
+#define DCR_R(d) PROFILE_RECORDS
+#define ADD_R(s) PROFILE_RECORDS
+#define ADC_R(s) PROFILE_RECORDS
+#define SUB_R(s) PROFILE_RECORDS
+#define SBB_R(s) PROFILE_RECORDS
+#define ANA_R(s) PROFILE_RECORDS
+#define XRA_R(s) PROFILE_RECORDS
+#define ORA_R(s) PROFILE_RECORDS
+#define CMP_R(s) PROFILE_RECORDS
+#define ADI_I() PROFILE_RECORDS
+#define ACI_I() PROFILE_RECORDS
+#define SUI_I() PROFILE_RECORDS
+#define SBI_I() PROFILE_RECORDS
+#define ANI_I() PROFILE_RECORDS
+#define XRI_I() PROFILE_RECORDS
+#define ORI_I() PROFILE_RECORDS
+#define CPI_I() PROFILE_RECORDS
+#define LXI_P(p) 0
+#define INX_P(p) 0
+#define DCX_P(p) 0
+#define DAD_P(p) PROFILE_SETTLES
+#define LDAX_P(p) 0
+#define STAX_P(p) 0
+#define LDA_A() 0
+#define STA_A() 0
+#define LHLD_A() 0
+#define SHLD_A() 0
+#define XCHG_() 0
+#define XTHL_() 0
+#define SPHL_() 0
+#define PUSH_P(p) PROFILE_SETTLES
+#define POP_P(p) 0
+#define RLC_() PROFILE_SETTLES
+#define RRC_() PROFILE_SETTLES
+#define RAL_() PROFILE_SETTLES
+#define RAR_() PROFILE_SETTLES
+#define DAA_() PROFILE_SETTLES
+#define CMA_() 0
+#define STC_() PROFILE_SETTLES
+#define CMC_() PROFILE_SETTLES
+#define JMP_A() PROFILE_ENDS
+#define JCC_A(c) PROFILE_ENDS | PROFILE_SETTLES
+#define CALL_A() PROFILE_ENDS | PROFILE_CALLS
+#define CCC_A(c) PROFILE_ENDS | PROFILE_SETTLES | PROFILE_CALLS
+#define RET_() PROFILE_ENDS | PROFILE_RETURNS
+#define RCC_(c) PROFILE_ENDS | PROFILE_SETTLES | PROFILE_RETURNS
+#define RST_N(n) PROFILE_ENDS | PROFILE_CALLS
+#define PCHL_() PROFILE_ENDS
+#define IN_P() 0
+#define OUT_P() 0
+#define EI_() 0
+#define DI_() 0
+
+static const uint8_t profile_classes[256] = {
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = (body),
+#include "opcodes.def"
+#undef OPCODE
+};
+
+Profile* create_profile(void) {
+    Profile* profile = calloc(1, sizeof(Profile));
+    if (profile == NULL) return NULL;
+    profile->frame_capacity = 256;
+    profile->frames = calloc(profile->frame_capacity, sizeof(ProfileFrame));
+    profile->frame_slots = calloc(profile->frame_capacity * 2, sizeof(uint32_t));
+    if (profile->frames == NULL || profile->frame_slots == NULL) {
+        free_profile(profile);
+        return NULL;
+    }
+    profile->frame_count = 1; // The root
+    return profile;
+}
+
+void free_profile(Profile* profile) {
+    if (profile == NULL) return;
+    free(profile->frames);
+    free(profile->frame_slots);
+    free(profile);
+}
+
+// Call tree
+static uint32_t* frame_slot(const Profile* profile, uint32_t parent, uint16_t function) {
+    uint32_t mask = profile->frame_capacity * 2 - 1;
+    uint32_t slot = (parent * 0x9E3779B1u ^ function * 0x85EBCA6Bu) & mask;
+    for (;; slot = (slot + 1) & mask) {
+        uint32_t frame = profile->frame_slots[slot];
+        if (frame == 0 || (profile->frames[frame - 1].parent == parent && profile->frames[frame - 1].function == function)) return &profile->frame_slots[slot];
+    }
+}
+// The frame for calling function from parent, made the first time. Out of memory it stays in the
+// parent
+static uint32_t enter_frame(Profile* profile, uint32_t parent, uint16_t function) {
+    uint32_t* slot = frame_slot(profile, parent, function);
+    if (*slot != 0) return *slot - 1;
+    if (profile->frame_count == profile->frame_capacity) { // Keeps the slots at most half full
+        uint32_t capacity = profile->frame_capacity * 2;
+        ProfileFrame* frames = realloc(profile->frames, capacity * sizeof(ProfileFrame));
+        uint32_t* slots = calloc(capacity * 2, sizeof(uint32_t));
+        if (frames != NULL) profile->frames = frames;
+        if (frames == NULL || slots == NULL) {
+            free(slots);
+            return parent;
+        }
+        free(profile->frame_slots);
+        profile->frame_slots = slots;
+        profile->frame_capacity = capacity;
+        for (uint32_t i = 1; i < profile->frame_count; i++) *frame_slot(profile, profile->frames[i].parent, profile->frames[i].function) = i + 1;
+        slot = frame_slot(profile, parent, function);
+    }
+    uint32_t frame = profile->frame_count++;
+    profile->frames[frame] = (ProfileFrame) {.parent = parent, .function = function};
+    *slot = frame + 1;
+    return frame;
+}
+
+static void enter_call(Profile* profile, uint16_t return_slot, uint16_t function) {
+    if (profile->stack_depth == PROFILE_STACK_DEPTH) return;
+    uint32_t frame = enter_frame(profile, profile->frame, function);
+    profile->frames[frame].calls++;
+    profile->stack_frames[profile->stack_depth] = frame;
+    profile->stack_slots[profile->stack_depth] = return_slot;
+    profile->stack_depth++;
+    profile->frame = frame;
+}
+static void leave_calls(Profile* profile, uint16_t stack_pointer) {
+    // Slots compared as distances from SP, so a stack that wraps past 0xFFFF still works
+    while (profile->stack_depth > 0 && (int16_t) (stack_pointer - profile->stack_slots[profile->stack_depth - 1]) > 0) profile->stack_depth--;
+    profile->frame = profile->stack_depth > 0 ? profile->stack_frames[profile->stack_depth - 1] : profile->entry_frame;
+}
+
+// Copies the opcodes of [start, end] out of guest memory, returns how many instructions it holds
+static uint16_t snapshot_code(Profile* profile, Memory* memory, uint16_t start, uint16_t end) {
+    uint16_t address = start, instructions = 0;
+    for (;;) {
+        uint8_t opcode = read_memory(memory, address);
+        profile->code[address] = opcode;
+        profile->seen[address] = 1;
+        instructions++;
+        if (address == end || opcode_lookup[opcode].size == 0 || instructions == UINT16_MAX) return instructions;
+        address += opcode_lookup[opcode].size;
+    }
+}
+
+bool run_profiled(CPU* cpu, uint64_t* instruction_count) {
+    Profile* profile = cpu->profile;
+    if (!profile->in_block) {
+        profile->in_block = true;
+        profile->block_start = cpu->program_counter;
+        profile->block_start_cycles = cpu->cycles;
+        profile->entry_frame = profile->frame = enter_frame(profile, 0, cpu->program_counter);
+        profile->stack_depth = 0;
+    }
+    uint16_t block_start = profile->block_start;
+    uint64_t block_start_cycles = profile->block_start_cycles;
+    bool error_stop = false;
+    uint64_t count = 0;
+    while (cpu->running && cpu->cycles < cpu->cycle_limit) {
+        uint16_t address = cpu->program_counter;
+        uint8_t opcode = read_memory(&cpu->memory, address); // fetch, without the call
+        const Instruction* inst = &opcode_lookup[opcode];
+
+        if (inst->size == 0) { // Left at the PC for the caller to report, as in run_table
+            error_stop = true;
+            break;
+        }
+
+        uint8_t profile_class = profile_classes[opcode];
+        bool pending = (profile_class & PROFILE_SETTLES) && cpu->lazy_flags.kind != FLAGS_SETTLED;
+        uint16_t stack_pointer = cpu->stack_pointer;
+        cpu->cycles += inst->cycles;
+        cpu->program_counter += inst->size;
+        inst->execute(cpu, opcode);
+        count++;
+
+        if (pending && cpu->lazy_flags.kind == FLAGS_SETTLED) profile->flag_settles[opcode]++;
+        if (profile_class & PROFILE_ENDS) {
+            ProfileBlock* block = &profile->blocks[block_start];
+            if (block->entries == 0) {
+                block->end = address;
+                block->instructions = snapshot_code(profile, &cpu->memory, block_start, address);
+            }
+            block->entries++;
+            block->cycles += cpu->cycles - block_start_cycles;
+            profile->frames[profile->frame].cycles += cpu->cycles - block_start_cycles; // The call or return itself is the caller's
+            if ((profile_class & PROFILE_CALLS) && cpu->stack_pointer == (uint16_t) (stack_pointer - 2)) enter_call(profile, cpu->stack_pointer, cpu->program_counter);
+            if ((profile_class & PROFILE_RETURNS) && cpu->stack_pointer == (uint16_t) (stack_pointer + 2)) leave_calls(profile, cpu->stack_pointer);
+            block_start = cpu->program_counter;
+            block_start_cycles = cpu->cycles;
+        }
+#if CHECK_FLAGS
+        if (!check_flags(cpu)) {
+            error_stop = true;
+            break;
+        }
+#endif
+    }
+    profile->block_start = block_start;
+    profile->block_start_cycles = block_start_cycles;
+    *instruction_count = count;
+    return error_stop;
+}
+
+void end_profile_run(Profile* profile, CPU* cpu) {
+    if (!profile->in_block) return;
+    profile->frames[profile->frame].cycles += cpu->cycles - profile->block_start_cycles;
+    uint16_t address = profile->block_start;
+    for (int i = 0; address != cpu->program_counter && i < UINT16_MAX; i++) {
+        uint8_t opcode = read_memory(&cpu->memory, address);
+        if (opcode_lookup[opcode].size == 0) break;
+        profile->code[address] = opcode;
+        profile->seen[address] = 1;
+        profile->tails[address]++;
+        address += opcode_lookup[opcode].size;
+    }
+    profile->in_block = false;
+}
+
+void merge_profile(Profile* into, const Profile* from) {
+    for (int i = 0; i < 256; i++) into->flag_settles[i] += from->flag_settles[i];
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        into->tails[i] += from->tails[i];
+        if (from->seen[i] && !into->seen[i]) {
+            into->code[i] = from->code[i];
+            into->seen[i] = 1;
+        }
+        const ProfileBlock* block = &from->blocks[i];
+        if (block->entries == 0) continue;
+        if (into->blocks[i].entries == 0) {
+            into->blocks[i].end = block->end;
+            into->blocks[i].instructions = block->instructions;
+        }
+        into->blocks[i].entries += block->entries;
+        into->blocks[i].cycles += block->cycles;
+    }
+
+    // Parents come before their children, so each frame's parent is already in into
+    uint32_t* frames = malloc(from->frame_count * sizeof(uint32_t));
+    if (frames == NULL) {
+        printf("Out of memory merging the call trees, some calls are left out\n");
+        return;
+    }
+    frames[0] = 0;
+    for (uint32_t i = 1; i < from->frame_count; i++) {
+        frames[i] = enter_frame(into, frames[from->frames[i].parent], from->frames[i].function);
+        into->frames[frames[i]].calls += from->frames[i].calls;
+        into->frames[frames[i]].cycles += from->frames[i].cycles;
+    }
+    free(frames);
+}
+
+// Counts per address and opcode, spread out from the blocks
+typedef struct ProfileCounter {
+    uint64_t count;
+    uint64_t cycles;
+} ProfileCounter;
+
+// Routines, from the call tree
+typedef struct ProfileRoutine {
+    uint64_t calls;
+    uint64_t cycles; // In the routine itself
+    uint64_t total_cycles; // With everything it called, recursive calls counted once
+} ProfileRoutine;
+
+typedef struct ProfileCounts {
+    ProfileCounter opcodes[256];
+    ProfileCounter addresses[ADDRESS_SPACE_SIZE];
+    ProfileRoutine routines[ADDRESS_SPACE_SIZE]; // By the address called or where runs started
+    uint64_t instructions, cycles, flag_records, flag_settles;
+} ProfileCounts;
+
+static void count_instruction(ProfileCounts* counts, uint16_t address, uint8_t opcode, uint64_t count, uint64_t cycles) {
+    counts->addresses[address].count += count;
+    counts->addresses[address].cycles += cycles;
+    counts->opcodes[opcode].count += count;
+    counts->opcodes[opcode].cycles += cycles;
+}
+
+// Frames come after their parents, so going backwards adds every frame's total into its parent's
+// after it has all of its own. A frame only adds to its routine's total if no frame above it is in
+// the same routine, which would have counted it already
+static bool count_routines(const Profile* profile, ProfileCounts* counts) {
+    uint64_t* totals = calloc(profile->frame_count, sizeof(uint64_t));
+    if (totals == NULL) return false;
+    for (uint32_t i = profile->frame_count - 1; i > 0; i--) {
+        totals[i] += profile->frames[i].cycles;
+        totals[profile->frames[i].parent] += totals[i];
+    }
+    for (uint32_t i = 1; i < profile->frame_count; i++) {
+        const ProfileFrame* frame = &profile->frames[i];
+        ProfileRoutine* routine = &counts->routines[frame->function];
+        routine->calls += frame->calls;
+        routine->cycles += frame->cycles;
+        uint32_t above = frame->parent;
+        while (above != 0 && profile->frames[above].function != frame->function) above = profile->frames[above].parent;
+        if (above == 0) routine->total_cycles += totals[i];
+    }
+    free(totals);
+    return true;
+}
+
+static ProfileCounts* count_profile(const Profile* profile) {
+    ProfileCounts* counts = calloc(1, sizeof(ProfileCounts));
+    if (counts == NULL) return NULL;
+    if (!count_routines(profile, counts)) {
+        free(counts);
+        return NULL;
+    }
+    for (int start = 0; start < ADDRESS_SPACE_SIZE; start++) {
+        const ProfileBlock* block = &profile->blocks[start];
+        if (block->entries == 0) continue;
+        uint16_t address = start;
+        uint64_t block_cycles = 0;
+        for (int i = 0; i < block->instructions; i++) {
+            uint8_t opcode = profile->code[address];
+            uint64_t cycles = block->entries * opcode_lookup[opcode].cycles;
+            block_cycles += cycles;
+            if (i == block->instructions - 1) cycles += block->cycles - block_cycles; // Taken conditional calls and returns
+            count_instruction(counts, address, opcode, block->entries, cycles);
+            address += opcode_lookup[opcode].size;
+        }
+    }
+    for (int address = 0; address < ADDRESS_SPACE_SIZE; address++) {
+        if (profile->tails[address] == 0) continue;
+        uint8_t opcode = profile->code[address];
+        count_instruction(counts, address, opcode, profile->tails[address], profile->tails[address] * opcode_lookup[opcode].cycles);
+    }
+    for (int i = 0; i < 256; i++) {
+        counts->instructions += counts->opcodes[i].count;
+        counts->cycles += counts->opcodes[i].cycles;
+        if (profile_classes[i] & PROFILE_RECORDS) counts->flag_records += counts->opcodes[i].count;
+        counts->flag_settles += profile->flag_settles[i];
+    }
+    return counts;
+}
+
+// Reports
+static void write_profile_json(const Profile* profile, const SymbolMap* symbols, const ProfileCounts* counts, FILE* file) {
+    char name[SYMBOL_NAME_SIZE];
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n  \"flag_records\": %llu,\n  \"flag_settles\": %llu,\n",
+            (unsigned long long) counts->instructions, (unsigned long long) counts->cycles, (unsigned long long) counts->flag_records, (unsigned long long) counts->flag_settles);
+
+    fprintf(file, "  \"opcodes\": [");
+    const char* separator = "\n";
+    for (int i = 0; i < 256; i++) {
+        if (counts->opcodes[i].count == 0) continue;
+        fprintf(file, "%s    {\"opcode\": \"0x%02x\", \"name\": \"%s\", \"count\": %llu, \"cycles\": %llu, \"flag_settles\": %llu}", separator, i, get_opcode_name(i),
+                (unsigned long long) counts->opcodes[i].count, (unsigned long long) counts->opcodes[i].cycles, (unsigned long long) profile->flag_settles[i]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ],\n  \"addresses\": [");
+    separator = "\n";
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        if (counts->addresses[i].count == 0) continue;
+        fprintf(file, "%s    {\"address\": \"0x%04x\", \"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}", separator, i, get_opcode_name(profile->code[i]),
+                (unsigned long long) counts->addresses[i].count, (unsigned long long) counts->addresses[i].cycles);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ],\n  \"blocks\": [");
+    separator = "\n";
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        const ProfileBlock* block = &profile->blocks[i];
+        if (block->entries == 0) continue;
+        fprintf(file, "%s    {\"start\": \"0x%04x\", \"end\": \"0x%04x\", \"name\": \"%s\", \"entries\": %llu, \"instructions\": %llu, \"cycles\": %llu}", separator, i, block->end,
+                format_address(symbols, i, name), (unsigned long long) block->entries, (unsigned long long) (block->entries * block->instructions), (unsigned long long) block->cycles);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ],\n  \"routines\": [");
+    separator = "\n";
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        const ProfileRoutine* routine = &counts->routines[i];
+        if (routine->total_cycles == 0 && routine->calls == 0) continue;
+        fprintf(file, "%s    {\"address\": \"0x%04x\", \"name\": \"%s\", \"calls\": %llu, \"cycles\": %llu, \"total_cycles\": %llu}", separator, i, format_address(symbols, i, name),
+                (unsigned long long) routine->calls, (unsigned long long) routine->cycles, (unsigned long long) routine->total_cycles);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// One row per opcode, address, block and routine, columns that do not apply are left empty. A
+// routine's count is its calls
+static void write_profile_csv(const Profile* profile, const SymbolMap* symbols, const ProfileCounts* counts, FILE* file) {
+    char name[SYMBOL_NAME_SIZE];
+    fprintf(file, "kind,address,end,name,count,instructions,cycles,flag_settles,total_cycles\n");
+    fprintf(file, "total,,,,,%llu,%llu,%llu,\n", (unsigned long long) counts->instructions, (unsigned long long) counts->cycles, (unsigned long long) counts->flag_settles);
+    for (int i = 0; i < 256; i++) {
+        if (counts->opcodes[i].count == 0) continue;
+        fprintf(file, "opcode,0x%02x,,\"%s\",%llu,%llu,%llu,%llu,\n", i, get_opcode_name(i), (unsigned long long) counts->opcodes[i].count,
+                (unsigned long long) counts->opcodes[i].count, (unsigned long long) counts->opcodes[i].cycles, (unsigned long long) profile->flag_settles[i]);
+    }
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        if (counts->addresses[i].count == 0) continue;
+        fprintf(file, "address,0x%04x,,\"%s\",%llu,%llu,%llu,,\n", i, get_opcode_name(profile->code[i]), (unsigned long long) counts->addresses[i].count,
+                (unsigned long long) counts->addresses[i].count, (unsigned long long) counts->addresses[i].cycles);
+    }
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        const ProfileBlock* block = &profile->blocks[i];
+        if (block->entries == 0) continue;
+        fprintf(file, "block,0x%04x,0x%04x,\"%s\",%llu,%llu,%llu,,\n", i, block->end, format_address(symbols, i, name), (unsigned long long) block->entries,
+                (unsigned long long) (block->entries * block->instructions), (unsigned long long) block->cycles);
+    }
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) {
+        const ProfileRoutine* routine = &counts->routines[i];
+        if (routine->total_cycles == 0 && routine->calls == 0) continue;
+        fprintf(file, "routine,0x%04x,,\"%s\",%llu,,%llu,,%llu\n", i, format_address(symbols, i, name), (unsigned long long) routine->calls,
+                (unsigned long long) routine->cycles, (unsigned long long) routine->total_cycles);
+    }
+}
+
+int write_profile(const Profile* profile, const SymbolMap* symbols, const char* filename) {
+    ProfileCounts* counts = count_profile(profile);
+    FILE* file = counts != NULL ? fopen(filename, "w") : NULL;
+    if (file == NULL) {
+        printf("Could not write the profile to %s\n", filename);
+        free(counts);
+        return 1;
+    }
+    size_t length = strlen(filename);
+    if (length >= 5 && strcmp(filename + length - 5, ".json") == 0) write_profile_json(profile, symbols, counts, file);
+    else write_profile_csv(profile, symbols, counts, file);
+    fclose(file);
+    free(counts);
+    return 0;
+}
+
+// qsort has no context argument, so the comparisons read what they sort by from here. Only
+// print_profile_top sets these, and only around its own qsort calls
+static const ProfileCounts* sorted_counts;
+static const Profile* sorted_profile;
+
+static int compare_opcode_cycles(const void* left, const void* right) {
+    uint64_t a = sorted_counts->opcodes[*(const int*) left].cycles, b = sorted_counts->opcodes[*(const int*) right].cycles;
+    return (a < b) - (a > b);
+}
+static int compare_block_cycles(const void* left, const void* right) {
+    uint64_t a = sorted_profile->blocks[*(const int*) left].cycles, b = sorted_profile->blocks[*(const int*) right].cycles;
+    return (a < b) - (a > b);
+}
+static int compare_routine_cycles(const void* left, const void* right) {
+    uint64_t a = sorted_counts->routines[*(const int*) left].cycles, b = sorted_counts->routines[*(const int*) right].cycles;
+    return (a < b) - (a > b);
+}
+
+void print_profile_top(const Profile* profile, const SymbolMap* symbols, int top) {
+    ProfileCounts* counts = count_profile(profile);
+    int* order = malloc(ADDRESS_SPACE_SIZE * sizeof(int));
+    if (counts == NULL || order == NULL) {
+        printf("Out of memory printing the profile\n");
+        free(counts);
+        free(order);
+        return;
+    }
+    double cycles = counts->cycles > 0 ? counts->cycles : 1;
+    sorted_counts = counts;
+    sorted_profile = profile;
+
+    int used = 0;
+    for (int i = 0; i < 256; i++) if (counts->opcodes[i].count > 0) order[used++] = i;
+    qsort(order, used, sizeof(int), compare_opcode_cycles);
+    printf("%sTop opcodes by cycles%s\n", BOLD, RESET);
+    printf("%-13s %14s %16s %7s %14s\n", "opcode", "count", "cycles", "share", "flag settles");
+    for (int i = 0; i < used && i < top; i++) {
+        int opcode = order[i];
+        printf("%s%-13s%s %14llu %16llu %6.2f%% %14llu\n", OPCODE_COLOR, get_opcode_name(opcode), RESET, (unsigned long long) counts->opcodes[opcode].count,
+               (unsigned long long) counts->opcodes[opcode].cycles, 100 * counts->opcodes[opcode].cycles / cycles, (unsigned long long) profile->flag_settles[opcode]);
+    }
+
+    used = 0;
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) if (profile->blocks[i].entries > 0) order[used++] = i;
+    qsort(order, used, sizeof(int), compare_block_cycles);
+    printf("%sTop blocks by cycles%s\n", BOLD, RESET);
+    printf("%-13s %14s %16s %7s %14s%s\n", "block", "entries", "cycles", "share", "instructions", symbols != NULL ? "  label" : "");
+    char name[SYMBOL_NAME_SIZE];
+    for (int i = 0; i < used && i < top; i++) {
+        const ProfileBlock* block = &profile->blocks[order[i]];
+        printf("%s0x%04x-0x%04x%s %14llu %16llu %6.2f%% %14llu", DIM, order[i], block->end, RESET, (unsigned long long) block->entries,
+               (unsigned long long) block->cycles, 100 * block->cycles / cycles, (unsigned long long) (block->entries * block->instructions));
+        if (symbols != NULL) printf("  %s", format_address(symbols, order[i], name));
+        printf("\n");
+    }
+
+    used = 0;
+    for (int i = 0; i < ADDRESS_SPACE_SIZE; i++) if (counts->routines[i].cycles > 0) order[used++] = i;
+    qsort(order, used, sizeof(int), compare_routine_cycles);
+    printf("%sTop routines by cycles%s\n", BOLD, RESET);
+    printf("%-24s %12s %16s %7s %16s %7s\n", "routine", "calls", "cycles", "share", "total cycles", "share");
+    for (int i = 0; i < used && i < top; i++) {
+        const ProfileRoutine* routine = &counts->routines[order[i]];
+        printf("%s%-24s%s %12llu %16llu %6.2f%% %16llu %6.2f%%\n", OPCODE_COLOR, format_address(symbols, order[i], name), RESET, (unsigned long long) routine->calls,
+               (unsigned long long) routine->cycles, 100 * routine->cycles / cycles, (unsigned long long) routine->total_cycles, 100 * routine->total_cycles / cycles);
+    }
+    sorted_counts = NULL;
+    sorted_profile = NULL;
+
+    printf("%llu instructions, %llu cycles, %llu flag results recorded, %llu worked out (%.2f%%)\n", (unsigned long long) counts->instructions,
+           (unsigned long long) counts->cycles, (unsigned long long) counts->flag_records, (unsigned long long) counts->flag_settles,
+           counts->flag_records > 0 ? 100.0 * counts->flag_settles / counts->flag_records : 0.0);
+    free(counts);
+    free(order);
+}
+
+// Collapsed stacks, one "outer;inner;innermost cycles" line per call path that ran any cycles of
+// its own, which flamegraph.pl and speedscope read as they are. Paths start at where the run
+// started, an interrupt's routine stacks on top of whatever it interrupted
+int write_profile_stacks(const Profile* profile, const SymbolMap* symbols, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        printf("Could not write the call stacks to %s\n", filename);
+        return 1;
+    }
+    uint32_t path[PROFILE_STACK_DEPTH + 1]; // The deepest stack and the entry frame under it
+    char name[SYMBOL_NAME_SIZE];
+    for (uint32_t i = 1; i < profile->frame_count; i++) {
+        if (profile->frames[i].cycles == 0) continue;
+        int depth = 0;
+        for (uint32_t frame = i; frame != 0 && depth < PROFILE_STACK_DEPTH + 1; frame = profile->frames[frame].parent) path[depth++] = frame;
+        while (depth-- > 0) fprintf(file, "%s%s", format_address(symbols, profile->frames[path[depth]].function, name), depth > 0 ? ";" : "");
+        fprintf(file, " %llu\n", (unsigned long long) profile->frames[i].cycles);
+    }
+    fclose(file);
+    return 0;
+}
+
+int report_profile(const Profile* profile, const ProfileOutput* output) {
+    int status = 0;
+    print_profile_top(profile, output->symbols, output->top);
+    if (output->filename != NULL) status |= write_profile(profile, output->symbols, output->filename);
+    if (output->stacks_filename != NULL) status |= write_profile_stacks(profile, output->symbols, output->stacks_filename);
+    return status;
+}
@@ -0,0 +1,72 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "cpu.h"
+#include "symbols.h"
+
+// Profiler. A CPU with a profile attached runs on an instrumented copy of the table core loop that
+// counts basic block entries and cycles and how often a pending lazy flag result had to be worked
+// out, and charges the cycles to a call tree kept from CALL, RST and RET. Counts per guest address,
+// opcode and routine are worked out when a report is written, as JSON or CSV plus a top-N table,
+// and the call tree as collapsed stacks for flame graph tools, see profile.c
+
+#define PROFILE_STACK_DEPTH 1024 // Calls nested deeper than this are charged to the deepest one kept
+
+typedef struct ProfileBlock {
+    uint64_t entries;
+    uint64_t cycles;
+    uint16_t end; // Address of the instruction that ended it
+    uint16_t instructions; // Per entry, 0 until the block is first seen
+} ProfileBlock;
+
+// One path of calls from the start of a run. Frame 0 is the root, the frames under it are where
+// runs started
+typedef struct ProfileFrame {
+    uint32_t parent;
+    uint16_t function; // Address called
+    uint64_t calls;
+    uint64_t cycles; // In the routine itself on this path, not in what it called
+} ProfileFrame;
+
+typedef struct Profile {
+    ProfileBlock blocks[ADDRESS_SPACE_SIZE]; // By the address the block starts at
+    uint64_t tails[ADDRESS_SPACE_SIZE]; // Runs of instructions a run stopped in before their block ended
+    uint64_t flag_settles[256]; // Times the opcode found flags pending and worked them out
+    uint8_t code[ADDRESS_SPACE_SIZE]; // Opcode seen at each address when its block was first seen
+    uint8_t seen[ADDRESS_SPACE_SIZE]; // Non-zero where code holds an opcode
+
+    ProfileFrame* frames;
+    uint32_t frame_count, frame_capacity;
+    uint32_t* frame_slots; // Open addressing from parent and function to frame + 1, twice frame_capacity
+
+    // Block the last run stopped in and its shadow call stack, carried over when a run is resumed
+    // (paced runs)
+    bool in_block;
+    uint16_t block_start;
+    uint64_t block_start_cycles;
+    uint32_t entry_frame; // Where the run started, under the root
+    uint32_t frame; // Charged for the block running now
+    int stack_depth;
+    uint32_t stack_frames[PROFILE_STACK_DEPTH];
+    uint16_t stack_slots[PROFILE_STACK_DEPTH]; // Where each call left its return address
+} Profile;
+
+// What to report at the end of a profiled run or batch
+typedef struct ProfileOutput {
+    const char* filename; // JSON or CSV report, NULL for none
+    const char* stacks_filename; // Collapsed stacks, NULL for none
+    const SymbolMap* symbols; // Names routines and blocks, NULL to show addresses
+    int top; // Rows in the printed tables
+} ProfileOutput;
+
+Profile* create_profile(void);
+void free_profile(Profile* profile);
+bool run_profiled(CPU* cpu, uint64_t* instruction_count); // Same contract as run_table, cpu->profile must be set
+void end_profile_run(Profile* profile, CPU* cpu); // Counts the block a finished run stopped in, before its memory goes away
+void merge_profile(Profile* into, const Profile* from);
+int write_profile(const Profile* profile, const SymbolMap* symbols, const char* filename); // JSON if the name ends in .json, CSV otherwise
+int write_profile_stacks(const Profile* profile, const SymbolMap* symbols, const char* filename);
+void print_profile_top(const Profile* profile, const SymbolMap* symbols, int top);
+int report_profile(const Profile* profile, const ProfileOutput* output); // Prints the tables and writes the files asked for, non-zero if one failed
+
+#endif
@@ -2,46 +2,29 @@
 #define REGISTERS_H
 
 #include <stdint.h>
-#include <string.h>
-
-typedef struct uint8_register {
-    uint8_t value;
-    char name;
-} uint8_register;
-
-typedef struct uint16_register {
-    uint16_t value;
-    char name[3];
-} uint16_register;
-
-typedef struct int8_register {
-    int8_t value;
-    char name;
-} int8_register;
-
-typedef struct int16_register {
-    int16_t value;
-    char name[3];
-} int16_register;
-
-void combine_uint8_register_names(char* dest, char c1, char c2) {
-    dest[0] = c1;
-    dest[1] = c2;
-    dest[2] = '\0';
-}
-
-uint16_register uint8_to_uint16_register(uint8_register* reg_a, uint8_register* reg_b) {
-    uint16_register reg_c;
-    combine_uint8_register_names(reg_c.name, reg_a->name, reg_b->name);
-    reg_c.value = (((uint16_t) reg_a->value) << 8) | reg_b->value;
-    return reg_c;
-}
-
-int16_register int8_to_int16_register(int8_register* reg_a, int8_register* reg_b) {
-    int16_register reg_c;
-    combine_uint8_register_names(reg_c.name, reg_a->name, reg_b->name);
-    reg_c.value = (((int16_t) reg_a->value) << 8) | reg_b->value;
-    return reg_c;
-}
-
-#endif
\ No newline at end of file
+
+// The 8-bit registers and the 16-bit pairs share storage, so writing C also writes BC and nothing
+// has to be kept in step. Slots are ordered so each pair reads as one native uint16_t.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+enum { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_A, REG_F };
+#else
+enum { REG_C, REG_B, REG_E, REG_D, REG_L, REG_H, REG_F, REG_A };
+#endif
+
+enum { PAIR_BC, PAIR_DE, PAIR_HL, PAIR_PSW }; // PSW is A:F
+
+typedef union RegisterFile {
+    uint8_t r8[8]; // Indexed by REG_*
+    uint16_t r16[4]; // Indexed by PAIR_*
+} RegisterFile;
+
+#define REGISTER_M 6 // Register field for memory at H:L, it has no slot
+
+// Register field (DDD/SSS) to slot
+static const uint8_t register_slots[8] = {REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, 0xFF, REG_A};
+
+// Debug names, by register field and by pair
+static const char register_names[8] = {'B', 'C', 'D', 'E', 'H', 'L', 'M', 'A'};
+static const char* const pair_names[4] = {"BC", "DE", "HL", "PSW"};
+
+#endif
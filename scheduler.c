@@ -0,0 +1,147 @@
+#include "scheduler.h"
+#include "debugger.h"
+
+// Event scheduler and interrupt controller.
+//
+// Events sit in a binary min-heap on their deadline. run_scheduled lowers cycle_limit to the
+// earliest deadline, runs the core, fires every event that is due, and then lets the CPU take an
+// interrupt if one was requested and INTE is set. Taking one works like the RST instruction a
+// real interrupting device puts on the bus: INTE is cleared, PC is pushed and execution continues
+// at vector * 8, 11 cycles later. With several requests waiting the lowest vector goes first, the
+// others stay requested until interrupts are enabled again.
+//
+// EI hands control back to the scheduler when it runs here (see EI), and an interrupt is only
+// taken once the instruction after EI has run, as on the 8080, so EI; RET at the end of a
+// handler returns before the next interrupt comes in. HLT with interrupts enabled waits for the
+// next interrupt instead of stopping the run: the cycle counter skips ahead to the next event
+// rather than spinning. With interrupts disabled, or nothing left scheduled, HLT stops as usual.
+
+Scheduler* create_scheduler(void) {
+    return calloc(1, sizeof(Scheduler));
+}
+
+void free_scheduler(Scheduler* scheduler) {
+    free(scheduler);
+}
+
+static void sift_up(Scheduler* scheduler, int index) {
+    Event event = scheduler->events[index];
+    while (index > 0 && scheduler->events[(index - 1) / 2].deadline > event.deadline) {
+        scheduler->events[index] = scheduler->events[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    scheduler->events[index] = event;
+}
+static void sift_down(Scheduler* scheduler, int index) {
+    Event event = scheduler->events[index];
+    for (;;) {
+        int child = index * 2 + 1;
+        if (child >= scheduler->event_count) break;
+        if (child + 1 < scheduler->event_count && scheduler->events[child + 1].deadline < scheduler->events[child].deadline) child++;
+        if (scheduler->events[child].deadline >= event.deadline) break;
+        scheduler->events[index] = scheduler->events[child];
+        index = child;
+    }
+    scheduler->events[index] = event;
+}
+static void remove_event(Scheduler* scheduler, int index) {
+    scheduler->events[index] = scheduler->events[--scheduler->event_count];
+    if (index == scheduler->event_count) return;
+    sift_up(scheduler, index);
+    sift_down(scheduler, index);
+}
+
+bool schedule_event(CPU* cpu, uint64_t deadline, EventHandler handler, void* context) {
+    Scheduler* scheduler = cpu->scheduler;
+    if (scheduler == NULL || scheduler->event_count == MAX_EVENTS) return false;
+    scheduler->events[scheduler->event_count] = (Event) {deadline, handler, context};
+    sift_up(scheduler, scheduler->event_count++);
+    // Scheduled from a device inside the core, stop the core in time for it
+    if (scheduler->in_run && deadline < cpu->cycle_limit) cpu->cycle_limit = deadline;
+    return true;
+}
+
+void cancel_events(CPU* cpu, void* context) {
+    Scheduler* scheduler = cpu->scheduler;
+    if (scheduler == NULL) return;
+    for (int i = scheduler->event_count - 1; i >= 0; i--) {
+        if (scheduler->events[i].context == context) remove_event(scheduler, i);
+    }
+}
+
+void request_interrupt(CPU* cpu, uint8_t vector) {
+    if (cpu->scheduler != NULL) cpu->scheduler->requests |= 1 << (vector & 7);
+}
+
+static void fire_events(CPU* cpu, Scheduler* scheduler) {
+    while (scheduler->event_count > 0 && scheduler->events[0].deadline <= cpu->cycles) {
+        Event event = scheduler->events[0];
+        remove_event(scheduler, 0);
+        event.handler(cpu, event.context);
+    }
+}
+
+static void take_interrupt(CPU* cpu, Scheduler* scheduler) {
+    uint8_t vector = 0;
+    while (!(scheduler->requests & (1 << vector))) vector++;
+    scheduler->requests &= ~(1 << vector);
+    scheduler->waiting = false;
+    cpu->interrupts_enabled = false;
+    cpu->running = true;
+    push_word(cpu, cpu->program_counter);
+    cpu->program_counter = vector * 8;
+    cpu->cycles += 11;
+    TRACE("%sInterrupt, RST %d at cycle %llu\n%s", YELLOW, vector, (unsigned long long) cpu->cycles, RESET);
+}
+
+bool run_scheduled(CPU* cpu, Core core, uint64_t* instruction_count) {
+    Scheduler* scheduler = cpu->scheduler;
+    uint64_t limit = cpu->cycle_limit;
+    bool error_stop = false;
+    *instruction_count = 0;
+    scheduler->in_run = true;
+
+    for (;;) {
+        fire_events(cpu, scheduler);
+        if (scheduler->requests && cpu->interrupts_enabled) take_interrupt(cpu, scheduler);
+        if (scheduler->waiting) {
+            if (!cpu->interrupts_enabled || (scheduler->event_count == 0 && !scheduler->requests)) { // Nothing can wake it up any more
+                scheduler->waiting = false;
+                cpu->running = false;
+                break;
+            }
+            if (cpu->cycles >= limit) break;
+            uint64_t deadline = scheduler->event_count > 0 ? scheduler->events[0].deadline : limit;
+            if (deadline > cpu->cycles) cpu->cycles = deadline < limit ? deadline : limit;
+            continue;
+        }
+        if (!cpu->running || cpu->cycles >= limit) break;
+
+        bool was_enabled = cpu->interrupts_enabled;
+        uint64_t deadline = scheduler->event_count > 0 ? scheduler->events[0].deadline : UINT64_MAX;
+        cpu->cycle_limit = deadline < limit ? deadline : limit;
+        uint64_t count = 0;
+        error_stop = run_core(cpu, core, &count);
+        *instruction_count += count;
+        if (error_stop || run_paused(cpu)) break;
+
+        if (!cpu->running && cpu->interrupts_enabled) {
+            scheduler->waiting = true;
+            cpu->running = true;
+        }
+        else if (!was_enabled && cpu->interrupts_enabled && scheduler->requests && cpu->running) {
+            // Interrupts were just enabled, run the instruction after EI before taking one
+            cpu->cycle_limit = cpu->cycles + 1;
+            error_stop = run_core(cpu, CORE_TABLE, &count);
+            *instruction_count += count;
+            if (error_stop || run_paused(cpu)) break;
+            if (!cpu->running && cpu->interrupts_enabled) { // EI; HLT
+                scheduler->waiting = true;
+                cpu->running = true;
+            }
+        }
+    }
+    scheduler->in_run = false;
+    cpu->cycle_limit = limit;
+    return error_stop;
+}
@@ -0,0 +1,38 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "cpu.h"
+
+// Event scheduler and interrupt controller. Devices schedule events at a cycle count and raise
+// interrupts, and run_scheduled hands the core a cycle budget that ends at the next event, so the
+// cores never look for events themselves: they stop where they already check their budget (every
+// instruction on the table core, at branches on the threaded core and between blocks on the JIT)
+// and the scheduler fires whatever is due and lets the CPU take an interrupt before resuming it.
+// See scheduler.c
+
+#define MAX_EVENTS 64
+
+typedef void (*EventHandler)(CPU* cpu, void* context);
+
+typedef struct Event {
+    uint64_t deadline; // Cycle count it fires at
+    EventHandler handler;
+    void* context;
+} Event;
+
+typedef struct Scheduler {
+    Event events[MAX_EVENTS]; // Min-heap on deadline
+    int event_count;
+    uint8_t requests; // Bit per RST vector waiting to interrupt the CPU
+    bool waiting; // Halted with interrupts enabled, until an interrupt wakes it up
+    bool in_run; // Inside run_scheduled, where cycle_limit is the scheduler's to move
+} Scheduler;
+
+Scheduler* create_scheduler(void);
+void free_scheduler(Scheduler* scheduler);
+bool schedule_event(CPU* cpu, uint64_t deadline, EventHandler handler, void* context); // False if cpu has no scheduler or it is full
+void cancel_events(CPU* cpu, void* context); // Drops every event scheduled with this context
+void request_interrupt(CPU* cpu, uint8_t vector); // Interrupts with RST vector (0-7) once interrupts are enabled
+bool run_scheduled(CPU* cpu, Core core, uint64_t* instruction_count); // Same contract as run_table, run_cpu calls it when cpu->scheduler is set
+
+#endif
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE // memfd_create
+#include "snapshot.h"
+#include "alu.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Snapshots.
+//
+// A snapshot file is a 24 byte header (SnapshotFileHeader), the SnapshotState, and the 64 KiB
+// address space at memory_offset, SNAPSHOT_MEMORY_OFFSET for files written here. The gap before
+// the address space is left as a hole in the file, and the offset is a multiple of the host page
+// size, so a loaded snapshot restores by mapping the file itself with MAP_PRIVATE: nothing is
+// read until the guest touches it, and every CPU restored from it shares the page cache until it
+// writes. take_snapshot puts the address space in an anonymous memory file instead, which gives
+// in-process forks the same sharing.
+//
+// JIT translations, profiles and traces belong to the run that made them and are not kept; a
+// restored CPU starts without them and without devices, like initialize_cpu.
+
+typedef struct SnapshotFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t state_size;
+    uint64_t memory_offset;
+} SnapshotFileHeader;
+
+#ifndef _WIN32
+// An unlinked file holding a copy of the address space, -1 on failure
+static int create_memory_file(const uint8_t* bytes) {
+#ifdef __linux__
+    int fd = memfd_create("i8080-snapshot", MFD_CLOEXEC);
+#else
+    char name[] = "/tmp/i8080-snapshot-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd >= 0) unlink(name);
+#endif
+    if (fd < 0) return -1;
+    if (pwrite(fd, bytes, ADDRESS_SPACE_SIZE, 0) != ADDRESS_SPACE_SIZE) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+Snapshot* take_snapshot(CPU* cpu) {
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    if (snapshot == NULL) return NULL;
+    SnapshotState* state = &snapshot->state;
+    state->cycles = cpu->cycles;
+    state->image_size = cpu->memory.image_size;
+    state->rom_size = cpu->memory.rom_size;
+    state->stack_pointer = cpu->stack_pointer;
+    state->program_counter = cpu->program_counter;
+    for (int reg = 0; reg < 8; reg++) state->registers[reg] = reg == REGISTER_M ? get_flags(cpu) : cpu->registers.r8[register_slots[reg]];
+    state->running = cpu->running;
+    state->interrupts_enabled = cpu->interrupts_enabled;
+    memcpy(state->ports, cpu->ports, MAX_PORTS);
+
+#ifdef _WIN32
+    snapshot->bytes = malloc(ADDRESS_SPACE_SIZE);
+    if (snapshot->bytes == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+    memcpy(snapshot->bytes, cpu->memory.bytes, ADDRESS_SPACE_SIZE);
+#else
+    snapshot->fd = create_memory_file(cpu->memory.bytes);
+    snapshot->offset = 0;
+    if (snapshot->fd < 0) {
+        free(snapshot);
+        return NULL;
+    }
+#endif
+    return snapshot;
+}
+
+int restore_snapshot(CPU* cpu, const Snapshot* snapshot) {
+    const SnapshotState* state = &snapshot->state;
+#ifdef _WIN32
+    int code = copy_memory_image(&cpu->memory, snapshot->bytes, state->image_size, state->rom_size);
+#else
+    int code = map_memory_file(&cpu->memory, snapshot->fd, snapshot->offset, state->image_size, state->rom_size);
+#endif
+    if (code != 0) return code;
+
+    for (int reg = 0; reg < 8; reg++) {
+        if (reg != REGISTER_M) cpu->registers.r8[register_slots[reg]] = state->registers[reg];
+    }
+    cpu->registers.r8[REG_F] = state->registers[REGISTER_M];
+    cpu->lazy_flags.kind = FLAGS_SETTLED;
+    cpu->eager_flags = cpu->registers.r8[REG_F];
+    cpu->stack_pointer = state->stack_pointer;
+    cpu->program_counter = state->program_counter;
+    cpu->cycles = state->cycles;
+    cpu->cycle_limit = UINT64_MAX;
+    cpu->running = state->running;
+    cpu->interrupts_enabled = state->interrupts_enabled;
+    memcpy(cpu->ports, state->ports, MAX_PORTS);
+    cpu->bus = NULL;
+    cpu->scheduler = NULL;
+    cpu->jit = NULL;
+    cpu->fusion = NULL;
+    cpu->profile = NULL;
+    cpu->trace = NULL;
+    cpu->debugger = NULL;
+    return 0;
+}
+
+void free_snapshot(Snapshot* snapshot) {
+    if (snapshot == NULL) return;
+#ifdef _WIN32
+    free(snapshot->bytes);
+#else
+    close(snapshot->fd);
+#endif
+    free(snapshot);
+}
+
+int save_snapshot(const Snapshot* snapshot, const char* filename) {
+    uint8_t* bytes;
+#ifdef _WIN32
+    bytes = snapshot->bytes;
+#else
+    bytes = mmap(NULL, ADDRESS_SPACE_SIZE, PROT_READ, MAP_PRIVATE, snapshot->fd, (off_t) snapshot->offset);
+    if (bytes == MAP_FAILED) {
+        printf("Could not read back the snapshot to save it to %s\n", filename);
+        return 1;
+    }
+#endif
+
+    SnapshotFileHeader header = {SNAPSHOT_FILE_MAGIC, SNAPSHOT_FILE_VERSION, sizeof(SnapshotState), SNAPSHOT_MEMORY_OFFSET};
+    FILE* file = fopen(filename, "wb");
+    bool saved = file != NULL
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(&snapshot->state, sizeof(SnapshotState), 1, file) == 1
+        && fseek(file, SNAPSHOT_MEMORY_OFFSET, SEEK_SET) == 0
+        && fwrite(bytes, ADDRESS_SPACE_SIZE, 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) saved = false;
+#ifndef _WIN32
+    munmap(bytes, ADDRESS_SPACE_SIZE);
+#endif
+    if (!saved) {
+        printf("Could not write the snapshot to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the header and state, false if the file is not a snapshot this build can restore
+static bool read_snapshot_header(FILE* file, SnapshotFileHeader* header, SnapshotState* state) {
+    if (fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, SNAPSHOT_FILE_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != SNAPSHOT_FILE_VERSION || header->state_size != sizeof(SnapshotState)) return false;
+    if (header->memory_offset < sizeof(*header) + sizeof(SnapshotState)) return false;
+    return state == NULL || fread(state, sizeof(*state), 1, file) == 1;
+}
+
+bool is_snapshot_file(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+    SnapshotFileHeader header;
+    bool snapshot = read_snapshot_header(file, &header, NULL);
+    fclose(file);
+    return snapshot;
+}
+
+Snapshot* load_snapshot(const char* filename) {
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    FILE* file = fopen(filename, "rb");
+    if (snapshot == NULL || file == NULL) {
+        printf("Could not open snapshot %s\n", filename);
+        if (file != NULL) fclose(file);
+        free(snapshot);
+        return NULL;
+    }
+    SnapshotFileHeader header;
+    if (!read_snapshot_header(file, &header, &snapshot->state)) {
+        printf("%s is not a version %d snapshot\n", filename, SNAPSHOT_FILE_VERSION);
+        fclose(file);
+        free(snapshot);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    snapshot->bytes = malloc(ADDRESS_SPACE_SIZE);
+    bool loaded = snapshot->bytes != NULL && fseek(file, (long) header.memory_offset, SEEK_SET) == 0 && fread(snapshot->bytes, ADDRESS_SPACE_SIZE, 1, file) == 1;
+    fclose(file);
+    if (!loaded) {
+        printf("Could not read the address space from snapshot %s\n", filename);
+        free_snapshot(snapshot);
+        return NULL;
+    }
+#else
+    // Restores map the file itself, unless the address space does not start on a host page
+    struct stat info;
+    bool complete = fstat(fileno(file), &info) == 0 && (uint64_t) info.st_size >= header.memory_offset + ADDRESS_SPACE_SIZE;
+    bool aligned = header.memory_offset % (uint64_t) sysconf(_SC_PAGESIZE) == 0;
+    snapshot->fd = complete && aligned ? dup(fileno(file)) : -1;
+    snapshot->offset = header.memory_offset;
+    if (complete && !aligned) {
+        uint8_t* bytes = malloc(ADDRESS_SPACE_SIZE);
+        if (bytes != NULL && pread(fileno(file), bytes, ADDRESS_SPACE_SIZE, (off_t) header.memory_offset) == ADDRESS_SPACE_SIZE) snapshot->fd = create_memory_file(bytes);
+        snapshot->offset = 0;
+        free(bytes);
+    }
+    fclose(file);
+    if (snapshot->fd < 0) {
+        printf("Could not read the address space from snapshot %s\n", filename);
+        free(snapshot);
+        return NULL;
+    }
+#endif
+    return snapshot;
+}
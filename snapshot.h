@@ -0,0 +1,48 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cpu.h"
+
+// Snapshots of everything a run depends on: registers, flags, PC, SP, cycles, INTE, ports and the
+// whole address space. A snapshot in memory can be restored into any number of CPUs, which share
+// its memory copy-on-write, so a warmed-up state can be branched from without running the prefix
+// again. Snapshots are saved to and loaded from a versioned file, see snapshot.c for the format
+
+#define SNAPSHOT_FILE_MAGIC "I80SNAP"
+#define SNAPSHOT_FILE_VERSION 1
+#define SNAPSHOT_MEMORY_OFFSET 0x10000 // Lines the address space up with any host page size up to 64 KiB
+
+// Stored in host byte order (little-endian)
+typedef struct SnapshotState {
+    uint64_t cycles;
+    uint32_t image_size;
+    uint32_t rom_size;
+    uint16_t stack_pointer;
+    uint16_t program_counter;
+    uint8_t registers[8]; // By register field, with the settled flags where M would be
+    uint8_t running;
+    uint8_t interrupts_enabled;
+    uint8_t reserved[2];
+    uint8_t ports[MAX_PORTS];
+} SnapshotState;
+
+_Static_assert(sizeof(SnapshotState) == 288, "snapshot state is a fixed 288 bytes");
+
+typedef struct Snapshot {
+    SnapshotState state;
+#ifdef _WIN32
+    uint8_t* bytes; // Private copy of the address space, restored with memcpy
+#else
+    int fd; // The address space is ADDRESS_SPACE_SIZE bytes of this file at offset
+    size_t offset;
+#endif
+} Snapshot;
+
+Snapshot* take_snapshot(CPU* cpu);
+int restore_snapshot(CPU* cpu, const Snapshot* snapshot); // Sets up cpu like initialize_cpu does, safe from many threads at once
+void free_snapshot(Snapshot* snapshot);
+int save_snapshot(const Snapshot* snapshot, const char* filename);
+Snapshot* load_snapshot(const char* filename);
+bool is_snapshot_file(const char* filename);
+
+#endif
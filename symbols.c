@@ -0,0 +1,104 @@
+#include "symbols.h"
+
+// Symbol maps. Lines are "ADDRESS NAME", the address in hex with or without 0x, as asm.exe -m
+// writes them; blank lines and lines starting with # or ; are skipped. Where several labels share an
+// address, the first in alphabetical order names it, as asm.exe lists them.
+
+static int compare_entries(const void* left, const void* right) {
+    const SymbolEntry* a = left;
+    const SymbolEntry* b = right;
+    if (a->address != b->address) return a->address < b->address ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+SymbolMap* load_symbols(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Could not open the symbol map %s\n", filename);
+        return NULL;
+    }
+    SymbolMap* symbols = calloc(1, sizeof(SymbolMap));
+    int capacity = 0, line_number = 0;
+    bool failed = symbols == NULL;
+    char line[512];
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* text = line;
+        while (*text == ' ' || *text == '\t') text++;
+        if (*text == '\0' || *text == '\n' || *text == '\r' || *text == '#' || *text == ';') continue;
+
+        char* end;
+        unsigned long address = strtoul(text, &end, 16);
+        char* name = end;
+        while (*name == ' ' || *name == '\t') name++;
+        size_t length = strcspn(name, " \t\r\n");
+        if (end == text || name == end || length == 0 || address > 0xFFFF) {
+            printf("%s:%d: expected an address and a label\n", filename, line_number);
+            failed = true;
+            break;
+        }
+
+        if (symbols->count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            SymbolEntry* entries = realloc(symbols->entries, capacity * sizeof(SymbolEntry));
+            if (entries == NULL) {
+                printf("Out of memory loading %s\n", filename);
+                failed = true;
+                break;
+            }
+            symbols->entries = entries;
+        }
+        SymbolEntry* entry = &symbols->entries[symbols->count];
+        entry->address = (uint16_t) address;
+        entry->name = malloc(length + 1);
+        if (entry->name == NULL) {
+            printf("Out of memory loading %s\n", filename);
+            failed = true;
+            break;
+        }
+        memcpy(entry->name, name, length);
+        entry->name[length] = '\0';
+        symbols->count++;
+    }
+    fclose(file);
+    if (failed) {
+        free_symbols(symbols);
+        return NULL;
+    }
+    qsort(symbols->entries, symbols->count, sizeof(SymbolEntry), compare_entries);
+    return symbols;
+}
+
+void free_symbols(SymbolMap* symbols) {
+    if (symbols == NULL) return;
+    for (int i = 0; i < symbols->count; i++) free(symbols->entries[i].name);
+    free(symbols->entries);
+    free(symbols);
+}
+
+const SymbolEntry* find_label(const SymbolMap* symbols, uint16_t address) {
+    if (symbols == NULL) return NULL;
+    int low = 0, high = symbols->count; // First entry past address
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (symbols->entries[middle].address <= address) low = middle + 1;
+        else high = middle;
+    }
+    if (low == 0) return NULL;
+    const SymbolEntry* entry = &symbols->entries[low - 1];
+    while (entry > symbols->entries && entry[-1].address == entry->address) entry--;
+    return entry;
+}
+
+const char* label_at(const SymbolMap* symbols, uint16_t address) {
+    const SymbolEntry* entry = find_label(symbols, address);
+    return entry != NULL && entry->address == address ? entry->name : NULL;
+}
+
+const char* format_address(const SymbolMap* symbols, uint16_t address, char name[SYMBOL_NAME_SIZE]) {
+    const SymbolEntry* entry = find_label(symbols, address);
+    if (entry == NULL) snprintf(name, SYMBOL_NAME_SIZE, "0x%04x", address);
+    else if (entry->address == address) snprintf(name, SYMBOL_NAME_SIZE, "%s", entry->name);
+    else snprintf(name, SYMBOL_NAME_SIZE, "%s+0x%x", entry->name, address - entry->address);
+    return name;
+}
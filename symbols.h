@@ -0,0 +1,28 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include "cpu.h"
+
+// Symbol maps, the label addresses asm.exe -m writes next to an image, so profiles and traces can
+// name the guest routines they are in. One "ADDRESS NAME" line per label with the address in hex,
+// see symbols.c
+
+#define SYMBOL_NAME_SIZE 64 // Longest name a formatted address can come out as, with its offset
+
+typedef struct SymbolEntry {
+    uint16_t address;
+    char* name;
+} SymbolEntry;
+
+typedef struct SymbolMap {
+    SymbolEntry* entries; // Sorted by address
+    int count;
+} SymbolMap;
+
+SymbolMap* load_symbols(const char* filename); // NULL if it can't be read, after saying why
+void free_symbols(SymbolMap* symbols);
+const SymbolEntry* find_label(const SymbolMap* symbols, uint16_t address); // The last label at or before address, NULL if none
+const char* label_at(const SymbolMap* symbols, uint16_t address); // Only a label exactly at address
+const char* format_address(const SymbolMap* symbols, uint16_t address, char name[SYMBOL_NAME_SIZE]); // "label", "label+0x12" or "0x1234"
+
+#endif
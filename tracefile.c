@@ -0,0 +1,530 @@
+#include "tracefile.h"
+#include "alu.h"
+
+// Binary execution traces.
+//
+// A trace file is a 24 byte header (TraceFileHeader) followed by blocks of up to
+// TRACE_BLOCK_RECORDS records. Every block is a TraceBlockHeader and then its records, compressed:
+// each record is XORed with a reference (see delta_block), which leaves mostly zero bytes since an
+// instruction only changes a few fields, and the result is run-length coded. A control byte below
+// 0x80 is followed by that many plus one literal bytes, one at 0x80 or above stands for that many
+// minus 0x7F zero bytes. Blocks never refer to each other, so a
+// reader can skip one by its size without decoding it, and two runs that agree produce
+// byte-identical blocks, which diff_traces compares before decoding anything.
+//
+// Memory writes are worked out from the opcode rather than by watching the memory path, so
+// recording costs the cores nothing when it is off. write_values are read back after the
+// instruction, so a write to ROM shows the byte that stayed there.
+
+typedef struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t block_records;
+    uint32_t reserved;
+} TraceFileHeader;
+
+typedef struct TraceBlockHeader {
+    uint64_t first; // Index of the block's first record
+    uint32_t records;
+    uint32_t size; // Compressed bytes that follow
+} TraceBlockHeader;
+
+#define TRACE_BLOCK_BYTES (TRACE_BLOCK_RECORDS * sizeof(TraceRecord))
+#define TRACE_COMPRESSED_BYTES (TRACE_BLOCK_BYTES + TRACE_BLOCK_BYTES / 128 + 16) // Worst case, all literals
+
+// Memory write of each opcode, from opcodes.def
+#define TRACE_WRITES_A TRACE_WRITE_NONE
+#define TRACE_WRITES_B TRACE_WRITE_NONE
+#define TRACE_WRITES_C TRACE_WRITE_NONE
+#define TRACE_WRITES_D TRACE_WRITE_NONE
+#define TRACE_WRITES_E TRACE_WRITE_NONE
+#define TRACE_WRITES_H TRACE_WRITE_NONE
+#define TRACE_WRITES_L TRACE_WRITE_NONE
+#define TRACE_WRITES_M TRACE_WRITE_HL
+#define TRACE_STAX_BC TRACE_WRITE_BC
+#define TRACE_STAX_DE TRACE_WRITE_DE
+
+#define NOP_() TRACE_WRITE_NONE
+#define HLT_() TRACE_WRITE_NONE
+#define MOV_RR(d, s) TRACE_WRITES_##d
+#define MVI_R(d) TRACE_WRITES_##d
+#define INR_R(d) TRACE_WRITES_##d
+#define DCR_R(d) TRACE_WRITES_##d
+#define ADD_R(s) TRACE_WRITE_NONE
+#define ADC_R(s) TRACE_WRITE_NONE
+#define SUB_R(s) TRACE_WRITE_NONE
+#define SBB_R(s) TRACE_WRITE_NONE
+#define ANA_R(s) TRACE_WRITE_NONE
+#define XRA_R(s) TRACE_WRITE_NONE
+#define ORA_R(s) TRACE_WRITE_NONE
+#define CMP_R(s) TRACE_WRITE_NONE
+#define ADI_I() TRACE_WRITE_NONE
+#define ACI_I() TRACE_WRITE_NONE
+#define SUI_I() TRACE_WRITE_NONE
+#define SBI_I() TRACE_WRITE_NONE
+#define ANI_I() TRACE_WRITE_NONE
+#define XRI_I() TRACE_WRITE_NONE
+#define ORI_I() TRACE_WRITE_NONE
+#define CPI_I() TRACE_WRITE_NONE
+#define LXI_P(p) TRACE_WRITE_NONE
+#define INX_P(p) TRACE_WRITE_NONE
+#define DCX_P(p) TRACE_WRITE_NONE
+#define DAD_P(p) TRACE_WRITE_NONE
+#define LDAX_P(p) TRACE_WRITE_NONE
+#define STAX_P(p) TRACE_STAX_##p
+#define LDA_A() TRACE_WRITE_NONE
+#define STA_A() TRACE_WRITE_DIRECT
+#define LHLD_A() TRACE_WRITE_NONE
+#define SHLD_A() TRACE_WRITE_DIRECT16
+#define XCHG_() TRACE_WRITE_NONE
+#define XTHL_() TRACE_WRITE_XTHL
+#define SPHL_() TRACE_WRITE_NONE
+#define PUSH_P(p) TRACE_WRITE_PUSH
+#define POP_P(p) TRACE_WRITE_NONE
+#define RLC_() TRACE_WRITE_NONE
+#define RRC_() TRACE_WRITE_NONE
+#define RAL_() TRACE_WRITE_NONE
+#define RAR_() TRACE_WRITE_NONE
+#define DAA_() TRACE_WRITE_NONE
+#define CMA_() TRACE_WRITE_NONE
+#define STC_() TRACE_WRITE_NONE
+#define CMC_() TRACE_WRITE_NONE
+#define JMP_A() TRACE_WRITE_NONE
+#define JCC_A(c) TRACE_WRITE_NONE
+#define CALL_A() TRACE_WRITE_PUSH
+#define CCC_A(c) TRACE_WRITE_PUSH
+#define RET_() TRACE_WRITE_NONE
+#define RCC_(c) TRACE_WRITE_NONE
+#define RST_N(n) TRACE_WRITE_PUSH
+#define PCHL_() TRACE_WRITE_NONE
+#define IN_P() TRACE_WRITE_NONE
+#define OUT_P() TRACE_WRITE_NONE
+#define EI_() TRACE_WRITE_NONE
+#define DI_() TRACE_WRITE_NONE
+
+static const uint8_t trace_writes[256] = {
+#define OPCODE(opcode, name, size, cycles, body) [opcode] = body,
+#include "opcodes.def"
+#undef OPCODE
+};
+
+// Compression. The PC is XORed with where the previous instruction would fall through to, and
+// the rest of the record with the last record at the same PC in this block, so straight-line code
+// and every pass round a loop leave only what actually changed
+#define TRACE_PC_BYTES sizeof(uint16_t) // program_counter comes first
+
+static uint16_t predicted_pc(const TraceRecord* records, uint32_t index) {
+    if (index == 0) return 0;
+    return records[index - 1].program_counter + opcode_lookup[records[index - 1].opcode].size;
+}
+
+// last_at is scratch of ADDRESS_SPACE_SIZE entries
+static void delta_block(const TraceRecord* records, uint32_t count, TraceRecord* deltas, uint32_t* last_at) {
+    memset(last_at, 0, ADDRESS_SPACE_SIZE * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* record = (const uint8_t*) &records[i];
+        uint8_t* delta = (uint8_t*) &deltas[i];
+        uint16_t pc = records[i].program_counter;
+        const uint8_t* reference = last_at[pc] > 0 ? (const uint8_t*) &records[last_at[pc] - 1] : NULL;
+        deltas[i].program_counter = pc ^ predicted_pc(records, i);
+        for (size_t j = TRACE_PC_BYTES; j < sizeof(TraceRecord); j++) delta[j] = record[j] ^ (reference != NULL ? reference[j] : 0);
+        last_at[pc] = i + 1;
+    }
+}
+
+static void undelta_block(TraceRecord* records, uint32_t count, uint32_t* last_at) {
+    memset(last_at, 0, ADDRESS_SPACE_SIZE * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* record = (uint8_t*) &records[i];
+        uint16_t pc = records[i].program_counter ^ predicted_pc(records, i);
+        records[i].program_counter = pc;
+        if (last_at[pc] > 0) {
+            const uint8_t* reference = (const uint8_t*) &records[last_at[pc] - 1];
+            for (size_t j = TRACE_PC_BYTES; j < sizeof(TraceRecord); j++) record[j] ^= reference[j];
+        }
+        last_at[pc] = i + 1;
+    }
+}
+
+// Run-length codes the zeros out of the deltas
+static size_t compress_block(const TraceRecord* deltas, uint32_t count, uint8_t* out) {
+    const uint8_t* raw = (const uint8_t*) deltas;
+    size_t size = count * sizeof(TraceRecord), in = 0, used = 0;
+    while (in < size) {
+        if (raw[in] == 0) {
+            size_t run = 1;
+            while (in + run < size && run < 128 && raw[in + run] == 0) run++;
+            out[used++] = 0x80 + run - 1;
+            in += run;
+            continue;
+        }
+        size_t start = in, run = 0;
+        while (in < size && run < 128 && !(raw[in] == 0 && in + 1 < size && raw[in + 1] == 0)) { // Single zeros stay in the literal
+            in++;
+            run++;
+        }
+        out[used++] = run - 1;
+        memcpy(out + used, raw + start, run);
+        used += run;
+    }
+    return used;
+}
+
+static bool decompress_block(const uint8_t* in, size_t size, TraceRecord* deltas, uint32_t count) {
+    uint8_t* raw = (uint8_t*) deltas;
+    size_t expected = count * sizeof(TraceRecord), used = 0;
+    for (size_t i = 0; i < size;) {
+        uint8_t control = in[i++];
+        size_t run = control < 0x80 ? control + 1 : control - 0x7F;
+        if (used + run > expected || (control < 0x80 && i + run > size)) return false;
+        if (control < 0x80) {
+            memcpy(raw + used, in + i, run);
+            i += run;
+        }
+        else memset(raw + used, 0, run);
+        used += run;
+    }
+    return used == expected;
+}
+
+// Writer
+static void* trace_writer_main(void* argument) {
+    TraceWriter* writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->closing) pthread_cond_wait(&writer->filled, &writer->lock);
+        if (writer->queued == 0) break;
+        int index = writer->head;
+        TraceBlockHeader header = {writer->firsts[index], writer->counts[index], 0};
+        pthread_mutex_unlock(&writer->lock);
+
+        delta_block(writer->buffers[index], header.records, writer->deltas, writer->last_at);
+        header.size = compress_block(writer->deltas, header.records, writer->compressed);
+        bool written = fwrite(&header, sizeof(header), 1, writer->file) == 1 && fwrite(writer->compressed, 1, header.size, writer->file) == header.size;
+
+        pthread_mutex_lock(&writer->lock);
+        if (!written) writer->failed = true;
+        writer->head = (writer->head + 1) % TRACE_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->drained);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Hands the block being filled to the thread and waits for a free one if all of them are queued
+static void submit_block(TraceWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->counts[writer->tail] = writer->used;
+    writer->firsts[writer->tail] = writer->records - writer->used;
+    writer->tail = (writer->tail + 1) % TRACE_BUFFERS;
+    writer->queued++;
+    pthread_cond_signal(&writer->filled);
+    while (writer->queued == TRACE_BUFFERS) pthread_cond_wait(&writer->drained, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+    writer->used = 0;
+}
+
+static void free_trace_writer(TraceWriter* writer) {
+    for (int i = 0; i < TRACE_BUFFERS; i++) free(writer->buffers[i]);
+    free(writer->compressed);
+    free(writer->deltas);
+    free(writer->last_at);
+    if (writer->file != NULL) fclose(writer->file);
+    free(writer);
+}
+
+// Registers in record order, with the flags worked out without settling them
+static void trace_registers(CPU* cpu, uint8_t* registers) {
+    for (int reg = 0; reg < 8; reg++) {
+        registers[reg] = reg == REGISTER_M ? compute_flags(&cpu->lazy_flags, cpu->registers.r8[REG_F]) : cpu->registers.r8[register_slots[reg]];
+    }
+}
+
+TraceWriter* open_trace_writer(const char* filename, CPU* cpu) {
+    TraceWriter* writer = calloc(1, sizeof(TraceWriter));
+    if (writer == NULL) return NULL;
+    writer->file = fopen(filename, "wb");
+    writer->compressed = malloc(TRACE_COMPRESSED_BYTES);
+    writer->deltas = malloc(TRACE_BLOCK_BYTES);
+    writer->last_at = malloc(ADDRESS_SPACE_SIZE * sizeof(uint32_t));
+    bool ready = writer->file != NULL && writer->compressed != NULL && writer->deltas != NULL && writer->last_at != NULL;
+    for (int i = 0; i < TRACE_BUFFERS && ready; i++) {
+        writer->buffers[i] = malloc(TRACE_BLOCK_BYTES);
+        ready = writer->buffers[i] != NULL;
+    }
+    TraceFileHeader header = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION, sizeof(TraceRecord), TRACE_BLOCK_RECORDS, 0};
+    if (!ready || fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+        printf("Could not open %s to write the trace\n", filename);
+        free_trace_writer(writer);
+        return NULL;
+    }
+
+    trace_registers(cpu, writer->last.registers);
+    writer->last.stack_pointer = cpu->stack_pointer;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->drained, NULL);
+    if (pthread_create(&writer->thread, NULL, trace_writer_main, writer) != 0) {
+        printf("Could not start the trace writer\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->filled);
+        pthread_cond_destroy(&writer->drained);
+        free_trace_writer(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+bool close_trace_writer(TraceWriter* writer) {
+    if (writer->used > 0) submit_block(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    bool written = !writer->failed && fflush(writer->file) == 0;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->filled);
+    pthread_cond_destroy(&writer->drained);
+    free_trace_writer(writer);
+    return written;
+}
+
+bool run_recorded(CPU* cpu, uint64_t* instruction_count) {
+    TraceWriter* writer = cpu->trace;
+    uint64_t count = 0;
+    while (cpu->running && cpu->cycles < cpu->cycle_limit) {
+        uint16_t address = cpu->program_counter;
+        uint8_t opcode = read_memory(&cpu->memory, address);
+        const Instruction* inst = &opcode_lookup[opcode];
+
+        if (inst->size == 0) { // Left at the PC for the caller to report, as in run_table
+            *instruction_count = count;
+            return true;
+        }
+
+        // Targets that the instruction itself may change are taken before it runs
+        uint8_t writes = trace_writes[opcode];
+        uint16_t target = 0;
+        switch (writes) {
+            case TRACE_WRITE_HL: target = cpu->registers.r16[PAIR_HL]; break;
+            case TRACE_WRITE_BC: target = cpu->registers.r16[PAIR_BC]; break;
+            case TRACE_WRITE_DE: target = cpu->registers.r16[PAIR_DE]; break;
+            case TRACE_WRITE_DIRECT: case TRACE_WRITE_DIRECT16: target = read_memory16(&cpu->memory, address + 1); break;
+            case TRACE_WRITE_XTHL: target = cpu->stack_pointer; break;
+        }
+        uint16_t stack_pointer = cpu->stack_pointer;
+        uint64_t start_cycles = cpu->cycles;
+
+        cpu->cycles += inst->cycles;
+        cpu->program_counter += inst->size;
+        inst->execute(cpu, opcode);
+        count++;
+
+        TraceRecord* record = &writer->buffers[writer->tail][writer->used];
+        *record = (TraceRecord) {
+            .program_counter = address,
+            .stack_pointer = cpu->stack_pointer,
+            .opcode = opcode,
+            .operands = {inst->size > 1 ? read_memory(&cpu->memory, address + 1) : 0, inst->size > 2 ? read_memory(&cpu->memory, address + 2) : 0},
+            .cycles = cpu->cycles - start_cycles,
+        };
+        trace_registers(cpu, record->registers);
+        for (int reg = 0; reg < 8; reg++) if (record->registers[reg] != writer->last.registers[reg]) record->changed |= 1 << reg;
+        if (record->stack_pointer != writer->last.stack_pointer) record->changed |= 1 << 8;
+
+        if (writes == TRACE_WRITE_PUSH && cpu->stack_pointer == (uint16_t) (stack_pointer - 2)) target = cpu->stack_pointer; // Not for untaken calls
+        else if (writes == TRACE_WRITE_PUSH) writes = TRACE_WRITE_NONE;
+        if (writes != TRACE_WRITE_NONE) {
+            record->write_address = target;
+            record->write_count = writes == TRACE_WRITE_DIRECT16 || writes == TRACE_WRITE_PUSH || writes == TRACE_WRITE_XTHL ? 2 : 1;
+            for (int i = 0; i < record->write_count; i++) record->write_values[i] = read_memory(&cpu->memory, target + i);
+        }
+
+        writer->last = *record;
+        writer->records++;
+        if (++writer->used == TRACE_BLOCK_RECORDS) submit_block(writer);
+#if CHECK_FLAGS
+        if (!check_flags(cpu)) {
+            *instruction_count = count;
+            return true;
+        }
+#endif
+    }
+    *instruction_count = count;
+    return false;
+}
+
+// Reader
+typedef struct TraceReader {
+    FILE* file;
+    const char* filename;
+    TraceBlockHeader block;
+    uint8_t* compressed;
+    TraceRecord* records;
+    uint32_t* last_at;
+} TraceReader;
+
+static void close_trace_reader(TraceReader* reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    free(reader->compressed);
+    free(reader->records);
+    free(reader->last_at);
+}
+
+static bool open_trace_reader(TraceReader* reader, const char* filename) {
+    *reader = (TraceReader) {.file = fopen(filename, "rb"), .filename = filename};
+    TraceFileHeader header;
+    if (reader->file == NULL || fread(&header, sizeof(header), 1, reader->file) != 1) {
+        printf("Could not read the trace %s\n", filename);
+        close_trace_reader(reader);
+        return false;
+    }
+    if (memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_FILE_VERSION ||
+        header.record_size != sizeof(TraceRecord) || header.block_records != TRACE_BLOCK_RECORDS) {
+        printf("%s is not a version %d trace\n", filename, TRACE_FILE_VERSION);
+        close_trace_reader(reader);
+        return false;
+    }
+    reader->compressed = malloc(TRACE_COMPRESSED_BYTES);
+    reader->records = malloc(TRACE_BLOCK_BYTES);
+    reader->last_at = malloc(ADDRESS_SPACE_SIZE * sizeof(uint32_t));
+    if (reader->compressed == NULL || reader->records == NULL || reader->last_at == NULL) {
+        printf("Out of memory reading the trace %s\n", filename);
+        close_trace_reader(reader);
+        return false;
+    }
+    return true;
+}
+
+// Reads the next block header, 1 if there is one, 0 at the end and -1 if the file is damaged
+static int next_trace_block(TraceReader* reader) {
+    size_t read = fread(&reader->block, 1, sizeof(reader->block), reader->file);
+    if (read == 0 && feof(reader->file)) return 0;
+    if (read != sizeof(reader->block) || reader->block.records > TRACE_BLOCK_RECORDS || reader->block.size > TRACE_COMPRESSED_BYTES) {
+        printf("%s is damaged or cut short\n", reader->filename);
+        return -1;
+    }
+    return 1;
+}
+
+static bool read_trace_payload(TraceReader* reader) {
+    if (fread(reader->compressed, 1, reader->block.size, reader->file) == reader->block.size) return true;
+    printf("%s is cut short\n", reader->filename);
+    return false;
+}
+
+static bool decode_trace_block(TraceReader* reader) {
+    if (decompress_block(reader->compressed, reader->block.size, reader->records, reader->block.records)) {
+        undelta_block(reader->records, reader->block.records, reader->last_at);
+        return true;
+    }
+    printf("%s has a damaged block at record %llu\n", reader->filename, (unsigned long long) reader->block.first);
+    return false;
+}
+
+static void print_trace_record(const TraceRecord* record, uint64_t index) {
+    const char* name = get_opcode_name(record->opcode);
+    printf("%s%llu%s %s0x%04x%s %s%s%s", DIM, (unsigned long long) index, RESET, DIM, record->program_counter, RESET, OPCODE_COLOR, name, RESET);
+    int size = opcode_lookup[record->opcode].size;
+    if (size == 2) printf(" %s0x%02x%s", IMMEDIATE_COLOR, record->operands[0], RESET);
+    if (size == 3) printf(" %s0x%04x%s", IMMEDIATE_COLOR, record->operands[0] | (record->operands[1] << 8), RESET);
+    printf("\t");
+    uint8_t order[] = {7, 0, 1, 2, 3, 4, 5, REGISTER_M}; // A first, then B-L and the flags
+    for (int i = 0; i < 8; i++) {
+        uint8_t reg = order[i];
+        bool changed = record->changed & (1 << reg);
+        printf(" %s%c=%02x%s", changed ? REGISTER_COLOR : DIM, reg == REGISTER_M ? 'F' : register_names[reg], record->registers[reg], RESET);
+    }
+    printf(" %sSP=%04x%s", record->changed & (1 << 8) ? REGISTER_COLOR : DIM, record->stack_pointer, RESET);
+    if (record->write_count == 1) printf(" %s[0x%04x]=%02x%s", YELLOW, record->write_address, record->write_values[0], RESET);
+    if (record->write_count == 2) printf(" %s[0x%04x]=%02x %02x%s", YELLOW, record->write_address, record->write_values[0], record->write_values[1], RESET);
+    printf(" %s(%d cycles)%s\n", COMMENT_COLOR, record->cycles, RESET);
+}
+
+// With symbols, a record starting at a label gets the label on a line of its own first
+int dump_trace(const char* filename, const SymbolMap* symbols, uint64_t first, uint64_t count) {
+    TraceReader reader;
+    if (!open_trace_reader(&reader, filename)) return 2;
+    int status = 0, next;
+    uint64_t end = count > UINT64_MAX - first ? UINT64_MAX : first + count;
+    while (end > first && (next = next_trace_block(&reader)) != 0) {
+        if (next < 0) {
+            status = 2;
+            break;
+        }
+        if (reader.block.first + reader.block.records <= first) { // Skip whole blocks without decoding them
+            if (fseek(reader.file, reader.block.size, SEEK_CUR) != 0) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+        if (!read_trace_payload(&reader) || !decode_trace_block(&reader)) {
+            status = 2;
+            break;
+        }
+        for (uint32_t i = 0; i < reader.block.records; i++) {
+            uint64_t index = reader.block.first + i;
+            if (index < first || index >= end) continue;
+            const char* label = label_at(symbols, reader.records[i].program_counter);
+            if (label != NULL) printf("%s%s:%s\n", BOLD, label, RESET);
+            print_trace_record(&reader.records[i], index);
+        }
+        if (reader.block.first + reader.block.records >= end) break;
+    }
+    close_trace_reader(&reader);
+    return status;
+}
+
+int diff_traces(const char* filename_a, const char* filename_b) {
+    TraceReader a, b;
+    if (!open_trace_reader(&a, filename_a)) return 2;
+    if (!open_trace_reader(&b, filename_b)) {
+        close_trace_reader(&a);
+        return 2;
+    }
+    int status = 0;
+    uint64_t records = 0;
+    for (;;) {
+        int next_a = next_trace_block(&a), next_b = next_trace_block(&b);
+        if (next_a < 0 || next_b < 0 || (next_a > 0 && !read_trace_payload(&a)) || (next_b > 0 && !read_trace_payload(&b))) {
+            status = 2;
+            break;
+        }
+        if (next_a == 0 && next_b == 0) break;
+
+        // Matching runs give byte-identical blocks, only blocks that differ are decoded
+        if (next_a > 0 && next_b > 0 && a.block.records == b.block.records && a.block.size == b.block.size && memcmp(a.compressed, b.compressed, a.block.size) == 0) {
+            records += a.block.records;
+            continue;
+        }
+        uint32_t count_a = next_a > 0 ? a.block.records : 0, count_b = next_b > 0 ? b.block.records : 0;
+        if ((count_a > 0 && !decode_trace_block(&a)) || (count_b > 0 && !decode_trace_block(&b))) {
+            status = 2;
+            break;
+        }
+        status = 1;
+        uint32_t shared = count_a < count_b ? count_a : count_b;
+        for (uint32_t i = 0; i < shared; i++) {
+            if (memcmp(&a.records[i], &b.records[i], sizeof(TraceRecord)) == 0) continue;
+            printf("Traces differ at record %llu\n", (unsigned long long) (records + i));
+            if (i > 0) print_trace_record(&a.records[i - 1], records + i - 1);
+            printf("%s:\n", filename_a);
+            print_trace_record(&a.records[i], records + i);
+            printf("%s:\n", filename_b);
+            print_trace_record(&b.records[i], records + i);
+            goto done;
+        }
+        printf("Traces match for %llu records, then %s ends\n", (unsigned long long) (records + shared), count_a < count_b ? filename_a : filename_b);
+        goto done;
+    }
+    if (status == 0) printf("Traces match, %llu records\n", (unsigned long long) records);
+done:
+    close_trace_reader(&a);
+    close_trace_reader(&b);
+    return status;
+}
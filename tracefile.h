@@ -0,0 +1,76 @@
+#ifndef TRACEFILE_H
+#define TRACEFILE_H
+
+#include <pthread.h>
+#include "cpu.h"
+#include "symbols.h"
+
+// Binary execution traces. A CPU with a TraceWriter attached runs on a recording copy of the table
+// core loop that writes one fixed-size record per instruction. Records are gathered into blocks,
+// and a background thread compresses the blocks and writes them out, so the CPU only ever
+// touches memory. The reader seeks, dumps and diffs traces a block at a time, so a trace never
+// has to fit in RAM, see tracefile.c for the format
+
+#define TRACE_FILE_MAGIC "I80TRACE"
+#define TRACE_FILE_VERSION 1
+#define TRACE_BLOCK_RECORDS 65536
+#define TRACE_BUFFERS 4 // Blocks in flight between the CPU and the writer thread
+
+// Memory writes
+#define TRACE_WRITE_NONE 0
+#define TRACE_WRITE_HL 1 // MOV M, r, MVI M, INR M, DCR M
+#define TRACE_WRITE_BC 2 // STAX B
+#define TRACE_WRITE_DE 3 // STAX D
+#define TRACE_WRITE_DIRECT 4 // STA
+#define TRACE_WRITE_DIRECT16 5 // SHLD
+#define TRACE_WRITE_PUSH 6 // PUSH, CALL, RST and taken conditional calls
+#define TRACE_WRITE_XTHL 7
+
+// One instruction, all fields as they are after it ran. Stored in host byte order (little-endian)
+typedef struct TraceRecord {
+    uint16_t program_counter; // Where the instruction was
+    uint16_t stack_pointer;
+    uint16_t write_address;
+    uint16_t changed; // Bit per entry of registers that changed, bit 8 for SP
+    uint8_t opcode;
+    uint8_t operands[2]; // Immediate bytes, 0 past the end of the instruction
+    uint8_t registers[8]; // By register field, with the flags worked out from the lazy ones where M would be
+    uint8_t write_count; // Bytes written at write_address, 0 to 2
+    uint8_t write_values[2];
+    uint8_t cycles; // T-states it took
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 24, "trace records are a fixed 24 bytes");
+
+typedef struct TraceWriter {
+    FILE* file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled; // A block was queued or the writer is closing
+    pthread_cond_t drained; // The thread finished writing a block
+    TraceRecord* buffers[TRACE_BUFFERS];
+    uint32_t counts[TRACE_BUFFERS]; // Records in each queued block
+    uint64_t firsts[TRACE_BUFFERS]; // Index of each queued block's first record
+    int head; // Next block the thread writes
+    int tail; // Block the CPU is filling
+    int queued;
+    bool closing;
+    bool failed; // A write failed, the trace is incomplete
+
+    // Only touched by the CPU
+    uint32_t used; // Records in the block being filled
+    uint64_t records; // Records so far
+    TraceRecord last; // Deltas are against this
+    // Only touched by the thread
+    TraceRecord* deltas;
+    uint32_t* last_at;
+    uint8_t* compressed;
+} TraceWriter;
+
+TraceWriter* open_trace_writer(const char* filename, CPU* cpu);
+bool close_trace_writer(TraceWriter* writer); // False if any of the trace failed to write
+bool run_recorded(CPU* cpu, uint64_t* instruction_count); // Same contract as run_table, cpu->trace must be set
+int dump_trace(const char* filename, const SymbolMap* symbols, uint64_t first, uint64_t count); // symbols can be NULL
+int diff_traces(const char* filename_a, const char* filename_b); // 0 if they match, 1 if they differ, 2 on errors
+
+#endif
@@ -0,0 +1,42 @@
+; Arithmetic loop: multiplies every pair of bytes with a shift-and-add routine and adds the
+; products up in 16 bits. Mostly register ALU work, rotates through carry, DAD and short
+; conditional branches, about 4.7 million instructions.
+; Prints the sum, high byte first: 64 then 0 (0x7F80 squared is 0x3F804000)
+
+        ORG 0x0000
+        LXI SP, 0x0000
+        LXI H, 0
+        SHLD sum
+        MVI B, 0            ; Multiplier, every byte
+outer:  MVI C, 0            ; Multiplicand, every byte
+inner:  LXI H, 0            ; HL = B * C
+        MOV E, C
+        MVI D, 0
+        MOV A, B
+multiply:
+        ORA A               ; Clears carry, and sets Z once no bits are left
+        JZ product
+        RAR                 ; Next bit of the multiplier into carry
+        JNC shift
+        DAD D
+shift:  XCHG                ; DE <<= 1
+        DAD H
+        XCHG
+        JMP multiply
+product:
+        XCHG                ; sum += B * C
+        LHLD sum
+        DAD D
+        SHLD sum
+        INR C
+        JNZ inner
+        INR B
+        JNZ outer
+
+        MOV A, H
+        OUT 0
+        MOV A, L
+        OUT 0
+        HLT
+
+sum:    DW 0
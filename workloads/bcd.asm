@@ -0,0 +1,63 @@
+; BCD with DAA: counts an 8 digit packed BCD counter from 1 to 50000 with ADI, ACI and DAA and
+; adds every value into an 8 digit BCD total with ADC and DAA. About 3.1 million instructions.
+; Prints the total, most significant byte first: 80, 2, 80, 0 (1 + 2 + ... + 50000 = 1250025000,
+; the low 8 digits are 50025000)
+
+        ORG 0x0000
+        LXI SP, 0x0000
+        LXI H, 50000
+        SHLD left
+
+step:   LXI H, count        ; count += 1, least significant byte first
+        MOV A, M
+        ADI 1
+        DAA
+        MOV M, A
+        INX H
+        MOV A, M
+        ACI 0
+        DAA
+        MOV M, A
+        INX H
+        MOV A, M
+        ACI 0
+        DAA
+        MOV M, A
+        INX H
+        MOV A, M
+        ACI 0
+        DAA
+        MOV M, A
+
+        LXI H, count        ; total += count
+        LXI D, total
+        MVI B, 4
+        ORA A               ; No carry into the first byte
+add:    LDAX D
+        ADC M
+        DAA
+        STAX D
+        INX H
+        INX D
+        DCR B
+        JNZ add
+
+        LHLD left
+        DCX H
+        SHLD left
+        MOV A, H
+        ORA L
+        JNZ step
+
+        LXI H, total + 3
+        MVI B, 4
+print:  MOV A, M
+        OUT 0
+        DCX H
+        DCR B
+        JNZ print
+        HLT
+
+left:   DW 0
+count:  DB 0, 0, 0, 0
+total:  DB 0, 0, 0, 0
@@ -0,0 +1,62 @@
+; CP/M style console output: a program loaded at 0x0100 prints 20000 numbered lines through the
+; BDOS entry at 0x0005, with function 9 for the $ terminated text and function 2 for the digit
+; and line ends, as CP/M programs do. The BDOS here writes every character to port 0; on CP/M it
+; sits at the top of memory, here it follows the program to keep the image small.
+; About 3.7 million instructions and 20000 * 25 characters out of port 0
+
+BDOS    EQU 0x0005
+LINES   EQU 20000
+
+        ORG 0x0000
+        JMP start           ; Warm boot on CP/M
+        DB 0, 0             ; IOBYTE and current drive
+        JMP bdos
+
+        ORG 0x0100
+start:  LXI SP, 0x0000
+        LXI H, LINES
+        SHLD left
+
+line:   MVI C, 9
+        LXI D, message
+        CALL BDOS
+        LDA left            ; Lines left modulo 8, as a digit
+        ANI 7
+        ADI '0'
+        MOV E, A
+        MVI C, 2
+        CALL BDOS
+        MVI E, 13
+        MVI C, 2
+        CALL BDOS
+        MVI E, 10
+        MVI C, 2
+        CALL BDOS
+
+        LHLD left
+        DCX H
+        SHLD left
+        MOV A, H
+        ORA L
+        JNZ line
+        HLT
+
+left:   DW 0
+message:
+        DB 'Hello from CP/M, line $'
+
+; C = 2 writes E, C = 9 writes the string at DE up to the $, anything else does nothing
+bdos:   MOV A, C
+        CPI 2
+        JZ conout
+        CPI 9
+        RNZ
+print:  LDAX D
+        CPI '$'
+        RZ
+        OUT 0
+        INX D
+        JMP print
+conout: MOV A, E
+        OUT 0
+        RET
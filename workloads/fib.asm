@@ -0,0 +1,37 @@
+; Call-heavy recursion: works out Fibonacci number 24 four times with the naive recursive
+; routine, 150049 calls each. Mostly CALL, RET, PUSH and POP, with PSW saved on the stack
+; around every first recursive call. About 5.1 million instructions.
+; Prints fib(24) = 46368, high byte first: 181 then 32
+
+        ORG 0x0000
+        LXI SP, 0x0000
+        MVI B, 4
+again:  MVI A, 24
+        PUSH B
+        CALL fib
+        POP B
+        DCR B
+        JNZ again
+
+        MOV A, H
+        OUT 0
+        MOV A, L
+        OUT 0
+        HLT
+
+; HL = fib(A), changes A, DE and the flags
+fib:    CPI 2
+        JC small
+        PUSH PSW
+        DCR A
+        CALL fib            ; HL = fib(n - 1)
+        POP PSW
+        PUSH H
+        SUI 2
+        CALL fib            ; HL = fib(n - 2)
+        POP D
+        DAD D
+        RET
+small:  MOV L, A
+        MVI H, 0
+        RET
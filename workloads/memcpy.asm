@@ -0,0 +1,57 @@
+; memset and memcpy: fills a 4 KiB buffer with one byte and copies it to another 4 KiB buffer,
+; 64 times over with a different byte each time. Byte loops over HL, DE and BC with a 16-bit
+; count, about 3.7 million instructions.
+; Prints the 8-bit sum of the destination after the last pass: 0 (4096 copies of 1)
+
+SIZE    EQU 4096
+SOURCE  EQU 0x4000
+DEST    EQU 0x6000
+
+        ORG 0x0000
+        LXI SP, 0x0000
+        MVI A, 64
+        STA passes
+
+pass:   LXI H, SOURCE       ; memset(SOURCE, passes, SIZE)
+        LXI B, SIZE
+        LDA passes
+        MOV E, A
+fill:   MOV M, E
+        INX H
+        DCX B
+        MOV A, B
+        ORA C
+        JNZ fill
+
+        LXI H, SOURCE       ; memcpy(DEST, SOURCE, SIZE)
+        LXI D, DEST
+        LXI B, SIZE
+copy:   MOV A, M
+        STAX D
+        INX H
+        INX D
+        DCX B
+        MOV A, B
+        ORA C
+        JNZ copy
+
+        LXI H, passes
+        DCR M
+        JNZ pass
+
+        LXI H, DEST         ; Sum the destination
+        LXI B, SIZE
+        MVI E, 0
+sum:    MOV A, E
+        ADD M
+        MOV E, A
+        INX H
+        DCX B
+        MOV A, B
+        ORA C
+        JNZ sum
+        MOV A, E
+        OUT 0
+        HLT
+
+passes: DB 0